@@ -0,0 +1,1034 @@
+/**
+ * bench.c - Замеры производительности сборщика (программа luna-bench)
+ *
+ * Микрозамеры: файловые функции utils.c на файлах разного размера,
+ * затраты на запуск команды и разбор luna.conf. Замер конвейера:
+ * mmdebstrap и apt заменены детерминированным генератором chroot
+ * заданного объёма, после которого измеряются дедупликация, запись
+ * squashfs (полная и инкрементальная), размещение файлов в casper,
+ * сборка ISO и удаление дерева. Всё выполняется без сети и повторяется с тем же
+ * результатом при том же зерне генератора.
+ *
+ * Результаты выводятся таблицей и пишутся в JSON (-o), по одному замеру
+ * на строку; два таких файла сравнивает luna-bench compare.
+ *
+ * Сборка:
+ *   gcc -std=gnu11 -O2 -Iinclude bench.c chroot.c clean.c config.c dedup.c exec.c hash.c \
+ *       iso.c log.c sqfs.c squashfs.c stage.c trace.c utils.c -o luna-bench \
+ *       -lpthread -lz -llzma -lm
+ */
+
+#define _GNU_SOURCE
+
+#include "clean.h"
+#include "config.h"
+#include "dedup.h"
+#include "exec.h"
+#include "iso.h"
+#include "sqfs.h"
+#include "squashfs.h"
+#include "stage.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#define BENCH_MAX_RESULTS 128
+#define BENCH_MAX_SAMPLES 64
+#define BENCH_MIN_BATCH_SECONDS 0.02
+#define BENCH_FORMAT "luna-bench 1"
+
+// Время изменения всех файлов синтетического chroot: образ squashfs
+// от прогона к прогону получается одинаковым
+#define BENCH_MTIME 1700000000
+
+typedef struct {
+    char name[96];
+    double samples[BENCH_MAX_SAMPLES];  // секунды на одну операцию
+    int count;
+    unsigned long long bytes;           // данных на одну операцию; 0 — без пропускной способности
+} BenchResult;
+
+typedef struct {
+    const char *dir;
+    const char *json_path;
+    const char *conf_path;
+    const char *profile;
+    const char *label;
+    char only[128];
+    int samples;
+    int runs;
+    int chroot_mb;
+    int max_file_mb;
+    unsigned long long seed;
+    bool drop_caches;
+    bool verbose;
+} BenchOptions;
+
+static BenchResult results[BENCH_MAX_RESULTS];
+static int result_count;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static BenchResult *result_get(const char *name, unsigned long long bytes) {
+    for (int i = 0; i < result_count; i++) {
+        if (strcmp(results[i].name, name) == 0) {
+            return &results[i];
+        }
+    }
+    if (result_count == BENCH_MAX_RESULTS) {
+        return NULL;
+    }
+
+    BenchResult *result = &results[result_count++];
+    memset(result, 0, sizeof(*result));
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->bytes = bytes;
+    return result;
+}
+
+static void result_add(const char *name, unsigned long long bytes, double seconds) {
+    BenchResult *result = result_get(name, bytes);
+    if (result && result->count < BENCH_MAX_SAMPLES) {
+        result->samples[result->count++] = seconds;
+    }
+}
+
+static bool selected(const BenchOptions *options, const char *group) {
+    if (!options->only[0]) {
+        return true;
+    }
+
+    size_t len = strlen(group);
+    for (const char *p = options->only; (p = strstr(p, group)) != NULL; p += len) {
+        if ((p == options->only || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void format_size(unsigned long long bytes, char *buf, size_t size) {
+    if (bytes >= 1024 * 1024) {
+        snprintf(buf, size, "%lluM", bytes / (1024 * 1024));
+    } else {
+        snprintf(buf, size, "%lluK", bytes / 1024);
+    }
+}
+
+// Сброс страничного кэша перед фазой конвейера (-C): чтение с диска, как
+// в первой сборке после загрузки
+static void drop_caches(const BenchOptions *options) {
+    if (!options->drop_caches) {
+        return;
+    }
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (write(fd, "3", 1) != 1) {
+            log_warning("Не удалось сбросить страничный кэш");
+        }
+        close(fd);
+    }
+}
+
+static int remove_tree(const char *path) {
+    char *const argv[] = { "rm", "-rf", "--one-file-system", (char *)path, NULL };
+    return exec_command(argv, false);
+}
+
+// ---------------------------------------------------------------------
+// Микрозамеры
+// ---------------------------------------------------------------------
+
+typedef void (*BenchFn)(void *ctx);
+
+// Операции идут пачками не короче BENCH_MIN_BATCH_SECONDS: у быстрых
+// операций время одной меньше точности часов
+static void bench_loop(const BenchOptions *options, const char *name,
+                       unsigned long long bytes, BenchFn fn, void *ctx) {
+    double start = now_seconds();
+    fn(ctx);
+    double once = now_seconds() - start;
+
+    long batch = once > 0 ? (long)(BENCH_MIN_BATCH_SECONDS / once) + 1 : 1000;
+    for (int s = 0; s < options->samples; s++) {
+        start = now_seconds();
+        for (long i = 0; i < batch; i++) {
+            fn(ctx);
+        }
+        result_add(name, bytes, (now_seconds() - start) / batch);
+    }
+}
+
+// Путь замера; усечённый путь указал бы на чужой файл, поэтому замер пропускается
+static bool bench_path(char *path, size_t size, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static bool bench_path(char *path, size_t size, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(path, size, format, ap);
+    va_end(ap);
+    if (len < 0 || (size_t)len >= size) {
+        log_warning("Слишком длинный путь замера: %s", path);
+        return false;
+    }
+    return true;
+}
+
+typedef struct {
+    char src[PATH_MAX];
+    char dst[PATH_MAX];
+    char *content;
+    unsigned long long counter;
+} FileCtx;
+
+static void op_write_to_file(void *ctx) {
+    FileCtx *file = ctx;
+    write_to_file(file->dst, file->content);
+}
+
+static void op_read_file(void *ctx) {
+    FileCtx *file = ctx;
+    free(read_file(file->src));
+}
+
+static void op_copy_file(void *ctx) {
+    FileCtx *file = ctx;
+    copy_file(file->src, file->dst);
+}
+
+static void op_file_exists(void *ctx) {
+    FileCtx *file = ctx;
+    file_exists(file->src);
+}
+
+static void op_make_dirs(void *ctx) {
+    FileCtx *file = ctx;
+    char path[PATH_MAX];
+    if (bench_path(path, sizeof(path), "%s/d%llu/usr/share/locale/ru/LC_MESSAGES/x",
+                   file->dst, file->counter++)) {
+        make_dirs(path);
+    }
+}
+
+static void bench_files(const BenchOptions *options) {
+    char dir[PATH_MAX];
+    if (!bench_path(dir, sizeof(dir), "%s/files", options->dir) || make_dirs(dir) != 0) {
+        return;
+    }
+
+    FileCtx file = { 0 };
+    for (unsigned long long size = 4096; size <= (unsigned long long)options->max_file_mb << 20;
+         size *= 16) {
+        char label[16], name[96];
+        format_size(size, label, sizeof(label));
+
+        // write_to_file пишет строку: содержимое без нулевых байтов
+        file.content = malloc(size + 1);
+        if (!file.content) {
+            break;
+        }
+        for (unsigned long long i = 0; i < size; i++) {
+            file.content[i] = (i % 64 == 63) ? '\n' : 'a' + (char)(i * 7 % 26);
+        }
+        file.content[size] = '\0';
+
+        if (!bench_path(file.src, sizeof(file.src), "%s/src-%s", dir, label) ||
+            !bench_path(file.dst, sizeof(file.dst), "%s/dst-%s", dir, label)) {
+            free(file.content);
+            break;
+        }
+        write_to_file(file.src, file.content);
+
+        snprintf(name, sizeof(name), "files/write_to_file/%s", label);
+        bench_loop(options, name, size, op_write_to_file, &file);
+        snprintf(name, sizeof(name), "files/read_file/%s", label);
+        bench_loop(options, name, size, op_read_file, &file);
+        snprintf(name, sizeof(name), "files/copy_file/%s", label);
+        bench_loop(options, name, size, op_copy_file, &file);
+
+        unlink(file.src);
+        unlink(file.dst);
+        free(file.content);
+        file.content = NULL;
+    }
+
+    snprintf(file.src, sizeof(file.src), "%s", dir);
+    bench_loop(options, "files/file_exists", 0, op_file_exists, &file);
+    if (bench_path(file.dst, sizeof(file.dst), "%s/dirs", dir)) {
+        bench_loop(options, "files/make_dirs/depth-7", 0, op_make_dirs, &file);
+    }
+
+    remove_tree(dir);
+}
+
+static void op_exec_run(void *ctx) {
+    (void)ctx;
+    char *const argv[] = { "true", NULL };
+    ExecResult result;
+    exec_run(argv, NULL, &result);
+}
+
+static void op_execute_cmd(void *ctx) {
+    (void)ctx;
+    execute_cmd("true", false);
+}
+
+static void op_spawn_process(void *ctx) {
+    (void)ctx;
+    char *const argv[] = { "true", NULL };
+    pid_t pid = spawn_process(argv, NULL, NULL, NULL);
+    if (pid > 0) {
+        wait_process(pid, NULL, NULL);
+    }
+}
+
+static void bench_spawn(const BenchOptions *options) {
+    bench_loop(options, "spawn/spawn_process", 0, op_spawn_process, NULL);
+    bench_loop(options, "spawn/exec_run", 0, op_exec_run, NULL);
+    bench_loop(options, "spawn/execute_cmd", 0, op_execute_cmd, NULL);
+}
+
+static void op_settings_load(void *ctx) {
+    SquashSettings settings;
+    squashfs_settings_init(&settings);
+    squashfs_settings_load(&settings, ctx);
+}
+
+// Полная загрузка: разбор, поля сборки и списки пакетов
+static void op_config_load(void *ctx) {
+    BuildConfig config;
+    config_init(&config);
+    config_load_from_file(&config, ctx);
+    config_free(&config);
+}
+
+static unsigned long long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (unsigned long long)st.st_size : 0;
+}
+
+// Конфигурация с длинными списками пакетов и комментариями: разбор
+// всего файла, а не только секции [Squashfs]
+static int write_synthetic_conf(const char *path) {
+    FILE *fp = fopen(path, "we");
+    if (!fp) {
+        return -1;
+    }
+
+    fprintf(fp, "[Build]\n# Синтетическая конфигурация luna-bench\nName = Luna Linux\n\n");
+    fprintf(fp, "[Squashfs]\nProfile = release-xz\nThreads = 0\n");
+    for (int i = 0; i < SQUASHFS_PROFILES_MAX / 2; i++) {
+        fprintf(fp, "Profile.bench-%d = -comp xz -b 1M -Xdict-size %d%%\n", i, 25 * (i % 4 + 1));
+    }
+    for (int section = 0; section < 40; section++) {
+        fprintf(fp, "\n[Packages%d]\n", section);
+        for (int line = 0; line < 50; line++) {
+            fprintf(fp, "# пакеты группы %d.%d\nList%d = ", section, line, line);
+            for (int pkg = 0; pkg < 20; pkg++) {
+                fprintf(fp, "%spackage-%d-%d-%d", pkg ? "," : "", section, line, pkg);
+            }
+            fprintf(fp, "\n");
+        }
+    }
+    return fclose(fp);
+}
+
+static void bench_config(const BenchOptions *options) {
+    if (file_exists(options->conf_path)) {
+        bench_loop(options, "config/squashfs_settings_load/luna.conf",
+                   file_size(options->conf_path), op_settings_load, (void *)options->conf_path);
+        bench_loop(options, "config/config_load/luna.conf",
+                   file_size(options->conf_path), op_config_load, (void *)options->conf_path);
+    }
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/synthetic.conf", options->dir);
+    if (write_synthetic_conf(path) == 0) {
+        bench_loop(options, "config/squashfs_settings_load/synthetic", file_size(path),
+                   op_settings_load, path);
+        bench_loop(options, "config/config_load/synthetic", file_size(path),
+                   op_config_load, path);
+    }
+    unlink(path);
+}
+
+// ---------------------------------------------------------------------
+// Синтетический chroot
+// ---------------------------------------------------------------------
+
+typedef struct {
+    uint64_t state;
+} Rng;
+
+// xorshift64*: одна и та же последовательность на любой платформе
+static uint64_t rng_next(Rng *rng) {
+    rng->state ^= rng->state >> 12;
+    rng->state ^= rng->state << 25;
+    rng->state ^= rng->state >> 27;
+    return rng->state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t rng_range(Rng *rng, uint64_t low, uint64_t high) {
+    return low + rng_next(rng) % (high - low + 1);
+}
+
+static const char *const words[] = {
+    "the", "package", "system", "config", "file", "luna", "linux", "kernel", "module",
+    "license", "copyright", "permission", "software", "version", "install", "library",
+    "service", "display", "plasma", "window", "manager", "translation", "message",
+    "function", "return", "value", "error", "warning", "default", "option", "path"
+};
+
+// Текст: документация, конфигурация, сценарии, переводы
+static void fill_text(Rng *rng, unsigned char *data, size_t size) {
+    size_t pos = 0;
+    while (pos < size) {
+        const char *word = words[rng_next(rng) % (sizeof(words) / sizeof(words[0]))];
+        size_t len = strlen(word);
+        for (size_t i = 0; i < len && pos < size; i++) {
+            data[pos++] = word[i];
+        }
+        if (pos < size) {
+            data[pos++] = rng_next(rng) % 12 == 0 ? '\n' : ' ';
+        }
+    }
+}
+
+// Машинный код: случайные участки вперемешку с повторами и нулями,
+// сжимается примерно вдвое
+static void fill_binary(Rng *rng, unsigned char *data, size_t size) {
+    size_t pos = 0;
+    while (pos < size) {
+        size_t run = rng_range(rng, 16, 512);
+        if (run > size - pos) {
+            run = size - pos;
+        }
+        switch (rng_next(rng) % 4) {
+            case 0:
+                memset(data + pos, 0, run);
+                break;
+            case 1:
+                if (pos >= run) {
+                    memcpy(data + pos, data + pos - run, run);
+                    break;
+                }
+                // fallthrough
+            default:
+                for (size_t i = 0; i < run; i++) {
+                    data[pos + i] = (unsigned char)rng_next(rng);
+                }
+                break;
+        }
+        pos += run;
+    }
+}
+
+// Сжатые данные (значки PNG, архивы): не сжимаются
+static void fill_random(Rng *rng, unsigned char *data, size_t size) {
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t value = rng_next(rng);
+        memcpy(data + i, &value, size - i < 8 ? size - i : 8);
+    }
+}
+
+static int write_data(const char *path, const unsigned char *data, size_t size, mode_t mode) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (fd < 0) {
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t written = write(fd, data + done, size - done);
+        if (written <= 0) {
+            close(fd);
+            return -1;
+        }
+        done += written;
+    }
+
+    struct timespec times[2] = { { BENCH_MTIME, 0 }, { BENCH_MTIME, 0 } };
+    futimens(fd, times);
+    return close(fd);
+}
+
+typedef struct {
+    unsigned long long files;
+    unsigned long long bytes;
+    unsigned long long duplicates;
+    unsigned long long links;
+} ChrootStats;
+
+// Дерево, похожее на установленную систему: /usr/bin и библиотеки,
+// документация пакетов, переводы, значки с повторяющимися копиями,
+// ссылки, ядро и initrd в /boot. Объём — около target_mb
+static int generate_chroot(const char *root, int target_mb, uint64_t seed, ChrootStats *stats) {
+    static const char *const dirs[] = {
+        "usr/bin", "usr/lib/x86_64-linux-gnu", "usr/share/doc", "usr/share/locale",
+        "usr/share/icons/breeze", "etc/default", "var/lib/dpkg/info", "boot", NULL
+    };
+
+    Rng rng = { seed ? seed : 1 };
+    memset(stats, 0, sizeof(*stats));
+
+    char path[1024];
+    for (int i = 0; dirs[i] != NULL; i++) {
+        snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+        if (make_dirs(path) != 0) {
+            return -1;
+        }
+    }
+
+    unsigned char *data = malloc(32 << 20);
+    if (!data) {
+        return -1;
+    }
+
+    // Ядро не сжимается, initrd сжимается частично
+    snprintf(path, sizeof(path), "%s/boot/vmlinuz-6.5.0-bench", root);
+    fill_random(&rng, data, 12 << 20);
+    int result = write_data(path, data, 12 << 20, 0644);
+    snprintf(path, sizeof(path), "%s/boot/initrd.img-6.5.0-bench", root);
+    fill_binary(&rng, data, 32 << 20);
+    result |= write_data(path, data, 32 << 20, 0644);
+    stats->files = 2;
+    stats->bytes = 44ULL << 20;
+
+    unsigned long long target = (unsigned long long)target_mb << 20;
+    char last[1024] = "";
+    unsigned long long n = 0;
+    while (result == 0 && stats->bytes < target) {
+        int kind = rng_next(&rng) % 100;
+        size_t size;
+        mode_t mode = 0644;
+        n++;
+
+        if (kind < 40) {
+            size = rng_range(&rng, 200, 64 << 10);
+            snprintf(path, sizeof(path), "%s/usr/share/doc/pkg%llu", root, n / 8);
+            make_dirs(path);
+            snprintf(path + strlen(path), sizeof(path) - strlen(path), "/README-%llu", n);
+            fill_text(&rng, data, size);
+        } else if (kind < 65) {
+            // Большинство программ и библиотек небольшие, крупные редки
+            size = rng_next(&rng) % 10 ? rng_range(&rng, 8 << 10, 256 << 10)
+                                       : rng_range(&rng, 256 << 10, 4 << 20);
+            bool library = kind < 55;
+            snprintf(path, sizeof(path), library ? "%s/usr/lib/x86_64-linux-gnu/lib%llu.so.1"
+                                                 : "%s/usr/bin/tool%llu", root, n);
+            mode = library ? 0644 : 0755;
+            fill_binary(&rng, data, size);
+        } else if (kind < 80) {
+            size = rng_range(&rng, 1 << 10, 32 << 10);
+            snprintf(path, sizeof(path), "%s/usr/share/icons/breeze/icon%llu.png", root, n);
+            fill_random(&rng, data, size);
+        } else if (kind < 90 && last[0]) {
+            // Одинаковые копии: лицензии, значки тем, переводы
+            struct stat st;
+            if (stat(last, &st) != 0) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/usr/share/doc/copy%llu", root, n);
+            result = stage_file(last, path, STAGE_COPY, NULL);
+            struct timespec times[2] = { { BENCH_MTIME, 0 }, { BENCH_MTIME, 0 } };
+            utimensat(AT_FDCWD, path, times, 0);
+            stats->files++;
+            stats->duplicates++;
+            stats->bytes += st.st_size;
+            continue;
+        } else if (kind < 95) {
+            size = rng_range(&rng, 2 << 10, 256 << 10);
+            snprintf(path, sizeof(path), "%s/usr/share/locale/ru%llu.mo", root, n % 64);
+            fill_text(&rng, data, size);
+        } else if (last[0]) {
+            snprintf(path, sizeof(path), "%s/usr/share/doc/link%llu", root, n);
+            result = kind < 98 ? symlink(last, path) : link(last, path);
+            stats->links++;
+            continue;
+        } else {
+            continue;
+        }
+
+        result = write_data(path, data, size, mode);
+        stats->files++;
+        stats->bytes += size;
+        if (kind % 3 == 0) {
+            snprintf(last, sizeof(last), "%s", path);
+        }
+    }
+
+    free(data);
+    return result == 0 ? 0 : -1;
+}
+
+// Изменение части файлов между сборками: обновление пакетов, которое
+// видит инкрементальная запись squashfs
+static int touch_chroot(const char *root, uint64_t seed) {
+    Rng rng = { seed ? seed * 31 : 31 };
+    unsigned char data[4096];
+    char path[1024];
+    int changed = 0;
+
+    for (unsigned long long n = 1; n < 100000; n += rng_range(&rng, 10, 30)) {
+        snprintf(path, sizeof(path), "%s/usr/lib/x86_64-linux-gnu/lib%llu.so.1", root, n);
+        int fd = open(path, O_WRONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        fill_binary(&rng, data, sizeof(data));
+        if (pwrite(fd, data, sizeof(data), 0) == (ssize_t)sizeof(data)) {
+            changed++;
+        }
+        close(fd);
+    }
+    return changed;
+}
+
+// ---------------------------------------------------------------------
+// Конвейер
+// ---------------------------------------------------------------------
+
+typedef struct {
+    SquashSettings settings;
+    SqfsOptions native;
+    bool use_native;
+    bool have_mksquashfs;
+} PipelineSetup;
+
+static int build_squashfs(const PipelineSetup *setup, const char *root, const char *image,
+                          const char *manifest, bool verbose) {
+    if (!setup->use_native) {
+        unlink(image);
+        ExecArgs args;
+        squashfs_args(&setup->settings, squashfs_profile(&setup->settings), root, image, &args);
+        int result = exec_command(args.argv, verbose);
+        exec_args_free(&args);
+        return result;
+    }
+
+    char part[600];
+    snprintf(part, sizeof(part), "%s.part", image);
+    SqfsWriter *writer = sqfs_writer_open(&setup->native, part);
+    if (!writer) {
+        return -1;
+    }
+    sqfs_writer_set_base(writer, manifest, image);
+    int result = sqfs_writer_finish(writer, root);
+    sqfs_writer_close(writer);
+
+    if (result != 0 || rename(part, image) != 0) {
+        unlink(part);
+        return -1;
+    }
+    return 0;
+}
+
+static void pipeline_run(const BenchOptions *options, const PipelineSetup *setup, int run) {
+    char root[512], chroot[600], imagedir[600], isodir[600], casper[700];
+    snprintf(root, sizeof(root), "%s/pipeline", options->dir);
+    snprintf(chroot, sizeof(chroot), "%s/chroot", root);
+    snprintf(imagedir, sizeof(imagedir), "%s/image", root);
+    snprintf(isodir, sizeof(isodir), "%s/iso", root);
+    snprintf(casper, sizeof(casper), "%s/casper", isodir);
+    remove_tree(root);
+    if (make_dirs(chroot) != 0 || make_dirs(imagedir) != 0 || make_dirs(casper) != 0) {
+        return;
+    }
+
+    double start = now_seconds();
+    ChrootStats chroot_stats;
+    if (generate_chroot(chroot, options->chroot_mb, options->seed, &chroot_stats) != 0) {
+        log_error("Не удалось создать синтетический chroot в %s", chroot);
+        return;
+    }
+    result_add("pipeline/generate", chroot_stats.bytes, now_seconds() - start);
+    if (run == 0) {
+        log_info("Синтетический chroot: %llu файлов, %.1f MB, %llu копий, %llu ссылок",
+                 chroot_stats.files, chroot_stats.bytes / (1024.0 * 1024.0),
+                 chroot_stats.duplicates, chroot_stats.links);
+    }
+
+    drop_caches(options);
+    DedupStats dedup;
+    if (dedup_tree(chroot, 0, &dedup) == 0) {
+        result_add("pipeline/dedup", dedup.bytes_total, dedup.seconds);
+    }
+
+    char image[700], manifest[700];
+    snprintf(image, sizeof(image), "%s/filesystem.squashfs", imagedir);
+    snprintf(manifest, sizeof(manifest), "%s/squashfs.manifest", root);
+
+    drop_caches(options);
+    start = now_seconds();
+    if (build_squashfs(setup, chroot, image, manifest, options->verbose) != 0) {
+        log_error("Не удалось собрать squashfs");
+        return;
+    }
+    result_add("pipeline/squashfs", chroot_stats.bytes, now_seconds() - start);
+
+    if (setup->use_native && setup->settings.incremental) {
+        touch_chroot(chroot, options->seed);
+        drop_caches(options);
+        start = now_seconds();
+        if (build_squashfs(setup, chroot, image, manifest, options->verbose) == 0) {
+            result_add("pipeline/squashfs_incremental", chroot_stats.bytes, now_seconds() - start);
+        }
+    }
+
+    // Размещение в casper, как в stage_casper_files
+    static const char *const staged[][2] = {
+        { "vmlinuz", "boot/vmlinuz-6.5.0-bench" },
+        { "initrd", "boot/initrd.img-6.5.0-bench" },
+        { "filesystem.squashfs", NULL }
+    };
+    unsigned long long staged_bytes = 0;
+    start = now_seconds();
+    for (size_t i = 0; i < sizeof(staged) / sizeof(staged[0]); i++) {
+        char source[800], target[800];
+        if (staged[i][1]) {
+            snprintf(source, sizeof(source), "%s/%s", chroot, staged[i][1]);
+        } else {
+            snprintf(source, sizeof(source), "%s/%s", imagedir, staged[i][0]);
+        }
+        snprintf(target, sizeof(target), "%s/%s", casper, staged[i][0]);
+        StageResult result;
+        if (stage_file(source, target, 0, &result) != 0) {
+            return;
+        }
+        staged_bytes += result.bytes;
+    }
+    result_add("pipeline/stage", staged_bytes, now_seconds() - start);
+
+    // Запись ISO без загрузочных образов: их в синтетическом дереве нет.
+    // Контрольные суммы считаются, как при сборке
+    char iso[600];
+    snprintf(iso, sizeof(iso), "%s/bench.iso", root);
+    static const IsoOptions iso_options = {
+        .volume_id = "LUNA_BENCH",
+        .md5_list = "md5sum.txt",
+        .checksums = true
+    };
+    IsoStats iso_stats;
+    drop_caches(options);
+    if (iso_write(isodir, iso, NULL, &iso_options, &iso_stats) == 0) {
+        result_add("pipeline/iso", iso_stats.bytes, iso_stats.seconds);
+    }
+
+    // Удаление, как при очистке рабочего каталога (-c, CleanMode = parallel)
+    drop_caches(options);
+    CleanStats clean;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (clean_tree(root, true, threads > 0 ? (int)threads : 1, &clean) == 0) {
+        result_add("pipeline/clean", chroot_stats.bytes, clean.seconds);
+    } else {
+        remove_tree(root);
+    }
+}
+
+static void bench_pipeline(const BenchOptions *options) {
+    PipelineSetup setup;
+    squashfs_settings_init(&setup.settings);
+    if (file_exists(options->conf_path)) {
+        squashfs_settings_load(&setup.settings, options->conf_path);
+    }
+    if (options->profile && squashfs_select(&setup.settings, options->profile) != 0) {
+        return;
+    }
+
+    setup.use_native = squashfs_native_options(&setup.settings, &setup.native);
+    setup.have_mksquashfs = check_dependency("mksquashfs");
+    if (setup.use_native) {
+        setup.native.mtime = BENCH_MTIME;
+    } else if (!setup.have_mksquashfs) {
+        log_error("Профиль %s требует mksquashfs", squashfs_profile(&setup.settings)->name);
+        return;
+    }
+
+    log_info("Конвейер: chroot %d MB, профиль %s (%s), прогонов: %d", options->chroot_mb,
+             squashfs_profile(&setup.settings)->name,
+             setup.use_native ? "встроенная запись" : "mksquashfs", options->runs);
+    for (int run = 0; run < options->runs; run++) {
+        pipeline_run(options, &setup, run);
+    }
+}
+
+// ---------------------------------------------------------------------
+// Отчёт
+// ---------------------------------------------------------------------
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+typedef struct {
+    double median;
+    double min;
+    double mean;
+    double stddev;
+} BenchSummary;
+
+static void summarize(const BenchResult *result, BenchSummary *summary) {
+    double sorted[BENCH_MAX_SAMPLES];
+    memcpy(sorted, result->samples, result->count * sizeof(double));
+    qsort(sorted, result->count, sizeof(double), compare_double);
+
+    int n = result->count;
+    summary->median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    summary->min = sorted[0];
+    summary->mean = 0;
+    for (int i = 0; i < n; i++) {
+        summary->mean += sorted[i] / n;
+    }
+    summary->stddev = 0;
+    for (int i = 0; i < n; i++) {
+        summary->stddev += (sorted[i] - summary->mean) * (sorted[i] - summary->mean);
+    }
+    summary->stddev = n > 1 ? sqrt(summary->stddev / (n - 1)) : 0;
+}
+
+static void format_time(double seconds, char *buf, size_t size) {
+    if (seconds >= 1) {
+        snprintf(buf, size, "%.2f с", seconds);
+    } else if (seconds >= 1e-3) {
+        snprintf(buf, size, "%.2f мс", seconds * 1e3);
+    } else {
+        snprintf(buf, size, "%.2f мкс", seconds * 1e6);
+    }
+}
+
+static void print_results(void) {
+    printf("\n");
+    print_padded("Замер", 48);
+    print_padded("Медиана", 14);
+    print_padded("Минимум", 14);
+    print_padded("Разброс", 10);
+    printf("MB/s\n");
+
+    for (int i = 0; i < result_count; i++) {
+        BenchSummary summary;
+        summarize(&results[i], &summary);
+
+        char median[32], min[32], spread[32];
+        format_time(summary.median, median, sizeof(median));
+        format_time(summary.min, min, sizeof(min));
+        snprintf(spread, sizeof(spread), "%.1f%%",
+                 summary.mean > 0 ? 100 * summary.stddev / summary.mean : 0);
+        print_padded(results[i].name, 48);
+        print_padded(median, 14);
+        print_padded(min, 14);
+        print_padded(spread, 10);
+        if (results[i].bytes > 0 && summary.median > 0) {
+            printf("%.1f", results[i].bytes / summary.median / (1024 * 1024));
+        }
+        printf("\n");
+    }
+}
+
+// Один замер на строку: файл читается построчно при сравнении
+static int write_json(const BenchOptions *options) {
+    FILE *fp = fopen(options->json_path, "we");
+    if (!fp) {
+        log_error("Не удалось записать %s: %s", options->json_path, strerror(errno));
+        return -1;
+    }
+
+    struct utsname host;
+    uname(&host);
+    fprintf(fp, "{\"format\":\"%s\",\"label\":\"%s\",\"time\":%lld,\"kernel\":\"%s\","
+                "\"cpus\":%ld,\"seed\":%llu,\"chroot_mb\":%d,\"results\":[\n",
+            BENCH_FORMAT, options->label, (long long)time(NULL), host.release,
+            sysconf(_SC_NPROCESSORS_ONLN), options->seed, options->chroot_mb);
+    for (int i = 0; i < result_count; i++) {
+        BenchSummary summary;
+        summarize(&results[i], &summary);
+        fprintf(fp, "{\"name\":\"%s\",\"samples\":%d,\"median\":%.9f,\"min\":%.9f,"
+                    "\"mean\":%.9f,\"stddev\":%.9f,\"bytes\":%llu}%s\n",
+                results[i].name, results[i].count, summary.median, summary.min,
+                summary.mean, summary.stddev, results[i].bytes,
+                i + 1 < result_count ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    return fclose(fp);
+}
+
+typedef struct {
+    char name[96];
+    double median;
+    double stddev;
+} SavedResult;
+
+static int load_json(const char *path, SavedResult *saved, int max) {
+    FILE *fp = fopen(path, "re");
+    if (!fp) {
+        log_error("Не удалось открыть %s", path);
+        return -1;
+    }
+
+    char line[512];
+    int count = 0;
+    while (count < max && fgets(line, sizeof(line), fp)) {
+        SavedResult *entry = &saved[count];
+        if (sscanf(line, "{\"name\":\"%95[^\"]\",\"samples\":%*d,\"median\":%lf,\"min\":%*f,"
+                         "\"mean\":%*f,\"stddev\":%lf",
+                   entry->name, &entry->median, &entry->stddev) == 3) {
+            count++;
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+// Изменение медианы; заметным считается изменение больше 5% и больше
+// двух стандартных отклонений обоих замеров
+static int compare_runs(const char *base_path, const char *new_path) {
+    static SavedResult base[BENCH_MAX_RESULTS], current[BENCH_MAX_RESULTS];
+    int base_count = load_json(base_path, base, BENCH_MAX_RESULTS);
+    int current_count = load_json(new_path, current, BENCH_MAX_RESULTS);
+    if (base_count < 0 || current_count < 0) {
+        return 1;
+    }
+
+    printf("\n");
+    print_padded("Замер", 48);
+    print_padded("Было", 14);
+    print_padded("Стало", 14);
+    printf("Изменение\n");
+
+    int regressions = 0;
+    for (int i = 0; i < current_count; i++) {
+        const SavedResult *before = NULL;
+        for (int j = 0; j < base_count; j++) {
+            if (strcmp(base[j].name, current[i].name) == 0) {
+                before = &base[j];
+                break;
+            }
+        }
+        if (!before || before->median <= 0) {
+            continue;
+        }
+
+        double change = (current[i].median - before->median) / before->median;
+        double noise = 2 * (before->stddev + current[i].stddev) / before->median;
+        bool significant = fabs(change) > 0.05 && fabs(change) > noise;
+
+        char was[32], now[32];
+        format_time(before->median, was, sizeof(was));
+        format_time(current[i].median, now, sizeof(now));
+        print_padded(current[i].name, 48);
+        print_padded(was, 14);
+        print_padded(now, 14);
+        printf("%+.1f%%%s\n", 100 * change,
+               !significant ? "" : change > 0 ? "  медленнее" : "  быстрее");
+        regressions += significant && change > 0;
+    }
+
+    return regressions > 0 ? 2 : 0;
+}
+
+static void usage(const char *program) {
+    printf("Использование: %s [параметры] [files,spawn,config,pipeline]\n", program);
+    printf("       %s compare <было.json> <стало.json>\n\n", program);
+    printf("  -d    Рабочий каталог (по умолчанию /var/tmp/luna-bench)\n");
+    printf("  -o    Файл результатов JSON\n");
+    printf("  -l    Метка прогона в JSON (например, хеш коммита)\n");
+    printf("  -n    Повторов микрозамера (по умолчанию 10)\n");
+    printf("  -s    Наибольший размер файла в микрозамерах, MB (по умолчанию 64)\n");
+    printf("  -m    Объём синтетического chroot, MB (по умолчанию 512)\n");
+    printf("  -r    Прогонов конвейера (по умолчанию 3)\n");
+    printf("  -S    Зерно генератора chroot (по умолчанию 1)\n");
+    printf("  -f    luna.conf с профилями сжатия (по умолчанию luna.conf)\n");
+    printf("  -z    Профиль сжатия\n");
+    printf("  -C    Сбрасывать страничный кэш перед фазами конвейера\n");
+    printf("  -v    Подробный вывод команд\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 4 && strcmp(argv[1], "compare") == 0) {
+        return compare_runs(argv[2], argv[3]);
+    }
+
+    BenchOptions options = {
+        .dir = "/var/tmp/luna-bench",
+        .conf_path = "luna.conf",
+        .label = "",
+        .samples = 10,
+        .runs = 3,
+        .chroot_mb = 512,
+        .max_file_mb = 64,
+        .seed = 1
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:o:l:n:s:m:r:S:f:z:Cvh")) != -1) {
+        switch (opt) {
+            case 'd': options.dir = optarg; break;
+            case 'o': options.json_path = optarg; break;
+            case 'l': options.label = optarg; break;
+            case 'n': options.samples = atoi(optarg); break;
+            case 's': options.max_file_mb = atoi(optarg); break;
+            case 'm': options.chroot_mb = atoi(optarg); break;
+            case 'r': options.runs = atoi(optarg); break;
+            case 'S': options.seed = strtoull(optarg, NULL, 10); break;
+            case 'f': options.conf_path = optarg; break;
+            case 'z': options.profile = optarg; break;
+            case 'C': options.drop_caches = true; break;
+            case 'v': options.verbose = true; break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (options.samples < 1 || options.samples > BENCH_MAX_SAMPLES ||
+        options.runs < 1 || options.runs > BENCH_MAX_SAMPLES) {
+        fprintf(stderr, "Число повторов: от 1 до %d\n", BENCH_MAX_SAMPLES);
+        return 1;
+    }
+    if (optind < argc) {
+        snprintf(options.only, sizeof(options.only), "%s", argv[optind]);
+    }
+    if (make_dirs(options.dir) != 0) {
+        fprintf(stderr, "Не удалось создать %s\n", options.dir);
+        return 1;
+    }
+
+    if (selected(&options, "files")) {
+        bench_files(&options);
+    }
+    if (selected(&options, "spawn")) {
+        bench_spawn(&options);
+    }
+    if (selected(&options, "config")) {
+        bench_config(&options);
+    }
+    if (selected(&options, "pipeline")) {
+        bench_pipeline(&options);
+    }
+
+    print_results();
+    if (options.json_path && write_json(&options) != 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,465 @@
+/**
+ * boot.c - Загрузочные образы El Torito
+ *
+ * Образ BIOS — ядро GRUB формата i386-pc-eltorito: grub-mkimage сам
+ * ставит перед ним cdboot.img. Образ EFI — раздел FAT с одним файлом
+ * EFI/BOOT/BOOTX64.EFI. Раздел собирается в памяти: загрузочный сектор,
+ * две копии FAT, корневой каталог и данные, ровно столько кластеров,
+ * сколько занимают файлы и каталоги. Тип FAT определяется числом
+ * кластеров, как того требует спецификация: до 4085 — FAT12, иначе FAT16.
+ *
+ * Все нужные модули GRUB встраиваются в ядро: в дереве ISO нет каталогов
+ * модулей, поэтому встроенная конфигурация только находит диск и
+ * передаёт управление его boot/grub/grub.cfg.
+ */
+
+#define _GNU_SOURCE
+
+#include "boot.h"
+#include "exec.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define FAT_SECTOR 512
+#define FAT_ROOT_ENTRIES 512
+#define FAT_MAX_NODES 64
+#define FAT12_MAX_CLUSTERS 4084
+#define FAT16_MAX_CLUSTERS 65524
+
+// Модули ядер GRUB: всё, что нужно меню LiveCD (linux, initrd, chainloader)
+static const char bios_modules[] =
+    "biosdisk iso9660 part_msdos part_gpt search search_fs_file configfile "
+    "normal linux chainloader echo test";
+static const char efi_modules[] =
+    "iso9660 part_msdos part_gpt fat search search_fs_file configfile "
+    "normal linux chainloader echo test all_video efi_gop";
+
+// Узел дерева раздела: каталог или файл
+typedef struct {
+    char name[11];              // имя 8.3 в виде записи каталога
+    bool dir;
+    int parent;                 // -1 — корневой каталог
+    const void *data;
+    size_t size;                // у каталога — размер его записей
+    uint32_t cluster;           // первый кластер, 0 — пусто
+    uint32_t clusters;
+} FatNode;
+
+typedef struct {
+    FatNode nodes[FAT_MAX_NODES];
+    int count;
+} FatTree;
+
+static void put16(uint8_t *p, uint16_t value) {
+    p[0] = value & 0xff;
+    p[1] = value >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t value) {
+    put16(p, value & 0xffff);
+    put16(p + 2, value >> 16);
+}
+
+// Компонент пути в поле имени 8.3; -1 — имя не укладывается в 8.3
+static int short_name(const char *name, size_t len, char out[11]) {
+    memset(out, ' ', 11);
+    const char *dot = memchr(name, '.', len);
+    size_t base = dot ? (size_t)(dot - name) : len;
+    size_t ext = dot ? len - base - 1 : 0;
+    if (base == 0 || base > 8 || ext > 3 || (dot && memchr(dot + 1, '.', ext))) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = name[i];
+        if (c != '.' && !isalnum(c) && c != '_' && c != '-') {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < base; i++) {
+        out[i] = toupper((unsigned char)name[i]);
+    }
+    for (size_t i = 0; i < ext; i++) {
+        out[8 + i] = toupper((unsigned char)dot[1 + i]);
+    }
+    return 0;
+}
+
+static int find_child(const FatTree *tree, int parent, const char name[11]) {
+    for (int i = 0; i < tree->count; i++) {
+        if (tree->nodes[i].parent == parent && memcmp(tree->nodes[i].name, name, 11) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int add_node(FatTree *tree, int parent, const char name[11], bool dir) {
+    if (tree->count == FAT_MAX_NODES) {
+        return -1;
+    }
+    FatNode *node = &tree->nodes[tree->count];
+    memset(node, 0, sizeof(*node));
+    memcpy(node->name, name, 11);
+    node->dir = dir;
+    node->parent = parent;
+    return tree->count++;
+}
+
+static int add_path(FatTree *tree, const BootFile *file) {
+    int parent = -1;
+    const char *p = file->path;
+    for (;;) {
+        const char *slash = strchr(p, '/');
+        size_t len = slash ? (size_t)(slash - p) : strlen(p);
+        char name[11];
+        if (short_name(p, len, name) != 0) {
+            log_error("Имя %s в разделе EFI не укладывается в 8.3", file->path);
+            return -1;
+        }
+
+        int node = find_child(tree, parent, name);
+        if (!slash) {
+            if (node >= 0 || (node = add_node(tree, parent, name, false)) < 0) {
+                return -1;
+            }
+            tree->nodes[node].data = file->data;
+            tree->nodes[node].size = file->size;
+            return 0;
+        }
+        if (node < 0 && (node = add_node(tree, parent, name, true)) < 0) {
+            return -1;
+        }
+        if (!tree->nodes[node].dir) {
+            return -1;
+        }
+        parent = node;
+        p = slash + 1;
+    }
+}
+
+static void dos_time(uint16_t *date, uint16_t *clock) {
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    *date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+    *clock = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+}
+
+static void write_entry(uint8_t *entry, const char name[11], uint8_t attr, uint32_t cluster,
+                        uint32_t size) {
+    uint16_t date, clock;
+    dos_time(&date, &clock);
+    memcpy(entry, name, 11);
+    entry[11] = attr;
+    put16(entry + 14, clock);
+    put16(entry + 16, date);
+    put16(entry + 18, date);
+    put16(entry + 22, clock);
+    put16(entry + 24, date);
+    put16(entry + 26, cluster & 0xffff);
+    put32(entry + 28, size);
+}
+
+static void set_fat(uint8_t *fat, bool fat12, uint32_t cluster, uint32_t value) {
+    if (!fat12) {
+        put16(fat + cluster * 2, value);
+        return;
+    }
+    uint8_t *p = fat + cluster * 3 / 2;
+    if (cluster & 1) {
+        p[0] = (p[0] & 0x0f) | ((value & 0x0f) << 4);
+        p[1] = value >> 4;
+    } else {
+        p[0] = value & 0xff;
+        p[1] = (p[1] & 0xf0) | ((value >> 8) & 0x0f);
+    }
+}
+
+int boot_fat_image(const BootFile *files, int count, const char *label,
+                   uint8_t **image, size_t *size) {
+    FatTree tree = { .count = 0 };
+    for (int i = 0; i < count; i++) {
+        if (add_path(&tree, &files[i]) != 0) {
+            return -1;
+        }
+    }
+
+    // Размер каталогов: ".", ".." и по записи на потомка
+    for (int i = 0; i < tree.count; i++) {
+        if (tree.nodes[i].dir) {
+            tree.nodes[i].size = 2 * 32;
+        }
+    }
+    int root_count = 1;     // метка тома
+    for (int i = 0; i < tree.count; i++) {
+        if (tree.nodes[i].parent >= 0) {
+            tree.nodes[tree.nodes[i].parent].size += 32;
+        } else {
+            root_count++;
+        }
+    }
+    if (root_count > FAT_ROOT_ENTRIES) {
+        return -1;
+    }
+
+    // Наименьший кластер, при котором их число укладывается в FAT16
+    uint32_t per_cluster = 1, clusters = 0;
+    for (; per_cluster <= 64; per_cluster *= 2) {
+        clusters = 0;
+        for (int i = 0; i < tree.count; i++) {
+            size_t bytes = per_cluster * FAT_SECTOR;
+            tree.nodes[i].clusters = (tree.nodes[i].size + bytes - 1) / bytes;
+            clusters += tree.nodes[i].clusters;
+        }
+        if (clusters <= FAT16_MAX_CLUSTERS) {
+            break;
+        }
+    }
+    if (per_cluster > 64) {
+        log_error("Раздел EFI: слишком большие файлы");
+        return -1;
+    }
+    if (clusters == 0) {
+        clusters = 1;
+    }
+
+    bool fat12 = clusters <= FAT12_MAX_CLUSTERS;
+    uint32_t fat_bytes = fat12 ? ((clusters + 2) * 3 + 1) / 2 : (clusters + 2) * 2;
+    uint32_t fat_sectors = (fat_bytes + FAT_SECTOR - 1) / FAT_SECTOR;
+    uint32_t root_sectors = FAT_ROOT_ENTRIES * 32 / FAT_SECTOR;
+    uint32_t data_start = 1 + 2 * fat_sectors + root_sectors;
+    uint32_t sectors = data_start + clusters * per_cluster;
+
+    uint8_t *buffer = calloc(sectors, FAT_SECTOR);
+    if (!buffer) {
+        return -1;
+    }
+
+    // Загрузочный сектор и BPB; код сектора только останавливает процессор
+    uint8_t *boot = buffer;
+    uint32_t serial = (uint32_t)time(NULL) ^ (clusters << 16);
+    memcpy(boot, "\xeb\x3c\x90" "LUNA    ", 11);
+    put16(boot + 11, FAT_SECTOR);
+    boot[13] = per_cluster;
+    put16(boot + 14, 1);
+    boot[16] = 2;
+    put16(boot + 17, FAT_ROOT_ENTRIES);
+    put16(boot + 19, sectors < 65536 ? sectors : 0);
+    boot[21] = 0xf8;
+    put16(boot + 22, fat_sectors);
+    put16(boot + 24, 32);
+    put16(boot + 26, 64);
+    put32(boot + 32, sectors < 65536 ? 0 : sectors);
+    boot[36] = 0x80;
+    boot[38] = 0x29;
+    put32(boot + 39, serial);
+    char volume[11];
+    memset(volume, ' ', sizeof(volume));
+    memcpy(volume, label, strnlen(label, sizeof(volume)));
+    memcpy(boot + 43, volume, 11);
+    memcpy(boot + 54, fat12 ? "FAT12   " : "FAT16   ", 8);
+    memcpy(boot + 62, "\xf4\xeb\xfd", 3);
+    boot[510] = 0x55;
+    boot[511] = 0xaa;
+
+    // Кластеры: каталоги и файлы подряд, цепочки в FAT непрерывные
+    uint8_t *fat = buffer + FAT_SECTOR;
+    uint32_t eoc = fat12 ? 0xfff : 0xffff;
+    set_fat(fat, fat12, 0, fat12 ? 0xff8 : 0xfff8);
+    set_fat(fat, fat12, 1, eoc);
+    uint32_t next = 2;
+    for (int i = 0; i < tree.count; i++) {
+        FatNode *node = &tree.nodes[i];
+        if (node->clusters == 0) {
+            continue;
+        }
+        node->cluster = next;
+        for (uint32_t c = 0; c < node->clusters; c++, next++) {
+            set_fat(fat, fat12, next, c + 1 < node->clusters ? next + 1 : eoc);
+        }
+    }
+    memcpy(fat + fat_sectors * FAT_SECTOR, fat, fat_sectors * FAT_SECTOR);
+
+    // Записи каталогов и данные файлов
+    size_t cluster_bytes = per_cluster * FAT_SECTOR;
+    uint8_t *root = buffer + (1 + 2 * fat_sectors) * FAT_SECTOR;
+    uint8_t *data = buffer + data_start * FAT_SECTOR;
+    size_t used[FAT_MAX_NODES] = { 0 };
+    size_t root_used = 0;
+    write_entry(root, volume, 0x08, 0, 0);
+    root_used += 32;
+
+    for (int i = 0; i < tree.count; i++) {
+        FatNode *node = &tree.nodes[i];
+        uint8_t *own = data + (node->cluster - 2) * cluster_bytes;
+        if (node->dir) {
+            uint32_t parent_cluster = node->parent >= 0 ? tree.nodes[node->parent].cluster : 0;
+            write_entry(own, ".          ", 0x10, node->cluster, 0);
+            write_entry(own + 32, "..         ", 0x10, parent_cluster, 0);
+            used[i] = 64;
+        } else if (node->size > 0) {
+            memcpy(own, node->data, node->size);
+        }
+
+        uint8_t *entry;
+        if (node->parent < 0) {
+            entry = root + root_used;
+            root_used += 32;
+        } else {
+            FatNode *parent = &tree.nodes[node->parent];
+            entry = data + (parent->cluster - 2) * cluster_bytes + used[node->parent];
+            used[node->parent] += 32;
+        }
+        write_entry(entry, node->name, node->dir ? 0x10 : 0x20, node->cluster,
+                    node->dir ? 0 : (uint32_t)node->size);
+    }
+
+    *image = buffer;
+    *size = (size_t)sectors * FAT_SECTOR;
+    return 0;
+}
+
+// Сборка образов
+
+// Чтение файла целиком; NULL — ошибка
+static void *load_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    void *data = malloc(st.st_size ? st.st_size : 1);
+    size_t done = 0;
+    while (data && done < (size_t)st.st_size) {
+        ssize_t n = read(fd, (char *)data + done, st.st_size - done);
+        if (n <= 0) {
+            free(data);
+            data = NULL;
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    *size = done;
+    return data;
+}
+
+// Запись буфера во временный файл и переименование на место
+static int store_file(const char *path, const void *data, size_t size) {
+    char tmp[600];
+    snprintf(tmp, sizeof(tmp), "%s.part", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, (const char *)data + done, size - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    if (close(fd) != 0 || done != size || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    ExecArgs args;
+    ExecOptions options;
+    int result;
+} MkimageJob;
+
+static void mkimage_args(MkimageJob *job, const char *format, const char *output,
+                         const char *config, const char *modules, bool verbose) {
+    exec_args_init(&job->args);
+    exec_args_add(&job->args, "grub-mkimage");
+    exec_args_addf(&job->args, "--format=%s", format);
+    exec_args_addf(&job->args, "--output=%s", output);
+    exec_args_addf(&job->args, "--config=%s", config);
+    exec_args_add(&job->args, "--prefix=/boot/grub");
+    exec_args_split(&job->args, modules);
+
+    // Вывод помощника идёт в журнал шага, запустившего сборку образов
+    job->options = (ExecOptions){
+        .log_path = exec_get_log(), .timeout = -1, .verbose = verbose, .title = format
+    };
+    job->result = -1;
+}
+
+static void *mkimage_thread(void *arg) {
+    MkimageJob *job = arg;
+    job->result = exec_command_options(job->args.argv, &job->options);
+    return NULL;
+}
+
+int boot_build_images(const char *isodir, const char *tmpdir, const char *embed_cfg,
+                      bool verbose) {
+    char config[512], efi_core[512], bios_img[512], efi_img[512];
+    snprintf(config, sizeof(config), "%s/grub-embed.cfg", tmpdir);
+    snprintf(efi_core, sizeof(efi_core), "%s/bootx64.efi", tmpdir);
+    snprintf(bios_img, sizeof(bios_img), "%s/boot/grub/bios.img", isodir);
+    snprintf(efi_img, sizeof(efi_img), "%s/boot/grub/efi.img", isodir);
+
+    if (write_to_file(config, embed_cfg) != 0) {
+        log_error("Не удалось записать %s", config);
+        return -1;
+    }
+
+    // Ядро BIOS собирается в помощнике, пока здесь собирается ядро EFI
+    MkimageJob bios, efi;
+    mkimage_args(&bios, "i386-pc-eltorito", bios_img, config, bios_modules, verbose);
+    mkimage_args(&efi, "x86_64-efi", efi_core, config, efi_modules, verbose);
+
+    pthread_t helper;
+    bool threaded = pthread_create(&helper, NULL, mkimage_thread, &bios) == 0;
+    mkimage_thread(&efi);
+    if (threaded) {
+        pthread_join(helper, NULL);
+    } else {
+        mkimage_thread(&bios);
+    }
+    exec_args_free(&bios.args);
+    exec_args_free(&efi.args);
+
+    int result = bios.result == 0 && efi.result == 0 ? 0 : -1;
+    if (result == 0) {
+        size_t core_size = 0;
+        void *core = load_file(efi_core, &core_size);
+        BootFile files[] = { { "EFI/BOOT/BOOTX64.EFI", core, core_size } };
+
+        uint8_t *image = NULL;
+        size_t image_size = 0;
+        if (!core || boot_fat_image(files, 1, "LUNA EFI", &image, &image_size) != 0 ||
+            store_file(efi_img, image, image_size) != 0) {
+            log_error("Не удалось создать %s", efi_img);
+            result = -1;
+        } else {
+            log_info("Раздел EFI: %s, %.1f KB (ядро GRUB %.1f KB)", efi_img,
+                     image_size / 1024.0, core_size / 1024.0);
+        }
+        free(image);
+        free(core);
+    }
+
+    unlink(config);
+    unlink(efi_core);
+    return result;
+}
@@ -0,0 +1,393 @@
+/**
+ * cache.c - Реализация кэша шагов сборки
+ *
+ * Каждый шаг описывается ключом — SHA-256 от имени шага, встроенных
+ * скриптов, значимых полей конфигурации и ключа предыдущего шага.
+ * Результат шага (каталог или файл) сохраняется в каталоге кэша под
+ * именем ключа и при совпадении ключа восстанавливается вместо запуска.
+ * Размер кэша ограничен: после сохранения артефакты, которые дольше
+ * всех не использовались, удаляются, пока кэш не уложится в лимит.
+ */
+
+#include "cache.h"
+#include "clean.h"
+#include "utils.h"
+#include "exec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+// Разделяемая блокировка от поиска до восстановления, исключительная — на
+// время вытеснения
+#define STEP_CACHE_LOCK ".lock"
+
+// Контрольные суммы образа рядом с его артефактом
+#define STEP_CACHE_SUMS ".sums"
+
+// Начало построения ключа
+void step_key_init(StepKey *key, const char *step_name) {
+    sha256_init(&key->ctx);
+    step_key_add(key, "step", step_name);
+}
+
+// Добавление именованного входа; длина пишется явно, чтобы
+// конкатенация разных входов не давала одинаковых ключей
+void step_key_add(StepKey *key, const char *label, const char *value) {
+    step_key_add_data(key, label, value, strlen(value));
+}
+
+void step_key_add_data(StepKey *key, const char *label, const void *data, size_t size) {
+    char header[128];
+    int len = snprintf(header, sizeof(header), "%s:%zu:", label, size);
+    sha256_update(&key->ctx, header, len);
+    sha256_update(&key->ctx, data, size);
+}
+
+void step_key_final(StepKey *key, char hex[SHA256_HEX_SIZE]) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256_final(&key->ctx, digest);
+    hash_to_hex(digest, sizeof(digest), hex);
+}
+
+// Пути к артефактам ключа: каталог хранится tar-архивом, файл — копией
+static void artifact_paths(StepCache *cache, const char *key,
+                           char *tar_path, char *file_path, size_t size) {
+    snprintf(tar_path, size, "%s/%s.tar", cache->dir, key);
+    snprintf(file_path, size, "%s/%s.file", cache->dir, key);
+}
+
+// Открытие кэша
+int step_cache_open(StepCache *cache, const char *dir, bool enabled, long long max_bytes) {
+    snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+    cache->max_bytes = max_bytes;
+    cache->enabled = enabled;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->hold_fd = -1;
+
+    if (!enabled) {
+        return 0;
+    }
+
+    if (make_dirs(cache->dir) != 0) {
+        log_warning("Не удалось создать каталог кэша %s, кэш отключён", cache->dir);
+        cache->enabled = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int lock_cache(const StepCache *cache, int operation) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/" STEP_CACHE_LOCK, cache->dir);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0 && flock(fd, operation) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static void unlock_cache(int fd) {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Поиск артефакта по ключу. Первый поиск берёт разделяемую блокировку:
+// найденный артефакт не вытесняется до step_cache_release
+bool step_cache_lookup(StepCache *cache, const char *key) {
+    char tar_path[512], file_path[512];
+    artifact_paths(cache, key, tar_path, file_path, sizeof(tar_path));
+
+    if (cache->hold_fd < 0) {
+        cache->hold_fd = lock_cache(cache, LOCK_SH);
+    }
+
+    if (file_exists(tar_path) || file_exists(file_path)) {
+        // Отметка использования: артефакт этой сборки вытесняется последним
+        utimensat(AT_FDCWD, file_exists(tar_path) ? tar_path : file_path, NULL, 0);
+        cache->hits++;
+        return true;
+    }
+
+    cache->misses++;
+    return false;
+}
+
+void step_cache_release(StepCache *cache) {
+    if (cache->hold_fd < 0) {
+        return;
+    }
+    unlock_cache(cache->hold_fd);
+    cache->hold_fd = -1;
+
+    // Вытеснение, отложенное на время удержания
+    if (cache->max_bytes > 0) {
+        step_cache_prune(cache, cache->max_bytes);
+    }
+}
+
+// Сохранение результата шага в кэш
+int step_cache_store(StepCache *cache, const char *key, const char *source,
+                     const char *step_name, bool verbose) {
+    char tar_path[512], file_path[512], tmp_path[560];
+    artifact_paths(cache, key, tar_path, file_path, sizeof(tar_path));
+
+    const char *final_path;
+    int result;
+    if (dir_exists(source)) {
+        final_path = tar_path;
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", tar_path, getpid());
+        char *const argv[] = { "tar", "--numeric-owner", "--xattrs", "--xattrs-include=*",
+                               "-C", (char *)source, "-cpf", tmp_path, ".", NULL };
+        result = exec_command(argv, verbose);
+    } else if (file_exists(source)) {
+        final_path = file_path;
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", file_path, getpid());
+        char *const argv[] = { "cp", "--reflink=auto", (char *)source, tmp_path, NULL };
+        result = exec_command(argv, verbose);
+    } else {
+        log_warning("Нечего сохранять в кэш: %s", source);
+        return -1;
+    }
+
+    if (result != 0) {
+        unlink(tmp_path);
+        log_warning("Не удалось сохранить шаг «%s» в кэш", step_name);
+        return -1;
+    }
+
+    // Переименование атомарно: параллельная сборка не увидит неполный артефакт
+    if (rename(tmp_path, final_path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    char info_path[512], info[512];
+    time_t now = time(NULL);
+    snprintf(info_path, sizeof(info_path), "%s/%s.info", cache->dir, key);
+    snprintf(info, sizeof(info), "step = %s\nsource = %s\ncreated = %s",
+             step_name, source, ctime(&now));
+    write_to_file(info_path, info);
+
+    if (cache->max_bytes > 0) {
+        step_cache_prune(cache, cache->max_bytes);
+    }
+    return 0;
+}
+
+// Восстановление результата шага из кэша
+int step_cache_restore(StepCache *cache, const char *key, const char *target, bool verbose) {
+    char tar_path[512], file_path[512];
+    artifact_paths(cache, key, tar_path, file_path, sizeof(tar_path));
+
+    // Пока артефакт читается, вытеснение его не удалит
+    int lock_fd = lock_cache(cache, LOCK_SH);
+
+    int result;
+    if (file_exists(tar_path)) {
+        long threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (clean_dir(target, CLEAN_PARALLEL, threads > 0 ? (int)threads : 1) != 0 ||
+            make_dirs(target) != 0) {
+            log_error("Не удалось подготовить каталог %s", target);
+            unlock_cache(lock_fd);
+            return -1;
+        }
+        char *const argv[] = { "tar", "--numeric-owner", "--xattrs", "--xattrs-include=*",
+                               "-C", (char *)target, "-xpf", tar_path, NULL };
+        result = exec_command(argv, verbose);
+    } else if (file_exists(file_path)) {
+        char *const argv[] = { "cp", "--reflink=auto", file_path, (char *)target, NULL };
+        result = exec_command(argv, verbose);
+    } else {
+        log_error("Артефакт %s отсутствует в кэше", key);
+        unlock_cache(lock_fd);
+        return -1;
+    }
+    unlock_cache(lock_fd);
+
+    if (result != 0) {
+        log_error("Не удалось восстановить %s из кэша", target);
+        return -1;
+    }
+
+    return 0;
+}
+
+int step_cache_store_sums(StepCache *cache, const char *key, const char *source) {
+    char *sums = read_file(source);
+    if (!sums) {
+        return -1;
+    }
+
+    // Как и артефакт, суммы появляются в кэше целиком
+    char path[512], tmp_path[560];
+    snprintf(path, sizeof(path), "%s/%s" STEP_CACHE_SUMS, cache->dir, key);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", path, getpid());
+    int result = write_to_file(tmp_path, sums);
+    free(sums);
+    if (result == 0 && rename(tmp_path, path) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(tmp_path);
+        log_warning("Не удалось сохранить контрольные суммы %s в кэш", key);
+    }
+    return result;
+}
+
+int step_cache_restore_sums(StepCache *cache, const char *key, const char *target) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s" STEP_CACHE_SUMS, cache->dir, key);
+
+    int lock_fd = lock_cache(cache, LOCK_SH);
+    char *sums = file_exists(path) ? read_file(path) : NULL;
+    unlock_cache(lock_fd);
+    if (!sums) {
+        return -1;
+    }
+
+    int result = write_to_file(target, sums);
+    free(sums);
+    return result;
+}
+
+// Артефакт кэша для вытеснения
+typedef struct {
+    char key[SHA256_HEX_SIZE];
+    char name[SHA256_HEX_SIZE + 8];
+    time_t used;
+    long long size;
+} CacheEntry;
+
+static int compare_used(const void *a, const void *b) {
+    const CacheEntry *x = a, *y = b;
+    return (x->used > y->used) - (x->used < y->used);
+}
+
+// Артефакты ключа: сам результат; его описание и суммы удаляются вместе с ним
+static bool artifact_name(const char *name, char key[SHA256_HEX_SIZE]) {
+    size_t len = strlen(name);
+    if (len != SHA256_HEX_SIZE - 1 + 4 && len != SHA256_HEX_SIZE - 1 + 5) {
+        return false;
+    }
+    const char *suffix = name + SHA256_HEX_SIZE - 1;
+    if (strcmp(suffix, ".tar") != 0 && strcmp(suffix, ".file") != 0) {
+        return false;
+    }
+    memcpy(key, name, SHA256_HEX_SIZE - 1);
+    key[SHA256_HEX_SIZE - 1] = '\0';
+    return true;
+}
+
+int step_cache_prune(StepCache *cache, long long max_bytes) {
+    int lock_fd = lock_cache(cache, LOCK_EX | LOCK_NB);
+    if (lock_fd < 0) {
+        log_debug("Кэш шагов занят другой сборкой, вытеснение отложено");
+        return 0;
+    }
+
+    DIR *dir = opendir(cache->dir);
+    if (!dir) {
+        unlock_cache(lock_fd);
+        return 0;
+    }
+
+    int count = 0, capacity = 64;
+    long long total = 0;
+    CacheEntry *entries = malloc(capacity * sizeof(CacheEntry));
+    struct dirent *ent;
+    while (entries && (ent = readdir(dir)) != NULL) {
+        char key[SHA256_HEX_SIZE];
+        char path[600];
+        struct stat st;
+        if (!artifact_name(ent->d_name, key)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, ent->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity *= 2;
+            CacheEntry *grown = realloc(entries, capacity * sizeof(CacheEntry));
+            if (!grown) {
+                break;
+            }
+            entries = grown;
+        }
+
+        CacheEntry *entry = &entries[count++];
+        snprintf(entry->key, sizeof(entry->key), "%s", key);
+        snprintf(entry->name, sizeof(entry->name), "%s", ent->d_name);
+        entry->used = st.st_mtime;
+        entry->size = (long long)st.st_blocks * 512;
+        total += entry->size;
+    }
+    closedir(dir);
+
+    int removed = 0;
+    if (entries) {
+        qsort(entries, count, sizeof(CacheEntry), compare_used);
+        for (int i = 0; i < count && total > max_bytes; i++) {
+            char path[600];
+            snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+            if (unlink(path) != 0) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%s.info", cache->dir, entries[i].key);
+            unlink(path);
+            snprintf(path, sizeof(path), "%s/%s" STEP_CACHE_SUMS, cache->dir, entries[i].key);
+            unlink(path);
+            total -= entries[i].size;
+            removed++;
+        }
+        free(entries);
+    }
+    unlock_cache(lock_fd);
+
+    if (removed > 0) {
+        log_info("Кэш шагов: вытеснено артефактов %d, занято %.1f MB",
+                 removed, total / (1024.0 * 1024.0));
+    }
+    return removed;
+}
+
+// Итоговая статистика кэша
+void step_cache_print_stats(const StepCache *cache) {
+    if (!cache->enabled) {
+        return;
+    }
+
+    log_info("Кэш шагов (%s): попаданий %d, промахов %d",
+             cache->dir, cache->hits, cache->misses);
+}
+
+// Проверка, что в рабочем каталоге уже развёрнут результат с этим ключом
+bool step_stamp_matches(const char *stamp_path, const char *key) {
+    char *stamp = read_file(stamp_path);
+    if (!stamp) {
+        return false;
+    }
+
+    bool matches = strncmp(stamp, key, SHA256_HEX_SIZE - 1) == 0;
+    free(stamp);
+    return matches;
+}
+
+int step_stamp_write(const char *stamp_path, const char *key) {
+    return write_to_file(stamp_path, key);
+}
+
+void step_stamp_clear(const char *stamp_path) {
+    unlink(stamp_path);
+}
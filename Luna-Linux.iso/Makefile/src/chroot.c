@@ -0,0 +1,176 @@
+/**
+ * chroot.c - Реализация запуска команд в chroot
+ *
+ * Дочерний процесс отделяет своё пространство имён монтирования, делает
+ * все точки монтирования приватными и монтирует в chroot /proc, /sys,
+ * /dev, новый экземпляр /dev/pts и tmpfs в /tmp, после чего выполняет
+ * chroot и exec. Снаружи эти точки монтирования не видны и исчезают
+ * вместе с последним процессом пространства имён, поэтому размонтировать
+ * их не нужно даже при аварийном завершении, а в слой overlayfs шага не
+ * попадает содержимое /tmp.
+ */
+
+#define _GNU_SOURCE
+
+#include "chroot.h"
+#include "exec.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+// Точки монтирования внутри chroot
+enum {
+    MOUNT_PROC,
+    MOUNT_SYS,
+    MOUNT_DEV,
+    MOUNT_DEVPTS,
+    MOUNT_TMP,
+    MOUNT_COUNT
+};
+
+typedef struct {
+    const char *subdir;
+    const char *source;
+    const char *fstype;
+    unsigned long flags;
+    const char *data;
+} ChrootMount;
+
+static const ChrootMount chroot_mounts[MOUNT_COUNT] = {
+    [MOUNT_PROC]   = { "proc",    "proc",   "proc",   MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL },
+    [MOUNT_SYS]    = { "sys",     "sysfs",  "sysfs",  MS_RDONLY | MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL },
+    [MOUNT_DEV]    = { "dev",     "/dev",   NULL,     MS_BIND, NULL },
+    [MOUNT_DEVPTS] = { "dev/pts", "devpts", "devpts", MS_NOSUID | MS_NOEXEC,
+                       "newinstance,ptmxmode=0666,mode=0620" },
+    [MOUNT_TMP]    = { "tmp",     "tmpfs",  "tmpfs",  MS_NOSUID | MS_NODEV, "mode=1777" },
+};
+
+// Всё, что нужно дочернему процессу, готовится до fork: между fork и
+// exec допустимы только системные вызовы
+typedef struct {
+    const char *root;
+    char targets[MOUNT_COUNT][600];
+    int script_fd;
+} ChrootEnv;
+
+static int child_error(const char *what, const char *path) {
+    const char *parts[] = { "chroot: ", what, " ", path, ": ", strerrorname_np(errno), "\n" };
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        if (parts[i]) {
+            write(STDERR_FILENO, parts[i], strlen(parts[i]));
+        }
+    }
+    return -1;
+}
+
+// Выполняется в дочернем процессе перед exec
+static int chroot_setup(void *arg) {
+    ChrootEnv *env = arg;
+
+    if (unshare(CLONE_NEWNS) != 0) {
+        return child_error("unshare", env->root);
+    }
+    // Без этого монтирования ушли бы в общую группу распространения хоста
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+        return child_error("mount --make-rprivate", "/");
+    }
+
+    for (int i = 0; i < MOUNT_COUNT; i++) {
+        const ChrootMount *m = &chroot_mounts[i];
+        mkdir(env->targets[i], 0755);
+        if (mount(m->source, env->targets[i], m->fstype, m->flags, m->data) != 0) {
+            return child_error("mount", env->targets[i]);
+        }
+    }
+
+    // dup2 на тот же номер не снимает O_CLOEXEC, поэтому флаг снимается явно
+    if (env->script_fd == CHROOT_SCRIPT_FD) {
+        if (fcntl(CHROOT_SCRIPT_FD, F_SETFD, 0) != 0) {
+            return child_error("fcntl", "script");
+        }
+    } else if (env->script_fd >= 0 && dup2(env->script_fd, CHROOT_SCRIPT_FD) < 0) {
+        return child_error("dup2", "script");
+    }
+
+    if (chroot(env->root) != 0) {
+        return child_error("chroot", env->root);
+    }
+    if (chdir("/") != 0) {
+        return child_error("chdir", "/");
+    }
+
+    return 0;
+}
+
+static void env_init(ChrootEnv *env, const char *root, int script_fd) {
+    env->root = root;
+    env->script_fd = script_fd;
+    for (int i = 0; i < MOUNT_COUNT; i++) {
+        snprintf(env->targets[i], sizeof(env->targets[i]), "%s/%s", root, chroot_mounts[i].subdir);
+    }
+}
+
+static int run_in_env(ChrootEnv *env, char *const argv[], const char *title, bool verbose) {
+    ExecOptions options = {
+        .log_path = NULL,
+        .timeout = -1,
+        .verbose = verbose,
+        .setup = chroot_setup,
+        .setup_arg = env,
+        .title = title
+    };
+    return exec_command_options(argv, &options);
+}
+
+int chroot_run(const char *root, char *const argv[], bool verbose) {
+    ChrootEnv env;
+    env_init(&env, root, -1);
+
+    char title[600];
+    snprintf(title, sizeof(title), "chroot %s", root);
+    return run_in_env(&env, argv, title, verbose);
+}
+
+int chroot_run_script(const char *root, const char *name, const char *script, bool verbose) {
+    // Скрипт целиком записывается в канал до запуска: интерпретатор читает
+    // его с CHROOT_SCRIPT_FD, а stdin команд остаётся /dev/null
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        log_error("Не удалось создать канал для скрипта %s: %s", name, strerror(errno));
+        return 1;
+    }
+
+    size_t len = strlen(script);
+    if (len > 65536 && fcntl(pipe_fds[1], F_SETPIPE_SZ, (int)len) < 0) {
+        log_error("Скрипт %s слишком велик для канала: %s", name, strerror(errno));
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return 1;
+    }
+
+    ssize_t written = write(pipe_fds[1], script, len);
+    close(pipe_fds[1]);
+    if (written < 0 || (size_t)written != len) {
+        log_error("Не удалось передать скрипт %s", name);
+        close(pipe_fds[0]);
+        return 1;
+    }
+
+    ChrootEnv env;
+    env_init(&env, root, pipe_fds[0]);
+
+    char script_path[32];
+    snprintf(script_path, sizeof(script_path), "/proc/self/fd/%d", CHROOT_SCRIPT_FD);
+    char *const argv[] = { "/bin/bash", script_path, NULL };
+
+    int result = run_in_env(&env, argv, name, verbose);
+    close(pipe_fds[0]);
+    return result;
+}
@@ -0,0 +1,609 @@
+/**
+ * clean.c - Быстрое удаление деревьев каталогов
+ *
+ * Дерево обходится через openat/getdents64/unlinkat: каждый каталог
+ * открывается один раз, файлы удаляются относительно его дескриптора без
+ * разбора полных путей. Каталоги раздаются пулу потоков с перехватом
+ * работы: поток берёт свои каталоги с конца очереди (в глубину, открытых
+ * дескрипторов немного), а простаивающий поток забирает чужие с начала —
+ * самые крупные неразобранные поддеревья. Каталог удаляется последним из
+ * своих потомков: счётчик незавершённых частей (свой просмотр и каждый
+ * подкаталог) доходит до нуля в том потоке, который закончил последнюю.
+ *
+ * Обход не пересекает точки монтирования: каталог на другом монтировании
+ * (по идентификатору монтирования statx, иначе по устройству) не
+ * просматривается и не удаляется, как и все каталоги над ним. Так
+ * оставшиеся от прерванной сборки /proc или привязанный кэш пакетов
+ * внутри chroot не пострадают.
+ */
+
+#define _GNU_SOURCE
+
+#include "clean.h"
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+
+#ifndef STATX_MNT_ID
+#define STATX_MNT_ID 0x00001000U
+#endif
+
+#define CLEAN_MAX_THREADS 64
+#define CLEAN_DENTS_SIZE (64 * 1024)
+#define CLEAN_IDLE_WAIT_NS (2 * 1000 * 1000)
+
+// Запись getdents64
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Каталог дерева: дескриптор открыт, пока не удалены все потомки
+typedef struct CleanDir {
+    struct CleanDir *parent;
+    int fd;
+    _Atomic int pending;        // свой просмотр и незавершённые подкаталоги
+    _Atomic bool kept;          // внутри осталось то, что удалять нельзя
+    char name[];                // имя в родителе; у корня — путь
+} CleanDir;
+
+// Очередь потока: владелец работает с конца, остальные забирают с начала
+typedef struct {
+    pthread_mutex_t lock;
+    CleanDir **items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} CleanDeque;
+
+typedef struct {
+    CleanDeque deques[CLEAN_MAX_THREADS];
+    int workers;
+    int step;                   // шаг трассы; -1 — без трассировки
+    bool remove_root;
+    uint64_t mnt_id;
+    dev_t dev;
+    bool have_mnt_id;
+
+    _Atomic long outstanding;   // каталоги в очередях и в работе
+    _Atomic int idle;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+
+    _Atomic unsigned long long files;
+    _Atomic unsigned long long dirs;
+    _Atomic unsigned long long mounts;
+    _Atomic unsigned long long errors;
+    pthread_mutex_t report_lock;
+    char first_mount[512];
+} CleanPool;
+
+typedef struct {
+    CleanPool *pool;
+    int index;
+} CleanWorker;
+
+int clean_parse_mode(const char *name, CleanMode *mode) {
+    if (strcmp(name, "background") == 0) {
+        *mode = CLEAN_BACKGROUND;
+    } else if (strcmp(name, "parallel") == 0) {
+        *mode = CLEAN_PARALLEL;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Очереди
+
+static void deque_push(CleanDeque *deque, CleanDir *dir) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        if (deque->head > 0) {
+            memmove(deque->items, deque->items + deque->head,
+                    (deque->tail - deque->head) * sizeof(CleanDir *));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        if (deque->tail == deque->capacity) {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 256;
+            CleanDir **items = realloc(deque->items, capacity * sizeof(CleanDir *));
+            if (!items) {
+                abort();
+            }
+            deque->items = items;
+            deque->capacity = capacity;
+        }
+    }
+    deque->items[deque->tail++] = dir;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static CleanDir *deque_pop(CleanDeque *deque, bool steal) {
+    CleanDir *dir = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        dir = steal ? deque->items[deque->head++] : deque->items[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return dir;
+}
+
+static CleanDir *next_dir(CleanPool *pool, int index) {
+    CleanDir *dir = deque_pop(&pool->deques[index], false);
+    for (int i = 1; !dir && i < pool->workers; i++) {
+        dir = deque_pop(&pool->deques[(index + i) % pool->workers], true);
+    }
+    return dir;
+}
+
+static void push_dir(CleanPool *pool, int index, CleanDir *dir) {
+    atomic_fetch_add(&pool->outstanding, 1);
+    deque_push(&pool->deques[index], dir);
+    if (atomic_load(&pool->idle) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+// Обход
+
+// Путь объекта от корня дерева собирается с конца, от имени к корню;
+// -1 и ENAMETOOLONG, если путь не помещается в буфер
+static int dir_path(const CleanDir *dir, const char *name, char *path, size_t size) {
+    size_t total = strlen(name);
+    for (const CleanDir *d = dir; d; d = d->parent) {
+        total += strlen(d->name) + 1;
+    }
+    if (total >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    size_t end = total;
+    path[end] = '\0';
+    for (;;) {
+        size_t len = strlen(name);
+        end -= len;
+        memcpy(path + end, name, len);
+        if (!dir) {
+            return 0;
+        }
+        path[--end] = '/';
+        name = dir->name;
+        dir = dir->parent;
+    }
+}
+
+static void report_mount(CleanPool *pool, const CleanDir *parent, const char *name) {
+    atomic_fetch_add(&pool->mounts, 1);
+    pthread_mutex_lock(&pool->report_lock);
+    // Слишком длинный путь в отчёте заменяется именем точки монтирования
+    if (!pool->first_mount[0] &&
+        dir_path(parent, name, pool->first_mount, sizeof(pool->first_mount)) != 0) {
+        snprintf(pool->first_mount, sizeof(pool->first_mount), ".../%.*s",
+                 (int)sizeof(pool->first_mount) - 5, name);
+    }
+    pthread_mutex_unlock(&pool->report_lock);
+}
+
+// Каталог на том же монтировании, что и корень дерева
+static bool same_mount(const CleanPool *pool, int fd, uint64_t *mnt_id, dev_t *dev,
+                       bool *have_mnt_id) {
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW, STATX_MNT_ID, &stx) != 0) {
+        return false;
+    }
+
+    *dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    *have_mnt_id = (stx.stx_mask & STATX_MNT_ID) != 0;
+    *mnt_id = *have_mnt_id ? stx.stx_mnt_id : 0;
+    if (!pool) {
+        return true;
+    }
+    if (*dev != pool->dev) {
+        return false;
+    }
+    return !pool->have_mnt_id || !*have_mnt_id || *mnt_id == pool->mnt_id;
+}
+
+// Завершение части каталога; последний закончивший удаляет каталог и
+// завершает часть родителя
+static void finish_part(CleanPool *pool, CleanDir *dir) {
+    while (dir && atomic_fetch_sub(&dir->pending, 1) == 1) {
+        CleanDir *parent = dir->parent;
+        if (dir->fd >= 0) {
+            close(dir->fd);
+        }
+
+        bool kept = atomic_load(&dir->kept);
+        int parent_fd = parent ? parent->fd : AT_FDCWD;
+        if (!kept && (parent || pool->remove_root)) {
+            if (unlinkat(parent_fd, dir->name, AT_REMOVEDIR) == 0) {
+                atomic_fetch_add(&pool->dirs, 1);
+            } else if (errno != ENOENT && (parent || errno != EBUSY)) {
+                atomic_fetch_add(&pool->errors, 1);
+                kept = true;
+            }
+        }
+        if (kept && parent) {
+            atomic_store(&parent->kept, true);
+        }
+
+        if (parent) {
+            free(dir);
+        }
+        dir = parent;
+    }
+}
+
+static CleanDir *new_dir(CleanDir *parent, const char *name) {
+    size_t len = strlen(name);
+    CleanDir *dir = malloc(sizeof(*dir) + len + 1);
+    if (!dir) {
+        return NULL;
+    }
+    dir->parent = parent;
+    dir->fd = -1;
+    atomic_init(&dir->pending, 1);
+    atomic_init(&dir->kept, false);
+    memcpy(dir->name, name, len + 1);
+    return dir;
+}
+
+// Удаление записи каталога; подкаталоги уходят в очередь потока
+static void remove_entry(CleanPool *pool, int index, CleanDir *dir, const char *name,
+                         unsigned char type) {
+    if (type == DT_UNKNOWN) {
+        struct stat st;
+        if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            return;
+        }
+        type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+    }
+
+    if (type != DT_DIR) {
+        if (unlinkat(dir->fd, name, 0) == 0) {
+            atomic_fetch_add(&pool->files, 1);
+            return;
+        }
+        int error = errno;
+        if (error == ENOENT) {
+            return;
+        }
+        if (error != EISDIR) {
+            if (error == EBUSY) {
+                // Файл, к которому привязано монтирование (resolv.conf и т. п.)
+                report_mount(pool, dir, name);
+            } else {
+                atomic_fetch_add(&pool->errors, 1);
+            }
+            atomic_store(&dir->kept, true);
+            return;
+        }
+    }
+
+    CleanDir *child = new_dir(dir, name);
+    if (!child) {
+        atomic_fetch_add(&pool->errors, 1);
+        atomic_store(&dir->kept, true);
+        return;
+    }
+    atomic_fetch_add(&dir->pending, 1);
+    push_dir(pool, index, child);
+}
+
+static void scan_dir(CleanPool *pool, int index, CleanDir *dir) {
+    int parent_fd = dir->parent ? dir->parent->fd : AT_FDCWD;
+    dir->fd = openat(parent_fd, dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir->fd < 0) {
+        if (errno != ENOENT) {
+            atomic_fetch_add(&pool->errors, 1);
+            atomic_store(&dir->kept, true);
+        }
+        finish_part(pool, dir);
+        return;
+    }
+
+    // Точка монтирования: ни содержимое, ни сам каталог не трогаются
+    uint64_t mnt_id;
+    dev_t dev;
+    bool have_mnt_id;
+    if (dir->parent && !same_mount(pool, dir->fd, &mnt_id, &dev, &have_mnt_id)) {
+        report_mount(pool, dir->parent, dir->name);
+        atomic_store(&dir->kept, true);
+        finish_part(pool, dir);
+        return;
+    }
+
+    char *buffer = malloc(CLEAN_DENTS_SIZE);
+    if (!buffer) {
+        atomic_fetch_add(&pool->errors, 1);
+        atomic_store(&dir->kept, true);
+        finish_part(pool, dir);
+        return;
+    }
+
+    for (;;) {
+        long len = syscall(SYS_getdents64, dir->fd, buffer, CLEAN_DENTS_SIZE);
+        if (len <= 0) {
+            if (len < 0) {
+                atomic_fetch_add(&pool->errors, 1);
+                atomic_store(&dir->kept, true);
+            }
+            break;
+        }
+        for (long offset = 0; offset < len;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buffer + offset);
+            offset += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            remove_entry(pool, index, dir, name, entry->d_type);
+        }
+    }
+
+    free(buffer);
+    finish_part(pool, dir);
+}
+
+static void *clean_worker(void *arg) {
+    CleanWorker *worker = arg;
+    CleanPool *pool = worker->pool;
+    if (pool->step >= 0) {
+        trace_thread_begin(pool->step);
+    }
+
+    for (;;) {
+        CleanDir *dir = next_dir(pool, worker->index);
+        if (dir) {
+            scan_dir(pool, worker->index, dir);
+            if (atomic_fetch_sub(&pool->outstanding, 1) == 1) {
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->idle_cond);
+                pthread_mutex_unlock(&pool->idle_lock);
+            }
+            continue;
+        }
+        if (atomic_load(&pool->outstanding) == 0) {
+            break;
+        }
+
+        // Работа есть только у других потоков и пока не в очередях
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CLEAN_IDLE_WAIT_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&pool->idle_lock);
+        atomic_fetch_add(&pool->idle, 1);
+        if (atomic_load(&pool->outstanding) > 0) {
+            pthread_cond_timedwait(&pool->idle_cond, &pool->idle_lock, &deadline);
+        }
+        atomic_fetch_sub(&pool->idle, 1);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+
+    if (pool->step >= 0) {
+        trace_thread_end();
+    }
+    return NULL;
+}
+
+// Каждый открытый каталог держит дескриптор, поэтому предел поднимается
+// до жёсткого
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static int clean_tree_step(const char *path, bool remove_root, int threads, int step,
+                           CleanStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    double start = now_seconds();
+
+    CleanPool *pool = calloc(1, sizeof(*pool));
+    CleanDir *root = new_dir(NULL, path);
+    if (!pool || !root) {
+        free(pool);
+        free(root);
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        free(pool);
+        free(root);
+        return errno == ENOENT ? 0 : -1;
+    }
+    same_mount(NULL, fd, &pool->mnt_id, &pool->dev, &pool->have_mnt_id);
+    close(fd);
+
+    raise_fd_limit();
+    pool->workers = threads > CLEAN_MAX_THREADS ? CLEAN_MAX_THREADS : threads < 1 ? 1 : threads;
+    pool->step = step;
+    pool->remove_root = remove_root;
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pthread_mutex_init(&pool->report_lock, NULL);
+    for (int i = 0; i < pool->workers; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+
+    // Корень завершается последним, его удаляет finish_part
+    atomic_fetch_add(&root->pending, 1);
+    push_dir(pool, 0, root);
+
+    pthread_t handles[CLEAN_MAX_THREADS];
+    CleanWorker workers[CLEAN_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < pool->workers; i++) {
+        workers[i] = (CleanWorker){ pool, i };
+        if (i > 0 && pthread_create(&handles[started], NULL, clean_worker, &workers[i]) == 0) {
+            started++;
+        }
+    }
+    clean_worker(&workers[0]);
+    for (int i = 0; i < started; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    finish_part(pool, root);
+
+    stats->files = atomic_load(&pool->files);
+    stats->dirs = atomic_load(&pool->dirs);
+    stats->mounts = atomic_load(&pool->mounts);
+    stats->errors = atomic_load(&pool->errors);
+    snprintf(stats->first_mount, sizeof(stats->first_mount), "%s", pool->first_mount);
+    stats->seconds = now_seconds() - start;
+
+    for (int i = 0; i < pool->workers; i++) {
+        free(pool->deques[i].items);
+    }
+    free(pool);
+    free(root);
+    return stats->errors == 0 ? 0 : -1;
+}
+
+int clean_tree(const char *path, bool remove_root, int threads, CleanStats *stats) {
+    return clean_tree_step(path, remove_root, threads, trace_current_step(), stats);
+}
+
+// Фоновое удаление
+
+// Потомок сборки не пишет в её журнал и не держит её дескрипторы:
+// иначе читатель вывода команды или клиент службы ждали бы его конца
+static void detach_descriptors(void) {
+    int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (null >= 0) {
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+    }
+    if (syscall(SYS_close_range, 3, ~0U, 0) != 0) {
+        long max = sysconf(_SC_OPEN_MAX);
+        for (int fd = 3; fd < (max > 0 ? max : 1024); fd++) {
+            close(fd);
+        }
+    }
+}
+
+int clean_background(const char *path) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        if (fork() == 0) {
+            detach_descriptors();
+
+            // Удаление не должно отнимать диск и процессор у сборки
+            setpriority(PRIO_PROCESS, 0, 10);
+            syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, (2 << 13) | 7);
+
+            CleanStats stats;
+            long threads = sysconf(_SC_NPROCESSORS_ONLN);
+            clean_tree_step(path, true, threads > 0 ? (int)threads : 1, -1, &stats);
+            _exit(0);
+        }
+        _exit(0);
+    }
+
+    waitpid(pid, NULL, 0);
+    return 0;
+}
+
+// Остатки прерванных фоновых очисток рядом с path
+static void sweep_trash(const char *path) {
+    char dir[512], prefix[512];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (!slash) {
+        return;
+    }
+    snprintf(prefix, sizeof(prefix), "%s.trash-", slash + 1);
+    *slash = '\0';
+
+    DIR *parent = opendir(dir[0] ? dir : "/");
+    if (!parent) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(parent)) != NULL) {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0) {
+            char trash[1024];
+            snprintf(trash, sizeof(trash), "%s/%s", dir, entry->d_name);
+            clean_background(trash);
+        }
+    }
+    closedir(parent);
+}
+
+static void report_stats(const char *path, const CleanStats *stats) {
+    log_info("Удалено %s: %llu файлов, %llu каталогов за %.2f с",
+             path, stats->files, stats->dirs, stats->seconds);
+    if (stats->mounts > 0) {
+        log_warning("Пропущено точек монтирования: %llu (первая: %s)",
+                    stats->mounts, stats->first_mount);
+    }
+    if (stats->errors > 0) {
+        log_warning("Не удалось удалить объектов: %llu", stats->errors);
+    }
+}
+
+int clean_dir(const char *path, CleanMode mode, int threads) {
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return unlink(path) == 0 ? 0 : -1;
+    }
+
+    if (mode == CLEAN_BACKGROUND) {
+        sweep_trash(path);
+
+        char trash[600];
+        snprintf(trash, sizeof(trash), "%s.trash-%d-%ld", path, getpid(), (long)time(NULL));
+        if (rename(path, trash) == 0) {
+            log_info("%s перенесён в %s и удаляется в фоне", path, trash);
+            return clean_background(trash);
+        }
+        log_debug("Не удалось перенести %s (%s), удаление на месте", path, strerror(errno));
+    }
+
+    CleanStats stats;
+    int result = clean_tree(path, true, threads, &stats);
+    report_stats(path, &stats);
+    return stats.mounts > 0 || result == 0 ? 0 : -1;
+}
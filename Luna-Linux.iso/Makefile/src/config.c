@@ -1,106 +1,487 @@
 /**
  * config.c - Реализация модуля конфигурации
+ *
+ * Файл luna.conf отображается в память и разбирается за один проход:
+ * секции, ключи и значения остаются участками отображения, без копий.
+ * Списки пакетов — массивы таких участков в арене; и записи файла, и
+ * списки освобождаются вместе с ареной одним вызовом. Известные ключи
+ * описаны таблицей полей BuildConfig; остальные секции ([Squashfs],
+ * [Branding]) остаются в разобранных файлах для своих модулей.
  */
 
+#define _GNU_SOURCE
+
 #include "config.h"
+#include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdalign.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CONFIG_ARENA_BLOCK (64 * 1024)
+
+struct ConfigArenaBlock {
+    ConfigArenaBlock *next;
+    size_t used;
+    size_t size;
+    alignas(max_align_t) unsigned char data[];
+};
+
+// Списки пакетов по умолчанию (формат секции [Packages] в luna.conf)
+static const char *const default_packages[PACKAGE_LIST_COUNT] = {
+    [PACKAGES_BASE] = "sudo,linux-image-generic,initramfs-tools,"
+                      "grub2-common,grub-pc,grub-efi-amd64-bin",
+    [PACKAGES_DESKTOP] = "kde-plasma-desktop,plasma-workspace-wayland,kwin-wayland,sddm,"
+                         "sddm-theme-breeze,plasma-nm,plasma-pa,dolphin,konsole,kate,ark",
+    [PACKAGES_INSTALLER] = "calamares,calamares-settings-ubuntu",
+    [PACKAGES_ADDITIONAL] = "firefox,libreoffice,vlc,gimp,neofetch,curl,wget,git,nano"
+};
+
+static const char *const package_keys[PACKAGE_LIST_COUNT] = {
+    [PACKAGES_BASE] = "Base",
+    [PACKAGES_DESKTOP] = "Desktop",
+    [PACKAGES_INSTALLER] = "Installer",
+    [PACKAGES_ADDITIONAL] = "Additional"
+};
+
+// Поля BuildConfig, которые задаются в luna.conf
+typedef enum {
+    FIELD_TEXT,
+    FIELD_PATH,             // ~ заменяется домашним каталогом
+    FIELD_BOOL,
+    FIELD_INT,
+    FIELD_LONG,
+    FIELD_PACKAGES          // offset — номер списка пакетов
+} FieldType;
+
+typedef struct {
+    const char *section;
+    const char *key;
+    FieldType type;
+    size_t offset;
+    size_t size;
+} ConfigField;
+
+#define FIELD(section, key, type, member) \
+    { section, key, type, offsetof(BuildConfig, member), sizeof(((BuildConfig *)0)->member) }
+#define PACKAGES(id) { "Packages", NULL, FIELD_PACKAGES, id, 0 }
+
+static const ConfigField fields[] = {
+    FIELD("Distribution", "Name", FIELD_TEXT, distro_name),
+    FIELD("Distribution", "ShortName", FIELD_TEXT, distro_short_name),
+    FIELD("Distribution", "Version", FIELD_TEXT, version),
+    FIELD("Distribution", "Codename", FIELD_TEXT, codename),
+    FIELD("Distribution", "Architecture", FIELD_TEXT, arch),
+    FIELD("Base", "Distribution", FIELD_TEXT, base_distro),
+    FIELD("Base", "Version", FIELD_TEXT, ubuntu_version),
+    FIELD("Base", "Codename", FIELD_TEXT, ubuntu_codename),
+    FIELD("Base", "Mirror", FIELD_TEXT, mirror),
+    FIELD("Base", "Components", FIELD_TEXT, components),
+    FIELD("Paths", "WorkDir", FIELD_PATH, workdir),
+    FIELD("Paths", "OutputISO", FIELD_PATH, output_iso),
+    FIELD("Paths", "IsoTarget", FIELD_PATH, iso_target),
+    FIELD("Paths", "CacheDir", FIELD_PATH, cachedir),
+    FIELD("Paths", "DebCacheDir", FIELD_PATH, debcachedir),
+    FIELD("Build", "Verbose", FIELD_BOOL, verbose),
+    FIELD("Build", "CleanBuild", FIELD_BOOL, clean_build),
+    FIELD("Build", "KeepChroot", FIELD_BOOL, keep_chroot),
+    FIELD("Build", "UseCache", FIELD_BOOL, use_cache),
+    FIELD("Build", "Layers", FIELD_BOOL, use_layers),
+    FIELD("Build", "Jobs", FIELD_INT, jobs),
+    FIELD("Build", "CommandTimeout", FIELD_INT, command_timeout),
+    FIELD("Build", "CacheMaxMB", FIELD_LONG, cache_max_mb),
+    FIELD("Build", "DebCacheMaxMB", FIELD_LONG, debcache_max_mb),
+    FIELD("Build", "LogLevel", FIELD_TEXT, log_level),
+    FIELD("Build", "CleanMode", FIELD_TEXT, clean_mode),
+    PACKAGES(PACKAGES_BASE),
+    PACKAGES(PACKAGES_DESKTOP),
+    PACKAGES(PACKAGES_INSTALLER),
+    PACKAGES(PACKAGES_ADDITIONAL)
+};
+
+#define FIELD_COUNT (sizeof(fields) / sizeof(fields[0]))
+
+static const char *field_key(const ConfigField *field) {
+    return field->type == FIELD_PACKAGES ? package_keys[field->offset] : field->key;
+}
+
+// Арена
+
+void *config_arena_alloc(ConfigArena *arena, size_t size) {
+    size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+
+    ConfigArenaBlock *block = arena->head;
+    if (!block || block->size - block->used < size) {
+        size_t capacity = size > CONFIG_ARENA_BLOCK ? size : CONFIG_ARENA_BLOCK;
+        block = malloc(sizeof(*block) + capacity);
+        if (!block) {
+            return NULL;
+        }
+        block->next = arena->head;
+        block->used = 0;
+        block->size = capacity;
+        arena->head = block;
+    }
+
+    void *memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+void config_arena_free(ConfigArena *arena) {
+    ConfigArenaBlock *block = arena->head;
+    while (block) {
+        ConfigArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+// Разбор файла
+
+bool config_str_equals(ConfigStr str, const char *text) {
+    return strlen(text) == str.len && memcmp(str.data, text, str.len) == 0;
+}
+
+bool config_str_bool(ConfigStr str) {
+    return config_str_equals(str, "yes") || config_str_equals(str, "true") ||
+           config_str_equals(str, "1") || config_str_equals(str, "on");
+}
+
+static ConfigStr trim(const char *start, const char *end) {
+    while (start < end && (*start == ' ' || *start == '\t')) {
+        start++;
+    }
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+        end--;
+    }
+    return (ConfigStr){ start, (size_t)(end - start) };
+}
+
+// Массив записей растёт удвоением внутри арены: старая копия остаётся
+// в арене до её освобождения, всего не больше удвоенного объёма
+static ConfigEntry *add_entry(ConfigFile *file) {
+    if (file->count == file->capacity) {
+        size_t capacity = file->capacity ? file->capacity * 2 : 64;
+        ConfigEntry *entries = config_arena_alloc(&file->arena, capacity * sizeof(*entries));
+        if (!entries) {
+            return NULL;
+        }
+        if (file->count > 0) {
+            memcpy(entries, file->entries, file->count * sizeof(*entries));
+        }
+        file->entries = entries;
+        file->capacity = capacity;
+    }
+    return &file->entries[file->count++];
+}
+
+int config_file_parse(ConfigFile *file, const char *path) {
+    memset(file, 0, sizeof(*file));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Пустой файл не отображается: mmap нулевой длины невозможен
+    if (st.st_size > 0) {
+        file->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->map == MAP_FAILED) {
+            file->map = NULL;
+            close(fd);
+            return -1;
+        }
+        file->size = st.st_size;
+        madvise(file->map, file->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    const char *p = file->map;
+    const char *end = p ? p + file->size : NULL;
+    ConfigStr section = { "", 0 };
+    unsigned int line = 0;
+
+    while (p && p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            eol = end;
+        }
+        line++;
+
+        ConfigStr text = trim(p, eol);
+        p = eol + 1;
+        if (text.len == 0 || text.data[0] == '#' || text.data[0] == ';') {
+            continue;
+        }
+
+        if (text.data[0] == '[' && text.data[text.len - 1] == ']') {
+            section = trim(text.data + 1, text.data + text.len - 1);
+            continue;
+        }
+
+        const char *equals = memchr(text.data, '=', text.len);
+        if (!equals) {
+            log_warning("%s:%u: строка без \"=\" пропущена", path, line);
+            continue;
+        }
+
+        ConfigEntry *entry = add_entry(file);
+        if (!entry) {
+            config_file_free(file);
+            return -1;
+        }
+        entry->section = section;
+        entry->key = trim(text.data, equals);
+        entry->value = trim(equals + 1, text.data + text.len);
+        entry->line = line;
+    }
+
+    return 0;
+}
+
+void config_file_free(ConfigFile *file) {
+    if (file->map) {
+        munmap(file->map, file->size);
+    }
+    config_arena_free(&file->arena);
+    file->map = NULL;
+    file->entries = NULL;
+    file->count = 0;
+    file->capacity = 0;
+}
+
+// Списки пакетов
+
+const char *config_package_list_name(PackageListId id) {
+    return package_keys[id];
+}
+
+// Разбиение "a, b c" на участки; число элементов не больше числа
+// разделителей плюс один, массив выделяется в арене сразу нужного размера
+static int split_packages(ConfigArena *arena, ConfigStr value, PackageList *list) {
+    size_t bound = 1;
+    for (size_t i = 0; i < value.len; i++) {
+        char c = value.data[i];
+        bound += c == ',' || c == ' ' || c == '\t';
+    }
+
+    list->items = config_arena_alloc(arena, bound * sizeof(ConfigStr));
+    list->count = 0;
+    if (!list->items) {
+        return -1;
+    }
+
+    const char *p = value.data;
+    const char *end = value.data + value.len;
+    while (p < end) {
+        const char *start = p;
+        while (p < end && *p != ',' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        if (p > start) {
+            list->items[list->count++] = (ConfigStr){ start, (size_t)(p - start) };
+        }
+        p++;
+    }
+    return 0;
+}
+
+int config_set_packages(BuildConfig *config, PackageListId id, const char *list) {
+    size_t len = strlen(list);
+    char *copy = config_arena_alloc(&config->arena, len + 1);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, list, len + 1);
+    return split_packages(&config->arena, (ConfigStr){ copy, len }, &config->packages[id]);
+}
+
+// Конфигурация
+
+static const char *home_dir(void) {
+    const char *home = getenv("HOME");
+    if (!home) {
+        struct passwd *pw = getpwuid(getuid());
+        home = pw ? pw->pw_dir : "/root";
+    }
+    return home;
+}
+
+static int derive_path(char *path, size_t size, const char *workdir, const char *name) {
+    int len = snprintf(path, size, "%s/%s", workdir, name);
+    return len >= 0 && (size_t)len < size ? 0 : -1;
+}
+
+int config_derive_paths(BuildConfig *config) {
+    if (derive_path(config->chroot, sizeof(config->chroot), config->workdir, "chroot") != 0 ||
+        derive_path(config->imagedir, sizeof(config->imagedir), config->workdir, "image") != 0 ||
+        derive_path(config->isodir, sizeof(config->isodir), config->workdir, "iso") != 0 ||
+        derive_path(config->layersdir, sizeof(config->layersdir), config->workdir, "layers") != 0) {
+        log_error("Слишком длинный путь рабочего каталога: %s", config->workdir);
+        return -1;
+    }
+    return 0;
+}
 
 // Инициализация конфигурации по умолчанию
 void config_init(BuildConfig *config) {
+    memset(config, 0, sizeof(*config));
+    const char *home = home_dir();
+
     // Основные настройки
     strcpy(config->distro_name, "Luna Linux");
-    strcpy(config->distro_short_name, "luna");
+    strcpy(config->distro_short_name, "luna-linux");
     strcpy(config->version, "1.0");
     strcpy(config->codename, "stellar");
     strcpy(config->base_distro, "ubuntu");
-    strcpy(config->base_version, "22.04");
-    strcpy(config->architecture, "amd64");
+    strcpy(config->ubuntu_version, "22.04");
+    strcpy(config->ubuntu_codename, "jammy");
+    strcpy(config->arch, "amd64");
 
     // Пути
-    const char *home = getenv("HOME");
-    if (!home) {
-        struct passwd *pw = getpwuid(getuid());
-        home = pw->pw_dir;
+    snprintf(config->workdir, sizeof(config->workdir), "%s/luna-linux-build", home);
+    config_derive_paths(config);
+    snprintf(config->output_iso, sizeof(config->output_iso),
+             "%s/Luna-Linux-%s-%s.iso", home, config->ubuntu_version, config->arch);
+    snprintf(config->cachedir, sizeof(config->cachedir), "%s/.cache/luna-linux-build", home);
+    strcpy(config->mirror, "http://archive.ubuntu.com/ubuntu/");
+    strcpy(config->components, "main,restricted,universe,multiverse");
+    snprintf(config->debcachedir, sizeof(config->debcachedir), "%s/.cache/luna-linux-debs", home);
+    config->debcache_max_mb = 16384;
+    config->cache_max_mb = 65536;
+
+    // Пакеты
+    for (int i = 0; i < PACKAGE_LIST_COUNT; i++) {
+        config_set_packages(config, i, default_packages[i]);
     }
 
-    snprintf(config->work_dir, sizeof(config->work_dir), "%s/luna-build", home);
-    snprintf(config->chroot_dir, sizeof(config->chroot_dir), "%s/chroot", config->work_dir);
-    snprintf(config->iso_dir, sizeof(config->iso_dir), "%s/iso", config->work_dir);
-    snprintf(config->output_iso, sizeof(config->output_iso),
-             "%s/Luna-Linux-1.0-amd64.iso", home);
-
-    // Настройки
-    config->verbose = false;
-    config->clean_build = true;
-    config->keep_chroot = false;
-
-    // Базовые пакеты
-    config->base_packages_count = 8;
-    config->base_packages = malloc(config->base_packages_count * sizeof(char*));
-    config->base_packages[0] = strdup("systemd");
-    config->base_packages[1] = strdup("dbus");
-    config->base_packages[2] = strdup("locales");
-    config->base_packages[3] = strdup("sudo");
-    config->base_packages[4] = strdup("network-manager");
-    config->base_packages[5] = strdup("grub2");
-    config->base_packages[6] = strdup("linux-image-generic");
-    config->base_packages[7] = strdup("initramfs-tools");
-
-    // Пакеты рабочего стола
-    config->desktop_packages_count = 10;
-    config->desktop_packages = malloc(config->desktop_packages_count * sizeof(char*));
-    config->desktop_packages[0] = strdup("kde-plasma-desktop");
-    config->desktop_packages[1] = strdup("plasma-workspace-wayland");
-    config->desktop_packages[2] = strdup("kwin-wayland");
-    config->desktop_packages[3] = strdup("sddm");
-    config->desktop_packages[4] = strdup("dolphin");
-    config->desktop_packages[5] = strdup("konsole");
-    config->desktop_packages[6] = strdup("firefox");
-    config->desktop_packages[7] = strdup("calamares");
-    config->desktop_packages[8] = strdup("plymouth-themes");
-    config->desktop_packages[9] = strdup("grub2-themes");
-
-    // Дополнительные пакеты
-    config->additional_packages_count = 5;
-    config->additional_packages = malloc(config->additional_packages_count * sizeof(char*));
-    config->additional_packages[0] = strdup("libreoffice");
-    config->additional_packages[1] = strdup("vlc");
-    config->additional_packages[2] = strdup("gimp");
-    config->additional_packages[3] = strdup("neofetch");
-    config->additional_packages[4] = strdup("git");
+    // Флаги
+    config->use_cache = 1;
+    config->use_layers = 1;
+    config->resume_layer = -1;
+    config->jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    strcpy(config->config_file, "luna.conf");
+    strcpy(config->log_level, "info");
+    strcpy(config->clean_mode, "background");
 }
 
-// Загрузка конфигурации из файла
-void config_load_from_file(BuildConfig *config, const char *filename) {
-    // Реализация загрузки из JSON/INI файла
-    printf("Загрузка конфигурации из %s\n", filename);
-    // TODO: Реализовать парсинг файла конфигурации
+static const ConfigField *find_field(const ConfigEntry *entry) {
+    for (size_t i = 0; i < FIELD_COUNT; i++) {
+        if (config_str_equals(entry->section, fields[i].section) &&
+            config_str_equals(entry->key, field_key(&fields[i]))) {
+            return &fields[i];
+        }
+    }
+    return NULL;
 }
 
-// Сохранение конфигурации в файл
-void config_save_to_file(BuildConfig *config, const char *filename) {
-    FILE *fp = fopen(filename, "w");
-    if (!fp) {
-        perror("Ошибка сохранения конфигурации");
-        return;
+static int apply_field(BuildConfig *config, const ConfigField *field,
+                       const ConfigEntry *entry, const char *path) {
+    char *target = (char *)config + field->offset;
+    char value[512];
+
+    if (field->type == FIELD_PACKAGES) {
+        return split_packages(&config->arena, entry->value, &config->packages[field->offset]);
     }
 
-    fprintf(fp, "[Luna Linux Build Configuration]\n");
-    fprintf(fp, "distro_name = %s\n", config->distro_name);
-    fprintf(fp, "version = %s\n", config->version);
-    fprintf(fp, "codename = %s\n", config->codename);
-    fprintf(fp, "base_distro = %s\n", config->base_distro);
-    fprintf(fp, "base_version = %s\n", config->base_version);
-    fprintf(fp, "architecture = %s\n", config->architecture);
-    fprintf(fp, "work_dir = %s\n", config->work_dir);
-    fprintf(fp, "output_iso = %s\n", config->output_iso);
+    if (entry->value.len >= sizeof(value)) {
+        log_error("%s:%u: слишком длинное значение %s", path, entry->line, field_key(field));
+        return -1;
+    }
+    memcpy(value, entry->value.data, entry->value.len);
+    value[entry->value.len] = '\0';
 
-    fclose(fp);
+    switch (field->type) {
+        case FIELD_PATH:
+            if (value[0] == '~') {
+                int len = snprintf(value, sizeof(value), "%s%.*s", home_dir(),
+                                   (int)entry->value.len - 1, entry->value.data + 1);
+                if (len < 0 || (size_t)len >= sizeof(value)) {
+                    log_error("%s:%u: слишком длинное значение %s", path, entry->line,
+                              field_key(field));
+                    return -1;
+                }
+            }
+            // fallthrough
+        case FIELD_TEXT:
+            if (strlen(value) >= field->size) {
+                log_error("%s:%u: слишком длинное значение %s", path, entry->line,
+                          field_key(field));
+                return -1;
+            }
+            memcpy(target, value, strlen(value) + 1);
+            return 0;
+        case FIELD_BOOL:
+            *(int *)target = config_str_bool(entry->value);
+            return 0;
+        case FIELD_INT:
+        case FIELD_LONG: {
+            char *rest;
+            long long number = strtoll(value, &rest, 10);
+            if (rest == value || *rest != '\0') {
+                log_error("%s:%u: %s — ожидается число", path, entry->line, field_key(field));
+                return -1;
+            }
+            if (field->type == FIELD_INT) {
+                *(int *)target = (int)number;
+            } else {
+                *(long long *)target = number;
+            }
+            return 0;
+        }
+        default:
+            return 0;
+    }
+}
+
+// Загрузка конфигурации из файла
+int config_load_from_file(BuildConfig *config, const char *filename) {
+    ConfigFile *file = config_arena_alloc(&config->arena, sizeof(*file));
+    if (!file || config_file_parse(file, filename) != 0) {
+        return -1;
+    }
+
+    // Файл живёт вместе с конфигурацией: в него указывают списки пакетов
+    ConfigFile **tail = &config->sources;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = file;
+
+    char workdir[sizeof(config->workdir)];
+    snprintf(workdir, sizeof(workdir), "%s", config->workdir);
+
+    int result = 0;
+    for (size_t i = 0; i < file->count; i++) {
+        ConfigEntry *entry = &file->entries[i];
+        const ConfigField *field = find_field(entry);
+        if (field) {
+            if (apply_field(config, field, entry, filename) != 0) {
+                result = -1;
+            }
+        }
+    }
+
+    if (strcmp(workdir, config->workdir) != 0 && config_derive_paths(config) != 0) {
+        result = -1;
+    }
+    return result;
 }
 
 // Вывод конфигурации
@@ -108,45 +489,26 @@ void config_print(BuildConfig *config) {
     printf("=== Конфигурация Luna Linux Builder ===\n");
     printf("Дистрибутив: %s %s (%s)\n",
            config->distro_name, config->version, config->codename);
-    printf("База: %s %s %s\n",
-           config->base_distro, config->base_version, config->architecture);
-    printf("Рабочий каталог: %s\n", config->work_dir);
+    printf("База: %s %s (%s) %s\n",
+           config->base_distro, config->ubuntu_version, config->ubuntu_codename, config->arch);
+    printf("Рабочий каталог: %s\n", config->workdir);
     printf("Выходной ISO: %s\n", config->output_iso);
+    if (config->iso_target[0]) {
+        printf("Запись ISO также в: %s\n", config->iso_target);
+    }
+    for (int i = 0; i < PACKAGE_LIST_COUNT; i++) {
+        printf("Пакеты %s: %zu\n", package_keys[i], config->packages[i].count);
+    }
     printf("Режим: %s\n", config->verbose ? "подробный" : "обычный");
     printf("=======================================\n");
 }
 
-// Освобождение памяти
+// Освобождение памяти: файлы конфигурации, затем арена со списками
 void config_free(BuildConfig *config) {
-    for (int i = 0; i < config->base_packages_count; i++) {
-        free(config->base_packages[i]);
-    }
-    free(config->base_packages);
-
-    for (int i = 0; i < config->desktop_packages_count; i++) {
-        free(config->desktop_packages[i]);
+    for (ConfigFile *file = config->sources; file; file = file->next) {
+        config_file_free(file);
     }
-    free(config->desktop_packages);
-
-    for (int i = 0; i < config->additional_packages_count; i++) {
-        free(config->additional_packages[i]);
-    }
-    free(config->additional_packages);
-}
-
-// Расширение путей с переменными
-char* config_expand_path(const char *path) {
-    if (strstr(path, "~") == path) {
-        const char *home = getenv("HOME");
-        if (!home) {
-            struct passwd *pw = getpwuid(getuid());
-            home = pw->pw_dir;
-        }
-
-        char *expanded = malloc(strlen(home) + strlen(path));
-        sprintf(expanded, "%s%s", home, path + 1);
-        return expanded;
-    }
-
-    return strdup(path);
+    config->sources = NULL;
+    config_arena_free(&config->arena);
+    memset(config->packages, 0, sizeof(config->packages));
 }
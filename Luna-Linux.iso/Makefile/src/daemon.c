@@ -0,0 +1,889 @@
+/**
+ * daemon.c - Служба сборки
+ *
+ * Служба слушает Unix-сокет и принимает запросы сборки: параметры
+ * командной строки и каталог, относительно которого они заданы.
+ * Запросы ждут в очереди по приоритету, одновременно идёт не больше
+ * max_builds сборок, причём сборки с одним рабочим каталогом — строго
+ * по очереди: слои и кэш шагов этого каталога переходят от сборки к
+ * сборке. Каждая сборка выполняется в дочернем процессе службы, его
+ * вывод построчно пересылается клиенту.
+ *
+ * Протокол — строки текста. Клиент отправляет
+ *     BUILD | STATUS
+ *     PRIORITY <число>        больше — раньше
+ *     CWD <каталог>
+ *     ARG <аргумент>          по строке на аргумент
+ *     END
+ * Служба отвечает строками с буквой типа в начале:
+ *     Q <номер> <позиция>     запрос в очереди
+ *     R <номер>               сборка начата
+ *     O <текст>               строка вывода сборки
+ *     S <номер> <состояние> <приоритет> <рабочий каталог>
+ *     E <сообщение>           ошибка
+ *     X <код>                 конец ответа: код выхода сборки
+ * Отключение клиента отменяет его запрос, а идущую сборку прерывает.
+ */
+
+#define _GNU_SOURCE
+
+#include "daemon.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define DAEMON_CONNECTIONS (DAEMON_QUEUE_MAX + 16)
+#define DAEMON_REQUEST_MAX (64 * 1024)
+#define DAEMON_OUTPUT_MAX (4 * 1024 * 1024)    // недоставленный клиенту вывод
+#define DAEMON_LINE_MAX 4096
+#define DAEMON_STOP_WAIT 30.0                  // секунд на остановку сборок
+
+typedef enum {
+    REQUEST_FREE,
+    REQUEST_READING,        // приём запроса
+    REQUEST_QUEUED,
+    REQUEST_RUNNING,
+    REQUEST_CLOSING         // ответ дописывается, затем соединение закрывается
+} RequestState;
+
+typedef struct {
+    RequestState state;
+    int fd;                 // соединение с клиентом; -1 — клиент отключился
+    int id;
+    int priority;
+    bool status_request;    // запрос состояния очереди, а не сборки
+    char cwd[PATH_MAX];
+    char workdir[512];
+    char *argv[DAEMON_MAX_ARGS + 2];
+    int argc;
+    bool args_overflow;
+
+    char *in;               // принятая часть запроса
+    size_t in_len;
+    char *out;              // ответ, ещё не отправленный клиенту
+    size_t out_len;
+    size_t out_size;
+    unsigned long long dropped_lines;
+
+    pid_t pid;              // процесс сборки
+    int pipe_fd;            // её stdout и stderr
+    char line[DAEMON_LINE_MAX];
+    size_t line_len;
+    double start;
+} Request;
+
+static Request requests[DAEMON_CONNECTIONS];
+static int next_id = 1;
+static volatile sig_atomic_t stop_requested;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void handle_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+// Пустой обработчик: SIGCHLD только прерывает ожидание в ppoll
+static void handle_child(int sig) {
+    (void)sig;
+}
+
+// Ответ клиенту
+
+static void reply_raw(Request *req, const char *data, size_t len) {
+    if (req->fd < 0) {
+        return;
+    }
+    if (req->out_len + len > DAEMON_OUTPUT_MAX) {
+        req->dropped_lines++;
+        return;
+    }
+    if (req->out_len + len > req->out_size) {
+        size_t size = req->out_size ? req->out_size : 4096;
+        while (size < req->out_len + len) {
+            size *= 2;
+        }
+        char *out = realloc(req->out, size);
+        if (!out) {
+            req->dropped_lines++;
+            return;
+        }
+        req->out = out;
+        req->out_size = size;
+    }
+    memcpy(req->out + req->out_len, data, len);
+    req->out_len += len;
+}
+
+static void reply(Request *req, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void reply(Request *req, const char *format, ...) {
+    char line[DAEMON_LINE_MAX + 64];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    }
+    if ((size_t)len > sizeof(line) - 2) {
+        len = sizeof(line) - 2;
+    }
+    line[len++] = '\n';
+    reply_raw(req, line, len);
+}
+
+// Отправка накопленного ответа без ожидания; -1 — клиент отключился
+static int flush_reply(Request *req) {
+    while (req->fd >= 0 && req->out_len > 0) {
+        ssize_t sent = send(req->fd, req->out, req->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        memmove(req->out, req->out + sent, req->out_len - sent);
+        req->out_len -= sent;
+    }
+    return 0;
+}
+
+static void free_request(Request *req) {
+    if (req->fd >= 0) {
+        close(req->fd);
+    }
+    if (req->pipe_fd >= 0) {
+        close(req->pipe_fd);
+    }
+    for (int i = 0; i < req->argc; i++) {
+        free(req->argv[i]);
+    }
+    free(req->in);
+    free(req->out);
+    memset(req, 0, sizeof(*req));
+    req->state = REQUEST_FREE;
+    req->fd = -1;
+    req->pipe_fd = -1;
+}
+
+// Завершение ответа: соединение закроется, когда ответ уйдёт клиенту
+static void finish_request(Request *req, int code) {
+    if (req->dropped_lines > 0) {
+        unsigned long long dropped = req->dropped_lines;
+        req->dropped_lines = 0;
+        req->out_len = 0;   // место под итог важнее хвоста вывода
+        reply(req, "E Клиент не успевал читать вывод: пропущено строк: %llu", dropped);
+    }
+    reply(req, "X %d", code);
+    req->state = REQUEST_CLOSING;
+}
+
+// Очередь
+
+static bool queued_before(const Request *a, const Request *b) {
+    return a->priority > b->priority || (a->priority == b->priority && a->id < b->id);
+}
+
+static int queue_position(const Request *req) {
+    int position = 1;
+    for (int i = 0; i < DAEMON_CONNECTIONS; i++) {
+        if (requests[i].state == REQUEST_QUEUED && &requests[i] != req &&
+            queued_before(&requests[i], req)) {
+            position++;
+        }
+    }
+    return position;
+}
+
+static bool workdir_busy(const char *workdir) {
+    for (int i = 0; i < DAEMON_CONNECTIONS; i++) {
+        if (requests[i].state == REQUEST_RUNNING && strcmp(requests[i].workdir, workdir) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int running_builds(void) {
+    int count = 0;
+    for (int i = 0; i < DAEMON_CONNECTIONS; i++) {
+        count += requests[i].state == REQUEST_RUNNING;
+    }
+    return count;
+}
+
+// Разбор запроса
+
+static void add_arg(Request *req, const char *arg) {
+    if (req->argc >= DAEMON_MAX_ARGS + 1) {
+        req->args_overflow = true;
+        return;
+    }
+    req->argv[req->argc++] = strdup(arg);
+    req->argv[req->argc] = NULL;
+}
+
+static void send_status(Request *req) {
+    static const char *const names[] = {
+        [REQUEST_QUEUED] = "queued", [REQUEST_RUNNING] = "running"
+    };
+    for (int pass = 0; pass < 2; pass++) {
+        RequestState state = pass == 0 ? REQUEST_RUNNING : REQUEST_QUEUED;
+        for (int i = 0; i < DAEMON_CONNECTIONS; i++) {
+            Request *other = &requests[i];
+            if (other->state == state) {
+                reply(req, "S %d %s %d %s", other->id, names[state], other->priority,
+                      other->workdir);
+            }
+        }
+    }
+    finish_request(req, 0);
+}
+
+// Запрос принят целиком: проверка параметров и постановка в очередь
+static void accept_request(Request *req, DaemonPrepareFn prepare) {
+    if (req->status_request) {
+        send_status(req);
+        return;
+    }
+    if (req->args_overflow) {
+        reply(req, "E Слишком много аргументов (больше %d)", DAEMON_MAX_ARGS);
+        finish_request(req, 1);
+        return;
+    }
+    if (stop_requested) {
+        reply(req, "E Служба останавливается");
+        finish_request(req, 1);
+        return;
+    }
+
+    int queued = 0;
+    for (int i = 0; i < DAEMON_CONNECTIONS; i++) {
+        queued += requests[i].state == REQUEST_QUEUED;
+    }
+    if (queued >= DAEMON_QUEUE_MAX) {
+        reply(req, "E Очередь заполнена (%d запросов)", DAEMON_QUEUE_MAX);
+        finish_request(req, 1);
+        return;
+    }
+
+    // Параметры разбираются в каталоге клиента: пути в них относительны
+    char cwd[PATH_MAX];
+    bool moved = getcwd(cwd, sizeof(cwd)) && req->cwd[0] && chdir(req->cwd) == 0;
+    int prepared = prepare(req->argc, req->argv, req->workdir, sizeof(req->workdir));
+    optind = 1;
+    if (moved && chdir(cwd) != 0) {
+        log_warning("Не удалось вернуться в %s", cwd);
+    }
+    if (prepared != 0) {
+        reply(req, "E Неверные параметры сборки");
+        finish_request(req, 1);
+        return;
+    }
+
+    req->id = next_id++;
+    req->state = REQUEST_QUEUED;
+    reply(req, "Q %d %d", req->id, queue_position(req));
+    log_info("Запрос %d: приоритет %d, %s", req->id, req->priority, req->workdir);
+}
+
+// Строки запроса; -1 — ошибка протокола
+static int parse_request(Request *req, DaemonPrepareFn prepare) {
+    char *start = req->in;
+    char *end = req->in + req->in_len;
+    char *newline;
+    int result = 0;
+
+    while (req->state == REQUEST_READING &&
+           (newline = memchr(start, '\n', end - start)) != NULL) {
+        *newline = '\0';
+        if (strcmp(start, "BUILD") == 0 || strcmp(start, "STATUS") == 0) {
+            req->status_request = strcmp(start, "STATUS") == 0;
+        } else if (strncmp(start, "PRIORITY ", 9) == 0) {
+            req->priority = atoi(start + 9);
+        } else if (strncmp(start, "CWD ", 4) == 0) {
+            snprintf(req->cwd, sizeof(req->cwd), "%s", start + 4);
+        } else if (strncmp(start, "ARG ", 4) == 0) {
+            add_arg(req, start + 4);
+        } else if (strcmp(start, "END") == 0) {
+            accept_request(req, prepare);
+        } else {
+            reply(req, "E Неизвестная строка запроса: %.64s", start);
+            finish_request(req, 1);
+            result = -1;
+        }
+        start = newline + 1;
+    }
+
+    req->in_len = end - start;
+    memmove(req->in, start, req->in_len);
+    return result;
+}
+
+static void read_request(Request *req, DaemonPrepareFn prepare) {
+    if (!req->in) {
+        req->in = malloc(DAEMON_REQUEST_MAX);
+        if (!req->in) {
+            free_request(req);
+            return;
+        }
+    }
+
+    ssize_t bytes = read(req->fd, req->in + req->in_len, DAEMON_REQUEST_MAX - req->in_len);
+    if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    }
+    if (bytes <= 0) {
+        free_request(req);
+        return;
+    }
+
+    req->in_len += bytes;
+    parse_request(req, prepare);
+    if (req->state == REQUEST_READING && req->in_len == DAEMON_REQUEST_MAX) {
+        reply(req, "E Запрос больше %d байт", DAEMON_REQUEST_MAX);
+        finish_request(req, 1);
+    }
+}
+
+// Клиент отключился: запрос из очереди снимается, сборка прерывается
+static void drop_client(Request *req) {
+    close(req->fd);
+    req->fd = -1;
+    req->out_len = 0;
+
+    if (req->state == REQUEST_RUNNING) {
+        log_warning("Клиент запроса %d отключился, сборка прерывается", req->id);
+        kill(req->pid, SIGTERM);
+    } else {
+        if (req->state == REQUEST_QUEUED) {
+            log_info("Запрос %d снят: клиент отключился", req->id);
+        }
+        free_request(req);
+    }
+}
+
+// Сборки
+
+// Пересылка доступного вывода сборки: 1 — переслан, 0 — пока нечего,
+// -1 — вывод закрыт
+static int relay_output(Request *req) {
+    char buffer[16384];
+    ssize_t bytes = read(req->pipe_fd, buffer, sizeof(buffer));
+    if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    if (bytes <= 0) {
+        if (req->line_len > 0) {
+            reply(req, "O %.*s", (int)req->line_len, req->line);
+            req->line_len = 0;
+        }
+        return -1;
+    }
+
+    for (ssize_t i = 0; i < bytes; i++) {
+        if (buffer[i] == '\n' || req->line_len == sizeof(req->line)) {
+            reply(req, "O %.*s", (int)req->line_len, req->line);
+            req->line_len = 0;
+            if (buffer[i] == '\n') {
+                continue;
+            }
+        }
+        req->line[req->line_len++] = buffer[i];
+    }
+    return 1;
+}
+
+static void start_build(Request *req, int listen_fd, DaemonBuildFn build) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        reply(req, "E Не удалось создать канал: %s", strerror(errno));
+        finish_request(req, 1);
+        return;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        reply(req, "E Не удалось запустить сборку: %s", strerror(errno));
+        finish_request(req, 1);
+        return;
+    }
+
+    if (pid == 0) {
+        // Сборка: свой процесс со своей группой, вывод — в канал службы
+        sigset_t all;
+        sigemptyset(&all);
+        sigprocmask(SIG_SETMASK, &all, NULL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        setpgid(0, 0);
+
+        close(listen_fd);
+        for (int i = 0; i < DAEMON_CONNECTIONS; i++) {
+            if (requests[i].fd >= 0) {
+                close(requests[i].fd);
+            }
+            if (requests[i].pipe_fd >= 0) {
+                close(requests[i].pipe_fd);
+            }
+        }
+
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
+        }
+        dup2(pipefd[1], STDOUT_FILENO);
+        dup2(pipefd[1], STDERR_FILENO);
+        setvbuf(stdout, NULL, _IOLBF, 0);
+
+        if (req->cwd[0] && chdir(req->cwd) != 0) {
+            fprintf(stderr, "Каталог %s недоступен: %s\n", req->cwd, strerror(errno));
+            _exit(1);
+        }
+        exit(build(req->argc, req->argv));
+    }
+
+    close(pipefd[1]);
+    fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL) | O_NONBLOCK);
+    req->pid = pid;
+    req->pipe_fd = pipefd[0];
+    req->state = REQUEST_RUNNING;
+    req->start = now_seconds();
+    reply(req, "R %d", req->id);
+    log_info("Сборка %d начата (процесс %d)", req->id, pid);
+}
+
+// Запуск сборок из очереди, пока есть свободные места
+static void start_queued(int max_builds, int listen_fd, DaemonBuildFn build) {
+    while (!stop_requested && running_builds() < max_builds) {
+        Request *next = NULL;
+        for (int i = 0; i < DAEMON_CONNECTIONS; i++) {
+            Request *req = &requests[i];
+            if (req->state == REQUEST_QUEUED && !workdir_busy(req->workdir) &&
+                (!next || queued_before(req, next))) {
+                next = req;
+            }
+        }
+        if (!next) {
+            return;
+        }
+        start_build(next, listen_fd, build);
+    }
+}
+
+static void reap_builds(void) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < DAEMON_CONNECTIONS; i++) {
+            Request *req = &requests[i];
+            if (req->state != REQUEST_RUNNING || req->pid != pid) {
+                continue;
+            }
+
+            // Процесс завершён: остаток вывода уже в канале. Канал может
+            // держать и оставшийся потомок сборки — его вывод не ждём
+            if (req->pipe_fd >= 0) {
+                while (relay_output(req) > 0) {
+                }
+                close(req->pipe_fd);
+                req->pipe_fd = -1;
+            }
+
+            int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            log_info("Сборка %d завершена за %.0f с, код %d", req->id,
+                     now_seconds() - req->start, code);
+            if (req->fd < 0) {
+                free_request(req);
+            } else {
+                finish_request(req, code);
+            }
+        }
+    }
+}
+
+// Сокет
+
+static int listen_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("Слишком длинный путь сокета: %s", path);
+        return -1;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        log_error("Не удалось создать сокет: %s", strerror(errno));
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 && errno == EADDRINUSE) {
+        // Сокет остался от прежней службы, если к нему никто не подключается
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool alive = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) {
+            close(probe);
+        }
+        if (alive) {
+            log_error("Служба уже запущена: %s", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            log_error("Не удалось занять сокет %s: %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    // Сборка идёт от root: отправлять запросы могут root и группа сокета
+    chmod(path, 0660);
+    if (listen(fd, 16) != 0) {
+        log_error("Не удалось слушать сокет %s: %s", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+static void accept_clients(int listen_fd) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd < 0) {
+            return;
+        }
+
+        Request *req = NULL;
+        for (int i = 0; i < DAEMON_CONNECTIONS && !req; i++) {
+            if (requests[i].state == REQUEST_FREE) {
+                req = &requests[i];
+            }
+        }
+        if (!req) {
+            static const char busy[] = "E Слишком много подключений\nX 1\n";
+            send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(fd);
+            continue;
+        }
+
+        req->state = REQUEST_READING;
+        req->fd = fd;
+        req->pipe_fd = -1;
+    }
+}
+
+int daemon_serve(const char *socket_path, int max_builds,
+                 DaemonPrepareFn prepare, DaemonBuildFn build) {
+    for (int i = 0; i < DAEMON_CONNECTIONS; i++) {
+        requests[i].state = REQUEST_FREE;
+        requests[i].fd = -1;
+        requests[i].pipe_fd = -1;
+    }
+
+    // Сигналы доставляются только внутри ppoll: состояние меняет один цикл
+    sigset_t blocked, waiting;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGHUP);
+    sigprocmask(SIG_BLOCK, &blocked, &waiting);
+    sigdelset(&waiting, SIGCHLD);
+    sigdelset(&waiting, SIGTERM);
+    sigdelset(&waiting, SIGINT);
+    sigdelset(&waiting, SIGHUP);
+
+    struct sigaction action = { .sa_handler = handle_stop };
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
+    action.sa_handler = handle_child;
+    sigaction(SIGCHLD, &action, NULL);
+
+    int listen_fd = listen_socket(socket_path);
+    if (listen_fd < 0) {
+        return 1;
+    }
+    log_info("Служба сборки: %s, одновременно сборок: %d", socket_path, max_builds);
+
+    bool stopping = false;
+    double stop_time = 0;
+    for (;;) {
+        if (stop_requested && !stopping) {
+            // Остановка: новые запросы не принимаются, очередь снимается,
+            // идущие сборки прерываются и дожидаются
+            stopping = true;
+            stop_time = now_seconds();
+            log_info("Остановка службы");
+            for (int i = 0; i < DAEMON_CONNECTIONS; i++) {
+                Request *req = &requests[i];
+                if (req->state == REQUEST_QUEUED || req->state == REQUEST_READING) {
+                    reply(req, "E Служба остановлена");
+                    finish_request(req, 1);
+                } else if (req->state == REQUEST_RUNNING) {
+                    kill(req->pid, SIGTERM);
+                }
+            }
+        }
+
+        reap_builds();
+        start_queued(max_builds, listen_fd, build);
+
+        struct pollfd fds[1 + 2 * DAEMON_CONNECTIONS];
+        Request *owners[1 + 2 * DAEMON_CONNECTIONS];
+        int nfds = 0;
+        bool busy = false;
+
+        if (!stopping) {
+            fds[nfds] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+            owners[nfds++] = NULL;
+        }
+        for (int i = 0; i < DAEMON_CONNECTIONS; i++) {
+            Request *req = &requests[i];
+            if (req->state == REQUEST_FREE) {
+                continue;
+            }
+            if (flush_reply(req) != 0) {
+                drop_client(req);
+                continue;
+            }
+            if (req->state == REQUEST_CLOSING && req->out_len == 0) {
+                free_request(req);
+                continue;
+            }
+            busy = true;
+            if (req->fd >= 0) {
+                short events = req->state == REQUEST_CLOSING ? 0 : POLLIN;
+                fds[nfds] = (struct pollfd){ .fd = req->fd,
+                    .events = events | (req->out_len > 0 ? POLLOUT : 0) };
+                owners[nfds++] = req;
+            }
+            if (req->pipe_fd >= 0) {
+                fds[nfds] = (struct pollfd){ .fd = req->pipe_fd, .events = POLLIN };
+                owners[nfds++] = req;
+            }
+        }
+
+        if (stopping && !busy) {
+            break;
+        }
+        if (stopping && now_seconds() - stop_time > DAEMON_STOP_WAIT) {
+            log_warning("Сборки не остановились за %.0f с и будут завершены принудительно",
+                        DAEMON_STOP_WAIT);
+            for (int i = 0; i < DAEMON_CONNECTIONS; i++) {
+                if (requests[i].state == REQUEST_RUNNING) {
+                    kill(requests[i].pid, SIGKILL);
+                }
+            }
+            break;
+        }
+
+        struct timespec tick = { 1, 0 };
+        int ready = ppoll(fds, nfds, stopping ? &tick : NULL, &waiting);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("Ошибка ожидания событий: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            Request *req = owners[i];
+            if (!fds[i].revents) {
+                continue;
+            }
+            if (!req) {
+                accept_clients(listen_fd);
+            } else if (fds[i].fd == req->pipe_fd) {
+                if (relay_output(req) < 0) {
+                    close(req->pipe_fd);
+                    req->pipe_fd = -1;
+                }
+            } else if (fds[i].fd == req->fd) {
+                if (req->state == REQUEST_READING && (fds[i].revents & POLLIN)) {
+                    read_request(req, prepare);
+                } else if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    // После запроса клиент только читает: данные или конец
+                    // соединения означают, что он ушёл
+                    char byte;
+                    if (recv(req->fd, &byte, 1, MSG_DONTWAIT) != -1 || errno != EAGAIN) {
+                        drop_client(req);
+                    }
+                }
+            }
+        }
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
+}
+
+// Клиент
+
+static int connect_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        log_error("Служба сборки недоступна (%s): %s", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Чтение ответа службы до строки X; код из неё или 1
+static int read_reply(int fd) {
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) {
+        close(fd);
+        return 1;
+    }
+
+    int code = 1;
+    bool finished = false;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while (!finished && (len = getline(&line, &size, fp)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        const char *text = len > 2 ? line + 2 : "";
+        switch (line[0]) {
+            case 'O':
+                printf("%s\n", text);
+                break;
+            case 'Q': {
+                int id = 0, position = 0;
+                sscanf(text, "%d %d", &id, &position);
+                printf("Запрос %d в очереди, позиция %d\n", id, position);
+                break;
+            }
+            case 'R':
+                printf("Сборка %s начата\n", text);
+                break;
+            case 'S':
+                printf("%s\n", text);
+                break;
+            case 'E':
+                log_error("%s", text);
+                break;
+            case 'X':
+                code = atoi(text);
+                finished = true;
+                break;
+        }
+        fflush(stdout);
+    }
+
+    if (!finished) {
+        log_error("Служба закрыла соединение, не завершив ответ");
+    }
+    free(line);
+    fclose(fp);
+    return code;
+}
+
+static int send_request(int fd, const char *text) {
+    size_t len = strlen(text);
+    while (len > 0) {
+        ssize_t sent = send(fd, text, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("Ошибка отправки запроса: %s", strerror(errno));
+            return -1;
+        }
+        text += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+int daemon_submit(const char *socket_path, int priority, int argc, char *argv[]) {
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        cwd[0] = '\0';
+    }
+
+    // Запрос собирается целиком и уходит одной отправкой
+    size_t size = strlen(cwd) + 64;
+    for (int i = 0; i < argc; i++) {
+        if (strchr(argv[i], '\n')) {
+            log_error("Аргумент с переводом строки не передаётся службе");
+            return 1;
+        }
+        size += strlen(argv[i]) + 6;
+    }
+    char *request = malloc(size);
+    if (!request) {
+        return 1;
+    }
+    size_t len = snprintf(request, size, "BUILD\nPRIORITY %d\nCWD %s\nARG luna-builder\n",
+                          priority, cwd);
+    for (int i = 0; i < argc; i++) {
+        len += snprintf(request + len, size - len, "ARG %s\n", argv[i]);
+    }
+    snprintf(request + len, size - len, "END\n");
+
+    int fd = connect_socket(socket_path);
+    if (fd < 0) {
+        free(request);
+        return 1;
+    }
+    int sent = send_request(fd, request);
+    free(request);
+    if (sent != 0) {
+        close(fd);
+        return 1;
+    }
+    return read_reply(fd);
+}
+
+int daemon_status(const char *socket_path) {
+    int fd = connect_socket(socket_path);
+    if (fd < 0) {
+        return 1;
+    }
+    if (send_request(fd, "STATUS\nEND\n") != 0) {
+        close(fd);
+        return 1;
+    }
+    return read_reply(fd);
+}
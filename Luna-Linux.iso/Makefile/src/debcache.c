@@ -0,0 +1,269 @@
+/**
+ * debcache.c - Реализация общего кэша пакетов .deb
+ *
+ * Каталог кэша монтируется в /var/cache/apt/archives внутри chroot, поэтому
+ * apt сам проверяет хэши уже скачанных пакетов по индексам и докачивает
+ * только недостающие. После шага кэш отключается, в образ он не попадает.
+ * Попадания и промахи считаются по dpkg.log шага: распакованные пакеты,
+ * файлы которых появились в кэше за время шага, — промахи, остальные —
+ * попадания. Размер кэша ограничен, вытесняются давно не читавшиеся пакеты.
+ */
+
+#include "debcache.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#define DEBCACHE_EVICT_LOCK ".evict.lock"
+
+// Открытие кэша
+int debcache_open(DebCache *cache, const char *dir, long long max_bytes) {
+    memset(cache, 0, sizeof(*cache));
+    snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+    cache->max_bytes = max_bytes;
+    cache->lock_fd = -1;
+
+    char partial[512];
+    snprintf(partial, sizeof(partial), "%s/partial", dir);
+    if (make_dirs(partial) != 0) {
+        log_warning("Не удалось создать кэш пакетов %s, пакеты будут скачиваться заново", dir);
+        return -1;
+    }
+
+    cache->enabled = true;
+    return 0;
+}
+
+static long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : 0;
+}
+
+// Разделяемая блокировка кэша
+int debcache_hold(const DebCache *cache) {
+    char lock_path[512];
+    snprintf(lock_path, sizeof(lock_path), "%s/%s", cache->dir, DEBCACHE_EVICT_LOCK);
+
+    int fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || flock(fd, LOCK_SH) != 0) {
+        log_error("Не удалось заблокировать кэш пакетов %s: %s", cache->dir, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    return fd;
+}
+
+void debcache_release(int fd) {
+    if (fd >= 0) {
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+}
+
+// Подключение кэша к chroot
+int debcache_attach(DebCache *cache, const char *chroot, bool bind) {
+    if (!cache->enabled) {
+        return 0;
+    }
+
+    cache->lock_fd = debcache_hold(cache);
+    if (cache->lock_fd < 0) {
+        return -1;
+    }
+
+    snprintf(cache->dpkg_log, sizeof(cache->dpkg_log), "%s/var/log/dpkg.log", chroot);
+    cache->dpkg_log_offset = file_size(cache->dpkg_log);
+    cache->attach_time = time(NULL);
+    cache->mountpoint[0] = '\0';
+
+    if (!bind) {
+        return 0;
+    }
+
+    char target[512];
+    snprintf(target, sizeof(target), "%s%s", chroot, DEBCACHE_CHROOT_DIR);
+    if (make_dirs(target) != 0 || mount(cache->dir, target, NULL, MS_BIND, NULL) != 0) {
+        log_error("Не удалось подключить кэш пакетов в %s: %s", target, strerror(errno));
+        debcache_release(cache->lock_fd);
+        cache->lock_fd = -1;
+        return -1;
+    }
+    snprintf(cache->mountpoint, sizeof(cache->mountpoint), "%s", target);
+
+    return 0;
+}
+
+// Подсчёт пакетов, распакованных dpkg за время шага
+static int count_unpacked(DebCache *cache) {
+    FILE *fp = fopen(cache->dpkg_log, "r");
+    if (!fp) {
+        return 0;
+    }
+
+    // Журнал мог быть создан заново (базовая система)
+    if (file_size(cache->dpkg_log) >= cache->dpkg_log_offset) {
+        fseek(fp, cache->dpkg_log_offset, SEEK_SET);
+    }
+
+    int unpacked = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        if (strstr(line, " unpack ")) {
+            unpacked++;
+        }
+    }
+
+    fclose(fp);
+    return unpacked;
+}
+
+// Файл пакета из кэша
+typedef struct {
+    char name[256];
+    time_t atime;
+    long long size;
+} DebEntry;
+
+static int compare_atime(const void *a, const void *b) {
+    const DebEntry *x = a, *y = b;
+    return (x->atime > y->atime) - (x->atime < y->atime);
+}
+
+// Сканирование кэша: всего пакетов и байт, новые пакеты шага
+static DebEntry *scan_debs(DebCache *cache, int *count, long long *total,
+                           int *added, long long *added_bytes) {
+    DIR *dir = opendir(cache->dir);
+    if (!dir) {
+        return NULL;
+    }
+
+    int capacity = 256;
+    DebEntry *entries = malloc(capacity * sizeof(DebEntry));
+    *count = 0;
+    *total = 0;
+    *added = 0;
+    *added_bytes = 0;
+
+    struct dirent *ent;
+    while (entries && (ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len < 5 || strcmp(ent->d_name + len - 4, ".deb") != 0 || len >= sizeof(entries->name)) {
+            continue;
+        }
+
+        char path[600];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, ent->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity *= 2;
+            DebEntry *grown = realloc(entries, capacity * sizeof(DebEntry));
+            if (!grown) {
+                free(entries);
+                entries = NULL;
+                break;
+            }
+            entries = grown;
+        }
+
+        // apt переносит пакет из partial/ переименованием: ctime — время появления
+        if (st.st_ctime >= cache->attach_time) {
+            (*added)++;
+            *added_bytes += st.st_size;
+        }
+
+        DebEntry *entry = &entries[(*count)++];
+        snprintf(entry->name, sizeof(entry->name), "%s", ent->d_name);
+        entry->atime = st.st_atime;
+        entry->size = st.st_size;
+        *total += st.st_size;
+    }
+
+    closedir(dir);
+    return entries;
+}
+
+// Вытеснение давно не использованных пакетов сверх лимита; выполняется,
+// только если кэш не подключён ни к одной другой сборке
+static void evict(DebCache *cache, DebEntry *entries, int count, long long total) {
+    if (cache->max_bytes <= 0 || total <= cache->max_bytes ||
+        flock(cache->lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        return;
+    }
+
+    qsort(entries, count, sizeof(DebEntry), compare_atime);
+
+    int removed = 0;
+    for (int i = 0; i < count && total > cache->max_bytes; i++) {
+        char path[600];
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+        if (unlink(path) == 0) {
+            total -= entries[i].size;
+            removed++;
+        }
+    }
+
+    if (removed > 0) {
+        log_info("Кэш пакетов: вытеснено %d пакетов, занято %.1f MB",
+                 removed, total / (1024.0 * 1024.0));
+    }
+}
+
+// Отключение кэша от chroot, учёт статистики и вытеснение
+int debcache_detach(DebCache *cache) {
+    if (!cache->enabled || cache->lock_fd < 0) {
+        return 0;
+    }
+
+    int result = 0;
+    if (cache->mountpoint[0] &&
+        umount2(cache->mountpoint, 0) != 0 && umount2(cache->mountpoint, MNT_DETACH) != 0) {
+        log_error("Не удалось отключить кэш пакетов %s: %s", cache->mountpoint, strerror(errno));
+        result = -1;
+    }
+    cache->mountpoint[0] = '\0';
+
+    int count, added;
+    long long total, added_bytes;
+    DebEntry *entries = scan_debs(cache, &count, &total, &added, &added_bytes);
+
+    int unpacked = count_unpacked(cache);
+    cache->misses += added;
+    cache->hits += unpacked > added ? unpacked - added : 0;
+    cache->downloaded_bytes += added_bytes;
+
+    if (entries) {
+        evict(cache, entries, count, total);
+        free(entries);
+    }
+
+    debcache_release(cache->lock_fd);
+    cache->lock_fd = -1;
+
+    return result;
+}
+
+// Итоговая статистика кэша пакетов
+void debcache_print_stats(const DebCache *cache) {
+    if (!cache->enabled) {
+        return;
+    }
+
+    log_info("Кэш пакетов (%s): из кэша %d, скачано %d (%.1f MB)",
+             cache->dir, cache->hits, cache->misses,
+             cache->downloaded_bytes / (1024.0 * 1024.0));
+}
@@ -0,0 +1,432 @@
+/**
+ * dedup.c - Реализация дедупликации файлов перед сборкой squashfs
+ *
+ * Дерево обходится один раз, файлы группируются по размеру; хешируются
+ * только файлы, у которых есть другой inode того же размера. Хеширование
+ * идёт параллельно. Дубликат заменяется атомарно: жёсткая ссылка на
+ * оставляемый файл создаётся рядом под временным именем и переименовывается
+ * поверх. Права, владелец и xattr входят в ключ группы, потому что у
+ * жёстких ссылок они общие; время изменения берётся у оставляемого файла.
+ *
+ * Обходятся только каталоги, которые в установленной системе меняет лишь
+ * менеджер пакетов (программы, библиотеки, общие данные в /usr). В /etc,
+ * /var, /root и /home лежат файлы настроек и данные: правка одной копии
+ * через общую ссылку молча изменила бы и другую.
+ */
+
+#define _GNU_SOURCE
+
+#include "dedup.h"
+#include "hash.h"
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+typedef struct {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    char hash[SHA256_HEX_SIZE];
+    char xattrs[SHA256_HEX_SIZE];   // хеш имён и значений xattr
+    bool candidate;
+} DedupFile;
+
+typedef struct {
+    DedupFile *items;
+    size_t count;
+    size_t cap;
+} DedupList;
+
+// Каталоги дедупликации относительно корня chroot
+static const char *const dedup_dirs[] = {
+    "usr/bin", "usr/sbin", "usr/lib", "usr/lib32", "usr/lib64", "usr/libx32",
+    "usr/libexec", "usr/include", "usr/share", "usr/src", NULL
+};
+
+// nftw не передаёт контекст, поэтому список собирается в переменной файла
+static DedupList walk_list;
+
+static int add_file(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)ftw;
+    if (flag != FTW_F || !S_ISREG(st->st_mode) || st->st_size == 0) {
+        return 0;
+    }
+
+    if (walk_list.count == walk_list.cap) {
+        walk_list.cap = walk_list.cap ? walk_list.cap * 2 : 4096;
+        DedupFile *items = realloc(walk_list.items, walk_list.cap * sizeof(DedupFile));
+        if (!items) {
+            return -1;
+        }
+        walk_list.items = items;
+    }
+
+    DedupFile *file = &walk_list.items[walk_list.count++];
+    memset(file, 0, sizeof(*file));
+    file->path = strdup(path);
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->size = st->st_size;
+    file->mode = st->st_mode;
+    file->uid = st->st_uid;
+    file->gid = st->st_gid;
+    return 0;
+}
+
+static void free_files(DedupFile *items, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(items[i].path);
+    }
+    free(items);
+}
+
+static int compare_inode(const void *a, const void *b) {
+    const DedupFile *x = a, *y = b;
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+// Порядок групп: содержимое и метаданные, затем inode, чтобы имена
+// одного inode шли подряд
+static int compare_content(const void *a, const void *b) {
+    const DedupFile *x = a, *y = b;
+    int result;
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    if ((result = strcmp(x->hash, y->hash)) != 0) {
+        return result;
+    }
+    if (x->mode != y->mode) {
+        return x->mode < y->mode ? -1 : 1;
+    }
+    if (x->uid != y->uid) {
+        return x->uid < y->uid ? -1 : 1;
+    }
+    if (x->gid != y->gid) {
+        return x->gid < y->gid ? -1 : 1;
+    }
+    if ((result = strcmp(x->xattrs, y->xattrs)) != 0) {
+        return result;
+    }
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+static bool same_content(const DedupFile *x, const DedupFile *y) {
+    return x->candidate && y->candidate && x->size == y->size &&
+           strcmp(x->hash, y->hash) == 0 && x->mode == y->mode && x->uid == y->uid &&
+           x->gid == y->gid && strcmp(x->xattrs, y->xattrs) == 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Буфер под xattr: размер узнаётся пробным вызовом; если атрибут
+// вырос между вызовами (ERANGE), чтение повторяется. NULL — ошибка чтения
+static char *read_xattr(const char *path, const char *name, ssize_t *len) {
+    for (int attempt = 0; attempt < 4; attempt++) {
+        ssize_t size = name ? lgetxattr(path, name, NULL, 0) : llistxattr(path, NULL, 0);
+        if (size < 0) {
+            return NULL;
+        }
+        char *buffer = malloc(size + 1);
+        if (!buffer) {
+            return NULL;
+        }
+        *len = name ? lgetxattr(path, name, buffer, size) : llistxattr(path, buffer, size);
+        if (*len >= 0) {
+            return buffer;
+        }
+        free(buffer);
+        if (errno != ERANGE) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Хеш xattr: имена в порядке сортировки и их значения целиком. false —
+// xattr не прочитались, и файл не сравнивается с другими: иначе могли бы
+// объединиться файлы с разными ACL или метками безопасности
+static bool hash_xattrs(const char *path, char hex[SHA256_HEX_SIZE]) {
+    hex[0] = '\0';
+    ssize_t len;
+    char *names = read_xattr(path, NULL, &len);
+    if (!names) {
+        return errno == ENOTSUP;
+    }
+    if (len == 0) {
+        free(names);
+        return true;
+    }
+    names[len] = '\0';
+
+    int count = 0;
+    for (char *name = names; name < names + len; name += strlen(name) + 1) {
+        count++;
+    }
+    const char **sorted = malloc(count * sizeof(sorted[0]));
+    if (!sorted) {
+        free(names);
+        return false;
+    }
+    count = 0;
+    for (char *name = names; name < names + len; name += strlen(name) + 1) {
+        sorted[count++] = name;
+    }
+    qsort(sorted, count, sizeof(sorted[0]), compare_names);
+
+    Sha256Ctx ctx;
+    sha256_init(&ctx);
+    bool ok = true;
+    for (int i = 0; i < count && ok; i++) {
+        ssize_t value_len;
+        char *value = read_xattr(path, sorted[i], &value_len);
+        if (!value) {
+            ok = false;
+            break;
+        }
+        // Длина перед значением: границы значений однозначны
+        uint64_t size = value_len;
+        sha256_update(&ctx, sorted[i], strlen(sorted[i]) + 1);
+        sha256_update(&ctx, &size, sizeof(size));
+        sha256_update(&ctx, value, value_len);
+        free(value);
+    }
+    free(sorted);
+    free(names);
+
+    if (ok) {
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256_final(&ctx, digest);
+        hash_to_hex(digest, SHA256_DIGEST_SIZE, hex);
+    }
+    return ok;
+}
+
+typedef struct {
+    DedupFile **jobs;
+    size_t count;
+    size_t next;
+    unsigned long long bytes;
+    int step;
+    pthread_mutex_t lock;
+} HashQueue;
+
+static void *hash_worker(void *arg) {
+    HashQueue *queue = arg;
+    trace_thread_begin(queue->step);
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        size_t index = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (index >= queue->count) {
+            trace_thread_end();
+            return NULL;
+        }
+
+        DedupFile *file = queue->jobs[index];
+        if (sha256_file(file->path, file->hash) != 0) {
+            // Нечитаемый файл не попадёт ни в одну группу
+            file->candidate = false;
+            continue;
+        }
+        if (!hash_xattrs(file->path, file->xattrs)) {
+            file->candidate = false;
+            continue;
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        queue->bytes += file->size;
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+// Хеширование первого имени каждого inode-кандидата на пуле потоков
+static void hash_candidates(DedupFile *items, size_t count, int threads, DedupStats *stats) {
+    HashQueue queue = { .step = trace_current_step() };
+    pthread_mutex_init(&queue.lock, NULL);
+    queue.jobs = malloc((count ? count : 1) * sizeof(DedupFile *));
+    for (size_t i = 0; i < count; i++) {
+        bool first = i == 0 || items[i - 1].dev != items[i].dev || items[i - 1].ino != items[i].ino;
+        if (items[i].candidate && first) {
+            queue.jobs[queue.count++] = &items[i];
+        }
+    }
+
+    pthread_t workers[64];
+    int started = 0;
+    threads = threads > 64 ? 64 : threads < 1 ? 1 : threads;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, hash_worker, &queue) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        hash_worker(&queue);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // Остальные имена того же inode получают его хеш
+    for (size_t i = 1; i < count; i++) {
+        if (items[i].candidate && items[i - 1].dev == items[i].dev &&
+            items[i - 1].ino == items[i].ino) {
+            memcpy(items[i].hash, items[i - 1].hash, sizeof(items[i].hash));
+            memcpy(items[i].xattrs, items[i - 1].xattrs, sizeof(items[i].xattrs));
+            items[i].candidate = items[i - 1].candidate;
+        }
+    }
+
+    stats->bytes_hashed = queue.bytes;
+    free(queue.jobs);
+    pthread_mutex_destroy(&queue.lock);
+}
+
+// Замена имени жёсткой ссылкой на оставляемый файл
+static int replace_with_link(const char *keep, const char *path) {
+    char tmp[4200];
+    snprintf(tmp, sizeof(tmp), "%s.luna-dedup", path);
+    unlink(tmp);
+
+    if (link(keep, tmp) != 0) {
+        return -1;
+    }
+    if (rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int dedup_tree(const char *root, int threads, DedupStats *stats) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(stats, 0, sizeof(*stats));
+
+    walk_list = (DedupList){ 0 };
+    for (int i = 0; dedup_dirs[i]; i++) {
+        char dir[4096];
+        int len = snprintf(dir, sizeof(dir), "%s/%s", root, dedup_dirs[i]);
+        if (len < 0 || (size_t)len >= sizeof(dir)) {
+            log_error("Слишком длинный путь: %s/%s", root, dedup_dirs[i]);
+            free_files(walk_list.items, walk_list.count);
+            return -1;
+        }
+        struct stat st;
+        if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+        if (nftw(dir, add_file, 64, FTW_PHYS | FTW_MOUNT) != 0) {
+            log_error("Не удалось обойти %s", dir);
+            free_files(walk_list.items, walk_list.count);
+            return -1;
+        }
+    }
+    DedupFile *items = walk_list.items;
+    size_t count = walk_list.count;
+    walk_list = (DedupList){ 0 };
+
+    // Кандидаты: у размера есть хотя бы два разных inode
+    qsort(items, count, sizeof(DedupFile), compare_inode);
+    size_t group = 0;
+    for (size_t i = 0; i <= count; i++) {
+        if (i < count && items[i].size == items[group].size) {
+            continue;
+        }
+        bool several = false;
+        for (size_t j = group + 1; j < i; j++) {
+            several = several || items[j].ino != items[group].ino || items[j].dev != items[group].dev;
+        }
+        for (size_t j = group; j < i; j++) {
+            items[j].candidate = several;
+        }
+        group = i;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        stats->files++;
+        if (i == 0 || items[i - 1].dev != items[i].dev || items[i - 1].ino != items[i].ino) {
+            stats->bytes_total += items[i].size;
+        }
+    }
+
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    hash_candidates(items, count, threads, stats);
+
+    // Группы одинакового содержимого и метаданных; первое имя остаётся
+    qsort(items, count, sizeof(DedupFile), compare_content);
+    size_t keep = 0;
+    for (size_t i = 1; i <= count; i++) {
+        if (i < count && same_content(&items[i], &items[keep])) {
+            continue;
+        }
+
+        bool linked_group = false;
+        for (size_t j = keep + 1; j < i; j++) {
+            DedupFile *file = &items[j];
+            if (file->ino == items[keep].ino && file->dev == items[keep].dev) {
+                continue;
+            }
+            if (replace_with_link(items[keep].path, file->path) != 0) {
+                log_warning("Не удалось заменить %s ссылкой: %s", file->path, strerror(errno));
+                continue;
+            }
+            stats->linked++;
+            linked_group = true;
+            // Объём освобождается один раз на inode дубликата
+            if (file->ino != items[j - 1].ino || file->dev != items[j - 1].dev) {
+                stats->bytes_saved += file->size;
+            }
+        }
+        stats->groups += linked_group;
+        keep = i;
+    }
+
+    free_files(items, count);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return 0;
+}
+
+void dedup_print_stats(const DedupStats *stats) {
+    double total = stats->bytes_total ? stats->bytes_total : 1;
+    log_info("Дедупликация: %llu файлов, %.1f MB; хешировано %.1f MB за %.1f с; "
+             "%llu групп, %llu имён заменено ссылками, освобождено %.1f MB (%.1f%%)",
+             stats->files, stats->bytes_total / (1024.0 * 1024.0),
+             stats->bytes_hashed / (1024.0 * 1024.0), stats->seconds,
+             stats->groups, stats->linked, stats->bytes_saved / (1024.0 * 1024.0),
+             100.0 * stats->bytes_saved / total);
+}
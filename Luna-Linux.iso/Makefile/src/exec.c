@@ -0,0 +1,552 @@
+/**
+ * exec.c - Реализация запуска внешних команд
+ *
+ * Команда запускается по вектору аргументов через spawn_process
+ * (posix_spawn), без промежуточной оболочки и без ограничений длины
+ * командной строки. stdout и stderr читаются одним циклом poll и
+ * построчно пишутся в журнал шага с меткой времени и потоком вывода.
+ * По истечении времени ожидания группа процессов получает SIGTERM,
+ * а через несколько секунд — SIGKILL. Завершившийся процесс сначала
+ * только замечается (waitid с WNOWAIT): пока он не удалён из таблицы,
+ * из /proc/<pid>/io читается ввод-вывод его и его потомков.
+ */
+
+#define _GNU_SOURCE
+
+#include "exec.h"
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// Пауза между SIGTERM и SIGKILL при превышении времени ожидания
+#define EXEC_KILL_GRACE_MS 5000
+
+// Сколько ещё читать вывод после завершения команды: запущенные ею
+// фоновые процессы (службы в chroot) могут держать каналы открытыми
+#define EXEC_DRAIN_MS 1000
+#define EXEC_POLL_MS 250
+
+// Опрос завершения команды, закрывшей свой вывод, при заданном времени ожидания
+#define EXEC_WAIT_MS 50
+
+static __thread char thread_log[512];
+static __thread ExecIo thread_io;
+static int default_timeout = 0;
+
+// Буфер неполной строки одного потока вывода
+typedef struct {
+    int fd;
+    const char *label;
+    const char *command;    // имя команды в журнале сборки
+    char line[4096];
+    size_t len;
+} ExecStream;
+
+// Вектор без аргументов: argv всегда можно передать exec_run
+static char *empty_argv[] = { NULL };
+
+void exec_args_init(ExecArgs *args) {
+    args->argv = empty_argv;
+    args->argc = 0;
+    args->capacity = 0;
+    args->failed = false;
+}
+
+static void release_args(ExecArgs *args) {
+    for (int i = 0; i < args->argc; i++) {
+        free(args->argv[i]);
+    }
+    if (args->capacity > 0) {
+        free(args->argv);
+    }
+}
+
+// Усечённая команда опаснее незапущенной: вектор очищается целиком
+static void fail_args(ExecArgs *args) {
+    log_error("Не хватает памяти для аргументов команды");
+    release_args(args);
+    exec_args_init(args);
+    args->failed = true;
+}
+
+void exec_args_add(ExecArgs *args, const char *arg) {
+    if (args->failed) {
+        return;
+    }
+
+    if (args->argc + 1 >= args->capacity) {
+        int capacity = args->capacity ? args->capacity * 2 : 16;
+        char **argv = realloc(args->capacity ? args->argv : NULL, capacity * sizeof(char *));
+        if (!argv) {
+            fail_args(args);
+            return;
+        }
+        args->argv = argv;
+        args->capacity = capacity;
+    }
+
+    char *copy = strdup(arg);
+    if (!copy) {
+        fail_args(args);
+        return;
+    }
+
+    args->argv[args->argc++] = copy;
+    args->argv[args->argc] = NULL;
+}
+
+void exec_args_addf(ExecArgs *args, const char *format, ...) {
+    char *arg;
+    va_list ap;
+    va_start(ap, format);
+    int len = vasprintf(&arg, format, ap);
+    va_end(ap);
+
+    if (len < 0) {
+        if (!args->failed) {
+            fail_args(args);
+        }
+        return;
+    }
+
+    exec_args_add(args, arg);
+    free(arg);
+}
+
+// Разбиение строки параметров по пробелам; "..." объединяет слова
+void exec_args_split(ExecArgs *args, const char *words) {
+    if (args->failed) {
+        return;
+    }
+
+    // Слово не длиннее всей строки, поэтому одного буфера хватает на все
+    char *word = malloc(strlen(words) + 1);
+    if (!word) {
+        fail_args(args);
+        return;
+    }
+
+    const char *p = words;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\\') {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+
+        size_t len = 0;
+        bool quoted = false;
+        while (*p && (quoted || (*p != ' ' && *p != '\t' && *p != '\n'))) {
+            if (*p == '"') {
+                quoted = !quoted;
+            } else {
+                word[len++] = *p;
+            }
+            p++;
+        }
+        word[len] = '\0';
+        exec_args_add(args, word);
+    }
+
+    free(word);
+}
+
+void exec_args_free(ExecArgs *args) {
+    release_args(args);
+    exec_args_init(args);
+}
+
+void exec_set_log(const char *path) {
+    snprintf(thread_log, sizeof(thread_log), "%s", path ? path : "");
+}
+
+const char *exec_get_log(void) {
+    return thread_log[0] ? thread_log : NULL;
+}
+
+void exec_set_default_timeout(int seconds) {
+    default_timeout = seconds;
+}
+
+void exec_io_reset(void) {
+    thread_io.read_bytes = 0;
+    thread_io.write_bytes = 0;
+}
+
+void exec_io_get(ExecIo *io) {
+    *io = thread_io;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Метка времени строки журнала
+static void timestamp(char *buffer, size_t size) {
+    struct timespec ts;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &tm);
+    snprintf(buffer, size, "%02d:%02d:%02d.%03ld",
+             tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec / 1000000);
+}
+
+// Последние строки stderr сохраняются для сообщения об ошибке
+static void keep_tail(ExecResult *result, const char *line, size_t len) {
+    size_t size = sizeof(result->stderr_tail);
+    size_t used = strlen(result->stderr_tail);
+
+    if (len + 2 > size) {
+        line += len - (size - 2);
+        len = size - 2;
+    }
+    if (used + len + 2 > size) {
+        size_t drop = used + len + 2 - size;
+        memmove(result->stderr_tail, result->stderr_tail + drop, used - drop + 1);
+        used -= drop;
+    }
+
+    memcpy(result->stderr_tail + used, line, len);
+    result->stderr_tail[used + len] = '\n';
+    result->stderr_tail[used + len + 1] = '\0';
+}
+
+// Вывод готовой строки в журнал шага и в журнал сборки; в терминал —
+// при подробном режиме
+static void emit_line(ExecStream *stream, FILE *log, bool verbose,
+                      bool is_stderr, ExecResult *result) {
+    if (log) {
+        char ts[32];
+        timestamp(ts, sizeof(ts));
+        fprintf(log, "[%s] %s| %.*s\n", ts, stream->label, (int)stream->len, stream->line);
+    }
+    log_output(stream->command, is_stderr, verbose, stream->line, stream->len);
+    if (is_stderr) {
+        keep_tail(result, stream->line, stream->len);
+    }
+    stream->len = 0;
+}
+
+// Чтение доступных данных потока; false — поток закрыт
+static bool drain_stream(ExecStream *stream, FILE *log, bool verbose,
+                         bool is_stderr, ExecResult *result) {
+    char buffer[8192];
+    ssize_t bytes = read(stream->fd, buffer, sizeof(buffer));
+    if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return true;
+    }
+
+    if (bytes <= 0) {
+        if (stream->len > 0) {
+            emit_line(stream, log, verbose, is_stderr, result);
+        }
+        return false;
+    }
+
+    for (ssize_t i = 0; i < bytes; i++) {
+        char c = buffer[i];
+        if (c == '\n' || c == '\r') {
+            if (stream->len > 0 || c == '\n') {
+                emit_line(stream, log, verbose, is_stderr, result);
+            }
+        } else {
+            if (stream->len == sizeof(stream->line)) {
+                emit_line(stream, log, verbose, is_stderr, result);
+            }
+            stream->line[stream->len++] = c;
+        }
+    }
+
+    return true;
+}
+
+// Завершение процесса без удаления из таблицы процессов: 1 — завершён,
+// 0 — ещё работает, -1 — ошибка
+static int peek_exit(pid_t pid, bool block) {
+    for (;;) {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT | (block ? 0 : WNOHANG)) == 0) {
+            return info.si_pid == pid ? 1 : 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+        if (!block) {
+            return 0;
+        }
+    }
+}
+
+// Превышение времени: сначала SIGTERM группе, после паузы — SIGKILL.
+// true — сигнал отправлен сейчас
+static bool enforce_deadline(ExecResult *result, double *deadline) {
+    if (*deadline <= 0 || now_seconds() < *deadline) {
+        return false;
+    }
+    if (!result->timed_out) {
+        result->timed_out = true;
+        kill(-result->pid, SIGTERM);
+        *deadline = now_seconds() + EXEC_KILL_GRACE_MS / 1000.0;
+    } else {
+        kill(-result->pid, SIGKILL);
+        *deadline = 0;
+    }
+    return true;
+}
+
+// Имя команды в трассе и журнале: программа и подкоманда
+static void command_name(char *const argv[], const ExecOptions *options,
+                         char *name, size_t size) {
+    if (options && options->title) {
+        snprintf(name, size, "%s", options->title);
+    } else {
+        char program[256];
+        snprintf(program, sizeof(program), "%s", argv[0]);
+        const char *sub = argv[1] && argv[1][0] != '-' && argv[1][0] != '/' ? argv[1] : NULL;
+        snprintf(name, size, "%s%s%s", basename(program), sub ? " " : "", sub ? sub : "");
+    }
+}
+
+// Интервал команды в трассе
+static void trace_exec(char *const argv[], const char *name, double start,
+                       const ExecResult *result) {
+    char line[512];
+    size_t len = 0;
+    line[0] = '\0';
+    for (int i = 0; argv[i] != NULL && len < sizeof(line) - 1; i++) {
+        int written = snprintf(line + len, sizeof(line) - len, "%s%s", i ? " " : "", argv[i]);
+        len += written > 0 ? (size_t)written : 0;
+    }
+
+    trace_command(name, line, start, start + result->duration,
+                  result->term_signal ? 128 + result->term_signal : result->exit_code,
+                  &result->usage);
+}
+
+int exec_run(char *const argv[], const ExecOptions *options, ExecResult *result) {
+    memset(result, 0, sizeof(*result));
+    result->exit_code = -1;
+
+    if (!argv[0]) {
+        result->spawn_failed = true;
+        snprintf(result->stderr_tail, sizeof(result->stderr_tail),
+                 "Пустая команда: аргументы не собраны\n");
+        return -1;
+    }
+
+    const char *log_path = options && options->log_path ? options->log_path : exec_get_log();
+    int timeout = options && options->timeout >= 0 ? options->timeout : default_timeout;
+    bool verbose = options && options->verbose;
+
+    FILE *log = log_path ? fopen(log_path, "ae") : NULL;
+    if (log) {
+        char ts[32];
+        timestamp(ts, sizeof(ts));
+        fprintf(log, "[%s] $", ts);
+        for (int i = 0; argv[i] != NULL; i++) {
+            fprintf(log, " %s", argv[i]);
+        }
+        fprintf(log, "\n");
+    }
+
+    char name[96];
+    command_name(argv, options, name, sizeof(name));
+
+    double start = now_seconds();
+    ExecStream streams[2] = {
+        { .fd = -1, .label = "out", .command = name },
+        { .fd = -1, .label = "err", .command = name }
+    };
+
+    result->pid = spawn_process_setup(argv, options ? options->setup : NULL,
+                                      options ? options->setup_arg : NULL,
+                                      NULL, &streams[0].fd, &streams[1].fd);
+    if (result->pid < 0) {
+        result->spawn_failed = true;
+        snprintf(result->stderr_tail, sizeof(result->stderr_tail), "%s: %s\n",
+                 argv[0], strerror(errno));
+        if (log) {
+            fprintf(log, "%s", result->stderr_tail);
+            fclose(log);
+        }
+        return -1;
+    }
+
+    double deadline = timeout > 0 ? start + timeout : 0;
+    double drain_until = 0;
+    int open_streams = 2;
+    int status = 0;
+    int exited = 0;
+    struct rusage usage;
+    TraceIo io;
+    memset(&usage, 0, sizeof(usage));
+
+    while (open_streams > 0 && (drain_until == 0 || now_seconds() < drain_until)) {
+        struct pollfd fds[2];
+        int nfds = 0;
+        int map[2];
+        for (int i = 0; i < 2; i++) {
+            if (streams[i].fd >= 0) {
+                fds[nfds].fd = streams[i].fd;
+                fds[nfds].events = POLLIN;
+                map[nfds++] = i;
+            }
+        }
+
+        int wait_ms = EXEC_POLL_MS;
+        if (deadline > 0) {
+            double left = deadline - now_seconds();
+            int until_deadline = left > 0 ? (int)(left * 1000) + 1 : 0;
+            wait_ms = until_deadline < wait_ms ? until_deadline : wait_ms;
+        }
+
+        int ready = poll(fds, nfds, wait_ms);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (int i = 0; i < nfds && ready > 0; i++) {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ExecStream *stream = &streams[map[i]];
+                if (!drain_stream(stream, log, verbose, map[i] == 1, result)) {
+                    close(stream->fd);
+                    stream->fd = -1;
+                    open_streams--;
+                }
+            }
+        }
+
+        enforce_deadline(result, &deadline);
+
+        if (!exited) {
+            exited = peek_exit(result->pid, false);
+            if (exited != 0) {
+                drain_until = now_seconds() + EXEC_DRAIN_MS / 1000.0;
+            }
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (streams[i].fd >= 0) {
+            close(streams[i].fd);
+        }
+    }
+
+    // Каналы закрыты, а команда ещё работает (перевела вывод в файл или
+    // ушла в фон): время ожидания соблюдается и здесь
+    while (exited == 0 && deadline > 0) {
+        exited = peek_exit(result->pid, false);
+        if (exited == 0 && !enforce_deadline(result, &deadline)) {
+            double left = deadline - now_seconds();
+            int wait_ms = left < EXEC_WAIT_MS / 1000.0 ? (int)(left * 1000) + 1 : EXEC_WAIT_MS;
+            poll(NULL, 0, wait_ms);
+        }
+    }
+    if (exited == 0) {
+        exited = peek_exit(result->pid, true);
+    }
+    bool have_io = exited > 0 && trace_read_io(result->pid, &io) == 0;
+    if (wait_process(result->pid, &status, &usage) != 0) {
+        status = -1;
+    }
+    result->duration = now_seconds() - start;
+
+    result->usage.user_time = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    result->usage.sys_time = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    result->usage.max_rss_kb = usage.ru_maxrss;
+    if (have_io) {
+        result->usage.io = io;
+    } else {
+        // Без /proc — по rusage: ru_inblock и ru_oublock в блоках по 512 байт
+        result->usage.io.read_bytes = (unsigned long long)usage.ru_inblock * 512;
+        result->usage.io.write_bytes = (unsigned long long)usage.ru_oublock * 512;
+    }
+    result->read_bytes = result->usage.io.read_bytes;
+    result->write_bytes = result->usage.io.write_bytes;
+    thread_io.read_bytes += result->read_bytes;
+    thread_io.write_bytes += result->write_bytes;
+
+    if (status != -1 && WIFEXITED(status)) {
+        result->exit_code = WEXITSTATUS(status);
+    } else if (status != -1 && WIFSIGNALED(status)) {
+        result->term_signal = WTERMSIG(status);
+    }
+
+    if (log) {
+        char ts[32], description[128];
+        timestamp(ts, sizeof(ts));
+        exec_describe(result, description, sizeof(description));
+        fprintf(log, "[%s] %s за %.1f с\n", ts, description, result->duration);
+        fclose(log);
+    }
+
+    trace_exec(argv, name, start, result);
+
+    return result->exit_code == 0 && !result->timed_out ? 0 : -1;
+}
+
+void exec_describe(const ExecResult *result, char *buffer, size_t size) {
+    if (result->spawn_failed) {
+        snprintf(buffer, size, "не удалось запустить");
+    } else if (result->timed_out) {
+        snprintf(buffer, size, "превышено время ожидания");
+    } else if (result->term_signal) {
+        snprintf(buffer, size, "завершена сигналом %d (%s)",
+                 result->term_signal, strsignal(result->term_signal));
+    } else {
+        snprintf(buffer, size, "код выхода %d", result->exit_code);
+    }
+}
+
+int exec_command_options(char *const argv[], const ExecOptions *options) {
+    ExecResult result;
+    const char *title = options->title ? options->title : argv[0] ? argv[0] : "(пусто)";
+
+    // Командная строка — в журнал сборки; в терминал при подробном выводе
+    if (log_get_level(LOG_SINK_TERMINAL) <= LOG_DEBUG ||
+        log_get_level(LOG_SINK_FILE) <= LOG_DEBUG) {
+        char line[1024];
+        size_t len = snprintf(line, sizeof(line), "%s", options->title ? options->title : "");
+        for (int i = 0; argv[i] != NULL && len < sizeof(line); i++) {
+            len += snprintf(line + len, sizeof(line) - len, "%s%s", len ? " " : "", argv[i]);
+        }
+        log_debug("[CMD] %s", line);
+    }
+
+    if (exec_run(argv, options, &result) == 0) {
+        return 0;
+    }
+
+    char description[128];
+    exec_describe(&result, description, sizeof(description));
+    log_error("Команда %s: %s", title, description);
+    if (!options->verbose && result.stderr_tail[0]) {
+        fprintf(stderr, "%s", result.stderr_tail);
+    }
+    if (exec_get_log()) {
+        log_error("Полный вывод: %s", exec_get_log());
+    }
+
+    return 1;
+}
+
+int exec_command(char *const argv[], bool verbose) {
+    ExecOptions options = { .log_path = NULL, .timeout = -1, .verbose = verbose };
+    return exec_command_options(argv, &options);
+}
@@ -0,0 +1,31 @@
+/**
+ * boot.h - Загрузочные образы El Torito: BIOS (GRUB) и EFI (раздел FAT)
+ */
+
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Файл образа FAT: путь из имён 8.3 через "/" и содержимое в памяти
+typedef struct {
+    const char *path;
+    const void *data;
+    size_t size;
+} BootFile;
+
+// Образ FAT12/FAT16 в памяти, по размеру файлов и каталогов без
+// запаса; каталоги пути создаются сами. *image освобождает вызывающий
+int boot_fat_image(const BootFile *files, int count, const char *label,
+                   uint8_t **image, size_t *size);
+
+// boot/grub/bios.img и boot/grub/efi.img в дереве isodir. Ядра GRUB
+// собирает grub-mkimage (оба одновременно) со встроенной конфигурацией
+// embed_cfg; раздел EFI пишется из памяти одним вызовом, без mkfs,
+// mtools и loop-устройств. tmpdir — для конфигурации и ядра EFI
+int boot_build_images(const char *isodir, const char *tmpdir, const char *embed_cfg,
+                      bool verbose);
+
+#endif // BOOT_H
@@ -0,0 +1,61 @@
+/**
+ * cache.h - Кэш результатов шагов сборки с адресацией по содержимому
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "hash.h"
+
+// Ключ шага: SHA-256 от всех входных данных шага
+typedef struct {
+    Sha256Ctx ctx;
+} StepKey;
+
+// Кэш шагов сборки. Время последнего использования артефакта — его mtime:
+// обновляется при попадании, по нему вытесняются артефакты сверх лимита
+typedef struct {
+    char dir[256];
+    long long max_bytes;    // 0 — без ограничения
+    bool enabled;
+    int hold_fd;            // блокировка от первого поиска до step_cache_release
+    int hits;
+    int misses;
+} StepCache;
+
+// Построение ключа шага
+void step_key_init(StepKey *key, const char *step_name);
+void step_key_add(StepKey *key, const char *label, const char *value);
+void step_key_add_data(StepKey *key, const char *label, const void *data, size_t size);
+void step_key_final(StepKey *key, char hex[SHA256_HEX_SIZE]);
+
+// Работа с кэшем
+int step_cache_open(StepCache *cache, const char *dir, bool enabled, long long max_bytes);
+bool step_cache_lookup(StepCache *cache, const char *key);
+// Снятие блокировки, взятой step_cache_lookup, после восстановления всех
+// найденных артефактов; отложенное вытеснение выполняется сразу
+void step_cache_release(StepCache *cache);
+int step_cache_store(StepCache *cache, const char *key, const char *source,
+                     const char *step_name, bool verbose);
+int step_cache_restore(StepCache *cache, const char *key, const char *target, bool verbose);
+
+// Контрольные суммы файла-артефакта (образа ISO): хранятся рядом с ним
+// в <ключ>.sums и вытесняются вместе с ним
+int step_cache_store_sums(StepCache *cache, const char *key, const char *source);
+int step_cache_restore_sums(StepCache *cache, const char *key, const char *target);
+void step_cache_print_stats(const StepCache *cache);
+
+// Вытеснение давно не использованных артефактов, пока кэш больше
+// max_bytes (0 — удалить всё). Пока другая сборка удерживает кэш (от
+// поиска до восстановления артефактов), вытеснение пропускается.
+// Возвращает число удалённых
+int step_cache_prune(StepCache *cache, long long max_bytes);
+
+// Метки состояния рабочего каталога: какой ключ сейчас развёрнут в target
+bool step_stamp_matches(const char *stamp_path, const char *key);
+int step_stamp_write(const char *stamp_path, const char *key);
+void step_stamp_clear(const char *stamp_path);
+
+#endif // CACHE_H
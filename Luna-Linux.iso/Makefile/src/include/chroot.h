@@ -0,0 +1,20 @@
+/**
+ * chroot.h - Запуск команд в chroot с собственным пространством имён монтирования
+ */
+
+#ifndef CHROOT_H
+#define CHROOT_H
+
+#include <stdbool.h>
+
+// Дескриптор, через который скрипт передаётся интерпретатору в chroot
+#define CHROOT_SCRIPT_FD 3
+
+// Запуск команды внутри root: /proc, /sys, /dev, /dev/pts и /tmp
+// монтируются только в пространстве имён команды
+int chroot_run(const char *root, char *const argv[], bool verbose);
+
+// Запуск скрипта bash, переданного через канал; name — имя в сообщениях
+int chroot_run_script(const char *root, const char *name, const char *script, bool verbose);
+
+#endif // CHROOT_H
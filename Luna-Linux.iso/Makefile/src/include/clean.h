@@ -0,0 +1,45 @@
+/**
+ * clean.h - Быстрое удаление деревьев каталогов рабочего каталога
+ */
+
+#ifndef CLEAN_H
+#define CLEAN_H
+
+#include <stdbool.h>
+
+// Способ очистки каталога
+typedef enum {
+    CLEAN_BACKGROUND,   // переименование в сторону и удаление в фоновом процессе
+    CLEAN_PARALLEL      // удаление на месте пулом потоков
+} CleanMode;
+
+// Итоги удаления
+typedef struct {
+    unsigned long long files;       // удалено файлов, ссылок и устройств
+    unsigned long long dirs;        // удалено каталогов
+    unsigned long long mounts;      // пропущено точек монтирования
+    unsigned long long errors;      // не удалось удалить
+    double seconds;
+    char first_mount[512];          // первая пропущенная точка монтирования
+} CleanStats;
+
+int clean_parse_mode(const char *name, CleanMode *mode);
+
+// Удаление содержимого path (и самого path, если remove_root) пулом из
+// threads потоков с перехватом работы. Точки монтирования внутри дерева
+// не затрагиваются: ни их содержимое, ни каталоги, в которые они
+// смонтированы. 0 — всё, что можно было удалить, удалено
+int clean_tree(const char *path, bool remove_root, int threads, CleanStats *stats);
+
+// Удаление path целиком в отвязанном фоновом процессе с пониженным
+// приоритетом; сборка продолжается сразу
+int clean_background(const char *path);
+
+// Очистка каталога перед сборкой: после вызова path нет (или он пуст,
+// если сам является точкой монтирования).
+// CLEAN_BACKGROUND переименовывает path рядом (path.trash-*) и удаляет
+// в фоне вместе с остатками прерванных очисток; если переименовать
+// нельзя, удаляет на месте
+int clean_dir(const char *path, CleanMode mode, int threads);
+
+#endif // CLEAN_H
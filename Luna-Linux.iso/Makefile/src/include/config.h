@@ -6,45 +6,122 @@
 #define CONFIG_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
-// Структура конфигурации сборки
+// Участок текста без копирования и без завершающего нуля: указывает в
+// отображённый файл конфигурации или в арену
+typedef struct {
+    const char *data;
+    size_t len;
+} ConfigStr;
+
+// Арена: память выделяется из крупных блоков и освобождается одним вызовом
+typedef struct ConfigArenaBlock ConfigArenaBlock;
+
+typedef struct {
+    ConfigArenaBlock *head;
+} ConfigArena;
+
+// Строка файла "Ключ = значение" в секции [Секция]
+typedef struct {
+    ConfigStr section;
+    ConfigStr key;
+    ConfigStr value;
+    unsigned int line;
+} ConfigEntry;
+
+// Разобранный файл: отображение в память и записи в арене
+typedef struct ConfigFile {
+    char *map;
+    size_t size;
+    ConfigEntry *entries;
+    size_t count;
+    size_t capacity;
+    ConfigArena arena;
+    struct ConfigFile *next;    // следующий загруженный файл конфигурации
+} ConfigFile;
+
+// Список пакетов: участки текста файла конфигурации; массив — в арене
+typedef struct {
+    ConfigStr *items;
+    size_t count;
+} PackageList;
+
+typedef enum {
+    PACKAGES_BASE,
+    PACKAGES_DESKTOP,
+    PACKAGES_INSTALLER,
+    PACKAGES_ADDITIONAL,
+    PACKAGE_LIST_COUNT
+} PackageListId;
+
+// Конфигурация сборки
 typedef struct {
     char distro_name[64];
     char distro_short_name[32];
     char version[16];
     char codename[32];
     char base_distro[32];
-    char base_version[16];
-    char architecture[16];
-
-    // Пути
-    char work_dir[256];
-    char chroot_dir[256];
-    char iso_dir[256];
+    char ubuntu_version[16];
+    char ubuntu_codename[32];
+    char arch[16];
+    char workdir[256];
+    char chroot[256];
+    char imagedir[256];
+    char isodir[256];
     char output_iso[256];
+    char iso_target[256];   // копия потока ISO: устройство или "-"; пусто — нет
+    char cachedir[256];
+    long long cache_max_mb;     // лимит кэша шагов; 0 — без ограничения
+    char layersdir[256];
+    char mirror[256];
+    char components[64];
+    char debcachedir[256];
+    long long debcache_max_mb;
+    PackageList packages[PACKAGE_LIST_COUNT];
+    int verbose;
+    int clean_build;
+    int keep_chroot;
+    int use_cache;
+    int use_layers;
+    int resume_layer;
+    int jobs;
+    int command_timeout;
+    int ram_build;
+    int fused_packaging;
+    char config_file[512];
+    char squashfs_profile[32];
+    char log_level[16];     // уровень вывода в терминал: debug, info, warning, error
+    char clean_mode[16];    // очистка -c: background или parallel
 
-    // Настройки
-    bool verbose;
-    bool clean_build;
-    bool keep_chroot;
-
-    // Пакеты для установки
-    char **base_packages;
-    int base_packages_count;
-    char **desktop_packages;
-    int desktop_packages_count;
-    char **additional_packages;
-    int additional_packages_count;
+    ConfigFile *sources;    // загруженные файлы по порядку; списки пакетов ссылаются в них
+    ConfigArena arena;      // списки пакетов и описания файлов
 } BuildConfig;
 
+// Арена
+void *config_arena_alloc(ConfigArena *arena, size_t size);
+void config_arena_free(ConfigArena *arena);
+
+// Разбор файла за один проход по отображению в память; -1 — файл не
+// открылся. Строки без "=" пропускаются с предупреждением
+int config_file_parse(ConfigFile *file, const char *path);
+void config_file_free(ConfigFile *file);
+
+bool config_str_equals(ConfigStr str, const char *text);
+bool config_str_bool(ConfigStr str);
+
 // Функции работы с конфигурацией
 void config_init(BuildConfig *config);
-void config_load_from_file(BuildConfig *config, const char *filename);
-void config_save_to_file(BuildConfig *config, const char *filename);
+int config_load_from_file(BuildConfig *config, const char *filename);
 void config_print(BuildConfig *config);
 void config_free(BuildConfig *config);
 
-// Утилиты
-char* config_expand_path(const char *path);
+// Пути, производные от рабочего каталога (chroot, image, iso, layers);
+// -1 — рабочий каталог слишком длинный для них
+int config_derive_paths(BuildConfig *config);
+
+// Замена списка пакетов: строка через запятую копируется в арену
+int config_set_packages(BuildConfig *config, PackageListId id, const char *list);
+const char *config_package_list_name(PackageListId id);
 
 #endif // CONFIG_H
@@ -0,0 +1,32 @@
+/**
+ * daemon.h - Служба сборки: очередь запросов через Unix-сокет
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stddef.h>
+
+#define DAEMON_SOCKET "/run/luna-builder.sock"
+#define DAEMON_MAX_ARGS 64
+#define DAEMON_QUEUE_MAX 64
+
+// Разбор запроса в процессе службы: рабочий каталог сборки (сборки
+// с одним каталогом идут по очереди); 0 — параметры верны
+typedef int (*DaemonPrepareFn)(int argc, char *argv[], char *workdir, size_t size);
+
+// Сборка в дочернем процессе службы; код выхода
+typedef int (*DaemonBuildFn)(int argc, char *argv[]);
+
+// Служба: принимает запросы, пока не получит SIGTERM или SIGINT.
+// max_builds — сколько сборок идёт одновременно
+int daemon_serve(const char *socket_path, int max_builds,
+                 DaemonPrepareFn prepare, DaemonBuildFn build);
+
+// Клиент: отправка сборки и вывод её хода; код выхода сборки
+int daemon_submit(const char *socket_path, int priority, int argc, char *argv[]);
+
+// Клиент: очередь и идущие сборки
+int daemon_status(const char *socket_path);
+
+#endif // DAEMON_H
@@ -0,0 +1,52 @@
+/**
+ * debcache.h - Общий кэш пакетов .deb для сборок
+ */
+
+#ifndef DEBCACHE_H
+#define DEBCACHE_H
+
+#include <stdbool.h>
+#include <time.h>
+
+// Файл блокировки транзакций apt: одновременно общий каталог архивов
+// использует только одна сборка
+#define DEBCACHE_DOWNLOAD_LOCK ".download.lock"
+
+// Каталог пакетов внутри chroot
+#define DEBCACHE_CHROOT_DIR "/var/cache/apt/archives"
+
+// Кэш архивов пакетов на хосте, общий для всех сборок и рабочих каталогов.
+// Пока кэш подключён, сборка держит разделяемую блокировку, и вытеснение
+// (исключительная блокировка) его не трогает.
+typedef struct {
+    char dir[256];
+    long long max_bytes;
+    bool enabled;
+
+    int lock_fd;
+    char mountpoint[512];
+    char dpkg_log[512];
+    long dpkg_log_offset;
+    time_t attach_time;
+
+    int hits;
+    int misses;
+    long long downloaded_bytes;
+} DebCache;
+
+// Открытие кэша
+int debcache_open(DebCache *cache, const char *dir, long long max_bytes);
+
+// Подключение к chroot; bind — смонтировать каталог в chroot сразу,
+// иначе монтирование выполняет сама команда (хуки mmdebstrap)
+int debcache_attach(DebCache *cache, const char *chroot, bool bind);
+int debcache_detach(DebCache *cache);
+
+// Разделяемая блокировка кэша без подключения к chroot (предзагрузка):
+// пока она держится, пакеты не вытесняются. Возвращает дескриптор или -1.
+int debcache_hold(const DebCache *cache);
+void debcache_release(int fd);
+
+void debcache_print_stats(const DebCache *cache);
+
+#endif // DEBCACHE_H
@@ -0,0 +1,26 @@
+/**
+ * dedup.h - Поиск одинаковых файлов в chroot и замена их жёсткими ссылками
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+typedef struct {
+    unsigned long long files;           // обычных файлов в дереве
+    unsigned long long bytes_total;     // их объём (каждый inode один раз)
+    unsigned long long bytes_hashed;    // прочитано для сравнения содержимого
+    unsigned long long groups;          // групп одинаковых файлов
+    unsigned long long linked;          // имён заменено жёсткими ссылками
+    unsigned long long bytes_saved;     // объём освободившихся копий
+    double seconds;
+} DedupStats;
+
+// Одинаковыми считаются файлы с тем же содержимым (SHA-256), правами,
+// владельцем и xattr; в каждой группе остаётся один inode. Обходятся
+// только неизменяемые каталоги /usr, без /etc, /var и домашних. threads —
+// потоки хеширования, 0 — все ядра
+int dedup_tree(const char *root, int threads, DedupStats *stats);
+
+void dedup_print_stats(const DedupStats *stats);
+
+#endif // DEDUP_H
@@ -0,0 +1,81 @@
+/**
+ * exec.h - Запуск внешних команд без оболочки
+ */
+
+#ifndef EXEC_H
+#define EXEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "trace.h"
+
+// Вектор аргументов команды; строки и массив принадлежат вектору. Если
+// памяти не хватило, вектор становится пустым и остаётся пустым:
+// exec_run отказывается запускать пустую команду
+typedef struct {
+    char **argv;
+    int argc;
+    int capacity;
+    bool failed;
+} ExecArgs;
+
+// Параметры запуска
+typedef struct {
+    const char *log_path;   // журнал вывода; NULL — журнал текущего шага
+    int timeout;            // секунды, 0 — без ограничения; -1 — по умолчанию
+    bool verbose;           // дублировать вывод команды в терминал
+    int (*setup)(void *);   // подготовка в дочернем процессе перед exec
+    void *setup_arg;
+    const char *title;      // имя команды в сообщениях; NULL — argv[0]
+} ExecOptions;
+
+// Результат выполнения
+typedef struct {
+    pid_t pid;
+    int exit_code;          // код выхода или -1, если процесс не завершился сам
+    int term_signal;        // сигнал, завершивший процесс, или 0
+    bool timed_out;
+    bool spawn_failed;
+    double duration;
+    unsigned long long read_bytes;   // блочный ввод-вывод команды и её потомков
+    unsigned long long write_bytes;
+    TraceUsage usage;       // время ЦП, пиковая память и /proc/<pid>/io
+    char stderr_tail[512];  // последние строки stderr для сообщения об ошибке
+} ExecResult;
+
+// Суммарный блочный ввод-вывод команд, завершённых в текущем потоке
+typedef struct {
+    unsigned long long read_bytes;
+    unsigned long long write_bytes;
+} ExecIo;
+
+// Построение вектора аргументов
+void exec_args_init(ExecArgs *args);
+void exec_args_add(ExecArgs *args, const char *arg);
+void exec_args_addf(ExecArgs *args, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void exec_args_split(ExecArgs *args, const char *words);
+void exec_args_free(ExecArgs *args);
+
+// Журнал и время ожидания по умолчанию; журнал задаётся для каждого
+// рабочего потока отдельно, чтобы у параллельных шагов были свои файлы
+void exec_set_log(const char *path);
+const char *exec_get_log(void);
+void exec_set_default_timeout(int seconds);
+
+// Счётчики ввода-вывода потока: сбрасываются перед шагом, читаются после
+void exec_io_reset(void);
+void exec_io_get(ExecIo *io);
+
+// Запуск: stdout и stderr читаются через poll и пишутся в журнал
+// построчно с метками времени
+int exec_run(char *const argv[], const ExecOptions *options, ExecResult *result);
+
+// Запуск с сообщением об ошибке; 0 — успех
+int exec_command(char *const argv[], bool verbose);
+int exec_command_options(char *const argv[], const ExecOptions *options);
+
+void exec_describe(const ExecResult *result, char *buffer, size_t size);
+
+#endif // EXEC_H
@@ -0,0 +1,61 @@
+/**
+ * hash.h - Хеш-функции для кэширования и проверки целостности
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_HEX_SIZE    (SHA256_DIGEST_SIZE * 2 + 1)
+#define SHA512_DIGEST_SIZE 64
+#define SHA512_HEX_SIZE    (SHA512_DIGEST_SIZE * 2 + 1)
+#define MD5_DIGEST_SIZE    16
+#define MD5_HEX_SIZE       (MD5_DIGEST_SIZE * 2 + 1)
+
+// Контекст SHA-256
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buffer[64];
+    size_t buffer_len;
+} Sha256Ctx;
+
+// Контекст SHA-512
+typedef struct {
+    uint64_t state[8];
+    uint64_t length;
+    uint8_t buffer[128];
+    size_t buffer_len;
+} Sha512Ctx;
+
+// Контекст MD5 (только для md5sum.txt образа: его проверяет casper)
+typedef struct {
+    uint32_t state[4];
+    uint64_t length;
+    uint8_t buffer[64];
+    size_t buffer_len;
+} Md5Ctx;
+
+// Потоковое вычисление SHA-256; на процессорах с SHA-NI блоки
+// обрабатываются инструкциями SHA, выбор — при первом вызове
+void sha256_init(Sha256Ctx *ctx);
+void sha256_update(Sha256Ctx *ctx, const void *data, size_t len);
+void sha256_final(Sha256Ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+void sha512_init(Sha512Ctx *ctx);
+void sha512_update(Sha512Ctx *ctx, const void *data, size_t len);
+void sha512_final(Sha512Ctx *ctx, uint8_t digest[SHA512_DIGEST_SIZE]);
+
+void md5_init(Md5Ctx *ctx);
+void md5_update(Md5Ctx *ctx, const void *data, size_t len);
+void md5_final(Md5Ctx *ctx, uint8_t digest[MD5_DIGEST_SIZE]);
+
+// Утилиты
+void hash_to_hex(const uint8_t *digest, size_t len, char *hex);
+int sha256_file(const char *path, char hex[SHA256_HEX_SIZE]);
+int sha512_file(const char *path, char hex[SHA512_HEX_SIZE]);
+
+#endif // HASH_H
@@ -0,0 +1,50 @@
+/**
+ * iso.h - Запись образа ISO 9660 с Joliet, Rock Ridge, El Torito и
+ *         гибридной разметкой MBR/GPT за один проход
+ */
+
+#ifndef ISO_H
+#define ISO_H
+
+#include "hash.h"
+#include <stdbool.h>
+
+// Формат записи: входит в ключ шага, меняется вместе с раскладкой образа
+#define ISO_FORMAT "iso9660 joliet rockridge eltorito gpt md5sum 2"
+
+// Параметры образа
+typedef struct {
+    const char *volume_id;      // метка тома
+    const char *bios_image;     // образ El Torito для BIOS в дереве; NULL — нет
+    const char *efi_image;      // раздел EFI в дереве; NULL — нет
+    bool hybrid;                // MBR и GPT с разделом EFI для записи на USB
+    const char *md5_list;       // md5sum.txt в корне образа; NULL — не создаётся
+    bool checksums;             // SHA-256 и SHA-512 всего образа
+} IsoOptions;
+
+// Итоги записи
+typedef struct {
+    unsigned long long files;
+    unsigned long long dirs;
+    unsigned long long bytes;   // размер образа
+    double seconds;
+    char sha256[SHA256_HEX_SIZE];   // при checksums
+    char sha512[SHA512_HEX_SIZE];
+} IsoStats;
+
+// Образ дерева isodir в output (заменяется целиком после записи) и
+// одновременно, если target не NULL, в target: блочное устройство
+// (открывается монопольно), файл или "-" — стандартный вывод, захваченный
+// iso_claim_stdout. Раскладка вычисляется по дереву заранее, затем образ
+// пишется по порядку крупными выровненными блоками, данные файлов — без
+// промежуточных копий. Контрольные суммы считаются по тем же блокам в
+// отдельных потоках, пока пишутся следующие: MD5 каждого файла для
+// md5_list (он пишется последним) и SHA всего образа — без чтения его заново
+int iso_write(const char *isodir, const char *output, const char *target,
+              const IsoOptions *options, IsoStats *stats);
+
+// Передача стандартного вывода записи образа ("-"): вывод программы
+// после вызова идёт в stderr. -1 — вывод в терминал или ошибка
+int iso_claim_stdout(void);
+
+#endif // ISO_H
@@ -0,0 +1,46 @@
+/**
+ * layers.h - Слои overlayfs для шагов, изменяющих chroot
+ */
+
+#ifndef LAYERS_H
+#define LAYERS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LAYERS_MAX 32
+
+// Стек слоёв: каждый шаг пишет в свой верхний слой поверх
+// зафиксированных нижних, объединённый вид монтируется в mountpoint
+typedef struct {
+    char root[256];
+    char mountpoint[256];
+    bool mounted;
+} LayerStack;
+
+// Инициализация и пути
+int layers_init(LayerStack *stack, const char *root, const char *mountpoint);
+void layers_path(const LayerStack *stack, int index, const char *part, char *path, size_t size);
+bool layers_exists(const LayerStack *stack, int index);
+
+// Монтирование
+int layers_begin(LayerStack *stack, int index);
+int layers_mount_view(LayerStack *stack);
+
+// Слои с индексом меньше limit только для чтения в отдельной точке
+// монтирования; нижние слои не меняются, пока выше собираются новые
+int layers_mount_snapshot(const LayerStack *stack, int limit, const char *mountpoint);
+int layers_unmount(LayerStack *stack);
+
+// Отбрасывание слоёв (переименование за O(1), удаление в фоне)
+int layers_discard(LayerStack *stack, int index);
+int layers_discard_from(LayerStack *stack, int index);
+
+// Удаление в слоях с индексом от from и выше: whiteout или непрозрачный
+// каталог overlayfs. true — найдено, путь первого в found
+bool layers_find_deletion(const LayerStack *stack, int from, char *found, size_t size);
+
+// Слой index берётся из стека source по ссылке, без копирования
+int layers_share(LayerStack *stack, int index, const LayerStack *source);
+
+#endif // LAYERS_H
@@ -0,0 +1,66 @@
+/**
+ * log.h - Журнал сборки: кольцевой буфер и фоновый поток вывода
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+    LOG_DEBUG,
+    LOG_OUTPUT,         // строка вывода команды
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR,
+    LOG_LEVEL_COUNT
+} LogLevel;
+
+// Приёмники записи
+typedef enum {
+    LOG_SINK_TERMINAL,
+    LOG_SINK_FILE,
+    LOG_SINK_COUNT
+} LogSink;
+
+// Счётчики с запуска журнала
+typedef struct {
+    unsigned long long written[LOG_LEVEL_COUNT];
+    unsigned long long dropped[LOG_LEVEL_COUNT];    // буфер был заполнен
+    unsigned long long truncated;                   // строка длиннее записи
+    unsigned long long waits;                       // ожидания места для важных записей
+    size_t peak;                                    // наибольшая занятость буфера
+    size_t capacity;
+} LogStats;
+
+// Запуск фонового потока. path — сжатый журнал сборки (.log.gz) или NULL.
+// До запуска и после остановки записи выводятся сразу в вызывающем потоке
+int log_start(const char *path);
+void log_stop(void);
+
+// Ожидание вывода всего, что записано до вызова
+void log_flush(void);
+
+// Уровни фильтрации приёмников; меняются в любой момент
+void log_set_level(LogSink sink, LogLevel level);
+LogLevel log_get_level(LogSink sink);
+int log_parse_level(const char *name, LogLevel *level);
+const char *log_level_name(LogLevel level);
+
+// Записи с меткой шага текущего потока (trace_current_step)
+void log_info(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void log_warning(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void log_error(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void log_debug(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// Заголовок шага сборки: уровень info, в терминале — без метки уровня
+void log_step(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// Строка вывода команды; в терминал — только если terminal
+void log_output(const char *command, bool is_stderr, bool terminal,
+                const char *line, size_t len);
+
+void log_get_stats(LogStats *stats);
+
+#endif // LOG_H
@@ -0,0 +1,43 @@
+/**
+ * packages.h - Планировщик установки пакетов в chroot
+ */
+
+#ifndef PACKAGES_H
+#define PACKAGES_H
+
+#include <stddef.h>
+
+#define PACKAGES_MAX 8192
+
+// Имя пакета без копирования: участок списка из конфигурации
+typedef struct {
+    const char *name;
+    size_t len;
+} PackageName;
+
+// Объединение списков пакетов без повторов, в порядке первого упоминания.
+// Имена указывают в списки, которые должны жить дольше набора
+typedef struct {
+    PackageName *names;
+    int count;
+    int capacity;
+} PackageSet;
+
+// Построение объединения
+void package_set_init(PackageSet *set);
+int package_set_add(PackageSet *set, const char *name, size_t len);
+int package_set_add_list(PackageSet *set, const char *list);
+void package_set_free(PackageSet *set);
+
+// Размер буфера для скрипта установки набора
+size_t package_set_script_size(const PackageSet *set);
+
+// Скрипт одной транзакции apt: одно обновление индексов, одно
+// разрешение зависимостей и один запуск dpkg для всего набора.
+// download_lock — файл блокировки общего кэша пакетов внутри chroot
+// (NULL, если кэш не подключён): транзакция идёт под этой блокировкой,
+// собственные блокировки apt и dpkg остаются в силе.
+int package_set_install_script(const PackageSet *set, const char *download_lock,
+                               char *script, size_t size);
+
+#endif // PACKAGES_H
@@ -0,0 +1,48 @@
+/**
+ * prefetch.h - Предварительная загрузка пакетов в общий кэш
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdbool.h>
+#include "hash.h"
+#include "packages.h"
+
+#define PREFETCH_CONNECTIONS 4
+
+// Пакет к загрузке: адрес, имя файла в кэше, размер и SHA-256 из индекса
+typedef struct {
+    char url[512];
+    char filename[256];
+    long long size;
+    char sha256[SHA256_HEX_SIZE];
+} PrefetchItem;
+
+// Параметры и итоги предзагрузки
+typedef struct {
+    char statedir[512];     // состояние apt на хосте (индексы, sources.list)
+    char mirror[256];       // http:// или file:// зеркало
+    char codename[32];
+    char components[128];   // через запятую, как у mmdebstrap
+    char arch[16];
+    char destdir[256];      // каталог кэша пакетов
+    int connections;
+    bool verbose;
+
+    int fetched;
+    int present;
+    int failed;
+    long long bytes;
+} Prefetch;
+
+// -1 — параметр не помещается в поле структуры
+int prefetch_init(Prefetch *pf, const char *statedir, const char *mirror,
+                  const char *codename, const char *components, const char *arch,
+                  const char *destdir);
+
+// Загрузка всех пакетов, нужных для установки набора, в destdir.
+// Ошибки загрузки отдельных пакетов не фатальны: их докачает apt.
+int prefetch_run(Prefetch *pf, const PackageSet *set);
+
+#endif // PREFETCH_H
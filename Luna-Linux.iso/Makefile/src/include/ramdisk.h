@@ -0,0 +1,45 @@
+/**
+ * ramdisk.h - Сборка в оперативной памяти (tmpfs) с переносом на диск
+ */
+
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Области рабочего каталога в порядке приоритета размещения в памяти
+typedef enum {
+    RAM_AREA_CHROOT,    // chroot и слои overlayfs: основная часть записи dpkg
+    RAM_AREA_IMAGE,     // ядро, initrd и filesystem.squashfs
+    RAM_AREA_ISO,       // дерево каталогов ISO
+    RAM_AREA_COUNT
+} RamArea;
+
+typedef struct {
+    char mountpoint[256];
+    char usage_path[512];               // фактический объём прошлой сборки
+    unsigned long long estimate[RAM_AREA_COUNT];
+    bool in_ram[RAM_AREA_COUNT];
+    unsigned long long available;       // MemAvailable за вычетом запаса
+    unsigned long long size;            // предел tmpfs
+    bool mounted;
+} RamDisk;
+
+// Оценка объёма областей и решение, какие из них помещаются в память
+int ramdisk_plan(RamDisk *disk, const char *workdir);
+
+// Монтирование и размонтирование tmpfs
+int ramdisk_mount(RamDisk *disk);
+int ramdisk_unmount(RamDisk *disk);
+
+// Путь внутри tmpfs для области
+void ramdisk_path(const RamDisk *disk, const char *name, char *path, size_t size);
+
+// Занятый объём tmpfs в байтах
+unsigned long long ramdisk_used(const RamDisk *disk);
+
+// Сохранение фактического объёма областей для оценки следующей сборки
+void ramdisk_record_usage(const RamDisk *disk, const char *const paths[RAM_AREA_COUNT]);
+
+#endif // RAMDISK_H
@@ -0,0 +1,62 @@
+/**
+ * scheduler.h - Планировщик шагов сборки по графу зависимостей
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#define SCHED_MAX_NODES 32
+#define SCHED_MAX_DEPS  8
+
+// Состояние узла графа
+typedef enum {
+    SCHED_PENDING,
+    SCHED_RUNNING,
+    SCHED_DONE,
+    SCHED_SKIPPED,
+    SCHED_FAILED,
+    SCHED_CANCELLED
+} SchedState;
+
+// Узел графа: шаг сборки и его зависимости
+typedef struct {
+    const char *name;
+    int deps[SCHED_MAX_DEPS];
+    int dep_count;
+    SchedState state;
+    double start_time;
+    double end_time;
+} SchedNode;
+
+// Функция выполнения узла: 0 — успех
+typedef int (*SchedRunFn)(void *ctx, int index);
+
+// Планировщик с пулом рабочих потоков
+typedef struct {
+    SchedNode nodes[SCHED_MAX_NODES];
+    int count;
+    int workers;
+    SchedRunFn run;
+    void *ctx;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running;
+    int failed;
+    bool stop;
+    bool live;
+    double start_time;
+} Scheduler;
+
+// Построение графа
+void sched_init(Scheduler *sched, int workers, SchedRunFn run, void *ctx);
+int sched_add(Scheduler *sched, const char *name, const int *deps, int dep_count, bool skip);
+
+// Выполнение: независимые узлы идут параллельно, первый сбой отменяет остальные
+int sched_run(Scheduler *sched);
+void sched_print_summary(Scheduler *sched);
+
+#endif // SCHEDULER_H
@@ -0,0 +1,70 @@
+/**
+ * sqfs.h - Встроенная многопоточная запись образов squashfs
+ */
+
+#ifndef SQFS_H
+#define SQFS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SQFS_MAX_THREADS 64
+
+// Идентификаторы алгоритмов сжатия в суперблоке squashfs
+typedef enum {
+    SQFS_COMP_GZIP = 1,
+    SQFS_COMP_XZ = 4
+} SqfsCompressor;
+
+typedef struct {
+    SqfsCompressor compressor;
+    int level;              // gzip: 1..9; xz: пресет 0..9
+    bool extreme;           // xz: LZMA_PRESET_EXTREME
+    bool x86_filter;        // xz: фильтр BCJ x86 для машинного кода
+    bool uncompressed;      // данные и метаданные хранятся без сжатия
+    uint32_t block_size;
+    int threads;            // потоки сжатия; 0 — все ядра
+    uint32_t mtime;         // время создания в суперблоке
+} SqfsOptions;
+
+// Итоги записи образа
+typedef struct {
+    unsigned long long files;           // файлов с данными в образе
+    unsigned long long reused_files;    // из них сжаты заранее
+    unsigned long long bytes_in;        // прочитано данных файлов
+    unsigned long long bytes_out;       // размер образа
+    unsigned long long wasted_bytes;    // заранее сжатые данные, не вошедшие в образ
+    unsigned long long copied_files;    // взяты из прошлого образа без сжатия
+    unsigned long long copied_bytes;    // сжатых данных скопировано из прошлого образа
+    unsigned long long hashed_bytes;    // прочитано для сравнения содержимого
+    unsigned int inodes;
+    unsigned int fragments;
+} SqfsStats;
+
+typedef struct SqfsWriter SqfsWriter;
+
+// Параметры из строки профиля mksquashfs (-comp, -b, -Xcompression-level,
+// -Xpreset, -Xe, -Xbcj, -noI/-noD/-noF); -1 — сочетание не поддерживается
+int sqfs_options_parse(SqfsOptions *options, const char *profile_options, int threads);
+
+// Создание образа: файл усекается, данные пишутся потоком по мере сжатия
+SqfsWriter *sqfs_writer_open(const SqfsOptions *options, const char *path);
+
+// Инкрементальная сборка: при завершении в manifest_path пишется
+// манифест образа. Если манифест описывает image_path и параметры сжатия
+// те же, сжатые данные неизменных файлов копируются из него. Вызывается
+// до первого прохода; 0 — прошлый образ будет использован
+int sqfs_writer_set_base(SqfsWriter *writer, const char *manifest_path, const char *image_path);
+
+// Предварительное сжатие данных файлов дерева, пока следующие шаги ещё
+// меняют chroot; в итоговом проходе неизменённые файлы не читаются снова
+int sqfs_writer_prefill(SqfsWriter *writer, const char *root);
+
+// Итоговый проход: данные новых и изменённых файлов, таблицы inode и
+// каталогов, фрагменты, идентификаторы, xattr и суперблок
+int sqfs_writer_finish(SqfsWriter *writer, const char *root);
+
+void sqfs_writer_stats(const SqfsWriter *writer, SqfsStats *stats);
+void sqfs_writer_close(SqfsWriter *writer);
+
+#endif // SQFS_H
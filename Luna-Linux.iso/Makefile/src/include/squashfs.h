@@ -0,0 +1,58 @@
+/**
+ * squashfs.h - Профили сжатия squashfs и их сравнение
+ */
+
+#ifndef SQUASHFS_H
+#define SQUASHFS_H
+
+#include <stdbool.h>
+#include "config.h"
+#include "exec.h"
+#include "sqfs.h"
+
+#define SQUASHFS_PROFILES_MAX 16
+#define SQUASHFS_DEFAULT_PROFILE "release-xz"
+
+// Именованный набор параметров mksquashfs
+typedef struct {
+    char name[32];
+    char options[256];
+} SquashProfile;
+
+typedef struct {
+    SquashProfile profiles[SQUASHFS_PROFILES_MAX];
+    int count;
+    int selected;
+    int threads;        // потоки сжатия; 0 — все ядра
+    bool native;        // встроенная запись образа вместо mksquashfs
+    bool incremental;   // копировать сжатые данные неизменных файлов из прошлого образа
+    bool dedup;         // заменять одинаковые файлы chroot жёсткими ссылками
+} SquashSettings;
+
+// Встроенные профили; выбран SQUASHFS_DEFAULT_PROFILE
+void squashfs_settings_init(SquashSettings *settings);
+
+// Секция [Squashfs] файла luna.conf: Profile, Threads, Writer,
+// Incremental, Dedup и Profile.<имя>
+int squashfs_settings_load(SquashSettings *settings, const char *conf_path);
+int squashfs_settings_apply(SquashSettings *settings, const ConfigFile *file);
+
+// Выбор профиля по имени
+int squashfs_select(SquashSettings *settings, const char *name);
+const SquashProfile *squashfs_profile(const SquashSettings *settings);
+
+// Параметры встроенной записи для выбранного профиля; false — профиль
+// собирается через mksquashfs (Writer = mksquashfs или zstd/lz4)
+bool squashfs_native_options(const SquashSettings *settings, SqfsOptions *options);
+
+// Команда mksquashfs для профиля
+void squashfs_args(const SquashSettings *settings, const SquashProfile *profile,
+                   const char *source, const char *target, ExecArgs *args);
+
+// Сравнение всех профилей на выборке из root объёмом sample_mb:
+// скорость сжатия и распаковки и степень сжатия для mksquashfs и
+// встроенной записи (для профилей, которые она поддерживает)
+int squashfs_benchmark(const SquashSettings *settings, const char *root,
+                       const char *workdir, int sample_mb, bool verbose);
+
+#endif // SQUASHFS_H
@@ -0,0 +1,36 @@
+/**
+ * stage.h - Размещение больших файлов без копирования данных
+ */
+
+#ifndef STAGE_H
+#define STAGE_H
+
+// Способ, которым файл оказался на месте
+typedef enum {
+    STAGE_HARDLINK,     // жёсткая ссылка в той же файловой системе
+    STAGE_RENAME,       // переименование в той же файловой системе
+    STAGE_REFLINK,      // общие экстенты (FICLONE: btrfs, xfs)
+    STAGE_COPY_RANGE,   // copy_file_range: копирование внутри ядра
+    STAGE_BUFFER        // чтение и запись через буфер
+} StageMethod;
+
+// Флаги размещения
+#define STAGE_MOVE    0x1   // источник больше не нужен
+#define STAGE_COPY    0x2   // нужна независимая копия, ссылки не подходят
+
+typedef struct {
+    StageMethod method;
+    unsigned long long bytes;
+    double seconds;
+} StageResult;
+
+// Размещение src в dst самым дешёвым доступным способом; dst
+// заменяется, права доступа берутся у src
+int stage_file(const char *src, const char *dst, int flags, StageResult *result);
+
+const char *stage_method_name(StageMethod method);
+
+// Строка журнала: путь, способ, объём и время
+void stage_report(const char *dst, const StageResult *result);
+
+#endif // STAGE_H
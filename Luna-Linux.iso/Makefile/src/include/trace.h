@@ -0,0 +1,58 @@
+/**
+ * trace.h - Трассировка шагов сборки и запущенных команд
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define TRACE_MAX_STEPS 32
+
+// Счётчики /proc/<pid>/io
+typedef struct {
+    unsigned long long rchar;           // байт передано вызовами read и аналогами
+    unsigned long long wchar;           // байт передано вызовами write и аналогами
+    unsigned long long read_bytes;      // прочитано с блочных устройств
+    unsigned long long write_bytes;     // записано на блочные устройства
+} TraceIo;
+
+// Ресурсы интервала: процесса команды или шага целиком
+typedef struct {
+    double user_time;
+    double sys_time;
+    long max_rss_kb;
+    TraceIo io;
+} TraceUsage;
+
+// Начало отсчёта времени трассы и пустая трасса; до вызова трассировка выключена
+void trace_init(void);
+bool trace_enabled(void);
+
+// Шаг, к которому относится работа текущего потока; -1 — вне шагов
+int trace_current_step(void);
+
+// Интервал шага в потоке планировщика. cached — результат взят из кэша
+void trace_step_begin(int step, const char *name, bool cached);
+void trace_step_end(int step, int status);
+
+// Вспомогательные потоки шага (пулы сжатия, хеширования) вызывают
+// trace_thread_end перед выходом: их время ЦП и ввод-вывод добавляются к шагу
+void trace_thread_begin(int step);
+void trace_thread_end(void);
+
+// Завершённая команда шага текущего потока
+void trace_command(const char *name, const char *command_line, double start, double end,
+                   int status, const TraceUsage *usage);
+
+// Чтение /proc/<pid>/io; pid 0 — текущий поток. -1 — нет данных
+int trace_read_io(pid_t pid, TraceIo *io);
+
+// Файл в формате Chrome Trace Event (chrome://tracing, ui.perfetto.dev)
+int trace_write_json(const char *path);
+
+// Таблица ресурсов по шагам и самые долгие команды
+void trace_print_summary(void);
+
+#endif // TRACE_H
@@ -6,30 +6,36 @@
 #define UTILS_H
 
 #include <stdbool.h>
+#include <sys/types.h>
+#include "log.h"
+
+struct rusage;
 
 // Выполнение команды с выводом
 int execute_cmd(const char *cmd, bool verbose);
 int execute_cmd_chroot(const char *chroot, const char *cmd, bool verbose);
+void terminate_running_processes(void);
 
 // Работа с файлами
 bool file_exists(const char *path);
 bool dir_exists(const char *path);
+int make_dirs(const char *path);
 int copy_file(const char *src, const char *dst);
 int write_to_file(const char *path, const char *content);
 char* read_file(const char *path);
 
 // Работа с процессами
-pid_t spawn_process(const char *cmd, int *stdin_fd, int *stdout_fd, int *stderr_fd);
-int wait_process(pid_t pid);
+pid_t spawn_process(char *const argv[], int *stdin_fd, int *stdout_fd, int *stderr_fd);
+pid_t spawn_process_setup(char *const argv[], int (*setup)(void *), void *arg,
+                          int *stdin_fd, int *stdout_fd, int *stderr_fd);
+int wait_process(pid_t pid, int *status, struct rusage *usage);
+int try_wait_process(pid_t pid, int *status, struct rusage *usage);
 
-// Логирование
-void log_info(const char *format, ...);
-void log_warning(const char *format, ...);
-void log_error(const char *format, ...);
-void log_debug(const char *format, ...);
+// Вывод строки с дополнением до width символов (UTF-8)
+void print_padded(const char *text, int width);
 
 // Проверка зависимостей
 bool check_dependency(const char *cmd);
-bool check_all_dependencies();
+bool check_all_dependencies(bool need_mksquashfs);
 
 #endif // UTILS_H
@@ -0,0 +1,1717 @@
+/**
+ * iso.c - Запись образа ISO за один проход
+ *
+ * Сначала дерево isodir читается целиком (только метаданные) и
+ * раскладывается по блокам: системная область с MBR и GPT, дескрипторы
+ * томов, каталог загрузки El Torito, таблицы путей и каталоги двух
+ * деревьев (ISO 9660 с Rock Ridge и Joliet), продолжения записей Rock
+ * Ridge, затем данные файлов и копия GPT в конце. После этого образ
+ * пишется строго по порядку через один выровненный буфер: метаданные
+ * формируются в нём, данные файлов читаются прямо в него. Поэтому
+ * приёмником может быть не только файл, но и устройство или канал.
+ *
+ * Контрольные суммы считаются по ходу записи: заполненный блок буфера
+ * уходит в приёмники и отдаётся потокам хеширования (SHA-256, SHA-512
+ * всего образа и MD5 файлов по их раскладке), а запись продолжается в
+ * следующий блок кольца. md5sum.txt стоит в раскладке последним: к нему
+ * MD5 всех остальных файлов уже известны.
+ *
+ * Файлы больше 4 GB записываются несколькими экстентами (ISO 9660
+ * уровня 3). Глубина каталогов не ограничивается восемью уровнями:
+ * Linux и GRUB читают такие образы, а дерево LiveCD неглубокое.
+ */
+
+#define _GNU_SOURCE
+
+#include "iso.h"
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <linux/fs.h>
+#include <zlib.h>
+
+#define ISO_BLOCK 2048
+#define ISO_BUFFER (4 << 20)                // блок буфера записи, кратен блоку ISO
+#define ISO_SLOTS 4                         // блоков в кольце записи и хеширования
+#define ISO_EXTENT_MAX 0xfffff800ULL        // наибольший экстент файла
+#define ISO_NAME_MAX 30                     // имя файла ISO 9660 без ";1"
+#define ISO_EXT_MAX 8
+#define JOLIET_NAME_MAX 64
+#define SYSTEM_BLOCKS 16
+#define GPT_ENTRIES 128
+#define GPT_TAIL_BLOCKS 9                   // копия таблицы (32 сектора) и заголовка
+
+typedef struct IsoNode IsoNode;
+
+struct IsoNode {
+    char *name;                     // имя в дереве (Rock Ridge)
+    char iso_name[ISO_NAME_MAX + 3];
+    uint16_t joliet[JOLIET_NAME_MAX];
+    int joliet_len;
+    char *source;
+    char *link;                     // цель символической ссылки
+    struct stat st;
+    IsoNode *parent;
+    IsoNode **children;             // по порядку имён ISO 9660
+    IsoNode **jchildren;            // по порядку имён Joliet
+    int count;
+    int capacity;
+    int subdirs;
+    int number;                     // номер в таблице путей ISO 9660
+    int jnumber;                    // и Joliet
+    uint32_t extent;                // блок каталога ISO 9660 или данных файла
+    uint32_t jextent;               // блок каталога Joliet
+    uint32_t size;                  // размер каталога ISO 9660 в байтах
+    uint32_t jsize;
+    uint32_t ce_offset;             // продолжение записи Rock Ridge
+    uint32_t ce_length;
+    uint8_t *data;                  // содержимое в памяти (образ BIOS)
+    uint8_t md5[MD5_DIGEST_SIZE];
+};
+
+// Блок кольца: пишется в приёмники, затем читается потоками хеширования
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    unsigned long long position;    // смещение в образе
+    int pending;                    // потоки хеширования, ещё не прочитавшие блок
+} IsoSlot;
+
+typedef enum {
+    DIGEST_SHA256,
+    DIGEST_SHA512,
+    DIGEST_MD5
+} DigestKind;
+
+typedef struct IsoWriter IsoWriter;
+
+typedef struct {
+    IsoWriter *w;
+    DigestKind kind;
+    int step;
+    pthread_t thread;
+    Sha256Ctx sha256;
+    Sha512Ctx sha512;
+    Md5Ctx md5;
+    int file;                       // MD5: текущий файл в порядке данных
+} IsoDigest;
+
+struct IsoWriter {
+    const IsoOptions *options;
+    IsoNode *root;
+    IsoNode **dirs;                 // каталоги в порядке таблицы путей ISO 9660
+    IsoNode **jdirs;                // и Joliet
+    IsoNode **files;                // файлы в порядке данных
+    int dir_count;
+    int file_count;
+    IsoNode *bios;
+    IsoNode *efi;
+    IsoNode *md5_list;              // создаётся при записи, последний в данных
+    size_t isodir_len;
+    time_t now;
+
+    // Продолжения записей Rock Ridge
+    uint8_t *ce;
+    size_t ce_size;
+    size_t ce_capacity;
+    uint32_t er_offset;
+    uint32_t er_length;
+
+    // Раскладка, блоки
+    uint32_t path_size;
+    uint32_t jpath_size;
+    uint32_t lba_catalog;
+    uint32_t lba_path_l;
+    uint32_t lba_path_m;
+    uint32_t lba_jpath_l;
+    uint32_t lba_jpath_m;
+    uint32_t lba_ce;
+    uint32_t lba_files;
+    uint32_t lba_end;               // конец данных
+    uint32_t total;
+
+    // Запись
+    IsoSlot slots[ISO_SLOTS];
+    int slot;                       // заполняемый блок кольца
+    uint8_t *buffer;                // его данные
+    size_t used;
+    unsigned long long slot_start;  // смещение заполняемого блока в образе
+    int fds[2];
+    int fd_count;
+    unsigned long long position;
+    uint8_t disk_guid[16];
+    uint8_t part_guid[16];
+
+    // Хеширование
+    IsoDigest digests[3];
+    int digest_count;
+    unsigned long long submitted;   // блоков отдано потокам хеширования
+    bool finished;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+typedef enum {
+    RECORD_SELF,
+    RECORD_PARENT,
+    RECORD_CHILD
+} RecordKind;
+
+static int stdout_fd = -1;
+
+// Числа в обоих порядках байт, как требует ISO 9660
+
+static void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_be16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    put_be16(p, v >> 16);
+    put_be16(p + 2, v);
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+static void put_both16(uint8_t *p, uint16_t v) {
+    put_le16(p, v);
+    put_be16(p + 2, v);
+}
+
+static void put_both32(uint8_t *p, uint32_t v) {
+    put_le32(p, v);
+    put_be32(p + 4, v);
+}
+
+static uint32_t blocks(uint64_t bytes) {
+    return (bytes + ISO_BLOCK - 1) / ISO_BLOCK;
+}
+
+// Дата записи каталога: 7 байт, время UTC
+static void put_record_time(uint8_t *p, time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    p[0] = tm.tm_year;
+    p[1] = tm.tm_mon + 1;
+    p[2] = tm.tm_mday;
+    p[3] = tm.tm_hour;
+    p[4] = tm.tm_min;
+    p[5] = tm.tm_sec;
+    p[6] = 0;
+}
+
+// Дата дескриптора тома: 17 байт, цифры и смещение пояса. Год вне
+// 0000..9999 не помещается в 16 цифр — такая дата пишется как не указанная
+static void put_volume_time(uint8_t *p, time_t t) {
+    struct tm tm;
+    char text[32];
+    int len = 0;
+    if (t != 0 && gmtime_r(&t, &tm) && tm.tm_year >= -1900 && tm.tm_year <= 9999 - 1900) {
+        len = snprintf(text, sizeof(text), "%04d%02d%02d%02d%02d%02d00", tm.tm_year + 1900,
+                       tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    }
+    if (len == 16) {
+        memcpy(p, text, 16);
+    } else {
+        memset(p, '0', 16);
+    }
+    p[16] = 0;
+}
+
+// Имена
+
+static char d_char(unsigned char c) {
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 'A';
+    }
+    if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        return c;
+    }
+    return '_';
+}
+
+// Идентификатор ISO 9660 без версии; number > 0 заменяет конец основы
+// числом, чтобы развести совпавшие после замены символов имена
+static void iso_ident(const IsoNode *node, int number, char *out) {
+    const char *name = node->name;
+    const char *dot = S_ISDIR(node->st.st_mode) ? NULL : strrchr(name, '.');
+    if (dot == name) {
+        dot = NULL;
+    }
+
+    size_t base_len = dot ? (size_t)(dot - name) : strlen(name);
+    size_t ext_len = dot ? strlen(dot + 1) : 0;
+    if (ext_len > ISO_EXT_MAX) {
+        ext_len = ISO_EXT_MAX;
+    }
+    size_t base_max = S_ISDIR(node->st.st_mode) ? ISO_NAME_MAX + 1
+                                                : ISO_NAME_MAX - (dot ? ext_len + 1 : 0);
+    if (base_len > base_max) {
+        base_len = base_max;
+    }
+
+    size_t len = 0;
+    for (size_t i = 0; i < base_len; i++) {
+        out[len++] = d_char(name[i]);
+    }
+    if (number > 0) {
+        char digits[8];
+        int n = snprintf(digits, sizeof(digits), "%03d", number);
+        len = len + n > base_max ? base_max - n : len;
+        memcpy(out + len, digits, n);
+        len += n;
+    }
+    if (dot) {
+        out[len++] = '.';
+        for (size_t i = 0; i < ext_len; i++) {
+            out[len++] = d_char(dot[1 + i]);
+        }
+    }
+    out[len] = '\0';
+}
+
+// Имя Joliet: UCS-2 из UTF-8, не больше 64 знаков
+static void joliet_ident(IsoNode *node) {
+    const unsigned char *p = (const unsigned char *)node->name;
+    int len = 0;
+    while (*p && len < JOLIET_NAME_MAX) {
+        uint32_t c = *p++;
+        int extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+        if (extra) {
+            c &= 0x3f >> extra;
+        }
+        for (; extra > 0 && (*p & 0xc0) == 0x80; extra--) {
+            c = (c << 6) | (*p++ & 0x3f);
+        }
+        if (c > 0xffff || c < 0x20 || strchr("*/:;?\\", (int)c)) {
+            c = '_';
+        }
+        node->joliet[len++] = c;
+    }
+    node->joliet_len = len;
+}
+
+static int compare_iso(const void *a, const void *b) {
+    return strcmp((*(IsoNode *const *)a)->iso_name, (*(IsoNode *const *)b)->iso_name);
+}
+
+static int compare_joliet(const void *a, const void *b) {
+    const IsoNode *x = *(IsoNode *const *)a, *y = *(IsoNode *const *)b;
+    for (int i = 0; i < x->joliet_len && i < y->joliet_len; i++) {
+        if (x->joliet[i] != y->joliet[i]) {
+            return x->joliet[i] < y->joliet[i] ? -1 : 1;
+        }
+    }
+    return x->joliet_len - y->joliet_len;
+}
+
+static void name_children(IsoNode *dir) {
+    for (int i = 0; i < dir->count; i++) {
+        IsoNode *child = dir->children[i];
+        joliet_ident(child);
+        for (int number = 0; number < 1000; number++) {
+            iso_ident(child, number, child->iso_name);
+            if (!S_ISDIR(child->st.st_mode)) {
+                strcat(child->iso_name, ";1");
+            }
+            bool taken = false;
+            for (int j = 0; j < i && !taken; j++) {
+                taken = strcmp(dir->children[j]->iso_name, child->iso_name) == 0;
+            }
+            if (!taken) {
+                break;
+            }
+        }
+    }
+
+    memcpy(dir->jchildren, dir->children, dir->count * sizeof(IsoNode *));
+    qsort(dir->children, dir->count, sizeof(IsoNode *), compare_iso);
+    qsort(dir->jchildren, dir->count, sizeof(IsoNode *), compare_joliet);
+}
+
+// Чтение дерева
+
+static void free_node(IsoNode *node) {
+    for (int i = 0; i < node->count; i++) {
+        free_node(node->children[i]);
+    }
+    free(node->children);
+    free(node->jchildren);
+    free(node->name);
+    free(node->source);
+    free(node->link);
+    free(node->data);
+    free(node);
+}
+
+static IsoNode *scan_node(const char *path, const char *name, IsoNode *parent) {
+    IsoNode *node = calloc(1, sizeof(IsoNode));
+    if (!node || !(node->name = strdup(name)) || !(node->source = strdup(path))) {
+        free(node ? node->name : NULL);
+        free(node);
+        return NULL;
+    }
+    node->parent = parent;
+
+    if (lstat(path, &node->st) != 0) {
+        log_error("Не удалось прочитать %s: %s", path, strerror(errno));
+        free_node(node);
+        return NULL;
+    }
+
+    if (S_ISLNK(node->st.st_mode)) {
+        char target[4096];
+        ssize_t len = readlink(path, target, sizeof(target) - 1);
+        if (len < 0) {
+            free_node(node);
+            return NULL;
+        }
+        target[len] = '\0';
+        node->link = strdup(target);
+        return node->link ? node : (free_node(node), NULL);
+    }
+    if (!S_ISDIR(node->st.st_mode)) {
+        return node;
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        log_error("Не удалось открыть каталог %s: %s", path, strerror(errno));
+        free_node(node);
+        return NULL;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char child_path[4096];
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, entry->d_name);
+        IsoNode *child = scan_node(child_path, entry->d_name, node);
+        if (!child) {
+            closedir(dir);
+            free_node(node);
+            return NULL;
+        }
+
+        mode_t mode = child->st.st_mode;
+        if (!S_ISREG(mode) && !S_ISDIR(mode) && !S_ISLNK(mode)) {
+            log_warning("В ISO не записывается %s: не файл, не каталог и не ссылка", child_path);
+            free_node(child);
+            continue;
+        }
+
+        if (node->count == node->capacity) {
+            int capacity = node->capacity ? node->capacity * 2 : 8;
+            IsoNode **children = realloc(node->children, capacity * sizeof(IsoNode *));
+            if (!children) {
+                free_node(child);
+                closedir(dir);
+                free_node(node);
+                return NULL;
+            }
+            node->children = children;
+            node->capacity = capacity;
+        }
+        node->children[node->count++] = child;
+        node->subdirs += S_ISDIR(mode);
+    }
+    closedir(dir);
+
+    node->jchildren = malloc((node->count ? node->count : 1) * sizeof(IsoNode *));
+    if (!node->jchildren) {
+        free_node(node);
+        return NULL;
+    }
+    name_children(node);
+    return node;
+}
+
+static IsoNode *find_node(IsoNode *root, const char *path) {
+    IsoNode *node = root;
+    while (node && *path) {
+        const char *slash = strchr(path, '/');
+        size_t len = slash ? (size_t)(slash - path) : strlen(path);
+        IsoNode *next = NULL;
+        for (int i = 0; i < node->count && !next; i++) {
+            if (strlen(node->children[i]->name) == len &&
+                memcmp(node->children[i]->name, path, len) == 0) {
+                next = node->children[i];
+            }
+        }
+        node = next;
+        path = slash ? slash + 1 : path + len;
+    }
+    return node;
+}
+
+// Файл корня, содержимое которого формируется при записи. Оставшийся от
+// прошлой сборки файл с тем же именем заменяется
+static IsoNode *generated_node(IsoWriter *w, const char *isodir, const char *name) {
+    IsoNode *root = w->root;
+    IsoNode *node = find_node(root, name);
+    if (node) {
+        if (!S_ISREG(node->st.st_mode)) {
+            log_error("%s/%s должен быть обычным файлом", isodir, name);
+            return NULL;
+        }
+        return node;
+    }
+
+    if (root->count == root->capacity) {
+        int capacity = root->capacity ? root->capacity * 2 : 8;
+        IsoNode **children = realloc(root->children, capacity * sizeof(IsoNode *));
+        if (!children) {
+            return NULL;
+        }
+        root->children = children;
+        root->capacity = capacity;
+    }
+    IsoNode **jchildren = realloc(root->jchildren, (root->count + 1) * sizeof(IsoNode *));
+    if (!jchildren) {
+        return NULL;
+    }
+    root->jchildren = jchildren;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", isodir, name);
+    node = calloc(1, sizeof(IsoNode));
+    if (!node || !(node->name = strdup(name)) || !(node->source = strdup(path))) {
+        free(node ? node->name : NULL);
+        free(node);
+        return NULL;
+    }
+    node->parent = root;
+    node->st.st_mode = S_IFREG | 0444;
+    node->st.st_nlink = 1;
+    node->st.st_atime = node->st.st_mtime = node->st.st_ctime = w->now;
+    root->children[root->count++] = node;
+    name_children(root);
+    return node;
+}
+
+// Rock Ridge
+
+// Место в области продолжений; записи не пересекают границу блока
+static int ce_alloc(IsoWriter *w, const uint8_t *data, uint32_t length, uint32_t *offset) {
+    if (w->ce_size % ISO_BLOCK + length > ISO_BLOCK) {
+        w->ce_size = (size_t)blocks(w->ce_size) * ISO_BLOCK;
+    }
+    if (w->ce_size + length > w->ce_capacity) {
+        size_t capacity = w->ce_capacity ? w->ce_capacity * 2 : ISO_BLOCK * 4;
+        while (capacity < w->ce_size + length) {
+            capacity *= 2;
+        }
+        uint8_t *ce = realloc(w->ce, capacity);
+        if (!ce) {
+            return -1;
+        }
+        memset(ce + w->ce_capacity, 0, capacity - w->ce_capacity);
+        w->ce = ce;
+        w->ce_capacity = capacity;
+    }
+    memcpy(w->ce + w->ce_size, data, length);
+    *offset = w->ce_size;
+    w->ce_size += length;
+    return 0;
+}
+
+static size_t rr_px(const IsoNode *node, uint8_t *p) {
+    uint32_t links = S_ISDIR(node->st.st_mode) ? 2 + node->subdirs : 1;
+    memcpy(p, "PX\x24\x01", 4);
+    put_both32(p + 4, node->st.st_mode);
+    put_both32(p + 12, links);
+    put_both32(p + 20, node->st.st_uid);
+    put_both32(p + 28, node->st.st_gid);
+    return 36;
+}
+
+static size_t rr_tf(const IsoNode *node, uint8_t *p) {
+    memcpy(p, "TF\x1a\x01\x0e", 5);    // изменение, доступ, атрибуты
+    put_record_time(p + 5, node->st.st_mtime);
+    put_record_time(p + 12, node->st.st_atime);
+    put_record_time(p + 19, node->st.st_ctime);
+    return 26;
+}
+
+// Имя (NM) и цель ссылки (SL) — части записи, которые могут не уместиться
+// в 255 байт и уходят в продолжение; -1 — ссылку не записать
+static int rr_tail(const IsoNode *node, uint8_t *p, size_t *length) {
+    size_t len = 0, name_len = strlen(node->name);
+    for (size_t done = 0; done < name_len;) {
+        size_t part = name_len - done > 250 ? 250 : name_len - done;
+        memcpy(p + len, "NM", 2);
+        p[len + 2] = 5 + part;
+        p[len + 3] = 1;
+        p[len + 4] = done + part < name_len;     // продолжение в следующей
+        memcpy(p + len + 5, node->name + done, part);
+        len += 5 + part;
+        done += part;
+    }
+
+    if (node->link) {
+        // Компоненты пути; SL переносится на следующую запись по границе компонента
+        size_t start = len;
+        const char *c = node->link;
+        len += 5;
+        while (*c) {
+            const char *slash = strchr(c, '/');
+            size_t clen = slash ? (size_t)(slash - c) : strlen(c);
+            uint8_t flags = 0;
+            if (c == node->link && clen == 0) {
+                flags = 0x08;
+            } else if (clen == 1 && c[0] == '.') {
+                flags = 0x02;
+            } else if (clen == 2 && c[0] == '.' && c[1] == '.') {
+                flags = 0x04;
+            }
+            size_t stored = flags ? 0 : clen;
+            if (stored > 248 || len + 2 + stored > 2000) {
+                return -1;
+            }
+            if (len - start + 2 + stored > 255) {
+                memcpy(p + start, "SL", 2);
+                p[start + 2] = len - start;
+                p[start + 3] = 1;
+                p[start + 4] = 1;
+                start = len;
+                len += 5;
+            }
+            if (clen > 0 || flags) {
+                p[len] = flags;
+                p[len + 1] = stored;
+                memcpy(p + len + 2, c, stored);
+                len += 2 + stored;
+            }
+            c = slash ? slash + 1 : c + clen;
+        }
+        memcpy(p + start, "SL", 2);
+        p[start + 2] = len - start;
+        p[start + 3] = 1;
+        p[start + 4] = 0;
+    }
+
+    *length = len;
+    return 0;
+}
+
+static size_t rr_ce(uint32_t block, uint32_t offset, uint32_t length, uint8_t *p) {
+    memcpy(p, "CE\x1c\x01", 4);
+    put_both32(p + 4, block);
+    put_both32(p + 12, offset);
+    put_both32(p + 20, length);
+    return 28;
+}
+
+// Продолжения: ER корня и хвосты записей, которые не помещаются в 255 байт
+static int prepare_rock_ridge(IsoWriter *w) {
+    static const char id[] = "RRIP_1991A";
+    static const char des[] = "THE ROCK RIDGE INTERCHANGE PROTOCOL PROVIDES SUPPORT FOR "
+                              "POSIX FILE SYSTEM SEMANTICS";
+    static const char src[] = "PLEASE CONTACT DISC PUBLISHER FOR SPECIFICATION SOURCE.  "
+                              "SEE PUBLISHER IDENTIFIER IN PRIMARY VOLUME DESCRIPTOR FOR "
+                              "CONTACT INFORMATION.";
+    uint8_t er[256];
+    size_t len = 8;
+    memcpy(er, "ER", 2);
+    er[3] = 1;
+    er[4] = sizeof(id) - 1;
+    er[5] = sizeof(des) - 1;
+    er[6] = sizeof(src) - 1;
+    er[7] = 1;
+    memcpy(er + len, id, sizeof(id) - 1);
+    len += sizeof(id) - 1;
+    memcpy(er + len, des, sizeof(des) - 1);
+    len += sizeof(des) - 1;
+    memcpy(er + len, src, sizeof(src) - 1);
+    len += sizeof(src) - 1;
+    er[2] = len;
+    w->er_length = len;
+    if (ce_alloc(w, er, len, &w->er_offset) != 0) {
+        return -1;
+    }
+
+    uint8_t tail[2048];
+    for (int d = 0; d < w->dir_count; d++) {
+        IsoNode *dir = w->dirs[d];
+        for (int i = 0; i < dir->count; i++) {
+            IsoNode *child = dir->children[i];
+            size_t tail_len;
+            if (rr_tail(child, tail, &tail_len) != 0) {
+                log_error("Слишком длинная ссылка для Rock Ridge: %s", child->source);
+                return -1;
+            }
+            size_t name_len = strlen(child->iso_name);
+            size_t base = 33 + name_len + !(name_len & 1) + 36 + 26;
+            if (base + tail_len > 255 &&
+                ce_alloc(w, tail, tail_len, &child->ce_offset) != 0) {
+                return -1;
+            }
+            child->ce_length = base + tail_len > 255 ? tail_len : 0;
+        }
+    }
+    return 0;
+}
+
+// Записи каталогов
+
+static uint64_t file_size_of(const IsoNode *node) {
+    return S_ISREG(node->st.st_mode) ? (uint64_t)node->st.st_size : 0;
+}
+
+// Число записей файла: по одной на экстент
+static int extent_count(const IsoNode *node) {
+    uint64_t size = file_size_of(node);
+    return size > ISO_EXTENT_MAX ? (int)((size + ISO_EXTENT_MAX - 1) / ISO_EXTENT_MAX) : 1;
+}
+
+// Запись каталога; out = NULL — только длина. part — экстент файла
+static size_t dir_record(const IsoWriter *w, const IsoNode *dir, const IsoNode *node,
+                         RecordKind kind, bool joliet, int part, uint8_t *out) {
+    uint8_t ident[JOLIET_NAME_MAX * 2];
+    size_t ident_len = 1;
+    if (kind != RECORD_CHILD) {
+        ident[0] = kind == RECORD_SELF ? 0 : 1;
+    } else if (joliet) {
+        ident_len = node->joliet_len * 2;
+        for (int i = 0; i < node->joliet_len; i++) {
+            put_be16(ident + i * 2, node->joliet[i]);
+        }
+    } else {
+        ident_len = strlen(node->iso_name);
+        memcpy(ident, node->iso_name, ident_len);
+    }
+
+    uint8_t su[255];
+    size_t su_len = 0;
+    if (!joliet) {
+        if (kind == RECORD_SELF && dir == w->root) {
+            memcpy(su, "SP\x07\x01\xbe\xef\x00", 7);
+            su_len = 7;
+            su_len += rr_ce(w->lba_ce + w->er_offset / ISO_BLOCK, w->er_offset % ISO_BLOCK,
+                            w->er_length, su + su_len);
+        }
+        su_len += rr_px(node, su + su_len);
+        su_len += rr_tf(node, su + su_len);
+        if (kind == RECORD_CHILD && node->ce_length) {
+            su_len += rr_ce(w->lba_ce + node->ce_offset / ISO_BLOCK,
+                            node->ce_offset % ISO_BLOCK, node->ce_length, su + su_len);
+        } else if (kind == RECORD_CHILD) {
+            size_t tail_len;
+            rr_tail(node, su + su_len, &tail_len);
+            su_len += tail_len;
+        }
+    }
+
+    size_t len = 33 + ident_len + !(ident_len & 1) + su_len;
+    if (!out) {
+        return len;
+    }
+
+    uint32_t extent;
+    uint64_t size;
+    uint8_t flags = 0;
+    if (S_ISDIR(node->st.st_mode)) {
+        extent = joliet ? node->jextent : node->extent;
+        size = joliet ? node->jsize : node->size;
+        flags = 0x02;
+    } else {
+        uint64_t total = file_size_of(node);
+        uint64_t offset = (uint64_t)part * ISO_EXTENT_MAX;
+        size = total - offset > ISO_EXTENT_MAX ? ISO_EXTENT_MAX : total - offset;
+        extent = size ? node->extent + offset / ISO_BLOCK : 0;
+        flags = part + 1 < extent_count(node) ? 0x80 : 0;
+    }
+
+    memset(out, 0, len);
+    out[0] = len;
+    put_both32(out + 2, extent);
+    put_both32(out + 10, size);
+    put_record_time(out + 18, node->st.st_mtime);
+    out[25] = flags;
+    put_both16(out + 28, 1);
+    out[32] = ident_len;
+    memcpy(out + 33, ident, ident_len);
+    memcpy(out + 33 + ident_len + !(ident_len & 1), su, su_len);
+    return len;
+}
+
+// Содержимое каталога; out = NULL — только размер в байтах, кратный блоку
+static uint32_t dir_contents(const IsoWriter *w, const IsoNode *dir, bool joliet, uint8_t *out) {
+    uint32_t offset = 0;
+    IsoNode *const *children = joliet ? dir->jchildren : dir->children;
+    for (int i = -2; i < dir->count; i++) {
+        const IsoNode *node = i == -2 ? dir : i == -1 ? (dir->parent ? dir->parent : dir)
+                                                      : children[i];
+        RecordKind kind = i == -2 ? RECORD_SELF : i == -1 ? RECORD_PARENT : RECORD_CHILD;
+        int parts = kind == RECORD_CHILD && !S_ISDIR(node->st.st_mode) ? extent_count(node) : 1;
+        for (int part = 0; part < parts; part++) {
+            size_t len = dir_record(w, dir, node, kind, joliet, part, NULL);
+            if (offset % ISO_BLOCK + len > ISO_BLOCK) {
+                offset = blocks(offset) * ISO_BLOCK;
+            }
+            if (out) {
+                dir_record(w, dir, node, kind, joliet, part, out + offset);
+            }
+            offset += len;
+        }
+    }
+    return blocks(offset) * ISO_BLOCK;
+}
+
+// Таблица путей; out = NULL — только размер
+static uint32_t path_table(const IsoWriter *w, bool joliet, bool big_endian, uint8_t *out) {
+    IsoNode *const *dirs = joliet ? w->jdirs : w->dirs;
+    uint32_t offset = 0;
+    for (int i = 0; i < w->dir_count; i++) {
+        const IsoNode *dir = dirs[i];
+        size_t ident_len = dir == w->root ? 1
+                         : joliet ? (size_t)dir->joliet_len * 2 : strlen(dir->iso_name);
+        if (out) {
+            uint8_t *p = out + offset;
+            const IsoNode *parent = dir->parent ? dir->parent : dir;
+            uint32_t extent = joliet ? dir->jextent : dir->extent;
+            uint16_t number = joliet ? parent->jnumber : parent->number;
+            p[0] = ident_len;
+            p[1] = 0;
+            if (big_endian) {
+                put_be32(p + 2, extent);
+                put_be16(p + 6, number);
+            } else {
+                put_le32(p + 2, extent);
+                put_le16(p + 6, number);
+            }
+            if (dir == w->root) {
+                p[8] = 0;
+            } else if (joliet) {
+                for (int c = 0; c < dir->joliet_len; c++) {
+                    put_be16(p + 8 + c * 2, dir->joliet[c]);
+                }
+            } else {
+                memcpy(p + 8, dir->iso_name, ident_len);
+            }
+        }
+        offset += 8 + ident_len + (ident_len & 1);
+    }
+    return offset;
+}
+
+// Раскладка
+
+// Каталоги в порядке таблицы путей: по уровням, внутри уровня по
+// номеру родителя и имени — то есть обход в ширину по сортированным детям
+static int order_dirs(IsoWriter *w, bool joliet) {
+    IsoNode **dirs = malloc(w->dir_count * sizeof(IsoNode *));
+    if (!dirs) {
+        return -1;
+    }
+    int count = 0;
+    dirs[count++] = w->root;
+    for (int i = 0; i < count; i++) {
+        IsoNode *dir = dirs[i];
+        if (joliet) {
+            dir->jnumber = i + 1;
+        } else {
+            dir->number = i + 1;
+        }
+        IsoNode **children = joliet ? dir->jchildren : dir->children;
+        for (int c = 0; c < dir->count; c++) {
+            if (S_ISDIR(children[c]->st.st_mode)) {
+                dirs[count++] = children[c];
+            }
+        }
+    }
+    if (joliet) {
+        w->jdirs = dirs;
+    } else {
+        w->dirs = dirs;
+    }
+    return 0;
+}
+
+static void count_nodes(const IsoNode *node, int *dirs, int *files) {
+    if (!S_ISDIR(node->st.st_mode)) {
+        (*files)++;
+        return;
+    }
+    (*dirs)++;
+    for (int i = 0; i < node->count; i++) {
+        count_nodes(node->children[i], dirs, files);
+    }
+}
+
+static int layout(IsoWriter *w) {
+    int dirs = 0, files = 0;
+    count_nodes(w->root, &dirs, &files);
+    w->dir_count = dirs;
+    w->files = malloc((files ? files : 1) * sizeof(IsoNode *));
+    if (!w->files || order_dirs(w, false) != 0 || order_dirs(w, true) != 0) {
+        return -1;
+    }
+    if (w->dir_count > 65535) {
+        log_error("Слишком много каталогов для таблицы путей ISO 9660");
+        return -1;
+    }
+
+    // Файлы с данными в порядке каталогов: образ читается почти подряд
+    for (int d = 0; d < w->dir_count; d++) {
+        for (int i = 0; i < w->dirs[d]->count; i++) {
+            IsoNode *node = w->dirs[d]->children[i];
+            if (S_ISREG(node->st.st_mode) && node != w->md5_list) {
+                w->files[w->file_count++] = node;
+            }
+        }
+    }
+
+    // md5sum.txt последним: строка "md5  ./путь" на каждый файл
+    if (w->md5_list) {
+        off_t size = 0;
+        for (int i = 0; i < w->file_count; i++) {
+            size += MD5_HEX_SIZE - 1 + 5 + strlen(w->files[i]->source + w->isodir_len + 1);
+        }
+        w->md5_list->st.st_size = size;
+        w->files[w->file_count++] = w->md5_list;
+    }
+
+    if (prepare_rock_ridge(w) != 0) {
+        return -1;
+    }
+
+    // Дескрипторы: основной, El Torito, Joliet, завершающий
+    uint32_t lba = SYSTEM_BLOCKS + 3 + (w->bios || w->efi);
+    if (w->bios || w->efi) {
+        w->lba_catalog = lba++;
+    }
+    w->path_size = path_table(w, false, false, NULL);
+    w->jpath_size = path_table(w, true, false, NULL);
+    w->lba_path_l = lba;
+    lba += blocks(w->path_size);
+    w->lba_path_m = lba;
+    lba += blocks(w->path_size);
+    w->lba_jpath_l = lba;
+    lba += blocks(w->jpath_size);
+    w->lba_jpath_m = lba;
+    lba += blocks(w->jpath_size);
+
+    // Размер каталога не зависит от адресов, поэтому считается до раскладки
+    for (int d = 0; d < w->dir_count; d++) {
+        w->dirs[d]->size = dir_contents(w, w->dirs[d], false, NULL);
+        w->jdirs[d]->jsize = dir_contents(w, w->jdirs[d], true, NULL);
+    }
+    for (int d = 0; d < w->dir_count; d++) {
+        w->dirs[d]->extent = lba;
+        lba += w->dirs[d]->size / ISO_BLOCK;
+    }
+    for (int d = 0; d < w->dir_count; d++) {
+        w->jdirs[d]->jextent = lba;
+        lba += w->jdirs[d]->jsize / ISO_BLOCK;
+    }
+    w->lba_ce = lba;
+    lba += blocks(w->ce_size);
+
+    w->lba_files = lba;
+    for (int i = 0; i < w->file_count; i++) {
+        uint64_t next = lba + (uint64_t)blocks(file_size_of(w->files[i]));
+        if (next > UINT32_MAX - GPT_TAIL_BLOCKS) {
+            log_error("Образ ISO слишком велик");
+            return -1;
+        }
+        w->files[i]->extent = file_size_of(w->files[i]) ? lba : 0;
+        lba = next;
+    }
+    w->lba_end = lba;
+    w->total = lba + (w->options->hybrid ? GPT_TAIL_BLOCKS : 0);
+    return 0;
+}
+
+// Загрузка
+
+// Таблица загрузки в образе BIOS (-boot-info-table): адрес дескриптора,
+// адрес и длина образа, сумма слов после 64-го байта
+static int patch_boot_info(IsoNode *bios) {
+    size_t size = bios->st.st_size;
+    if (size < 64 || size > (64 << 20)) {
+        log_error("Неподходящий размер образа BIOS %s", bios->source);
+        return -1;
+    }
+
+    int fd = open(bios->source, O_RDONLY | O_CLOEXEC);
+    bios->data = fd >= 0 ? calloc(1, size + 4) : NULL;
+    size_t done = 0;
+    while (bios->data && done < size) {
+        ssize_t n = read(fd, bios->data + done, size - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (done != size) {
+        log_error("Не удалось прочитать образ BIOS %s", bios->source);
+        return -1;
+    }
+
+    uint32_t sum = 0;
+    for (size_t i = 64; i < size; i += 4) {
+        sum += bios->data[i] | bios->data[i + 1] << 8 | bios->data[i + 2] << 16 |
+               (uint32_t)bios->data[i + 3] << 24;
+    }
+    put_le32(bios->data + 8, SYSTEM_BLOCKS);
+    put_le32(bios->data + 12, bios->extent);
+    put_le32(bios->data + 16, size);
+    put_le32(bios->data + 20, sum);
+    return 0;
+}
+
+static void catalog_entry(uint8_t *p, const IsoNode *image, uint16_t sectors) {
+    p[0] = 0x88;            // загрузочная, без эмуляции
+    put_le16(p + 6, sectors);
+    put_le32(p + 8, image->extent);
+}
+
+static void boot_catalog(const IsoWriter *w, uint8_t *p) {
+    const IsoNode *first = w->bios ? w->bios : w->efi;
+    uint16_t efi_sectors = 0;
+    if (w->efi) {
+        uint64_t sectors = ((uint64_t)w->efi->st.st_size + 511) / 512;
+        efi_sectors = sectors > 0xffff ? 0xffff : sectors;
+    }
+
+    // Проверочная запись: сумма 16-битных слов равна нулю
+    p[0] = 1;
+    p[1] = w->bios ? 0x00 : 0xef;
+    memcpy(p + 4, "LUNA LINUX", 10);
+    p[30] = 0x55;
+    p[31] = 0xaa;
+    uint16_t sum = 0;
+    for (int i = 0; i < 32; i += 2) {
+        sum += p[i] | p[i + 1] << 8;
+    }
+    put_le16(p + 28, -sum);
+
+    catalog_entry(p + 32, first, first == w->bios ? 4 : efi_sectors);
+    if (w->bios && w->efi) {
+        p[64] = 0x91;       // последний заголовок секции
+        p[65] = 0xef;
+        put_le16(p + 66, 1);
+        catalog_entry(p + 96, w->efi, efi_sectors);
+    }
+}
+
+// Защитный MBR и GPT с разделом EFI поверх образа efi.img: прошивка UEFI
+// находит загрузчик на USB так же, как на CD. Загрузочного кода MBR нет,
+// как и прежде: BIOS загружается с CD через El Torito
+static void gpt_header(const IsoWriter *w, uint8_t *p, uint64_t current, uint64_t backup,
+                       uint64_t entries, uint32_t entries_crc) {
+    uint64_t sectors = (uint64_t)w->total * 4;
+    memcpy(p, "EFI PART", 8);
+    put_le32(p + 8, 0x00010000);
+    put_le32(p + 12, 92);
+    put_le64(p + 24, current);
+    put_le64(p + 32, backup);
+    put_le64(p + 40, 34);
+    put_le64(p + 48, sectors - 34);
+    memcpy(p + 56, w->disk_guid, 16);
+    put_le64(p + 72, entries);
+    put_le32(p + 80, GPT_ENTRIES);
+    put_le32(p + 84, 128);
+    put_le32(p + 88, entries_crc);
+    put_le32(p + 16, crc32(0, p, 92));
+}
+
+static void gpt_entries(const IsoWriter *w, uint8_t *p) {
+    static const uint8_t esp[16] = {
+        0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8, 0xd2, 0x11,
+        0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b
+    };
+    static const char name[] = "EFI boot partition";
+    if (!w->efi) {
+        return;
+    }
+    uint64_t first = (uint64_t)w->efi->extent * 4;
+    memcpy(p, esp, 16);
+    memcpy(p + 16, w->part_guid, 16);
+    put_le64(p + 32, first);
+    put_le64(p + 40, first + ((uint64_t)w->efi->st.st_size + 511) / 512 - 1);
+    for (size_t i = 0; i < sizeof(name) - 1; i++) {
+        put_le16(p + 56 + i * 2, name[i]);
+    }
+}
+
+static void system_area(const IsoWriter *w, uint8_t *p) {
+    uint64_t sectors = (uint64_t)w->total * 4;
+    uint8_t *mbr = p;
+    memcpy(mbr + 440, w->disk_guid, 4);
+    uint8_t *part = mbr + 446;
+    memcpy(part + 1, "\x00\x02\x00\xee\xff\xff\xff", 7);
+    put_le32(part + 8, 1);
+    put_le32(part + 12, sectors - 1 > UINT32_MAX ? UINT32_MAX : sectors - 1);
+    mbr[510] = 0x55;
+    mbr[511] = 0xaa;
+
+    gpt_entries(w, p + 1024);
+    uint32_t crc = crc32(0, p + 1024, GPT_ENTRIES * 128);
+    gpt_header(w, p + 512, 1, sectors - 1, 2, crc);
+}
+
+static void gpt_tail(const IsoWriter *w, uint8_t *p) {
+    uint64_t sectors = (uint64_t)w->total * 4;
+    // Копия таблицы в последних 33 секторах; начало хвоста — 3 сектора нулей
+    uint8_t *entries = p + 3 * 512;
+    gpt_entries(w, entries);
+    uint32_t crc = crc32(0, entries, GPT_ENTRIES * 128);
+    gpt_header(w, entries + GPT_ENTRIES * 128, sectors - 1, 1, sectors - 33, crc);
+}
+
+static void random_guid(uint8_t *guid) {
+    if (getrandom(guid, 16, 0) != 16) {
+        uint64_t seed = time(NULL) ^ ((uint64_t)getpid() << 32);
+        for (int i = 0; i < 16; i++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            guid[i] = seed >> 56;
+        }
+    }
+    guid[7] = (guid[7] & 0x0f) | 0x40;
+    guid[8] = (guid[8] & 0x3f) | 0x80;
+}
+
+// Дескрипторы томов
+
+static void fill_text(uint8_t *p, size_t size, const char *text, bool ucs2) {
+    size_t len = strlen(text);
+    for (size_t i = 0; i < size; i += ucs2 ? 2 : 1) {
+        size_t c = ucs2 ? i / 2 : i;
+        char ch = c < len ? text[c] : ' ';
+        if (ucs2) {
+            put_be16(p + i, (unsigned char)ch);
+        } else {
+            p[i] = ch;
+        }
+    }
+}
+
+static void volume_descriptor(const IsoWriter *w, bool joliet, uint8_t *p) {
+    p[0] = joliet ? 2 : 1;
+    memcpy(p + 1, "CD001\x01", 6);
+    fill_text(p + 8, 32, "LINUX", joliet);
+    fill_text(p + 40, 32, w->options->volume_id, joliet);
+    put_both32(p + 80, w->total);
+    if (joliet) {
+        memcpy(p + 88, "%/E", 3);   // UCS-2 уровня 3
+    }
+    put_both16(p + 120, 1);
+    put_both16(p + 124, 1);
+    put_both16(p + 128, ISO_BLOCK);
+    put_both32(p + 132, joliet ? w->jpath_size : w->path_size);
+    put_le32(p + 140, joliet ? w->lba_jpath_l : w->lba_path_l);
+    put_be32(p + 148, joliet ? w->lba_jpath_m : w->lba_path_m);
+
+    // Корень — запись "." без полей Rock Ridge
+    uint8_t *root = p + 156;
+    root[0] = 34;
+    put_both32(root + 2, joliet ? w->root->jextent : w->root->extent);
+    put_both32(root + 10, joliet ? w->root->jsize : w->root->size);
+    put_record_time(root + 18, w->root->st.st_mtime);
+    root[25] = 0x02;
+    put_both16(root + 28, 1);
+    root[32] = 1;
+
+    fill_text(p + 190, 128, "", joliet);
+    fill_text(p + 318, 128, "", joliet);
+    fill_text(p + 446, 128, "", joliet);
+    fill_text(p + 574, 128, "LUNA LINUX BUILDER", joliet);
+    fill_text(p + 702, 37 * 3 - 1, "", joliet);
+    put_volume_time(p + 813, w->now);
+    put_volume_time(p + 830, w->now);
+    put_volume_time(p + 847, 0);
+    put_volume_time(p + 864, w->now);
+    p[881] = 1;
+}
+
+// Вывод
+
+// Хеширование
+
+static int out_generated(IsoWriter *w, uint32_t lba, const uint8_t *data, size_t size);
+
+// MD5 файлов, чьи данные попали в блок: файлы идут в порядке раскладки
+static void digest_files(IsoDigest *d, const IsoSlot *slot) {
+    IsoWriter *w = d->w;
+    int count = w->file_count - (w->md5_list != NULL);
+    unsigned long long slot_end = slot->position + slot->size;
+
+    while (d->file < count) {
+        IsoNode *node = w->files[d->file];
+        unsigned long long size = file_size_of(node);
+        unsigned long long start = (unsigned long long)node->extent * ISO_BLOCK;
+        unsigned long long end = start + size;
+        if (size > 0) {
+            if (start >= slot_end) {
+                return;
+            }
+            unsigned long long lo = start > slot->position ? start : slot->position;
+            unsigned long long hi = end < slot_end ? end : slot_end;
+            if (hi > lo) {
+                md5_update(&d->md5, slot->data + (lo - slot->position), hi - lo);
+            }
+            if (end > slot_end) {
+                return;
+            }
+        }
+        md5_final(&d->md5, node->md5);
+        md5_init(&d->md5);
+        d->file++;
+    }
+}
+
+static void *digest_thread(void *arg) {
+    IsoDigest *d = arg;
+    IsoWriter *w = d->w;
+    if (d->step >= 0) {
+        trace_thread_begin(d->step);
+    }
+
+    for (unsigned long long seq = 0;; seq++) {
+        pthread_mutex_lock(&w->lock);
+        while (seq == w->submitted && !w->finished) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        bool done = seq == w->submitted;
+        pthread_mutex_unlock(&w->lock);
+        if (done) {
+            break;
+        }
+
+        IsoSlot *slot = &w->slots[seq % ISO_SLOTS];
+        if (d->kind == DIGEST_SHA256) {
+            sha256_update(&d->sha256, slot->data, slot->size);
+        } else if (d->kind == DIGEST_SHA512) {
+            sha512_update(&d->sha512, slot->data, slot->size);
+        } else {
+            digest_files(d, slot);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        slot->pending--;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    if (d->step >= 0) {
+        trace_thread_end();
+    }
+    return NULL;
+}
+
+static void start_digests(IsoWriter *w) {
+    DigestKind kinds[3];
+    int count = 0;
+    if (w->options->checksums) {
+        kinds[count++] = DIGEST_SHA256;
+        kinds[count++] = DIGEST_SHA512;
+    }
+    if (w->md5_list) {
+        kinds[count++] = DIGEST_MD5;
+    }
+
+    for (int i = 0; i < count; i++) {
+        IsoDigest *d = &w->digests[w->digest_count];
+        memset(d, 0, sizeof(*d));
+        d->w = w;
+        d->kind = kinds[i];
+        d->step = trace_current_step();
+        sha256_init(&d->sha256);
+        sha512_init(&d->sha512);
+        md5_init(&d->md5);
+        if (pthread_create(&d->thread, NULL, digest_thread, d) != 0) {
+            break;
+        }
+        w->digest_count++;
+    }
+}
+
+// Ожидание, пока потоки хеширования прочитают все отданные блоки
+static void wait_digests(IsoWriter *w) {
+    pthread_mutex_lock(&w->lock);
+    for (int i = 0; i < ISO_SLOTS; i++) {
+        while (w->slots[i].pending > 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void stop_digests(IsoWriter *w) {
+    pthread_mutex_lock(&w->lock);
+    if (w->finished) {
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+    w->finished = true;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    for (int i = 0; i < w->digest_count; i++) {
+        pthread_join(w->digests[i].thread, NULL);
+    }
+}
+
+// Вывод
+
+// Заполненный блок — в приёмники и потокам хеширования; заполнение
+// продолжается в следующем блоке кольца, когда его дочитают
+static int out_flush(IsoWriter *w) {
+    if (w->used == 0) {
+        return 0;
+    }
+    for (int i = 0; i < w->fd_count; i++) {
+        size_t done = 0;
+        while (done < w->used) {
+            ssize_t n = write(w->fds[i], w->buffer + done, w->used - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                log_error("Ошибка записи образа ISO: %s", strerror(n < 0 ? errno : ENOSPC));
+                return -1;
+            }
+            done += n;
+        }
+    }
+
+    pthread_mutex_lock(&w->lock);
+    IsoSlot *slot = &w->slots[w->slot];
+    slot->size = w->used;
+    slot->position = w->slot_start;
+    slot->pending = w->digest_count;
+    w->submitted++;
+    pthread_cond_broadcast(&w->cond);
+
+    w->slot = (w->slot + 1) % ISO_SLOTS;
+    while (w->slots[w->slot].pending > 0) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    w->slot_start += w->used;
+    w->buffer = w->slots[w->slot].data;
+    w->used = 0;
+    return 0;
+}
+
+// md5sum.txt: строки "md5  ./путь" для всех файлов перед ним. Формирует
+// его пишущий поток, когда поток MD5 дочитал все отданные блоки
+static int out_md5_list(IsoWriter *w) {
+    if (out_flush(w) != 0) {
+        return -1;
+    }
+    wait_digests(w);
+
+    IsoNode *list = w->md5_list;
+    if (list->st.st_size == 0) {
+        return 0;
+    }
+    char *text = malloc(list->st.st_size + 1);
+    if (!text) {
+        return -1;
+    }
+    size_t len = 0;
+    for (int i = 0; i < w->file_count - 1; i++) {
+        char hex[MD5_HEX_SIZE];
+        hash_to_hex(w->files[i]->md5, MD5_DIGEST_SIZE, hex);
+        len += sprintf(text + len, "%s  ./%s\n", hex, w->files[i]->source + w->isodir_len + 1);
+    }
+    int result = out_generated(w, list->extent, (const uint8_t *)text, len);
+    free(text);
+    return result;
+}
+
+// Место в буфере для блоков метаданных; сам блок обнулён
+static uint8_t *out_reserve(IsoWriter *w, size_t size) {
+    if (w->used + size > ISO_BUFFER && out_flush(w) != 0) {
+        return NULL;
+    }
+    uint8_t *p = w->buffer + w->used;
+    memset(p, 0, size);
+    w->used += size;
+    w->position += size;
+    return p;
+}
+
+// Метаданные произвольного размера блоками через буфер
+static int out_generated(IsoWriter *w, uint32_t lba, const uint8_t *data, size_t size) {
+    if (w->position != (unsigned long long)lba * ISO_BLOCK) {
+        log_error("Раскладка ISO нарушена на блоке %u", lba);
+        return -1;
+    }
+    size_t padded = (size_t)blocks(size) * ISO_BLOCK;
+    for (size_t done = 0; done < padded;) {
+        size_t part = padded - done > ISO_BUFFER ? ISO_BUFFER : padded - done;
+        uint8_t *p = out_reserve(w, part);
+        if (!p) {
+            return -1;
+        }
+        if (done < size) {
+            memcpy(p, data + done, size - done < part ? size - done : part);
+        }
+        done += part;
+    }
+    return 0;
+}
+
+// Данные файла читаются прямо в буфер записи
+static int out_file(IsoWriter *w, const IsoNode *node) {
+    uint64_t size = file_size_of(node);
+    if (node == w->md5_list) {
+        return out_md5_list(w);
+    }
+    if (size == 0) {
+        return 0;
+    }
+    if (w->position != (unsigned long long)node->extent * ISO_BLOCK) {
+        log_error("Раскладка ISO нарушена на файле %s", node->source);
+        return -1;
+    }
+    if (node->data) {
+        return out_generated(w, node->extent, node->data, size);
+    }
+
+    int fd = open(node->source, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Не удалось открыть %s: %s", node->source, strerror(errno));
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint64_t padded = (uint64_t)blocks(size) * ISO_BLOCK;
+    uint64_t done = 0;
+    int result = 0;
+    while (done < padded && result == 0) {
+        if (w->used == ISO_BUFFER && out_flush(w) != 0) {
+            result = -1;
+            break;
+        }
+        size_t space = ISO_BUFFER - w->used;
+        if (done >= size) {
+            // Дополнение последнего блока
+            size_t pad = padded - done;
+            memset(w->buffer + w->used, 0, pad);
+            w->used += pad;
+            done += pad;
+            break;
+        }
+        size_t want = size - done < space ? size - done : space;
+        ssize_t n = read(fd, w->buffer + w->used, want);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            log_error("Файл %s изменился во время записи ISO", node->source);
+            result = -1;
+            break;
+        }
+        w->used += n;
+        done += n;
+    }
+    close(fd);
+    w->position += padded;
+    return result;
+}
+
+static int write_image(IsoWriter *w) {
+    uint8_t *p = out_reserve(w, SYSTEM_BLOCKS * ISO_BLOCK);
+    if (!p) {
+        return -1;
+    }
+    if (w->options->hybrid) {
+        system_area(w, p);
+    }
+
+    if (!(p = out_reserve(w, ISO_BLOCK))) {
+        return -1;
+    }
+    volume_descriptor(w, false, p);
+    if (w->bios || w->efi) {
+        if (!(p = out_reserve(w, ISO_BLOCK))) {
+            return -1;
+        }
+        p[0] = 0;
+        memcpy(p + 1, "CD001\x01" "EL TORITO SPECIFICATION", 29);
+        put_le32(p + 71, w->lba_catalog);
+    }
+    if (!(p = out_reserve(w, ISO_BLOCK))) {
+        return -1;
+    }
+    volume_descriptor(w, true, p);
+    if (!(p = out_reserve(w, ISO_BLOCK))) {
+        return -1;
+    }
+    memcpy(p, "\xff" "CD001\x01", 7);
+
+    if (w->bios || w->efi) {
+        if (!(p = out_reserve(w, ISO_BLOCK))) {
+            return -1;
+        }
+        boot_catalog(w, p);
+    }
+
+    // Таблицы путей и каталоги формируются прямо в буфере
+    const struct { uint32_t lba; bool joliet; bool big_endian; uint32_t size; } tables[] = {
+        { w->lba_path_l, false, false, w->path_size },
+        { w->lba_path_m, false, true, w->path_size },
+        { w->lba_jpath_l, true, false, w->jpath_size },
+        { w->lba_jpath_m, true, true, w->jpath_size },
+    };
+    for (size_t i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+        if (w->position != (unsigned long long)tables[i].lba * ISO_BLOCK ||
+            tables[i].size > ISO_BUFFER ||
+            !(p = out_reserve(w, (size_t)blocks(tables[i].size) * ISO_BLOCK))) {
+            log_error("Не удалось записать таблицу путей ISO");
+            return -1;
+        }
+        path_table(w, tables[i].joliet, tables[i].big_endian, p);
+    }
+
+    for (int joliet = 0; joliet < 2; joliet++) {
+        for (int d = 0; d < w->dir_count; d++) {
+            const IsoNode *dir = joliet ? w->jdirs[d] : w->dirs[d];
+            uint32_t size = joliet ? dir->jsize : dir->size;
+            uint32_t lba = joliet ? dir->jextent : dir->extent;
+            if (w->position != (unsigned long long)lba * ISO_BLOCK || size > ISO_BUFFER ||
+                !(p = out_reserve(w, size))) {
+                log_error("Не удалось записать каталог ISO %s", dir->source);
+                return -1;
+            }
+            dir_contents(w, dir, joliet, p);
+        }
+    }
+
+    if (out_generated(w, w->lba_ce, w->ce, w->ce_size) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < w->file_count; i++) {
+        if (out_file(w, w->files[i]) != 0) {
+            return -1;
+        }
+    }
+
+    if (w->options->hybrid) {
+        if (w->position != (unsigned long long)w->lba_end * ISO_BLOCK ||
+            !(p = out_reserve(w, GPT_TAIL_BLOCKS * ISO_BLOCK))) {
+            return -1;
+        }
+        gpt_tail(w, p);
+    }
+    return out_flush(w);
+}
+
+// Приёмники
+
+int iso_claim_stdout(void) {
+    if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Образ ISO не выводится в терминал: перенаправьте вывод\n");
+        return -1;
+    }
+    fflush(stdout);
+    stdout_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    if (stdout_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        return -1;
+    }
+    // Закрытый канал — ошибка записи, а не завершение сборки по сигналу
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+// Открытие дополнительного приёмника; *device — блочное устройство
+static int open_target(const char *target, unsigned long long size, bool *device) {
+    *device = false;
+    if (strcmp(target, "-") == 0) {
+        if (stdout_fd < 0) {
+            log_error("Стандартный вывод не передан записи образа");
+        }
+        return stdout_fd;
+    }
+
+    struct stat st;
+    if (stat(target, &st) == 0 && S_ISBLK(st.st_mode)) {
+        // O_EXCL на устройстве: отказ, если оно смонтировано или занято
+        int fd = open(target, O_WRONLY | O_EXCL | O_CLOEXEC);
+        unsigned long long capacity = 0;
+        if (fd < 0) {
+            log_error("Не удалось открыть устройство %s: %s", target, strerror(errno));
+            return -1;
+        }
+        if (ioctl(fd, BLKGETSIZE64, &capacity) == 0 && capacity < size) {
+            log_error("Устройство %s меньше образа: %.1f MB < %.1f MB", target,
+                      capacity / (1024.0 * 1024.0), size / (1024.0 * 1024.0));
+            close(fd);
+            return -1;
+        }
+        *device = true;
+        return fd;
+    }
+
+    int fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_error("Не удалось открыть %s: %s", target, strerror(errno));
+    }
+    return fd;
+}
+
+int iso_write(const char *isodir, const char *output, const char *target,
+              const IsoOptions *options, IsoStats *stats) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(stats, 0, sizeof(*stats));
+
+    IsoWriter w = { .options = options, .now = time(NULL), .fds = { -1, -1 },
+                    .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+    random_guid(w.disk_guid);
+    random_guid(w.part_guid);
+
+    int result = -1;
+    char part[600];
+    snprintf(part, sizeof(part), "%s.part", output);
+    bool device = false;
+
+    w.root = scan_node(isodir, "", NULL);
+    if (!w.root || !S_ISDIR(w.root->st.st_mode)) {
+        log_error("Дерево ISO %s не прочитано", isodir);
+        goto out;
+    }
+
+    if (options->bios_image && !(w.bios = find_node(w.root, options->bios_image))) {
+        log_error("Нет образа BIOS %s/%s", isodir, options->bios_image);
+        goto out;
+    }
+    if (options->efi_image && !(w.efi = find_node(w.root, options->efi_image))) {
+        log_error("Нет раздела EFI %s/%s", isodir, options->efi_image);
+        goto out;
+    }
+    if ((w.bios && !S_ISREG(w.bios->st.st_mode)) || (w.efi && !S_ISREG(w.efi->st.st_mode))) {
+        log_error("Загрузочные образы должны быть обычными файлами");
+        goto out;
+    }
+
+    w.isodir_len = strlen(isodir);
+    if (options->md5_list && !(w.md5_list = generated_node(&w, isodir, options->md5_list))) {
+        goto out;
+    }
+
+    if (layout(&w) != 0 || (w.bios && patch_boot_info(w.bios) != 0)) {
+        goto out;
+    }
+    unsigned long long image_size = (unsigned long long)w.total * ISO_BLOCK;
+
+    for (int i = 0; i < ISO_SLOTS; i++) {
+        if (posix_memalign((void **)&w.slots[i].data, 4096, ISO_BUFFER) != 0) {
+            w.slots[i].data = NULL;
+            goto out;
+        }
+    }
+    w.buffer = w.slots[0].data;
+    w.fds[0] = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w.fds[0] < 0) {
+        log_error("Не удалось создать %s: %s", part, strerror(errno));
+        goto out;
+    }
+    w.fd_count = 1;
+    if (target && target[0]) {
+        if ((w.fds[1] = open_target(target, image_size, &device)) < 0) {
+            goto out;
+        }
+        w.fd_count = 2;
+    }
+
+    log_info("Раскладка ISO: каталогов %d, файлов %d, %.1f MB", w.dir_count, w.file_count,
+             image_size / (1024.0 * 1024.0));
+    start_digests(&w);
+    if (write_image(&w) != 0) {
+        goto out;
+    }
+    stop_digests(&w);
+    for (int i = 0; i < w.digest_count; i++) {
+        uint8_t digest[SHA512_DIGEST_SIZE];
+        if (w.digests[i].kind == DIGEST_SHA256) {
+            sha256_final(&w.digests[i].sha256, digest);
+            hash_to_hex(digest, SHA256_DIGEST_SIZE, stats->sha256);
+        } else if (w.digests[i].kind == DIGEST_SHA512) {
+            sha512_final(&w.digests[i].sha512, digest);
+            hash_to_hex(digest, SHA512_DIGEST_SIZE, stats->sha512);
+        }
+    }
+    if (device && fsync(w.fds[1]) != 0) {
+        log_error("Не удалось сбросить данные на %s: %s", target, strerror(errno));
+        goto out;
+    }
+    if (close(w.fds[0]) != 0 || rename(part, output) != 0) {
+        w.fds[0] = -1;
+        log_error("Не удалось записать %s: %s", output, strerror(errno));
+        goto out;
+    }
+    w.fds[0] = -1;
+
+    stats->files = w.file_count;
+    stats->dirs = w.dir_count;
+    stats->bytes = image_size;
+    result = 0;
+
+out:
+    stop_digests(&w);
+    if (w.fds[0] >= 0) {
+        close(w.fds[0]);
+    }
+    if (result != 0) {
+        unlink(part);
+    }
+    // Стандартный вывод закрывается только после записи: за ним конец образа
+    if (w.fd_count == 2 && w.fds[1] >= 0) {
+        close(w.fds[1]);
+        if (w.fds[1] == stdout_fd) {
+            stdout_fd = -1;
+        }
+    }
+    if (w.root) {
+        free_node(w.root);
+    }
+    free(w.dirs);
+    free(w.jdirs);
+    free(w.files);
+    free(w.ce);
+    for (int i = 0; i < ISO_SLOTS; i++) {
+        free(w.slots[i].data);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return result;
+}
@@ -0,0 +1,283 @@
+/**
+ * layers.c - Реализация стека слоёв overlayfs
+ *
+ * Базовая система и каждый следующий шаг, изменяющий chroot, пишут в
+ * отдельный верхний слой (step-NN/upper). Нижние слои после фиксации не
+ * меняются, поэтому повторная сборка может начаться с любого слоя, а
+ * слои выше него отбрасываются переименованием без копирования.
+ * Редакции матричной сборки делят нижние слои по символьным ссылкам.
+ */
+
+#include "layers.h"
+#include "clean.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+
+// Инициализация стека слоёв
+int layers_init(LayerStack *stack, const char *root, const char *mountpoint) {
+    snprintf(stack->root, sizeof(stack->root), "%s", root);
+    snprintf(stack->mountpoint, sizeof(stack->mountpoint), "%s", mountpoint);
+    stack->mounted = false;
+    return 0;
+}
+
+// Путь к части слоя: "upper", "work", "key" или NULL для каталога слоя
+void layers_path(const LayerStack *stack, int index, const char *part, char *path, size_t size) {
+    if (part) {
+        snprintf(path, size, "%s/step-%02d/%s", stack->root, index, part);
+    } else {
+        snprintf(path, size, "%s/step-%02d", stack->root, index);
+    }
+}
+
+bool layers_exists(const LayerStack *stack, int index) {
+    char upper[512];
+    layers_path(stack, index, "upper", upper, sizeof(upper));
+    return dir_exists(upper);
+}
+
+// Строка lowerdir из слоёв с индексом меньше limit, верхние слои первыми
+static int build_lowerdir(const LayerStack *stack, int limit, char *lower, size_t size) {
+    // Пустой каталог служит самым нижним слоем для базовой системы
+    char empty[512];
+    snprintf(empty, sizeof(empty), "%s/empty", stack->root);
+    if (make_dirs(empty) != 0 || make_dirs(stack->mountpoint) != 0) {
+        log_error("Не удалось создать каталог слоёв %s", stack->root);
+        return -1;
+    }
+
+    size_t len = 0;
+    lower[0] = '\0';
+
+    for (int i = limit - 1; i >= 0; i--) {
+        if (!layers_exists(stack, i)) {
+            continue;
+        }
+
+        char upper[512];
+        layers_path(stack, i, "upper", upper, sizeof(upper));
+        int written = snprintf(lower + len, size - len, "%s%s", len ? ":" : "", upper);
+        if (written < 0 || (size_t)written >= size - len) {
+            log_error("Слишком длинная цепочка слоёв в %s", stack->root);
+            return -1;
+        }
+        len += written;
+    }
+
+    int written = snprintf(lower + len, size - len, "%s%s", len ? ":" : "", empty);
+    if (written < 0 || (size_t)written >= size - len) {
+        log_error("Слишком длинная цепочка слоёв в %s", stack->root);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Монтирование слоя index на запись поверх всех нижележащих слоёв
+int layers_begin(LayerStack *stack, int index) {
+    if (layers_unmount(stack) != 0) {
+        return -1;
+    }
+
+    char upper[512], work[512];
+    layers_path(stack, index, "upper", upper, sizeof(upper));
+    layers_path(stack, index, "work", work, sizeof(work));
+    if (make_dirs(upper) != 0 || make_dirs(work) != 0) {
+        log_error("Не удалось создать слой %d", index);
+        return -1;
+    }
+
+    char lower[4096], options[6144];
+    if (build_lowerdir(stack, index, lower, sizeof(lower)) != 0) {
+        return -1;
+    }
+    snprintf(options, sizeof(options), "lowerdir=%s,upperdir=%s,workdir=%s", lower, upper, work);
+
+    if (mount("overlay", stack->mountpoint, "overlay", 0, options) != 0) {
+        log_error("Ошибка монтирования слоя %d в %s: %s", index, stack->mountpoint, strerror(errno));
+        return -1;
+    }
+
+    stack->mounted = true;
+    return 0;
+}
+
+// Монтирование объединённого вида всех слоёв только для чтения
+int layers_mount_view(LayerStack *stack) {
+    if (layers_unmount(stack) != 0) {
+        return -1;
+    }
+
+    if (layers_mount_snapshot(stack, LAYERS_MAX, stack->mountpoint) != 0) {
+        return -1;
+    }
+
+    stack->mounted = true;
+    return 0;
+}
+
+// Монтирование слоёв ниже limit только для чтения в mountpoint
+int layers_mount_snapshot(const LayerStack *stack, int limit, const char *mountpoint) {
+    char lower[4096], options[4200];
+    if (build_lowerdir(stack, limit, lower, sizeof(lower)) != 0 || make_dirs(mountpoint) != 0) {
+        return -1;
+    }
+    snprintf(options, sizeof(options), "lowerdir=%s", lower);
+
+    if (mount("overlay", mountpoint, "overlay", MS_RDONLY, options) != 0) {
+        log_error("Ошибка монтирования слоёв в %s: %s", mountpoint, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Размонтирование объединённого вида
+int layers_unmount(LayerStack *stack) {
+    if (!stack->mounted) {
+        return 0;
+    }
+
+    if (umount2(stack->mountpoint, 0) != 0 &&
+        umount2(stack->mountpoint, MNT_DETACH) != 0 && errno != EINVAL) {
+        log_error("Не удалось размонтировать %s: %s", stack->mountpoint, strerror(errno));
+        return -1;
+    }
+
+    stack->mounted = false;
+    return 0;
+}
+
+// Отбрасывание слоёв с индексами from..to
+static int discard_range(LayerStack *stack, int from, int to) {
+    if (layers_unmount(stack) != 0) {
+        return -1;
+    }
+
+    char trash[512];
+    snprintf(trash, sizeof(trash), "%s/.trash-%d-%ld", stack->root, getpid(), (long)time(NULL));
+
+    bool moved = false;
+    for (int i = from; i <= to && i < LAYERS_MAX; i++) {
+        char layer[512], target[600];
+        layers_path(stack, i, NULL, layer, sizeof(layer));
+        if (!dir_exists(layer)) {
+            continue;
+        }
+
+        if (!moved && make_dirs(trash) != 0) {
+            log_error("Не удалось создать каталог %s", trash);
+            return -1;
+        }
+        moved = true;
+
+        snprintf(target, sizeof(target), "%s/step-%02d", trash, i);
+        if (rename(layer, target) != 0) {
+            log_error("Не удалось отбросить слой %s: %s", layer, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (!moved) {
+        return 0;
+    }
+
+    // Удаление в отвязанном процессе, сборка продолжается сразу
+    return clean_background(trash);
+}
+
+// Отбрасывание одного слоя перед его пересборкой
+int layers_discard(LayerStack *stack, int index) {
+    return discard_range(stack, index, index);
+}
+
+// Отбрасывание слоёв начиная с index
+int layers_discard_from(LayerStack *stack, int index) {
+    return discard_range(stack, index, LAYERS_MAX - 1);
+}
+
+// Удалённый файл в верхнем слое — символьное устройство 0:0, удалённое
+// содержимое каталога — атрибут opaque (trusted.* или user.* при userxattr)
+static bool is_opaque(const char *path) {
+    char value[2];
+    return (getxattr(path, "trusted.overlay.opaque", value, sizeof(value)) == 1 ||
+            getxattr(path, "user.overlay.opaque", value, sizeof(value)) == 1) &&
+           value[0] == 'y';
+}
+
+static bool find_in_dir(const char *path, char *found, size_t size) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return false;
+    }
+
+    bool result = false;
+    struct dirent *entry;
+    while (!result && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char child[4096];
+        struct stat st;
+        int len = snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if (len < 0 || (size_t)len >= sizeof(child) || lstat(child, &st) != 0) {
+            continue;
+        }
+        if ((S_ISCHR(st.st_mode) && st.st_rdev == makedev(0, 0)) ||
+            (S_ISDIR(st.st_mode) && is_opaque(child))) {
+            snprintf(found, size, "%s", child);
+            result = true;
+        } else if (S_ISDIR(st.st_mode)) {
+            result = find_in_dir(child, found, size);
+        }
+    }
+    closedir(dir);
+    return result;
+}
+
+bool layers_find_deletion(const LayerStack *stack, int from, char *found, size_t size) {
+    for (int i = from; i < LAYERS_MAX; i++) {
+        char upper[512];
+        layers_path(stack, i, "upper", upper, sizeof(upper));
+        if (dir_exists(upper) && find_in_dir(upper, found, size)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Слой index из другого стека: символьная ссылка на его каталог. Общий
+// слой остаётся нижним слоем overlayfs, поэтому слои выше него пишутся
+// в этом стеке, а сам он не меняется
+int layers_share(LayerStack *stack, int index, const LayerStack *source) {
+    char layer[512], target[512], current[512];
+    layers_path(stack, index, NULL, layer, sizeof(layer));
+    layers_path(source, index, NULL, target, sizeof(target));
+
+    ssize_t len = readlink(layer, current, sizeof(current) - 1);
+    if (len >= 0) {
+        current[len] = '\0';
+        if (strcmp(current, target) == 0) {
+            return 0;
+        }
+        unlink(layer);
+    } else if (dir_exists(layer) && layers_discard(stack, index) != 0) {
+        return -1;
+    }
+
+    if (make_dirs(stack->root) != 0 || symlink(target, layer) != 0) {
+        log_error("Не удалось подключить общий слой %s: %s", target, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,611 @@
+/**
+ * log.c - Журнал сборки
+ *
+ * Записи кладутся в кольцевой буфер фиксированного размера без
+ * блокировок (очередь Вьюкова: у каждой ячейки свой номер поколения,
+ * место занимается одним compare-and-swap). Выводит их один фоновый
+ * поток: в терминал и в сжатый журнал сборки. Поток, пишущий в журнал,
+ * не ждёт ни терминал, ни диск; строка целиком выводится одним вызовом,
+ * поэтому вывод параллельных шагов не перемешивается внутри строк.
+ *
+ * При заполненном буфере отладочные записи и вывод команд отбрасываются
+ * со счётчиком, а сообщения, предупреждения и ошибки ждут места: память
+ * журнала ограничена, важные записи не теряются.
+ */
+
+#define _GNU_SOURCE
+
+#include "log.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define LOG_RING_SLOTS 4096         // степень двойки
+#define LOG_TEXT_MAX 448
+#define LOG_TAG_MAX 24
+
+#define LOG_FILE_FLUSH_SEC 1.0      // сброс сжатого потока, пока поток простаивает
+#define LOG_IDLE_WAIT_MS 250
+
+// Цвета для терминала
+#define LOG_COLOR_INFO    "\033[0;32m"
+#define LOG_COLOR_WARNING "\033[1;33m"
+#define LOG_COLOR_ERROR   "\033[0;31m"
+#define LOG_COLOR_DEBUG   "\033[0;36m"
+#define LOG_COLOR_STEP    "\033[1;33m"
+#define LOG_COLOR_RESET   "\033[0m"
+
+typedef struct {
+    _Atomic size_t sequence;        // pos — свободна для записи, pos + 1 — готова
+    struct timespec time;
+    unsigned char level;
+    unsigned char sinks;            // биты LogSink
+    bool is_stderr;
+    bool banner;                    // заголовок шага сборки (log_step)
+    short step;
+    unsigned short len;
+    char tag[LOG_TAG_MAX];
+    char text[LOG_TEXT_MAX];
+} LogSlot;
+
+static const char *const level_names[LOG_LEVEL_COUNT] = {
+    [LOG_DEBUG] = "debug",
+    [LOG_OUTPUT] = "output",
+    [LOG_INFO] = "info",
+    [LOG_WARNING] = "warning",
+    [LOG_ERROR] = "error"
+};
+
+static const char *const level_labels[LOG_LEVEL_COUNT] = {
+    [LOG_DEBUG] = "DEBUG",
+    [LOG_OUTPUT] = "OUT",
+    [LOG_INFO] = "INFO",
+    [LOG_WARNING] = "WARNING",
+    [LOG_ERROR] = "ERROR"
+};
+
+static const char *const level_colors[LOG_LEVEL_COUNT] = {
+    [LOG_DEBUG] = LOG_COLOR_DEBUG,
+    [LOG_OUTPUT] = "",
+    [LOG_INFO] = LOG_COLOR_INFO,
+    [LOG_WARNING] = LOG_COLOR_WARNING,
+    [LOG_ERROR] = LOG_COLOR_ERROR
+};
+
+static _Atomic int levels[LOG_SINK_COUNT] = { LOG_INFO, LOG_DEBUG };
+
+static LogSlot *ring;
+static _Atomic size_t head;         // следующая позиция записи
+static size_t tail;                 // следующая позиция чтения; только фоновый поток
+static _Atomic size_t done;         // позиции до done выведены
+
+static _Atomic bool running;
+static _Atomic bool sleeping;
+static _Atomic uint32_t wake_seq;   // будит фоновый поток
+static _Atomic uint32_t done_seq;   // будит ожидающих log_flush
+static _Atomic int flush_waiters;
+static _Atomic int writers;         // потоки между проверкой running и публикацией
+static pthread_t thread;
+static gzFile file;
+
+static _Atomic unsigned long long written[LOG_LEVEL_COUNT];
+static _Atomic unsigned long long dropped[LOG_LEVEL_COUNT];
+static _Atomic unsigned long long truncated;
+static _Atomic unsigned long long waits;
+static size_t peak;
+
+// Ожидание и пробуждение на 32-битном счётчике
+static void futex_wait(_Atomic uint32_t *addr, uint32_t value, int timeout_ms) {
+    struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, &timeout, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void kick_thread(void) {
+    atomic_fetch_add(&wake_seq, 1);
+    futex_wake(&wake_seq);
+}
+
+static void wake_thread(void) {
+    if (atomic_exchange(&sleeping, false)) {
+        kick_thread();
+    }
+}
+
+// Уровни
+
+void log_set_level(LogSink sink, LogLevel level) {
+    atomic_store_explicit(&levels[sink], level, memory_order_relaxed);
+}
+
+LogLevel log_get_level(LogSink sink) {
+    return atomic_load_explicit(&levels[sink], memory_order_relaxed);
+}
+
+int log_parse_level(const char *name, LogLevel *level) {
+    for (int i = 0; i < LOG_LEVEL_COUNT; i++) {
+        if (strcasecmp(name, level_names[i]) == 0) {
+            *level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *log_level_name(LogLevel level) {
+    return level_names[level];
+}
+
+// Вывод записи
+
+// Длина без незаконченного последнего символа UTF-8
+static size_t utf8_cut(const char *text, size_t len) {
+    size_t start = len;
+    while (start > 0 && len - start < 4 && ((unsigned char)text[start - 1] & 0xc0) == 0x80) {
+        start--;
+    }
+    if (start == 0) {
+        return len;
+    }
+
+    unsigned char lead = text[start - 1];
+    size_t need = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1;
+    return len - (start - 1) < need ? start - 1 : len;
+}
+
+static void write_terminal(const LogSlot *slot) {
+    if (slot->level == LOG_OUTPUT) {
+        FILE *stream = slot->is_stderr ? stderr : stdout;
+        fwrite(slot->text, 1, slot->len, stream);
+        fputc('\n', stream);
+        return;
+    }
+
+    char line[LOG_TEXT_MAX + 64];
+    int len = slot->banner
+        ? snprintf(line, sizeof(line), LOG_COLOR_STEP "%.*s" LOG_COLOR_RESET "\n",
+                   (int)slot->len, slot->text)
+        : snprintf(line, sizeof(line), "%s[%s] %.*s" LOG_COLOR_RESET "\n",
+                   level_colors[slot->level], level_labels[slot->level],
+                   (int)slot->len, slot->text);
+    fwrite(line, 1, len < (int)sizeof(line) ? (size_t)len : sizeof(line) - 1, stdout);
+}
+
+// Дописывание части строки журнала; не помещающаяся часть обрезается,
+// и следующие части уже не пишутся за пределы буфера
+static size_t line_append(char *line, size_t size, size_t len, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static size_t line_append(char *line, size_t size, size_t len, const char *format, ...) {
+    if (len >= size - 1) {
+        return size - 1;
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(line + len, size - len, format, args);
+    va_end(args);
+    if (written < 0) {
+        return len;
+    }
+    return len + (size_t)written < size ? len + (size_t)written : size - 1;
+}
+
+// Строка журнала: время, уровень, шаг, команда. Буфер рассчитан на
+// самый длинный заголовок, метку и текст записи
+static void write_file(const LogSlot *slot) {
+    struct tm tm;
+    localtime_r(&slot->time.tv_sec, &tm);
+
+    char line[LOG_TEXT_MAX + LOG_TAG_MAX + 96];
+    size_t len = line_append(line, sizeof(line), 0, "%02d:%02d:%02d.%03ld %-7s ",
+                             tm.tm_hour, tm.tm_min, tm.tm_sec, slot->time.tv_nsec / 1000000,
+                             level_labels[slot->level]);
+    if (slot->step >= 0) {
+        len = line_append(line, sizeof(line), len, "[%02d] ", slot->step + 1);
+    }
+    if (slot->tag[0]) {
+        len = line_append(line, sizeof(line), len, "%s %s| ",
+                          slot->tag, slot->is_stderr ? "err" : "out");
+    }
+    len = line_append(line, sizeof(line), len, "%.*s\n", (int)slot->len, slot->text);
+
+    if (gzwrite(file, line, (unsigned)len) != (int)len) {
+        fprintf(stderr, "Журнал сборки: ошибка записи, журнал закрыт\n");
+        gzclose(file);
+        file = NULL;
+    }
+}
+
+static void write_slot(const LogSlot *slot) {
+    if (slot->sinks & (1 << LOG_SINK_TERMINAL)) {
+        write_terminal(slot);
+    }
+    if ((slot->sinks & (1 << LOG_SINK_FILE)) && file) {
+        write_file(slot);
+    }
+    atomic_fetch_add_explicit(&written[slot->level], 1, memory_order_relaxed);
+}
+
+static bool slot_ready(size_t pos) {
+    LogSlot *slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+    return atomic_load_explicit(&slot->sequence, memory_order_acquire) == pos + 1;
+}
+
+// Вывод всех готовых записей; число выведенных
+static size_t drain(void) {
+    size_t used = atomic_load_explicit(&head, memory_order_relaxed) - tail;
+    if (used > peak) {
+        peak = used > LOG_RING_SLOTS ? LOG_RING_SLOTS : used;
+    }
+
+    size_t count = 0;
+    flockfile(stdout);
+    while (slot_ready(tail)) {
+        LogSlot *slot = &ring[tail & (LOG_RING_SLOTS - 1)];
+        write_slot(slot);
+        atomic_store_explicit(&slot->sequence, tail + LOG_RING_SLOTS, memory_order_release);
+        tail++;
+        count++;
+    }
+    funlockfile(stdout);
+
+    if (count > 0) {
+        fflush(stdout);
+        atomic_store(&done, tail);
+        if (atomic_load(&flush_waiters) > 0) {
+            atomic_fetch_add(&done_seq, 1);
+            futex_wake(&done_seq);
+        }
+    }
+    return count;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *log_thread(void *arg) {
+    (void)arg;
+    double flushed = now_seconds();
+    bool dirty = false;
+
+    for (;;) {
+        uint32_t seq = atomic_load(&wake_seq);
+        if (drain() > 0) {
+            dirty = true;
+            continue;
+        }
+
+        // Сжатый поток сбрасывается в простое: после сбоя журнал читается
+        // до последних строк
+        if (dirty && file && now_seconds() - flushed >= LOG_FILE_FLUSH_SEC) {
+            gzflush(file, Z_SYNC_FLUSH);
+            flushed = now_seconds();
+            dirty = false;
+        }
+
+        // Остановка: дописываются записи, место под которые уже занято
+        if (!atomic_load(&running)) {
+            while (atomic_load(&writers) > 0 || tail != atomic_load(&head)) {
+                if (drain() == 0) {
+                    sched_yield();
+                }
+            }
+            break;
+        }
+
+        atomic_store(&sleeping, true);
+        if (slot_ready(tail)) {
+            atomic_store(&sleeping, false);
+            continue;
+        }
+        futex_wait(&wake_seq, seq, dirty ? (int)(LOG_FILE_FLUSH_SEC * 1000) : LOG_IDLE_WAIT_MS);
+        atomic_store(&sleeping, false);
+    }
+    return NULL;
+}
+
+// Запись
+
+// Место в буфере; NULL — запись отброшена или журнал не запущен
+static LogSlot *claim_slot(LogLevel level, size_t *position) {
+    atomic_fetch_add(&writers, 1);
+    size_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+
+    for (;;) {
+        if (!atomic_load(&running)) {
+            atomic_fetch_sub(&writers, 1);
+            return NULL;
+        }
+
+        LogSlot *slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *position = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            // Буфер заполнен
+            if (level < LOG_INFO) {
+                atomic_fetch_add_explicit(&dropped[level], 1, memory_order_relaxed);
+                atomic_fetch_sub(&writers, 1);
+                return NULL;
+            }
+            atomic_fetch_add_explicit(&waits, 1, memory_order_relaxed);
+            wake_thread();
+            sched_yield();
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+}
+
+static void publish_slot(LogSlot *slot, size_t pos) {
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    atomic_fetch_sub(&writers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&sleeping, memory_order_relaxed)) {
+        wake_thread();
+    }
+}
+
+// Запись без фонового потока: до запуска и после остановки журнала,
+// только в терминал
+static void write_direct(LogSlot *slot) {
+    slot->sinks &= 1 << LOG_SINK_TERMINAL;
+    if (!slot->sinks) {
+        return;
+    }
+    flockfile(stdout);
+    write_slot(slot);
+    funlockfile(stdout);
+    fflush(stdout);
+}
+
+static unsigned char sinks_for(LogLevel level, bool terminal) {
+    unsigned char sinks = 0;
+    if (terminal || level >= log_get_level(LOG_SINK_TERMINAL)) {
+        sinks |= 1 << LOG_SINK_TERMINAL;
+    }
+    if (atomic_load_explicit(&running, memory_order_relaxed) && file &&
+        level >= log_get_level(LOG_SINK_FILE)) {
+        sinks |= 1 << LOG_SINK_FILE;
+    }
+    return sinks;
+}
+
+static void fill_slot(LogSlot *slot, LogLevel level, unsigned char sinks) {
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    slot->level = level;
+    slot->sinks = sinks;
+    slot->is_stderr = false;
+    slot->banner = false;
+    slot->step = trace_current_step();
+    slot->tag[0] = '\0';
+}
+
+// Длина текста; в ячейке не больше LOG_TEXT_MAX - 1 байт
+static void set_text(LogSlot *slot, size_t len) {
+    if (len >= LOG_TEXT_MAX) {
+        atomic_fetch_add_explicit(&truncated, 1, memory_order_relaxed);
+        len = utf8_cut(slot->text, LOG_TEXT_MAX - 1);
+    }
+    slot->text[len] = '\0';
+    slot->len = len;
+}
+
+static void format_text(LogSlot *slot, const char *format, va_list args) {
+    int len = vsnprintf(slot->text, sizeof(slot->text), format, args);
+    set_text(slot, len > 0 ? (size_t)len : 0);
+}
+
+static void log_message(LogLevel level, bool banner, const char *format, va_list args) {
+    unsigned char sinks = sinks_for(level, false);
+    if (!sinks) {
+        return;
+    }
+
+    size_t pos;
+    LogSlot *slot = claim_slot(level, &pos);
+    if (!slot) {
+        if (atomic_load(&running)) {
+            return;     // отброшена
+        }
+        LogSlot direct;
+        fill_slot(&direct, level, sinks);
+        direct.banner = banner;
+        format_text(&direct, format, args);
+        write_direct(&direct);
+        return;
+    }
+
+    fill_slot(slot, level, sinks);
+    slot->banner = banner;
+    format_text(slot, format, args);
+    publish_slot(slot, pos);
+}
+
+void log_info(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_message(LOG_INFO, false, format, args);
+    va_end(args);
+}
+
+void log_warning(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_message(LOG_WARNING, false, format, args);
+    va_end(args);
+}
+
+void log_error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_message(LOG_ERROR, false, format, args);
+    va_end(args);
+}
+
+void log_debug(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_message(LOG_DEBUG, false, format, args);
+    va_end(args);
+}
+
+void log_step(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_message(LOG_INFO, true, format, args);
+    va_end(args);
+}
+
+void log_output(const char *command, bool is_stderr, bool terminal,
+                const char *line, size_t len) {
+    unsigned char sinks = sinks_for(LOG_OUTPUT, terminal);
+    if (!sinks) {
+        return;
+    }
+
+    size_t pos;
+    LogSlot *slot = claim_slot(LOG_OUTPUT, &pos);
+    LogSlot direct;
+    if (!slot) {
+        if (atomic_load(&running)) {
+            return;
+        }
+        slot = &direct;
+    }
+
+    fill_slot(slot, LOG_OUTPUT, sinks);
+    slot->is_stderr = is_stderr;
+    snprintf(slot->tag, sizeof(slot->tag), "%s", command ? command : "");
+    memcpy(slot->text, line, len < LOG_TEXT_MAX ? len : LOG_TEXT_MAX - 1);
+    set_text(slot, len);
+
+    if (slot == &direct) {
+        write_direct(slot);
+    } else {
+        publish_slot(slot, pos);
+    }
+}
+
+// Запуск и остановка
+
+int log_start(const char *path) {
+    if (atomic_load(&running)) {
+        return 0;
+    }
+
+    if (!ring) {
+        ring = malloc(LOG_RING_SLOTS * sizeof(LogSlot));
+        if (!ring) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+        atomic_init(&ring[i].sequence, i);
+    }
+    atomic_store(&head, 0);
+    atomic_store(&done, 0);
+    tail = 0;
+    peak = 0;
+
+    if (path) {
+        file = gzopen(path, "wb3");
+        if (!file) {
+            fprintf(stderr, "Не удалось открыть журнал сборки %s: %s\n", path, strerror(errno));
+        } else {
+            time_t now = time(NULL);
+            gzprintf(file, "# Журнал сборки Luna Linux, %s", ctime(&now));
+        }
+    }
+
+    atomic_store(&running, true);
+    if (pthread_create(&thread, NULL, log_thread, NULL) != 0) {
+        atomic_store(&running, false);
+        if (file) {
+            gzclose(file);
+            file = NULL;
+        }
+        return -1;
+    }
+
+    static bool registered;
+    if (!registered) {
+        atexit(log_stop);
+        registered = true;
+    }
+    return 0;
+}
+
+void log_flush(void) {
+    if (!atomic_load(&running)) {
+        fflush(stdout);
+        return;
+    }
+
+    size_t target = atomic_load(&head);
+    atomic_fetch_add(&flush_waiters, 1);
+    while (atomic_load(&done) < target && atomic_load(&running)) {
+        uint32_t seq = atomic_load(&done_seq);
+        if (atomic_load(&done) >= target) {
+            break;
+        }
+        kick_thread();
+        futex_wait(&done_seq, seq, LOG_IDLE_WAIT_MS);
+    }
+    atomic_fetch_sub(&flush_waiters, 1);
+}
+
+void log_stop(void) {
+    if (!atomic_load(&running)) {
+        return;
+    }
+
+    // Фоновый поток выводит оставшееся и завершается; новые записи
+    // с этого момента выводятся напрямую
+    atomic_store(&running, false);
+    kick_thread();
+    pthread_join(thread, NULL);
+
+    if (file) {
+        gzclose(file);
+        file = NULL;
+    }
+}
+
+void log_get_stats(LogStats *stats) {
+    for (int i = 0; i < LOG_LEVEL_COUNT; i++) {
+        stats->written[i] = atomic_load(&written[i]);
+        stats->dropped[i] = atomic_load(&dropped[i]);
+    }
+    stats->truncated = atomic_load(&truncated);
+    stats->waits = atomic_load(&waits);
+    stats->peak = peak;
+    stats->capacity = LOG_RING_SLOTS;
+}
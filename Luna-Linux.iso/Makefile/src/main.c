@@ -3,35 +3,45 @@
  * Основной файл программы
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <ctype.h>
 #include <time.h>
 #include <dirent.h>
-
-// Конфигурация сборки
-typedef struct {
-    char distro_name[64];
-    char distro_short_name[32];
-    char version[16];
-    char codename[32];
-    char ubuntu_version[16];
-    char ubuntu_codename[32];
-    char arch[16];
-    char workdir[256];
-    char chroot[256];
-    char imagedir[256];
-    char isodir[256];
-    char output_iso[256];
-    int verbose;
-    int clean_build;
-} BuildConfig;
+#include <glob.h>
+#include <signal.h>
+#include <sys/mount.h>
+#include <sys/file.h>
+#include "boot.h"
+#include "cache.h"
+#include "clean.h"
+#include "debcache.h"
+#include "dedup.h"
+#include "exec.h"
+#include "iso.h"
+#include "chroot.h"
+#include "config.h"
+#include "daemon.h"
+#include "layers.h"
+#include "packages.h"
+#include "ramdisk.h"
+#include "squashfs.h"
+#include "stage.h"
+#include "prefetch.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "utils.h"
 
 // Цвета для вывода
 #define COLOR_RED     "\033[0;31m"
@@ -44,52 +54,563 @@ typedef struct {
 
 // Прототипы функций
 void print_banner();
-void init_config(BuildConfig *config);
 int create_directory_structure(BuildConfig *config);
-int execute_command(const char *cmd, int show_output);
 int build_base_system(BuildConfig *config);
+int prefetch_packages(BuildConfig *config);
+int install_packages(BuildConfig *config);
 int customize_grub(BuildConfig *config);
-int install_kde_plasma(BuildConfig *config);
-int install_calamares(BuildConfig *config);
-int install_additional_software(BuildConfig *config);
+int configure_kde_plasma(BuildConfig *config);
+int configure_calamares(BuildConfig *config);
+int configure_system(BuildConfig *config);
+int dedup_chroot(BuildConfig *config);
+int prefill_squashfs(BuildConfig *config);
+int check_dependencies(BuildConfig *config);
 int prepare_iso_files(BuildConfig *config);
-int create_boot_structure(BuildConfig *config);
+int create_boot_config(BuildConfig *config);
+int create_boot_images(BuildConfig *config);
+int stage_casper_files(BuildConfig *config);
 int create_iso_image(BuildConfig *config);
 int cleanup_build(BuildConfig *config);
-void print_progress(int step, int total, const char *message);
 int write_file(const char *filename, const char *content);
 
+// Скрипт настройки GRUB
+static const char grub_setup[] =
+    "#!/bin/bash\n"
+    "set -e\n\n"
+    "# Создание кастомной темы Luna Linux\n"
+    "mkdir -p /boot/grub/themes/luna-linux\n\n"
+    "# Создание файла темы\n"
+    "cat > /boot/grub/themes/luna-linux/theme.txt << 'EOF'\n"
+    "# Luna Linux GRUB Theme\n\n"
+    "desktop-color: \"#0f0f1a\"\n"
+    "desktop-image: \"background.png\"\n\n"
+    "+ boot_menu {\n"
+    "    left = 30%\n"
+    "    top = 30%\n"
+    "    width = 40%\n"
+    "    height = 40%\n"
+    "    item_font = \"Unifont Regular 16\"\n"
+    "    item_color = \"#ffffff\"\n"
+    "    selected_item_color = \"#ff6600\"\n"
+    "    item_height = 40\n"
+    "    item_spacing = 10\n"
+    "}\n\n"
+    "+ label {\n"
+    "    text = \"Luna Linux\"\n"
+    "    color = \"#ff6600\"\n"
+    "    font = \"Unifont Regular 24\"\n"
+    "    left = 50%\n"
+    "    top = 20%\n"
+    "    align = \"center\"\n"
+    "}\n\n"
+    "+ label {\n"
+    "    text = \"Stellar Edition\"\n"
+    "    color = \"#aaaaaa\"\n"
+    "    font = \"Unifont Regular 16\"\n"
+    "    left = 50%\n"
+    "    top = 26%\n"
+    "    align = \"center\"\n"
+    "}\n"
+    "EOF\n\n"
+    "# Создание фонового изображения (простой градиент)\n"
+    "echo 'iVBORw0KGgoAAAANSUhEUgAAAEAAAABACAYAAACqaXHeAAAABHNCSVQICAgIfAhkiAAAAAlwSFlzAAAOxAAADsQBlSsOGwAAABl0RVh0U29mdHdhcmUAd3d3Lmlua3NjYXBlLm9yZ5vuPBoAAAArSURBVHic7cEBDQAAAMKg9U9tCF8gAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAB8GQNkAAECp1Zh3QAAAABJRU5ErkJggg==' | base64 -d > /boot/grub/themes/luna-linux/background.png\n\n"
+    "# Настройка конфигурации GRUB\n"
+    "cat > /etc/default/grub << 'EOF'\n"
+    "GRUB_DEFAULT=0\n"
+    "GRUB_TIMEOUT=10\n"
+    "GRUB_TIMEOUT_STYLE=menu\n"
+    "GRUB_DISTRIBUTOR=\"Luna Linux\"\n"
+    "GRUB_CMDLINE_LINUX_DEFAULT=\"quiet splash\"\n"
+    "GRUB_CMDLINE_LINUX=\"\"\n"
+    "GRUB_BACKGROUND=\"/boot/grub/themes/luna-linux/background.png\"\n"
+    "GRUB_THEME=\"/boot/grub/themes/luna-linux/theme.txt\"\n"
+    "GRUB_GFXMODE=auto\n"
+    "GRUB_DISABLE_OS_PROBER=false\n"
+    "GRUB_DISABLE_RECOVERY=\"true\"\n"
+    "EOF\n\n"
+    "# Обновление GRUB\n"
+    "update-grub\n";
+
+// Скрипт настройки KDE Plasma
+static const char kde_setup[] =
+    "#!/bin/bash\n"
+    "set -e\n\n"
+    "# Настройка SDDM\n"
+    "cat > /etc/sddm.conf << 'EOF'\n"
+    "[Autologin]\n"
+    "User=luna\n"
+    "Session=plasmawayland\n\n"
+    "[Theme]\n"
+    "Current=breeze\n\n"
+    "[Wayland]\n"
+    "CompositorCommand=kwin_wayland --no-lockscreen\n"
+    "EOF\n\n"
+    "# Создание пользователя luna\n"
+    "useradd -m -s /bin/bash luna || true\n"
+    "echo \"luna:luna\" | chpasswd\n"
+    "usermod -aG sudo luna\n"
+    "echo \"luna ALL=(ALL) NOPASSWD:ALL\" > /etc/sudoers.d/luna\n"
+    "chmod 440 /etc/sudoers.d/luna\n";
+
+// Скрипт настройки Calamares
+static const char calamares_setup[] =
+    "#!/bin/bash\n"
+    "set -e\n\n"
+    "# Создание конфигурации для Luna Linux\n"
+    "mkdir -p /etc/calamares\n"
+    "cp -r /usr/share/calamares/* /etc/calamares/\n\n"
+    "# Брендинг Luna Linux\n"
+    "mkdir -p /usr/share/calamares/branding/luna-linux\n"
+    "cat > /usr/share/calamares/branding/luna-linux/branding.desc << 'EOF'\n"
+    "---\n"
+    "componentName:  Luna Linux\n"
+    "shortName:      Luna\n"
+    "version:        1.0\n"
+    "bootloaderEntryName: \"Luna Linux\"\n"
+    "welcomeStyleCalamares: true\n"
+    "---\n"
+    "EOF\n";
+
+// Скрипт настройки системы; имя, версию и кодовое имя редакции
+// подставляет configure_system
+static const char software_setup[] =
+    "#!/bin/bash\n"
+    "set -e\n\n"
+    "# Создание системных идентификаторов Luna Linux\n"
+    "echo \"%s %s %s\" > /etc/luna-linux-release\n"
+    "cat > /etc/os-release << 'EOF'\n"
+    "NAME=\"%s\"\n"
+    "VERSION=\"%s (%s)\"\n"
+    "ID=luna\n"
+    "ID_LIKE=ubuntu debian\n"
+    "PRETTY_NAME=\"%s %s\"\n"
+    "VERSION_ID=\"%s\"\n"
+    "HOME_URL=\"https://luna-linux.org\"\n"
+    "SUPPORT_URL=\"https://forum.luna-linux.org\"\n"
+    "BUG_REPORT_URL=\"https://bugs.luna-linux.org\"\n"
+    "PRIVACY_POLICY_URL=\"https://luna-linux.org/privacy\"\n"
+    "VERSION_CODENAME=%s\n"
+    "UBUNTU_CODENAME=jammy\n"
+    "EOF\n\n"
+    "cat > /etc/lsb-release << 'EOF'\n"
+    "DISTRIB_ID=LunaLinux\n"
+    "DISTRIB_RELEASE=%s\n"
+    "DISTRIB_CODENAME=%s\n"
+    "DISTRIB_DESCRIPTION=\"%s %s\"\n"
+    "EOF\n\n"
+    "# Чистка системы (архив пакетов — общий кэш хоста, к этому шагу он\n"
+    "# уже отключён, поэтому apt clean очищает только каталог образа)\n"
+    "apt autoremove -y\n"
+    "apt clean\n";
+
+// Конфигурация GRUB для LiveCD: имя дистрибутива, кодовое имя, версия
+// подставляются из конфигурации редакции
+static const char live_grub_cfg[] =
+    "set timeout=30\n"
+    "set default=0\n\n"
+    "menuentry \"Start %s %s %s Live (Wayland)\" {\n"
+    "    linux /casper/vmlinuz boot=casper noprompt quiet splash ---\n"
+    "    initrd /casper/initrd\n"
+    "}\n\n"
+    "menuentry \"Start %s %s %s Live (Safe Graphics)\" {\n"
+    "    linux /casper/vmlinuz boot=casper nomodeset quiet splash ---\n"
+    "    initrd /casper/initrd\n"
+    "}\n\n"
+    "menuentry \"Install %s %s %s\" {\n"
+    "    linux /casper/vmlinuz boot=casper noprompt only-ubiquity quiet splash ---\n"
+    "    initrd /casper/initrd\n"
+    "}\n\n"
+    "menuentry \"Boot from first hard disk\" {\n"
+    "    set root=(hd0)\n"
+    "    chainloader +1\n"
+    "}\n";
+
+// Информация о диске: "Luna Linux Stellar 1.0 amd64", база Ubuntu
+static const char disk_info[] =
+    "%s %s %s %s\n"
+    "Based on Ubuntu %s%s\n";
+
+// Пакеты, включаемые в базовую систему mmdebstrap
+static const char base_include[] =
+    "systemd,systemd-sysv,dbus,locales,kbd,console-setup,network-manager";
+
+// Метка тома ISO
+static const char iso_volume_id[] = "Luna Linux";
+
+// Образ ISO: загрузка BIOS и EFI с CD через El Torito, с USB — через
+// раздел EFI в GPT. md5sum.txt проверяет casper (integrity-check)
+static const IsoOptions iso_options = {
+    .volume_id = iso_volume_id,
+    .bios_image = "boot/grub/bios.img",
+    .efi_image = "boot/grub/efi.img",
+    .hybrid = true,
+    .md5_list = "md5sum.txt",
+    .checksums = true
+};
+
+// Встроенная конфигурация ядер GRUB: найти диск Luna Linux и загрузить его grub.cfg
+static const char boot_embed_cfg[] =
+    "search --set=root --file /.disk/info\n"
+    "set prefix=($root)/boot/grub\n"
+    "configfile /boot/grub/grub.cfg\n";
+
+// Что производит шаг сборки (используется кэшем шагов)
+typedef enum {
+    OUTPUT_NONE,
+    OUTPUT_CHROOT,
+    OUTPUT_IMAGEDIR,
+    OUTPUT_ISO,
+    OUTPUT_COUNT
+} StepOutput;
+
+// Шаги сборки (узлы графа)
+enum {
+    STEP_DIRS,
+    STEP_DEPENDENCIES,
+    STEP_PREFETCH,
+    STEP_BASE,
+    STEP_PACKAGES,
+    STEP_GRUB,
+    STEP_KDE,
+    STEP_CALAMARES,
+    STEP_SOFTWARE,
+    STEP_DEDUP,
+    STEP_SQUASHFS_PREFILL,
+    STEP_ISO_FILES,
+    STEP_BOOT_CONFIG,
+    STEP_BOOT_IMAGES,
+    STEP_CASPER,
+    STEP_ISO,
+    STEP_CLEANUP,
+    STEP_COUNT
+};
+
+// Слой шага chroot в стеке: слой 0 — пустой нижний, слой шага — следующий
+// за его номером. Последний шаг, чьи слои сжимаются заранее
+#define step_layer(step) ((step) + 1)
+#define PREFILL_LAST_STEP STEP_PACKAGES
+
+// Описание шага сборки
+typedef struct {
+    const char *title;
+    int (*run)(BuildConfig *config);
+    StepOutput output;
+    int reads_chroot;       // шаг читает готовый chroot (монтируется вид всех слоёв)
+    const char *inputs[3];  // встроенные скрипты и шаблоны, от которых зависит результат
+    int deps[SCHED_MAX_DEPS];
+    int dep_count;
+} BuildStep;
+
+// Граф шагов: зависимости объявляются раньше зависящих от них шагов
+static const BuildStep build_steps[STEP_COUNT] = {
+    [STEP_DIRS] = { "Создание структуры каталогов", create_directory_structure,
+                    OUTPUT_NONE, 0, { NULL }, { 0 }, 0 },
+    [STEP_DEPENDENCIES] = { "Проверка зависимостей", check_dependencies,
+                            OUTPUT_NONE, 0, { NULL }, { 0 }, 0 },
+    [STEP_BASE] = { "Построение базовой системы", build_base_system,
+                    OUTPUT_CHROOT, 0, { base_include, NULL }, { STEP_DIRS }, 1 },
+    [STEP_PREFETCH] = { "Предзагрузка пакетов в кэш", prefetch_packages,
+                        OUTPUT_NONE, 0, { NULL }, { STEP_DIRS }, 1 },
+    [STEP_PACKAGES] = { "Установка пакетов одной транзакцией apt", install_packages,
+                        OUTPUT_CHROOT, 0, { NULL }, { STEP_BASE, STEP_PREFETCH }, 2 },
+    [STEP_GRUB] = { "Настройка GRUB с кастомной темой", customize_grub,
+                    OUTPUT_CHROOT, 0, { grub_setup, NULL }, { STEP_PACKAGES }, 1 },
+    [STEP_KDE] = { "Настройка KDE Plasma с Wayland", configure_kde_plasma,
+                   OUTPUT_CHROOT, 0, { kde_setup, NULL }, { STEP_GRUB }, 1 },
+    [STEP_CALAMARES] = { "Настройка графического установщика Calamares", configure_calamares,
+                         OUTPUT_CHROOT, 0, { calamares_setup, NULL }, { STEP_KDE }, 1 },
+    [STEP_SOFTWARE] = { "Системные идентификаторы и очистка", configure_system,
+                        OUTPUT_CHROOT, 0, { software_setup, NULL }, { STEP_CALAMARES }, 1 },
+    [STEP_DEDUP] = { "Замена одинаковых файлов жёсткими ссылками", dedup_chroot,
+                     OUTPUT_CHROOT, 0, { NULL }, { STEP_SOFTWARE }, 1 },
+    [STEP_SQUASHFS_PREFILL] = { "Предварительное сжатие нижних слоёв", prefill_squashfs,
+                                OUTPUT_NONE, 0, { NULL }, { PREFILL_LAST_STEP }, 1 },
+    [STEP_ISO_FILES] = { "Подготовка файлов для ISO", prepare_iso_files,
+                         OUTPUT_IMAGEDIR, 1, { NULL }, { STEP_DEDUP, STEP_SQUASHFS_PREFILL }, 2 },
+    [STEP_BOOT_CONFIG] = { "Конфигурация загрузчика LiveCD", create_boot_config,
+                           OUTPUT_NONE, 0, { live_grub_cfg, disk_info, NULL }, { STEP_DIRS }, 1 },
+    [STEP_BOOT_IMAGES] = { "Загрузочные образы BIOS и EFI", create_boot_images,
+                           OUTPUT_NONE, 0, { boot_embed_cfg, NULL }, { STEP_DIRS }, 1 },
+    [STEP_CASPER] = { "Размещение системы в каталоге casper", stage_casper_files,
+                      OUTPUT_NONE, 0, { NULL }, { STEP_ISO_FILES }, 1 },
+    [STEP_ISO] = { "Создание ISO образа", create_iso_image,
+                   OUTPUT_ISO, 0, { ISO_FORMAT, iso_volume_id, NULL },
+                   { STEP_CASPER, STEP_BOOT_CONFIG, STEP_BOOT_IMAGES, STEP_DEPENDENCIES }, 4 },
+    [STEP_CLEANUP] = { "Завершение сборки", cleanup_build,
+                       OUTPUT_NONE, 0, { NULL }, { STEP_ISO }, 1 }
+};
+
+// Действие шага в текущей сборке
+typedef enum {
+    ACTION_SKIP,     // результат не нужен или уже есть в рабочем каталоге
+    ACTION_RESTORE,  // результат разворачивается из кэша
+    ACTION_RUN       // шаг выполняется
+} StepAction;
+
+// План сборки: ключи шагов и их действия
+typedef struct {
+    char keys[STEP_COUNT][SHA256_HEX_SIZE];
+    StepAction actions[STEP_COUNT];
+    StepCache cache;
+    ExecIo io[STEP_COUNT];                   // блочный ввод-вывод команд шага
+    unsigned long long ram_bytes[STEP_COUNT]; // прирост занятого объёма tmpfs
+    bool excluded[STEP_COUNT];               // шаг в другой части матричной сборки
+    _Atomic int restores_left;               // пока не 0, кэш удерживается от вытеснения
+} BuildPlan;
+
+static const char *step_output_path(BuildConfig *config, StepOutput output);
+static void step_target(BuildConfig *config, int index, char *target, char *stamp, size_t size);
+static void compute_step_key(int index, BuildConfig *config, BuildPlan *plan);
+static bool step_in_workdir(BuildConfig *config, int index, char keys[][SHA256_HEX_SIZE]);
+static void plan_build(BuildPlan *plan, BuildConfig *config);
+static int run_node(void *ctx, int index);
+static int restore_step(BuildPlan *plan, int index);
+static int run_step(BuildConfig *config, int index, const char *key, StepCache *cache);
+static void handle_signal(int sig);
+static void handle_log_signal(int sig);
+static void setup_ram_build(BuildConfig *config);
+static void finish_ram_build(BuildConfig *config, int result);
+static void print_io_report(const BuildPlan *plan);
+static void output_path(const BuildConfig *config, const char *suffix, char *path, size_t size);
+static int format_path(char *path, size_t size, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+static int publish_iso_sums(BuildConfig *config);
+static void write_trace(const BuildConfig *config);
+static void report_log(const char *path);
+static int benchmark_squashfs(BuildConfig *config, int sample_mb);
+static int load_build_config(int argc, char *argv[], BuildConfig *config, const char *edition);
+static int load_squashfs_settings(const BuildConfig *config);
+static int build_main(int argc, char *argv[]);
+static int build_image(const bool *excluded);
+static int build_matrix(int argc, char *argv[], char *files[], int count);
+static int daemon_main(int argc, char *argv[]);
+static int client_main(int argc, char *argv[]);
+
+// Наибольшее число редакций матричной сборки
+#define MATRIX_MAX 8
+
+// Контрольные суммы последнего записанного образа в рабочем каталоге
+#define ISO_SUMS_FILE ".iso-sums"
+
 // Глобальные переменные
 BuildConfig g_config;
+LayerStack g_layers;
+DebCache g_debcache;
+RamDisk g_ramdisk;
+SquashSettings g_squashfs;
+SqfsWriter *g_sqfs;     // образ, начатый предварительным сжатием
+DedupStats g_dedup;     // итоги дедупликации в этой сборке
+bool g_dependencies_checked;    // проверены службой сборки при запуске
 
 int main(int argc, char *argv[]) {
-    int option;
-    int result = 0;
+    // Служба сборки и её клиент со своими опциями
+    if (argc > 1 && strcmp(argv[1], "daemon") == 0) {
+        return daemon_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && (strcmp(argv[1], "submit") == 0 || strcmp(argv[1], "status") == 0)) {
+        return client_main(argc - 1, argv + 1);
+    }
+    return build_main(argc, argv);
+}
 
-    // Инициализация конфигурации
-    init_config(&g_config);
+/**
+ * Конфигурация сборки: значения по умолчанию, затем luna.conf, затем
+ * файл редакции edition (NULL — без него), затем опции.
+ * 0 — можно собирать, 1 — ошибка, 2 — выведена справка
+ */
+static int load_build_config(int argc, char *argv[], BuildConfig *config, const char *edition) {
+    int option;
+    static const char options[] = "vchnC:D:m:Lr:j:t:RFf:z:l:o:";
+
+    // Файл выбирается опцией -f, поэтому он ищется отдельным проходом
+    config_init(config);
+    optind = 1;
+    opterr = 0;
+    while ((option = getopt(argc, argv, options)) != -1) {
+        if (option == 'f') {
+            snprintf(config->config_file, sizeof(config->config_file), "%s", optarg);
+        }
+    }
+    bool default_config = strcmp(config->config_file, "luna.conf") == 0;
+    if ((!default_config || file_exists(config->config_file)) &&
+        config_load_from_file(config, config->config_file) != 0) {
+        fprintf(stderr, "Не удалось прочитать конфигурацию %s\n", config->config_file);
+        return 1;
+    }
+    if (edition && config_load_from_file(config, edition) != 0) {
+        fprintf(stderr, "Не удалось прочитать редакцию %s\n", edition);
+        return 1;
+    }
+    optind = 1;
+    opterr = 1;
 
     // Парсинг аргументов командной строки
-    while ((option = getopt(argc, argv, "vch")) != -1) {
+    while ((option = getopt(argc, argv, options)) != -1) {
         switch (option) {
             case 'v':
-                g_config.verbose = 1;
+                config->verbose = 1;
                 break;
             case 'c':
-                g_config.clean_build = 1;
+                config->clean_build = 1;
+                break;
+            case 'n':
+                config->use_cache = 0;
+                break;
+            case 'C':
+                snprintf(config->cachedir, sizeof(config->cachedir), "%s", optarg);
+                break;
+            case 'D':
+                snprintf(config->debcachedir, sizeof(config->debcachedir), "%s", optarg);
+                break;
+            case 'm':
+                snprintf(config->mirror, sizeof(config->mirror), "%s", optarg);
+                break;
+            case 'L':
+                config->use_layers = 0;
+                break;
+            case 'r':
+                config->resume_layer = atoi(optarg);
+                break;
+            case 'j':
+                config->jobs = atoi(optarg);
+                break;
+            case 't':
+                config->command_timeout = atoi(optarg);
+                break;
+            case 'R':
+                config->ram_build = 1;
+                break;
+            case 'F':
+                config->fused_packaging = 1;
+                break;
+            case 'f':
+                break;
+            case 'z':
+                snprintf(config->squashfs_profile, sizeof(config->squashfs_profile), "%s", optarg);
+                break;
+            case 'l':
+                snprintf(config->log_level, sizeof(config->log_level), "%s", optarg);
+                break;
+            case 'o':
+                snprintf(config->iso_target, sizeof(config->iso_target), "%s", optarg);
                 break;
             case 'h':
-                printf("Использование: %s [опции]\n", argv[0]);
+                printf("Использование: %s [опции] [bench-squashfs [MB] | matrix редакция.conf...]\n",
+                       argv[0]);
                 printf("  -v    Подробный вывод\n");
                 printf("  -c    Полная очистка перед сборкой\n");
+                printf("  -n    Не использовать кэш шагов\n");
+                printf("  -C    Каталог кэша шагов (по умолчанию ~/.cache/luna-linux-build)\n");
+                printf("  -D    Общий кэш пакетов .deb (по умолчанию ~/.cache/luna-linux-debs)\n");
+                printf("  -m    Зеркало Ubuntu (http:// или file://, по умолчанию archive.ubuntu.com)\n");
+                printf("  -L    Собирать chroot в одном каталоге, без слоёв overlayfs\n");
+                printf("  -r N  Продолжить со слоя шага N, отбросив слои выше него\n");
+                printf("  -j N  Число параллельно выполняемых шагов (по умолчанию — число ядер)\n");
+                printf("  -t S  Предельное время одной команды в секундах (по умолчанию без ограничения)\n");
+                printf("  -R    Собирать chroot, образ и дерево ISO в памяти (tmpfs)\n");
+                printf("  -F    Писать ядро, initrd и squashfs сразу в casper дерева ISO\n");
+                printf("  -f    Файл конфигурации (по умолчанию luna.conf, если есть)\n");
+                printf("  -z P  Профиль сжатия squashfs: release-xz, fast-zstd, lz4-dev, no-compression\n");
+                printf("  -l L  Уровень вывода в терминал: debug, output, info, warning, error\n"
+                       "        (SIGUSR1 во время сборки — debug, SIGUSR2 — обратно)\n");
+                printf("  -o T  Писать ISO одновременно в T: блочное устройство (например, USB)\n"
+                       "        или - (стандартный вывод)\n");
                 printf("  -h    Эта справка\n");
-                return 0;
+                printf("\nbench-squashfs [MB] — сравнить профили сжатия на выборке из chroot "
+                       "(по умолчанию 256 MB)\n");
+                printf("matrix редакция.conf... — собрать несколько редакций: общие шаги "
+                       "один раз,\n        затем редакции параллельно поверх общих слоёв\n");
+                printf("cache-prune [MB] — сократить кэш шагов до MB (по умолчанию CacheMaxMB, "
+                       "0 — очистить)\n");
+                printf("\n%s daemon [-S сокет] [-b N] — служба сборки, N сборок одновременно\n"
+                       "%s submit [-S сокет] [-P приоритет] [опции] — сборка через службу\n"
+                       "%s status [-S сокет] — очередь службы\n",
+                       argv[0], argv[0], argv[0]);
+                return 2;
             default:
                 fprintf(stderr, "Неизвестная опция: %c\n", option);
                 return 1;
         }
     }
 
+    if (config->resume_layer >= 0 && !config->use_layers) {
+        fprintf(stderr, "Опция -r требует сборки со слоями overlayfs\n");
+        return 1;
+    }
+
+    // Слои в tmpfs не переживают сборку, продолжать не с чего
+    if (config->resume_layer >= 0 && config->ram_build) {
+        fprintf(stderr, "Опция -r несовместима со сборкой в памяти (-R)\n");
+        return 1;
+    }
+
+    LogLevel log_level;
+    if (log_parse_level(config->log_level, &log_level) != 0) {
+        fprintf(stderr, "Неизвестный уровень журнала: %s\n", config->log_level);
+        return 1;
+    }
+
+    CleanMode clean_mode;
+    if (clean_parse_mode(config->clean_mode, &clean_mode) != 0) {
+        fprintf(stderr, "Неизвестный способ очистки: %s (background или parallel)\n",
+                config->clean_mode);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Сборка образа: из командной строки или в процессе службы
+ */
+static int build_main(int argc, char *argv[]) {
+    int loaded = load_build_config(argc, argv, &g_config, NULL);
+    if (loaded != 0) {
+        return loaded == 2 ? 0 : 1;
+    }
+
+    // Уровень терминала; в журнал сборки пишется всё, включая вывод команд
+    LogLevel log_level = LOG_INFO;
+    log_parse_level(g_config.log_level, &log_level);
+    log_set_level(LOG_SINK_TERMINAL, g_config.verbose ? LOG_DEBUG : log_level);
+
+    exec_set_default_timeout(g_config.command_timeout);
+
+    if (load_squashfs_settings(&g_config) != 0) {
+        return 1;
+    }
+
+    int command = optind;
+    bool bench = command < argc && strcmp(argv[command], "bench-squashfs") == 0;
+    bool matrix = command < argc && strcmp(argv[command], "matrix") == 0;
+    bool prune = command < argc && strcmp(argv[command], "cache-prune") == 0;
+    if (command < argc && !bench && !matrix && !prune) {
+        fprintf(stderr, "Неизвестная команда: %s\n", argv[command]);
+        return 1;
+    }
+
+    // Очистка кэша шагов до лимита или до указанного размера (0 — целиком)
+    if (prune) {
+        long long max_mb = command + 1 < argc ? atoll(argv[command + 1]) : g_config.cache_max_mb;
+        StepCache cache;
+        if (step_cache_open(&cache, g_config.cachedir, true, 0) != 0) {
+            return 1;
+        }
+        int removed = step_cache_prune(&cache, max_mb * 1024 * 1024);
+        printf("Кэш шагов %s: удалено артефактов %d\n", cache.dir, removed);
+        return 0;
+    }
+
+    if (matrix && g_config.iso_target[0]) {
+        fprintf(stderr, "Опция -o несовместима с матричной сборкой\n");
+        return 1;
+    }
+
+    // Образ в стандартный вывод: сообщения сборки уходят в stderr
+    if (strcmp(g_config.iso_target, "-") == 0 && iso_claim_stdout() != 0) {
+        return 1;
+    }
+
     // Вывод баннера
     print_banner();
 
@@ -100,71 +621,129 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (bench) {
+        int sample_mb = command + 1 < argc ? atoi(argv[command + 1]) : 256;
+        return benchmark_squashfs(&g_config, sample_mb > 0 ? sample_mb : 256);
+    }
+
+    int result;
+    if (matrix) {
+        result = build_matrix(command, argv, argv + command + 1, argc - command - 1);
+    } else {
+        result = build_image(NULL);
+    }
+
+    config_free(&g_config);
+    return result;
+}
+
+/**
+ * Профили сжатия: встроенные, затем luna.conf и файл редакции, затем -z
+ */
+static int load_squashfs_settings(const BuildConfig *config) {
+    squashfs_settings_init(&g_squashfs);
+    for (const ConfigFile *file = config->sources; file; file = file->next) {
+        squashfs_settings_apply(&g_squashfs, file);
+    }
+    if (config->squashfs_profile[0] &&
+        squashfs_select(&g_squashfs, config->squashfs_profile) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Сборка по конфигурации g_config. excluded — шаги, которые выполняет
+ * другая часть матричной сборки (NULL — все шаги в этой сборке)
+ */
+static int build_image(const bool *excluded) {
+    int result = 0;
+
+    trace_init();
     printf(COLOR_CYAN "Начало сборки Luna Linux\n" COLOR_RESET);
     printf(COLOR_YELLOW "Дата и время: %s" COLOR_RESET, ctime(&(time_t){time(NULL)}));
 
-    // Основные шаги сборки
-    const char *steps[] = {
-        "Создание структуры каталогов",
-        "Построение базовой системы",
-        "Настройка GRUB с кастомной темой",
-        "Установка KDE Plasma с Wayland",
-        "Установка графического установщика Calamares",
-        "Установка дополнительного ПО",
-        "Подготовка файлов для ISO",
-        "Создание загрузочной структуры",
-        "Создание ISO образа",
-        "Завершение сборки"
-    };
+    // Журнал сборки рядом с ISO, как и трасса: рабочий каталог очищается -c
+    char log_path[300];
+    output_path(&g_config, ".log.gz", log_path, sizeof(log_path));
+    log_start(log_path);
 
-    int total_steps = sizeof(steps) / sizeof(steps[0]);
+    // Прерывание сборки завершает и запущенные команды
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGUSR1, handle_log_signal);
+    signal(SIGUSR2, handle_log_signal);
 
-    // Выполнение шагов сборки
-    for (int i = 0; i < total_steps; i++) {
-        print_progress(i + 1, total_steps, steps[i]);
+    if (g_config.ram_build) {
+        setup_ram_build(&g_config);
+    }
 
-        int step_result = 0;
-        switch (i) {
-            case 0:
-                step_result = create_directory_structure(&g_config);
-                break;
-            case 1:
-                step_result = build_base_system(&g_config);
-                break;
-            case 2:
-                step_result = customize_grub(&g_config);
-                break;
-            case 3:
-                step_result = install_kde_plasma(&g_config);
-                break;
-            case 4:
-                step_result = install_calamares(&g_config);
-                break;
-            case 5:
-                step_result = install_additional_software(&g_config);
-                break;
-            case 6:
-                step_result = prepare_iso_files(&g_config);
-                break;
-            case 7:
-                step_result = create_boot_structure(&g_config);
-                break;
-            case 8:
-                step_result = create_iso_image(&g_config);
-                break;
-            case 9:
-                step_result = cleanup_build(&g_config);
-                break;
+    // Совмещённая упаковка: образ собирается сразу на своём месте в дереве
+    // ISO, и запись ISO читает его из страничного кэша сразу после сжатия
+    if (g_config.fused_packaging) {
+        int len = snprintf(g_config.imagedir, sizeof(g_config.imagedir), "%s/casper",
+                           g_config.isodir);
+        if (len < 0 || (size_t)len >= sizeof(g_config.imagedir)) {
+            log_error("Слишком длинный путь дерева ISO: %s", g_config.isodir);
+            return 1;
         }
+    }
 
-        if (step_result != 0) {
-            printf(COLOR_RED "\nОшибка на шаге %d: %s\n" COLOR_RESET, i + 1, steps[i]);
-            result = 1;
-            break;
-        }
+    layers_init(&g_layers, g_config.layersdir, g_config.chroot);
+    debcache_open(&g_debcache, g_config.debcachedir, g_config.debcache_max_mb * 1024 * 1024);
+
+    // Слои выше точки возобновления (-r) собираются заново
+    if (g_config.resume_layer >= 0 &&
+        layers_discard_from(&g_layers, g_config.resume_layer + 1) != 0) {
+        return 1;
     }
 
-    if (result == 0) {
+    // План: что выполнить, что развернуть из кэша, что пропустить
+    static BuildPlan plan;
+    memset(&plan, 0, sizeof(plan));
+    if (excluded) {
+        memcpy(plan.excluded, excluded, sizeof(plan.excluded));
+    }
+    plan_build(&plan, &g_config);
+
+    // Независимые шаги выполняются параллельно на пуле потоков
+    Scheduler sched;
+    sched_init(&sched, g_config.jobs, run_node, &plan);
+    for (int i = 0; i < STEP_COUNT; i++) {
+        sched_add(&sched, build_steps[i].title, build_steps[i].deps, build_steps[i].dep_count,
+                  plan.actions[i] == ACTION_SKIP);
+    }
+
+    if (sched_run(&sched) != 0) {
+        log_flush();
+        printf(COLOR_RED "\nОшибка на шаге %d: %s\n" COLOR_RESET,
+               sched.failed + 1, build_steps[sched.failed].title);
+        result = 1;
+    }
+
+    // Восстановления, до которых сборка не дошла из-за ошибки
+    step_cache_release(&plan.cache);
+    layers_unmount(&g_layers);
+    sqfs_writer_close(g_sqfs);
+    g_sqfs = NULL;
+    log_flush();
+    sched_print_summary(&sched);
+    trace_print_summary();
+    write_trace(&g_config);
+    step_cache_print_stats(&plan.cache);
+    debcache_print_stats(&g_debcache);
+
+    if (g_config.ram_build) {
+        print_io_report(&plan);
+        finish_ram_build(&g_config, result);
+    }
+
+    // Образ не записывался в этой сборке — списки сумм обновляются по нему
+    if (result == 0 && !plan.excluded[STEP_ISO] && plan.actions[STEP_ISO] != ACTION_RUN) {
+        publish_iso_sums(&g_config);
+    }
+
+    if (result == 0 && !plan.excluded[STEP_ISO]) {
         printf(COLOR_GREEN "\n═══════════════════════════════════════════\n");
         printf("Сборка Luna Linux успешно завершена!\n");
         printf("ISO файл: %s\n", g_config.output_iso);
@@ -179,11 +758,266 @@ int main(int argc, char *argv[]) {
         printf("═══════════════════════════════════════════\n" COLOR_RESET);
 
         // Инструкция для записи на USB
-        printf(COLOR_YELLOW "\nДля записи на USB используйте:\n" COLOR_RESET);
-        printf("dd if=\"%s\" of=/dev/sdX bs=4M status=progress && sync\n", g_config.output_iso);
-        printf(COLOR_YELLOW "\nИли используйте Etcher/Rufus/Ventoy\n" COLOR_RESET);
+        if (g_config.iso_target[0]) {
+            printf(COLOR_YELLOW "\nОбраз записан также в %s\n" COLOR_RESET,
+                   strcmp(g_config.iso_target, "-") == 0 ? "стандартный вывод"
+                                                         : g_config.iso_target);
+        } else {
+            printf(COLOR_YELLOW "\nДля записи на USB используйте:\n" COLOR_RESET);
+            printf("dd if=\"%s\" of=/dev/sdX bs=4M status=progress && sync\n",
+                   g_config.output_iso);
+            printf(COLOR_YELLOW "\nИли соберите с -o /dev/sdX, или используйте "
+                   "Etcher/Rufus/Ventoy\n" COLOR_RESET);
+        }
+    }
+
+    log_stop();
+    report_log(log_path);
+    return result;
+}
+
+/**
+ * Редакция матричной сборки: конфигурация и процесс её сборки
+ */
+typedef struct {
+    char name[32];
+    BuildConfig config;
+    pid_t pid;
+    int result;
+    double seconds;
+} Edition;
+
+/**
+ * Конфигурация редакции: luna.conf, файл редакции, опции. Рабочий
+ * каталог редакции — editions/<имя> в общем рабочем каталоге, ISO без
+ * своего пути получает имя редакции
+ */
+static int load_edition(int argc, char *argv[], const char *file, Edition *edition) {
+    const char *base = strrchr(file, '/') ? strrchr(file, '/') + 1 : file;
+    size_t len = strcspn(base, ".");
+    if (len == 0 || len >= sizeof(edition->name)) {
+        fprintf(stderr, "Неподходящее имя файла редакции: %s\n", file);
+        return 1;
+    }
+    snprintf(edition->name, sizeof(edition->name), "%.*s", (int)len, base);
+
+    if (load_build_config(argc, argv, &edition->config, file) != 0) {
+        return 1;
+    }
+
+    BuildConfig *config = &edition->config;
+    int written = snprintf(config->workdir, sizeof(config->workdir), "%s/editions/%s",
+                               g_config.workdir, edition->name);
+    if (written < 0 || (size_t)written >= sizeof(config->workdir)) {
+        fprintf(stderr, "Слишком длинный рабочий каталог редакции %s\n", edition->name);
+        return 1;
+    }
+    if (config_derive_paths(config) != 0) {
+        return 1;
+    }
+    if (strcmp(config->output_iso, g_config.output_iso) == 0) {
+        char suffix[sizeof(edition->name) + sizeof("-.iso")];
+        snprintf(suffix, sizeof(suffix), "-%.*s.iso", (int)sizeof(edition->name) - 1,
+                 edition->name);
+        output_path(&g_config, suffix, config->output_iso, sizeof(config->output_iso));
+    }
+
+    // Общий рабочий каталог очищается один раз, до сборки общей части
+    config->clean_build = 0;
+    return 0;
+}
+
+/**
+ * Ключи всех шагов редакции
+ */
+static int edition_keys(Edition *edition, char keys[][SHA256_HEX_SIZE]) {
+    static BuildPlan plan;
+    if (load_squashfs_settings(&edition->config) != 0) {
+        return 1;
+    }
+    for (int i = 0; i < STEP_COUNT; i++) {
+        compute_step_key(i, &edition->config, &plan);
+    }
+    memcpy(keys, plan.keys, sizeof(plan.keys));
+    return 0;
+}
+
+/**
+ * Матричная сборка нескольких редакций. Шаги chroot с одинаковым ключом
+ * во всех редакциях (базовая система, а при общих списках пакетов и
+ * установка) собираются один раз в общем стеке слоёв. Затем каждая
+ * редакция собирается в своём процессе: общие слои входят в её стек
+ * ссылками и остаются нижними слоями overlayfs, а изменения редакции
+ * пишутся в её собственные верхние слои — ветки копирования при записи.
+ */
+static int build_matrix(int argc, char *argv[], char *files[], int count) {
+    static Edition editions[MATRIX_MAX];
+    static char keys[MATRIX_MAX][STEP_COUNT][SHA256_HEX_SIZE];
+
+    if (count < 1 || count > MATRIX_MAX) {
+        fprintf(stderr, "Матричная сборка: нужно от 1 до %d файлов редакций\n", MATRIX_MAX);
+        return 1;
+    }
+    if (!g_config.use_layers || g_config.ram_build || g_config.resume_layer >= 0) {
+        fprintf(stderr, "Матричная сборка требует слоёв overlayfs и несовместима с -R и -r\n");
+        return 1;
+    }
+
+    int result = 1;
+    int loaded = 0;
+    bool ok = true;
+    while (ok && loaded < count) {
+        int e = loaded++;
+        ok = load_edition(argc, argv, files[e], &editions[e]) == 0 &&
+             edition_keys(&editions[e], keys[e]) == 0;
+        for (int j = 0; ok && j < e; j++) {
+            if (strcmp(editions[j].name, editions[e].name) == 0) {
+                fprintf(stderr, "Редакция %s указана дважды\n", editions[e].name);
+                ok = false;
+            }
+        }
+    }
+    if (!ok) {
+        goto out;
+    }
+
+    // Общая часть: шаги chroot с одинаковым ключом во всех редакциях.
+    // Ключи включают ключи зависимостей, поэтому это начало цепочки слоёв
+    bool shared[STEP_COUNT] = { false };
+    bool outside[STEP_COUNT];
+    int shared_count = 0;
+    for (int i = 0; i < STEP_COUNT; i++) {
+        shared[i] = build_steps[i].output == OUTPUT_CHROOT;
+        for (int e = 1; e < count && shared[i]; e++) {
+            shared[i] = strcmp(keys[e][i], keys[0][i]) == 0;
+        }
+        shared_count += shared[i];
+        outside[i] = !shared[i];
+    }
+
+    // Для общей части нужны и зависимости её шагов (каталоги, предзагрузка)
+    for (int i = STEP_COUNT - 1; i >= 0; i--) {
+        for (int d = 0; !outside[i] && d < build_steps[i].dep_count; d++) {
+            outside[build_steps[i].deps[d]] = false;
+        }
+    }
+
+    printf(COLOR_CYAN "Матричная сборка: редакций %d, общих шагов chroot %d\n" COLOR_RESET,
+           count, shared_count);
+    for (int i = 0; i < STEP_COUNT; i++) {
+        if (shared[i]) {
+            printf("  [%02d] %s\n", i + 1, build_steps[i].title);
+        }
+    }
+
+    // Общие зависимости проверяются один раз для всех редакций,
+    // mksquashfs — при сборке редакции по её настройкам [Squashfs]
+    log_step("Проверка зависимостей...");
+    if (!check_all_dependencies(false)) {
+        goto out;
+    }
+    g_dependencies_checked = true;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Общая часть собирается по конфигурации первой редакции (ключи её
+    // шагов у всех редакций одинаковы) в общем рабочем каталоге
+    BuildConfig base = g_config;
+    if (shared_count > 0) {
+        BuildConfig *first = &editions[0].config;
+        g_config = *first;
+        memcpy(g_config.workdir, base.workdir, sizeof(base.workdir));
+        memcpy(g_config.chroot, base.chroot, sizeof(base.chroot));
+        memcpy(g_config.imagedir, base.imagedir, sizeof(base.imagedir));
+        memcpy(g_config.isodir, base.isodir, sizeof(base.isodir));
+        memcpy(g_config.layersdir, base.layersdir, sizeof(base.layersdir));
+        memcpy(g_config.output_iso, base.output_iso, sizeof(base.output_iso));
+        g_config.clean_build = base.clean_build;
+
+        printf(COLOR_CYAN "\nСборка общей части редакций\n" COLOR_RESET);
+        int shared_result = load_squashfs_settings(&g_config) == 0 ? build_image(outside) : 1;
+        g_config = base;
+        if (shared_result != 0) {
+            goto out;
+        }
+    } else if (base.clean_build) {
+        create_directory_structure(&g_config);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double shared_seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+    // Общие слои входят в стек каждой редакции ссылками
+    LayerStack shared_stack;
+    layers_init(&shared_stack, base.layersdir, base.chroot);
+    for (int e = 0; e < count; e++) {
+        LayerStack stack;
+        layers_init(&stack, editions[e].config.layersdir, editions[e].config.chroot);
+        if (make_dirs(editions[e].config.layersdir) != 0) {
+            log_error("Не удалось создать каталог %s", editions[e].config.layersdir);
+            goto out;
+        }
+        for (int i = 0; i < STEP_COUNT; i++) {
+            if (shared[i] && layers_share(&stack, step_layer(i), &shared_stack) != 0) {
+                goto out;
+            }
+        }
+    }
+
+    // Редакции собираются параллельно, каждая в своём процессе со своими
+    // глобальными данными сборки
+    log_flush();
+    fflush(stdout);
+    fflush(stderr);
+    for (int e = 0; e < count; e++) {
+        editions[e].pid = fork();
+        if (editions[e].pid == 0) {
+            g_config = editions[e].config;
+            printf(COLOR_CYAN "\nСборка редакции %s\n" COLOR_RESET, editions[e].name);
+            int status = load_squashfs_settings(&g_config) == 0 ? build_image(shared) : 1;
+            fflush(stdout);
+            _exit(status);
+        }
+        if (editions[e].pid < 0) {
+            log_error("Не удалось запустить сборку редакции %s: %s",
+                      editions[e].name, strerror(errno));
+            editions[e].result = 1;
+        }
+    }
+
+    result = 0;
+    for (int finished = 0; finished < count; finished++) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int e = 0; e < count; e++) {
+            if (editions[e].pid == pid) {
+                editions[e].result = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+                editions[e].seconds = (now.tv_sec - start.tv_sec) +
+                                      (now.tv_nsec - start.tv_nsec) / 1e9 - shared_seconds;
+            }
+        }
+    }
+
+    printf(COLOR_CYAN "\nМатричная сборка: общая часть %.1f с\n" COLOR_RESET, shared_seconds);
+    print_padded("Редакция", 16);
+    print_padded("Время, с", 12);
+    printf("ISO\n");
+    for (int e = 0; e < count; e++) {
+        print_padded(editions[e].name, 16);
+        printf("%-12.1f%s%s\n", editions[e].seconds, editions[e].config.output_iso,
+               editions[e].result == 0 ? "" : COLOR_RED " (ошибка)" COLOR_RESET);
+        result = result || editions[e].result != 0;
     }
 
+out:
+    for (int e = 0; e < loaded; e++) {
+        config_free(&editions[e].config);
+    }
     return result;
 }
 
@@ -198,51 +1032,32 @@ void print_banner() {
     printf("\n");
 }
 
-/**
- * Инициализация конфигурации сборки
- */
-void init_config(BuildConfig *config) {
-    // Настройки Luna Linux
-    strcpy(config->distro_name, "Luna Linux");
-    strcpy(config->distro_short_name, "luna-linux");
-    strcpy(config->version, "1.0");
-    strcpy(config->codename, "stellar");
-    strcpy(config->ubuntu_version, "22.04");
-    strcpy(config->ubuntu_codename, "jammy");
-    strcpy(config->arch, "amd64");
-
-    // Пути
-    snprintf(config->workdir, sizeof(config->workdir), "%s/luna-linux-build", getenv("HOME"));
-    snprintf(config->chroot, sizeof(config->chroot), "%s/chroot", config->workdir);
-    snprintf(config->imagedir, sizeof(config->imagedir), "%s/image", config->workdir);
-    snprintf(config->isodir, sizeof(config->isodir), "%s/iso", config->workdir);
-    snprintf(config->output_iso, sizeof(config->output_iso),
-             "%s/Luna-Linux-%s-%s.iso", getenv("HOME"), config->ubuntu_version, config->arch);
-
-    // Флаги
-    config->verbose = 0;
-    config->clean_build = 0;
-}
-
 /**
  * Создание структуры каталогов
  */
 int create_directory_structure(BuildConfig *config) {
-    printf(COLOR_YELLOW "Создание структуры каталогов...\n" COLOR_RESET);
+    log_step("Создание структуры каталогов...");
 
     // Очистка предыдущей сборки при необходимости
+    // chroot может остаться смонтированным после прерванной сборки
+    umount2(config->chroot, MNT_DETACH);
+
     if (config->clean_build) {
-        char cmd[512];
-        snprintf(cmd, sizeof(cmd), "rm -rf %s", config->workdir);
-        execute_command(cmd, 0);
+        CleanMode mode = CLEAN_BACKGROUND;
+        clean_parse_mode(config->clean_mode, &mode);
+        if (clean_dir(config->workdir, mode, config->jobs) != 0) {
+            log_error("Не удалось очистить %s", config->workdir);
+            return 1;
+        }
     }
 
     // Создание основных каталогов
     const char *dirs[] = {
         config->workdir,
         config->chroot,
-        config->imagedir,
+        config->layersdir,
         config->isodir,
+        config->imagedir,
         NULL
     };
 
@@ -260,481 +1075,1411 @@ int create_directory_structure(BuildConfig *config) {
  * Построение базовой системы Ubuntu
  */
 int build_base_system(BuildConfig *config) {
-    printf(COLOR_YELLOW "Построение базовой системы...\n" COLOR_RESET);
+    log_step("Построение базовой системы...");
 
     // Проверка наличия mmdebstrap
-    if (execute_command("which mmdebstrap", 0) != 0) {
-        printf(COLOR_RED "Ошибка: mmdebstrap не установлен\n" COLOR_RESET);
-        printf("Установите: apt install mmdebstrap\n");
+    if (!check_dependency("mmdebstrap")) {
+        log_error("mmdebstrap не установлен. Установите: apt install mmdebstrap");
         return 1;
     }
 
     // Команда для создания базовой системы
-    char cmd[1024];
-    snprintf(cmd, sizeof(cmd),
-        "mmdebstrap --variant=important "
-        "--include=systemd,systemd-sysv,dbus,locales,kbd,console-setup,network-manager "
-        "%s %s http://archive.ubuntu.com/ubuntu/",
-        config->ubuntu_codename, config->chroot);
+    ExecArgs args;
+    exec_args_init(&args);
+
+    // Общий кэш пакетов монтируется хуками mmdebstrap: каталог chroot
+    // перед запуском должен быть пуст. Кэш отключается до финальной
+    // очистки mmdebstrap, поэтому пакеты в нём остаются.
+    if (g_debcache.enabled) {
+        exec_args_add(&args, "flock");
+        exec_args_addf(&args, "%s/" DEBCACHE_DOWNLOAD_LOCK, g_debcache.dir);
+    }
+
+    exec_args_add(&args, "mmdebstrap");
+    exec_args_add(&args, "--variant=important");
+    exec_args_addf(&args, "--include=%s", base_include);
+    exec_args_addf(&args, "--components=%s", config->components);
+
+    if (g_debcache.enabled) {
+        exec_args_add(&args, "--skip=download/empty");
+        exec_args_add(&args, "--skip=essential/unlink");
+        exec_args_addf(&args, "--setup-hook=mkdir -p \"$1\"" DEBCACHE_CHROOT_DIR
+                       " && mount --bind \"%s\" \"$1\"" DEBCACHE_CHROOT_DIR, g_debcache.dir);
+        exec_args_add(&args, "--customize-hook=umount \"$1\"" DEBCACHE_CHROOT_DIR);
+    }
 
-    return execute_command(cmd, config->verbose);
+    exec_args_add(&args, config->ubuntu_codename);
+    exec_args_add(&args, config->chroot);
+    exec_args_add(&args, config->mirror);
+
+    int result = 1;
+    if (debcache_attach(&g_debcache, config->chroot, false) == 0) {
+        result = exec_command(args.argv, config->verbose);
+        debcache_detach(&g_debcache);
+    }
+
+    exec_args_free(&args);
+    return result;
 }
 
 /**
- * Настройка кастомного GRUB с темой Luna Linux
+ * Запуск встроенного скрипта внутри chroot
  */
-int customize_grub(BuildConfig *config) {
-    printf(COLOR_YELLOW "Настройка кастомного GRUB с логотипом Луны...\n" COLOR_RESET);
-
-    // Создание скрипта настройки GRUB
-    const char *grub_setup =
-        "#!/bin/bash\n"
-        "set -e\n\n"
-        "# Установка GRUB\n"
-        "apt update\n"
-        "apt install -y grub2-common grub-pc grub-efi-amd64 grub-efi-amd64-bin\n\n"
-        "# Создание кастомной темы Luna Linux\n"
-        "mkdir -p /boot/grub/themes/luna-linux\n\n"
-        "# Создание файла темы\n"
-        "cat > /boot/grub/themes/luna-linux/theme.txt << 'EOF'\n"
-        "# Luna Linux GRUB Theme\n\n"
-        "desktop-color: \"#0f0f1a\"\n"
-        "desktop-image: \"background.png\"\n\n"
-        "+ boot_menu {\n"
-        "    left = 30%\n"
-        "    top = 30%\n"
-        "    width = 40%\n"
-        "    height = 40%\n"
-        "    item_font = \"Unifont Regular 16\"\n"
-        "    item_color = \"#ffffff\"\n"
-        "    selected_item_color = \"#ff6600\"\n"
-        "    item_height = 40\n"
-        "    item_spacing = 10\n"
-        "}\n\n"
-        "+ label {\n"
-        "    text = \"Luna Linux\"\n"
-        "    color = \"#ff6600\"\n"
-        "    font = \"Unifont Regular 24\"\n"
-        "    left = 50%\n"
-        "    top = 20%\n"
-        "    align = \"center\"\n"
-        "}\n\n"
-        "+ label {\n"
-        "    text = \"Stellar Edition\"\n"
-        "    color = \"#aaaaaa\"\n"
-        "    font = \"Unifont Regular 16\"\n"
-        "    left = 50%\n"
-        "    top = 26%\n"
-        "    align = \"center\"\n"
-        "}\n"
-        "EOF\n\n"
-        "# Создание фонового изображения (простой градиент)\n"
-        "echo 'iVBORw0KGgoAAAANSUhEUgAAAEAAAABACAYAAACqaXHeAAAABHNCSVQICAgIfAhkiAAAAAlwSFlzAAAOxAAADsQBlSsOGwAAABl0RVh0U29mdHdhcmUAd3d3Lmlua3NjYXBlLm9yZ5vuPBoAAAArSURBVHic7cEBDQAAAMKg9U9tCF8gAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAB8GQNkAAECp1Zh3QAAAABJRU5ErkJggg==' | base64 -d > /boot/grub/themes/luna-linux/background.png\n\n"
-        "# Настройка конфигурации GRUB\n"
-        "cat > /etc/default/grub << 'EOF'\n"
-        "GRUB_DEFAULT=0\n"
-        "GRUB_TIMEOUT=10\n"
-        "GRUB_TIMEOUT_STYLE=menu\n"
-        "GRUB_DISTRIBUTOR=\"Luna Linux\"\n"
-        "GRUB_CMDLINE_LINUX_DEFAULT=\"quiet splash\"\n"
-        "GRUB_CMDLINE_LINUX=\"\"\n"
-        "GRUB_BACKGROUND=\"/boot/grub/themes/luna-linux/background.png\"\n"
-        "GRUB_THEME=\"/boot/grub/themes/luna-linux/theme.txt\"\n"
-        "GRUB_GFXMODE=auto\n"
-        "GRUB_DISABLE_OS_PROBER=false\n"
-        "GRUB_DISABLE_RECOVERY=\"true\"\n"
-        "EOF\n\n"
-        "# Обновление GRUB\n"
-        "update-grub\n";
-
-    // Сохранение скрипта во временный файл
-    char script_path[] = "/tmp/setup-grub.sh";
-    if (write_file(script_path, grub_setup) != 0) {
-        return 1;
-    }
-
-    // Копирование скрипта в chroot и выполнение
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "cp %s %s/tmp/", script_path, config->chroot);
-    execute_command(cmd, 0);
-
-    snprintf(cmd, sizeof(cmd), "chmod +x %s/tmp/setup-grub.sh", config->chroot);
-    execute_command(cmd, 0);
-
-    snprintf(cmd, sizeof(cmd), "chroot %s /bin/bash /tmp/setup-grub.sh", config->chroot);
-    return execute_command(cmd, config->verbose);
-}
-
-/**
- * Установка KDE Plasma с поддержкой Wayland
- */
-int install_kde_plasma(BuildConfig *config) {
-    printf(COLOR_YELLOW "Установка KDE Plasma с Wayland...\n" COLOR_RESET);
-
-    const char *kde_setup =
-        "#!/bin/bash\n"
-        "set -e\n\n"
-        "apt update\n"
-        "apt install -y \\\n"
-        "    kde-plasma-desktop \\\n"
-        "    plasma-workspace-wayland \\\n"
-        "    kwin-wayland \\\n"
-        "    sddm \\\n"
-        "    sddm-theme-breeze \\\n"
-        "    plasma-nm \\\n"
-        "    plasma-pa \\\n"
-        "    dolphin \\\n"
-        "    konsole \\\n"
-        "    kate \\\n"
-        "    ark\n\n"
-        "# Настройка SDDM\n"
-        "cat > /etc/sddm.conf << 'EOF'\n"
-        "[Autologin]\n"
-        "User=luna\n"
-        "Session=plasmawayland\n\n"
-        "[Theme]\n"
-        "Current=breeze\n\n"
-        "[Wayland]\n"
-        "CompositorCommand=kwin_wayland --no-lockscreen\n"
-        "EOF\n\n"
-        "# Создание пользователя luna\n"
-        "useradd -m -s /bin/bash luna || true\n"
-        "echo \"luna:luna\" | chpasswd\n"
-        "usermod -aG sudo luna\n"
-        "echo \"luna ALL=(ALL) NOPASSWD:ALL\" > /etc/sudoers.d/luna\n"
-        "chmod 440 /etc/sudoers.d/luna\n";
-
-    char script_path[] = "/tmp/setup-kde.sh";
-    if (write_file(script_path, kde_setup) != 0) {
-        return 1;
-    }
-
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "cp %s %s/tmp/", script_path, config->chroot);
-    execute_command(cmd, 0);
-
-    snprintf(cmd, sizeof(cmd), "chmod +x %s/tmp/setup-kde.sh", config->chroot);
-    execute_command(cmd, 0);
-
-    snprintf(cmd, sizeof(cmd), "chroot %s /bin/bash /tmp/setup-kde.sh", config->chroot);
-    return execute_command(cmd, config->verbose);
-}
-
-/**
- * Установка графического установщика Calamares
- */
-int install_calamares(BuildConfig *config) {
-    printf(COLOR_YELLOW "Установка Calamares...\n" COLOR_RESET);
-
-    const char *calamares_setup =
-        "#!/bin/bash\n"
-        "set -e\n\n"
-        "apt install -y calamares calamares-settings-ubuntu\n\n"
-        "# Создание конфигурации для Luna Linux\n"
-        "mkdir -p /etc/calamares\n"
-        "cp -r /usr/share/calamares/* /etc/calamares/\n\n"
-        "# Брендинг Luna Linux\n"
-        "mkdir -p /usr/share/calamares/branding/luna-linux\n"
-        "cat > /usr/share/calamares/branding/luna-linux/branding.desc << 'EOF'\n"
-        "---\n"
-        "componentName:  Luna Linux\n"
-        "shortName:      Luna\n"
-        "version:        1.0\n"
-        "bootloaderEntryName: \"Luna Linux\"\n"
-        "welcomeStyleCalamares: true\n"
-        "---\n"
-        "EOF\n";
-
-    char script_path[] = "/tmp/setup-calamares.sh";
-    if (write_file(script_path, calamares_setup) != 0) {
-        return 1;
-    }
-
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "cp %s %s/tmp/", script_path, config->chroot);
-    execute_command(cmd, 0);
-
-    snprintf(cmd, sizeof(cmd), "chmod +x %s/tmp/setup-calamares.sh", config->chroot);
-    execute_command(cmd, 0);
-
-    snprintf(cmd, sizeof(cmd), "chroot %s /bin/bash /tmp/setup-calamares.sh", config->chroot);
-    return execute_command(cmd, config->verbose);
-}
-
-/**
- * Установка дополнительного программного обеспечения
- */
-int install_additional_software(BuildConfig *config) {
-    printf(COLOR_YELLOW "Установка дополнительного ПО...\n" COLOR_RESET);
-
-    const char *software_setup =
-        "#!/bin/bash\n"
-        "set -e\n\n"
-        "apt update\n"
-        "apt install -y \\\n"
-        "    firefox \\\n"
-        "    libreoffice \\\n"
-        "    vlc \\\n"
-        "    gimp \\\n"
-        "    neofetch \\\n"
-        "    curl \\\n"
-        "    wget \\\n"
-        "    git \\\n"
-        "    nano\n\n"
-        "# Создание системных идентификаторов Luna Linux\n"
-        "echo \"Luna Linux Stellar 1.0\" > /etc/luna-linux-release\n"
-        "cat > /etc/os-release << 'EOF'\n"
-        "NAME=\"Luna Linux\"\n"
-        "VERSION=\"1.0 (Stellar)\"\n"
-        "ID=luna\n"
-        "ID_LIKE=ubuntu debian\n"
-        "PRETTY_NAME=\"Luna Linux Stellar\"\n"
-        "VERSION_ID=\"1.0\"\n"
-        "HOME_URL=\"https://luna-linux.org\"\n"
-        "SUPPORT_URL=\"https://forum.luna-linux.org\"\n"
-        "BUG_REPORT_URL=\"https://bugs.luna-linux.org\"\n"
-        "PRIVACY_POLICY_URL=\"https://luna-linux.org/privacy\"\n"
-        "VERSION_CODENAME=stellar\n"
-        "UBUNTU_CODENAME=jammy\n"
-        "EOF\n\n"
-        "cat > /etc/lsb-release << 'EOF'\n"
-        "DISTRIB_ID=LunaLinux\n"
-        "DISTRIB_RELEASE=1.0\n"
-        "DISTRIB_CODENAME=stellar\n"
-        "DISTRIB_DESCRIPTION=\"Luna Linux Stellar\"\n"
-        "EOF\n\n"
-        "# Чистка системы\n"
-        "apt autoremove -y\n"
-        "apt clean\n";
-
-    char script_path[] = "/tmp/setup-software.sh";
-    if (write_file(script_path, software_setup) != 0) {
-        return 1;
-    }
-
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "cp %s %s/tmp/", script_path, config->chroot);
-    execute_command(cmd, 0);
-
-    snprintf(cmd, sizeof(cmd), "chmod +x %s/tmp/setup-software.sh", config->chroot);
-    execute_command(cmd, 0);
-
-    snprintf(cmd, sizeof(cmd), "chroot %s /bin/bash /tmp/setup-software.sh", config->chroot);
-    return execute_command(cmd, config->verbose);
+static int run_chroot_script(BuildConfig *config, const char *name, const char *script) {
+    return chroot_run_script(config->chroot, name, script, config->verbose);
 }
 
 /**
- * Подготовка файлов для создания ISO образа
+ * Объединение всех списков пакетов образа
  */
-int prepare_iso_files(BuildConfig *config) {
-    printf(COLOR_YELLOW "Подготовка файлов для ISO...\n" COLOR_RESET);
-
-    // Поиск и копирование ядра
-    char find_cmd[512];
-    char vmlinuz_path[512];
-    FILE *fp;
-
-    snprintf(find_cmd, sizeof(find_cmd), "find %s/boot -name 'vmlinuz-*' -type f | head -1", config->chroot);
-    fp = popen(find_cmd, "r");
-    if (fp == NULL) return 1;
-
-    if (fgets(vmlinuz_path, sizeof(vmlinuz_path), fp) == NULL) {
-        pclose(fp);
-        return 1;
+static int plan_packages(BuildConfig *config, PackageSet *set) {
+    package_set_init(set);
+    for (int i = 0; i < PACKAGE_LIST_COUNT; i++) {
+        const PackageList *list = &config->packages[i];
+        for (size_t j = 0; j < list->count; j++) {
+            if (package_set_add(set, list->items[j].data, list->items[j].len) != 0) {
+                package_set_free(set);
+                return 1;
+            }
+        }
     }
-    pclose(fp);
 
-    // Удаление символа новой строки
-    vmlinuz_path[strcspn(vmlinuz_path, "\n")] = 0;
+    return 0;
+}
 
-    // Копирование vmlinuz
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "cp %s %s/vmlinuz", vmlinuz_path, config->imagedir);
-    if (execute_command(cmd, config->verbose) != 0) return 1;
+/**
+ * Загрузка пакетов в общий кэш параллельно с построением базовой системы:
+ * к началу транзакции apt архивы уже лежат локально. Сбой предзагрузки
+ * не прерывает сборку — недостающие пакеты скачает apt.
+ */
+int prefetch_packages(BuildConfig *config) {
+    if (!g_debcache.enabled) {
+        return 0;
+    }
 
-    // Поиск и копирование initrd
-    snprintf(find_cmd, sizeof(find_cmd), "find %s/boot -name 'initrd.img-*' -type f | head -1", config->chroot);
-    fp = popen(find_cmd, "r");
-    if (fp == NULL) return 1;
+    log_step("Предзагрузка пакетов...");
 
-    char initrd_path[512];
-    if (fgets(initrd_path, sizeof(initrd_path), fp) == NULL) {
-        pclose(fp);
-        return 1;
+    PackageSet set;
+    if (plan_packages(config, &set) != 0) {
+        return 0;
     }
-    pclose(fp);
 
-    initrd_path[strcspn(initrd_path, "\n")] = 0;
-    snprintf(cmd, sizeof(cmd), "cp %s %s/initrd", initrd_path, config->imagedir);
-    if (execute_command(cmd, config->verbose) != 0) return 1;
+    // Без предзагрузки пакеты скачает apt, поэтому ошибки здесь не фатальны
+    char statedir[512];
+    Prefetch pf;
+    if (format_path(statedir, sizeof(statedir), "%s/prefetch", config->workdir) != 0 ||
+        prefetch_init(&pf, statedir, config->mirror, config->ubuntu_codename,
+                      config->components, config->arch, g_debcache.dir) != 0) {
+        log_warning("Предзагрузка пропущена, пакеты будут скачаны apt");
+        package_set_free(&set);
+        return 0;
+    }
+    pf.verbose = config->verbose;
 
-    // Создание squashfs образа
-    printf(COLOR_YELLOW "Создание squashfs образа...\n" COLOR_RESET);
-    snprintf(cmd, sizeof(cmd),
-        "mksquashfs %s %s/filesystem.squashfs -comp xz -b 1M -noappend",
-        config->chroot, config->imagedir);
+    // Пока идёт загрузка, пакеты кэша не вытесняются
+    int hold = debcache_hold(&g_debcache);
+    if (hold >= 0) {
+        if (prefetch_run(&pf, &set) != 0) {
+            log_warning("Предзагрузка пропущена, пакеты будут скачаны apt");
+        }
+        debcache_release(hold);
+    }
 
-    return execute_command(cmd, config->verbose);
+    package_set_free(&set);
+    return 0;
 }
 
 /**
- * Создание загрузочной структуры для LiveCD
+ * Установка всех пакетов образа одной транзакцией apt: индексы
+ * обновляются один раз, зависимости объединения решаются один раз
  */
-int create_boot_structure(BuildConfig *config) {
-    printf(COLOR_YELLOW "Создание загрузочной структуры LiveCD...\n" COLOR_RESET);
+int install_packages(BuildConfig *config) {
+    log_step("Установка пакетов...");
 
-    // Создание каталогов
-    const char *dirs[] = {
-        "/boot/grub",
-        "/casper",
-        "/.disk",
-        NULL
-    };
+    PackageSet set;
+    if (plan_packages(config, &set) != 0) {
+        return 1;
+    }
 
-    for (int i = 0; dirs[i] != NULL; i++) {
-        char path[512];
-        snprintf(path, sizeof(path), "%s/%s", config->isodir, dirs[i]);
-        mkdir(path, 0755);
-    }
-
-    // Копирование файлов
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "cp %s/vmlinuz %s/casper/", config->imagedir, config->isodir);
-    execute_command(cmd, 0);
-
-    snprintf(cmd, sizeof(cmd), "cp %s/initrd %s/casper/", config->imagedir, config->isodir);
-    execute_command(cmd, 0);
-
-    snprintf(cmd, sizeof(cmd), "cp %s/filesystem.squashfs %s/casper/", config->imagedir, config->isodir);
-    execute_command(cmd, 0);
-
-    // Создание конфигурации GRUB для LiveCD
-    const char *grub_cfg =
-        "set timeout=30\n"
-        "set default=0\n\n"
-        "menuentry \"Start Luna Linux Live (Wayland)\" {\n"
-        "    linux /casper/vmlinuz boot=casper noprompt quiet splash ---\n"
-        "    initrd /casper/initrd\n"
-        "}\n\n"
-        "menuentry \"Start Luna Linux Live (Safe Graphics)\" {\n"
-        "    linux /casper/vmlinuz boot=casper nomodeset quiet splash ---\n"
-        "    initrd /casper/initrd\n"
-        "}\n\n"
-        "menuentry \"Install Luna Linux\" {\n"
-        "    linux /casper/vmlinuz boot=casper noprompt only-ubiquity quiet splash ---\n"
-        "    initrd /casper/initrd\n"
-        "}\n\n"
-        "menuentry \"Boot from first hard disk\" {\n"
-        "    set root=(hd0)\n"
-        "    chainloader +1\n"
-        "}\n";
+    const char *download_lock = g_debcache.enabled ?
+        DEBCACHE_CHROOT_DIR "/" DEBCACHE_DOWNLOAD_LOCK : NULL;
 
-    char grub_cfg_path[512];
-    snprintf(grub_cfg_path, sizeof(grub_cfg_path), "%s/boot/grub/grub.cfg", config->isodir);
-    if (write_file(grub_cfg_path, grub_cfg) != 0) {
+    size_t script_size = package_set_script_size(&set);
+    char *script = malloc(script_size);
+    if (!script) {
+        package_set_free(&set);
+        return 1;
+    }
+    int planned = package_set_install_script(&set, download_lock, script, script_size);
+    printf("Пакетов в транзакции: %d\n", set.count);
+    package_set_free(&set);
+    if (planned != 0) {
+        free(script);
         return 1;
     }
 
-    // Создание файла информации о диске
-    const char *disk_info =
-        "Luna Linux Stellar 1.0 amd64\n"
-        "Based on Ubuntu 22.04 LTS\n";
-
-    char disk_info_path[512];
-    snprintf(disk_info_path, sizeof(disk_info_path), "%s/.disk/info", config->isodir);
-    if (write_file(disk_info_path, disk_info) != 0) {
+    // Общий кэш пакетов подключается только на время транзакции
+    if (debcache_attach(&g_debcache, config->chroot, true) != 0) {
+        free(script);
         return 1;
     }
 
-    return 0;
+    int result = run_chroot_script(config, "setup-packages.sh", script);
+    free(script);
+
+    if (debcache_detach(&g_debcache) != 0) {
+        result = 1;
+    }
+
+    return result;
 }
 
 /**
- * Создание ISO образа
+ * Настройка кастомного GRUB с темой Luna Linux
+ */
+int customize_grub(BuildConfig *config) {
+    log_step("Настройка кастомного GRUB с логотипом Луны...");
+
+    return run_chroot_script(config, "setup-grub.sh", grub_setup);
+}
+
+/**
+ * Настройка KDE Plasma с поддержкой Wayland
+ */
+int configure_kde_plasma(BuildConfig *config) {
+    log_step("Настройка KDE Plasma с Wayland...");
+
+    return run_chroot_script(config, "setup-kde.sh", kde_setup);
+}
+
+/**
+ * Настройка графического установщика Calamares
+ */
+int configure_calamares(BuildConfig *config) {
+    log_step("Настройка Calamares...");
+
+    return run_chroot_script(config, "setup-calamares.sh", calamares_setup);
+}
+
+/**
+ * Кодовое имя с заглавной буквы: "Luna Linux Stellar"
+ */
+static void codename_title(const BuildConfig *config, char *title, size_t size) {
+    snprintf(title, size, "%s", config->codename);
+    title[0] = toupper((unsigned char)title[0]);
+}
+
+/**
+ * Системные идентификаторы Luna Linux и очистка
+ */
+int configure_system(BuildConfig *config) {
+    log_step("Настройка системных идентификаторов...");
+
+    char title[sizeof(config->codename)];
+    codename_title(config, title, sizeof(title));
+
+    const char *name = config->distro_name;
+    const char *version = config->version;
+    char script[sizeof(software_setup) + 8 * sizeof(config->distro_name)];
+    snprintf(script, sizeof(script), software_setup,
+             name, title, version,
+             name, version, title, name, title, version, config->codename,
+             version, config->codename, name, title);
+
+    return run_chroot_script(config, "setup-software.sh", script);
+}
+
+/**
+ * Поиск одинаковых файлов в chroot перед сборкой squashfs. При сборке со
+ * слоями ссылки создаются в собственном слое шага: overlayfs копирует
+ * вверх только оставляемый файл каждой группы.
+ */
+int dedup_chroot(BuildConfig *config) {
+    if (!g_squashfs.dedup) {
+        return 0;
+    }
+
+    log_step("Поиск одинаковых файлов в chroot...");
+    if (dedup_tree(config->chroot, 0, &g_dedup) != 0) {
+        return 1;
+    }
+    dedup_print_stats(&g_dedup);
+    return 0;
+}
+
+/**
+ * Объём, на который дедупликация сократила данные для сжатия (измерен), и
+ * оценка сэкономленного времени: время этого сжатия, пересчитанное
+ * пропорционально объёму. Сжатие без дедупликации не выполняется, поэтому
+ * время — оценка, а не измерение
+ */
+static void report_dedup_effect(double seconds) {
+    if (g_dedup.bytes_saved == 0 || g_dedup.bytes_total <= g_dedup.bytes_saved) {
+        return;
+    }
+
+    double remaining = g_dedup.bytes_total - g_dedup.bytes_saved;
+    double saved = seconds * g_dedup.bytes_saved / remaining;
+    log_info("Дедупликация сократила данные для сжатия на %.1f MB (%.1f%%); "
+             "оценка по объёму, не измерение: сжатие быстрее на ~%.1f с "
+             "(%.1f с вместо ~%.1f с)",
+             g_dedup.bytes_saved / (1024.0 * 1024.0),
+             100.0 * g_dedup.bytes_saved / g_dedup.bytes_total, saved, seconds, seconds + saved);
+}
+
+/**
+ * Начало встроенной записи образа; при инкрементальной сборке данные
+ * неизменных файлов берутся из прошлого filesystem.squashfs по манифесту
+ */
+static SqfsWriter *open_squashfs_writer(BuildConfig *config, const SqfsOptions *options,
+                                        const char *path) {
+    SqfsWriter *writer = sqfs_writer_open(options, path);
+    if (!writer || !g_squashfs.incremental) {
+        return writer;
+    }
+
+    char manifest[512], previous[512];
+    if (format_path(manifest, sizeof(manifest), "%s/squashfs.manifest", config->workdir) != 0 ||
+        format_path(previous, sizeof(previous), "%s/filesystem.squashfs", config->imagedir) != 0) {
+        sqfs_writer_close(writer);
+        return NULL;
+    }
+    if (sqfs_writer_set_base(writer, manifest, previous) == 0) {
+        log_info("Инкрементальная запись squashfs на основе %s", previous);
+    }
+    return writer;
+}
+
+/**
+ * Сжатие данных файлов из слоёв до установки пакетов включительно, пока
+ * следующие шаги настраивают систему в верхних слоях. Без слоёв или с
+ * профилем для mksquashfs шаг ничего не делает.
+ */
+int prefill_squashfs(BuildConfig *config) {
+    SqfsOptions options;
+    if (!config->use_layers || !squashfs_native_options(&g_squashfs, &options)) {
+        return 0;
+    }
+
+    log_step("Предварительное сжатие squashfs из нижних слоёв...");
+
+    char view[512], path[512];
+    if (format_path(view, sizeof(view), "%s/prefill-view", config->workdir) != 0 ||
+        format_path(path, sizeof(path), "%s/filesystem.squashfs.part", config->imagedir) != 0) {
+        return 1;
+    }
+
+    if (layers_mount_snapshot(&g_layers, step_layer(PREFILL_LAST_STEP) + 1, view) != 0) {
+        return 1;
+    }
+
+    g_sqfs = open_squashfs_writer(config, &options, path);
+    int result = g_sqfs ? sqfs_writer_prefill(g_sqfs, view) : -1;
+
+    umount2(view, MNT_DETACH);
+
+    // Образ можно собрать и без заготовки, поэтому ошибка не прерывает сборку
+    if (result != 0) {
+        log_warning("Предварительное сжатие не удалось, образ будет собран целиком");
+        sqfs_writer_close(g_sqfs);
+        g_sqfs = NULL;
+    }
+    return 0;
+}
+
+/**
+ * Встроенная запись squashfs: дописывает образ, начатый предварительным
+ * сжатием, или пишет его целиком
+ */
+static int write_squashfs(BuildConfig *config, const SqfsOptions *options, const char *target) {
+    char part[600];
+    snprintf(part, sizeof(part), "%s.part", target);
+
+    // Заранее сжатые данные файлов, удалённых верхними слоями, остались бы
+    // в образе: заготовка отбрасывается, образ пишется целиком
+    char deleted[512];
+    if (g_sqfs && layers_find_deletion(&g_layers, step_layer(PREFILL_LAST_STEP) + 1,
+                                       deleted, sizeof(deleted))) {
+        log_info("Заготовка squashfs отброшена: верхний слой удаляет %s", deleted);
+        sqfs_writer_close(g_sqfs);
+        g_sqfs = NULL;
+        unlink(part);
+    }
+
+    if (!g_sqfs) {
+        g_sqfs = open_squashfs_writer(config, options, part);
+        if (!g_sqfs) {
+            return 1;
+        }
+    }
+
+    int result = sqfs_writer_finish(g_sqfs, config->chroot);
+
+    SqfsStats stats;
+    sqfs_writer_stats(g_sqfs, &stats);
+    sqfs_writer_close(g_sqfs);
+    g_sqfs = NULL;
+
+    if (result != 0 || rename(part, target) != 0) {
+        log_error("Не удалось создать %s", target);
+        unlink(part);
+        return 1;
+    }
+
+    log_info("squashfs: %llu файлов (%llu сжаты заранее, %llu из прошлого образа), "
+             "%.1f MB -> %.1f MB, скопировано %.1f MB, лишних заранее сжатых данных %.1f MB",
+             stats.files, stats.reused_files, stats.copied_files,
+             stats.bytes_in / (1024.0 * 1024.0), stats.bytes_out / (1024.0 * 1024.0),
+             stats.copied_bytes / (1024.0 * 1024.0), stats.wasted_bytes / (1024.0 * 1024.0));
+    return 0;
+}
+
+/**
+ * Путь по формату; путь, не помещающийся в буфер, — ошибка, а не усечение
+ */
+static int format_path(char *path, size_t size, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(path, size, format, ap);
+    va_end(ap);
+
+    if (len < 0 || (size_t)len >= size) {
+        log_error("Слишком длинный путь: %s...", path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Версия ядра для ISO: цель ссылки /boot/vmlinuz, которую ведёт
+ * linux-base, а без неё — старшая версия vmlinuz-* по strverscmp
+ */
+static int find_kernel_version(const char *chroot, char *version, size_t size) {
+    char path[512], pattern[520], link[512];
+    if (format_path(path, sizeof(path), "%s/boot/vmlinuz", chroot) != 0) {
+        return -1;
+    }
+    snprintf(pattern, sizeof(pattern), "%s-*", path);
+
+    ssize_t link_len = readlink(path, link, sizeof(link) - 1);
+    if (link_len > 0) {
+        link[link_len] = '\0';
+        const char *name = strrchr(link, '/');
+        name = name ? name + 1 : link;
+        if (strncmp(name, "vmlinuz-", 8) == 0 && strlen(name + 8) < size) {
+            strcpy(version, name + 8);
+            return 0;
+        }
+        log_warning("Ссылка %s указывает на %s, берётся старшая версия ядра", path, link);
+    }
+
+    glob_t found;
+    if (glob(pattern, 0, NULL, &found) != 0) {
+        log_error("Не найден vmlinuz-* в %s/boot", chroot);
+        return -1;
+    }
+
+    const char *newest = NULL;
+    for (size_t i = 0; i < found.gl_pathc; i++) {
+        const char *name = strrchr(found.gl_pathv[i], '/') + 1 + 8;
+        if (!newest || strverscmp(name, newest) > 0) {
+            newest = name;
+        }
+    }
+
+    int result = 0;
+    if (strlen(newest) < size) {
+        strcpy(version, newest);
+    } else {
+        log_error("Слишком длинная версия ядра: %s", newest);
+        result = -1;
+    }
+    globfree(&found);
+    return result;
+}
+
+/**
+ * Подготовка файлов для создания ISO образа
+ */
+int prepare_iso_files(BuildConfig *config) {
+    log_step("Подготовка файлов для ISO...");
+
+    // Ядро и initrd одной версии
+    char version[256];
+    if (find_kernel_version(config->chroot, version, sizeof(version)) != 0) {
+        return 1;
+    }
+    log_info("Ядро для ISO: %s", version);
+
+    const char *images[][2] = {
+        { "vmlinuz", "vmlinuz" },
+        { "initrd.img", "initrd" }
+    };
+
+    for (int i = 0; i < 2; i++) {
+        char source[512], target[512];
+        if (format_path(source, sizeof(source), "%s/boot/%s-%s",
+                        config->chroot, images[i][0], version) != 0 ||
+            format_path(target, sizeof(target), "%s/%s", config->imagedir, images[i][1]) != 0) {
+            return 1;
+        }
+
+        if (access(source, R_OK) != 0) {
+            log_error("Не найден %s-%s в %s/boot", images[i][0], version, config->chroot);
+            return 1;
+        }
+
+        StageResult staged;
+        if (stage_file(source, target, 0, &staged) != 0) {
+            return 1;
+        }
+        stage_report(target, &staged);
+    }
+
+    // Создание squashfs образа
+    const SquashProfile *profile = squashfs_profile(&g_squashfs);
+    log_step("Создание squashfs образа (профиль %s)...", profile->name);
+
+    char squashfs_path[512];
+    if (format_path(squashfs_path, sizeof(squashfs_path), "%s/filesystem.squashfs",
+                    config->imagedir) != 0) {
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int result;
+    SqfsOptions options;
+    if (squashfs_native_options(&g_squashfs, &options)) {
+        result = write_squashfs(config, &options, squashfs_path);
+    } else {
+        // Старый образ может быть жёсткой ссылкой из casper
+        unlink(squashfs_path);
+
+        ExecArgs args;
+        squashfs_args(&g_squashfs, profile, config->chroot, squashfs_path, &args);
+        result = exec_command(args.argv, config->verbose);
+        exec_args_free(&args);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (result == 0) {
+        report_dedup_effect((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
+    return result;
+}
+
+/**
+ * Создание каталогов ISO относительно isodir
+ */
+static int make_iso_dirs(BuildConfig *config, const char *dirs[]) {
+    for (int i = 0; dirs[i] != NULL; i++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", config->isodir, dirs[i]);
+        if (make_dirs(path) != 0) {
+            perror("Ошибка создания каталога");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Конфигурация загрузчика и информация о диске LiveCD
+ */
+int create_boot_config(BuildConfig *config) {
+    log_step("Создание конфигурации загрузчика LiveCD...");
+
+    const char *dirs[] = { "boot/grub", ".disk", NULL };
+    if (make_iso_dirs(config, dirs) != 0) {
+        return 1;
+    }
+
+    const char *name = config->distro_name;
+    const char *version = config->version;
+    char title[sizeof(config->codename)];
+    codename_title(config, title, sizeof(title));
+
+    // Конфигурация GRUB для LiveCD с именем редакции
+    char grub_cfg[sizeof(live_grub_cfg) + 3 * (sizeof(config->distro_name) +
+                                               sizeof(config->codename) +
+                                               sizeof(config->version))];
+    snprintf(grub_cfg, sizeof(grub_cfg), live_grub_cfg,
+             name, title, version, name, title, version, name, title, version);
+
+    char grub_cfg_path[512];
+    snprintf(grub_cfg_path, sizeof(grub_cfg_path), "%s/boot/grub/grub.cfg", config->isodir);
+    if (write_file(grub_cfg_path, grub_cfg) != 0) {
+        return 1;
+    }
+
+    // Информация о диске; LTS — выпуски Ubuntu XX.04 чётных годов
+    const char *base = config->ubuntu_version;
+    bool lts = strlen(base) == 5 && strcmp(base + 2, ".04") == 0 && (base[1] - '0') % 2 == 0;
+    char info[sizeof(disk_info) + sizeof(config->distro_name) + sizeof(config->codename) +
+              sizeof(config->version) + sizeof(config->arch) + sizeof(config->ubuntu_version)];
+    snprintf(info, sizeof(info), disk_info, name, title, version, config->arch,
+             base, lts ? " LTS" : "");
+
+    char disk_info_path[512];
+    snprintf(disk_info_path, sizeof(disk_info_path), "%s/.disk/info", config->isodir);
+    if (write_file(disk_info_path, info) != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Загрузочные образы BIOS и EFI; не зависят от chroot и собираются
+ * параллельно с установкой пакетов и созданием squashfs
+ */
+int create_boot_images(BuildConfig *config) {
+    log_step("Создание загрузочных образов BIOS и EFI...");
+
+    const char *dirs[] = { "boot/grub", NULL };
+    if (make_iso_dirs(config, dirs) != 0) {
+        return 1;
+    }
+
+    return boot_build_images(config->isodir, config->workdir, boot_embed_cfg,
+                             config->verbose) == 0 ? 0 : 1;
+}
+
+/**
+ * Размещение ядра, initrd и squashfs в каталоге casper
+ */
+int stage_casper_files(BuildConfig *config) {
+    log_step("Размещение системы в каталоге casper...");
+
+    const char *dirs[] = { "casper", NULL };
+    if (make_iso_dirs(config, dirs) != 0) {
+        return 1;
+    }
+
+    // При совмещённой упаковке файлы уже записаны в casper
+    char casper[512];
+    snprintf(casper, sizeof(casper), "%s/casper", config->isodir);
+    if (strcmp(casper, config->imagedir) == 0) {
+        return 0;
+    }
+
+    const char *files[] = { "vmlinuz", "initrd", "filesystem.squashfs", NULL };
+    for (int i = 0; files[i] != NULL; i++) {
+        char source[512], target[512];
+        snprintf(source, sizeof(source), "%s/%s", config->imagedir, files[i]);
+        snprintf(target, sizeof(target), "%s/casper/%s", config->isodir, files[i]);
+
+        // Образ не меняется после этого шага, поэтому годится жёсткая ссылка
+        StageResult staged;
+        if (stage_file(source, target, 0, &staged) != 0) {
+            return 1;
+        }
+        stage_report(target, &staged);
+    }
+
+    return 0;
+}
+
+/**
+ * Строка "hex  имя" в списке контрольных сумм рядом с образом (формат
+ * sha256sum -c). Прежняя строка того же образа заменяется; список
+ * блокируется, так как редакции матричной сборки пишут его одновременно
+ */
+static int update_checksum_list(const char *iso, const char *list_name, const char *hex) {
+    char list[600];
+    const char *slash = strrchr(iso, '/');
+    const char *name = slash ? slash + 1 : iso;
+    snprintf(list, sizeof(list), "%.*s%s", slash ? (int)(slash - iso + 1) : 0, iso, list_name);
+
+    int fd = open(list, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+        log_warning("Не удалось открыть %s: %s", list, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    struct stat st;
+    char *text = NULL;
+    size_t len = 0;
+    if (fstat(fd, &st) == 0) {
+        text = malloc(st.st_size + strlen(hex) + strlen(name) + 5);
+    }
+    if (text && st.st_size > 0 && pread(fd, text, st.st_size, 0) != st.st_size) {
+        free(text);
+        text = NULL;
+    }
+    if (!text) {
+        log_warning("Не удалось прочитать %s", list);
+        close(fd);
+        return -1;
+    }
+
+    // Строки других образов остаются на месте
+    size_t name_len = strlen(name);
+    for (char *line = text; line < text + st.st_size;) {
+        char *eol = memchr(line, '\n', text + st.st_size - line);
+        size_t line_len = eol ? (size_t)(eol - line) + 1 : (size_t)(text + st.st_size - line);
+        size_t body = line_len - (eol != NULL);
+        bool same = body >= name_len + 2 &&
+                    memcmp(line + body - name_len - 2, "  ", 2) == 0 &&
+                    memcmp(line + body - name_len, name, name_len) == 0;
+        if (!same) {
+            memmove(text + len, line, line_len);
+            len += line_len;
+            if (!eol) {
+                text[len++] = '\n';
+            }
+        }
+        line += line_len;
+    }
+    len += sprintf(text + len, "%s  %s\n", hex, name);
+
+    int result = 0;
+    if (pwrite(fd, text, len, 0) != (ssize_t)len || ftruncate(fd, len) != 0) {
+        log_warning("Не удалось записать %s: %s", list, strerror(errno));
+        result = -1;
+    }
+    free(text);
+    close(fd);
+    return result;
+}
+
+/**
+ * Суммы последнего записанного образа: workdir/.iso-sums, строки
+ * "sha256 <hex>" и "sha512 <hex>". Пишутся вместе с образом, хранятся
+ * в кэше рядом с ним и восстанавливаются вместе с ним
+ */
+static void iso_sums_path(const BuildConfig *config, char *path, size_t size) {
+    snprintf(path, size, "%s/" ISO_SUMS_FILE, config->workdir);
+}
+
+static int write_iso_sums(const BuildConfig *config, const char *sha256, const char *sha512) {
+    char path[600], sums[SHA256_HEX_SIZE + SHA512_HEX_SIZE + 16];
+    iso_sums_path(config, path, sizeof(path));
+    snprintf(sums, sizeof(sums), "sha256 %s\nsha512 %s\n", sha256, sha512);
+    return write_to_file(path, sums);
+}
+
+static bool read_iso_sums(const BuildConfig *config, char sha256[SHA256_HEX_SIZE],
+                          char sha512[SHA512_HEX_SIZE]) {
+    char path[600];
+    iso_sums_path(config, path, sizeof(path));
+    char *sums = file_exists(path) ? read_file(path) : NULL;
+    if (!sums) {
+        return false;
+    }
+
+    bool ok = sscanf(sums, "sha256 %64s sha512 %128s", sha256, sha512) == 2 &&
+              strlen(sha256) == SHA256_HEX_SIZE - 1 && strlen(sha512) == SHA512_HEX_SIZE - 1;
+    free(sums);
+    return ok;
+}
+
+/**
+ * SHA256SUMS и SHA512SUMS для образа, который эта сборка не записывала:
+ * он развёрнут из кэша или уже актуален, а списки с тех пор могли
+ * перезаписать сборки другого содержимого под тем же именем. Суммы
+ * берутся из workdir/.iso-sums; без них образ читается один раз
+ */
+static int publish_iso_sums(BuildConfig *config) {
+    char sha256[SHA256_HEX_SIZE], sha512[SHA512_HEX_SIZE];
+    if (!read_iso_sums(config, sha256, sha512)) {
+        log_info("Подсчёт контрольных сумм %s...", config->output_iso);
+        if (sha256_file(config->output_iso, sha256) != 0 ||
+            sha512_file(config->output_iso, sha512) != 0) {
+            log_warning("Не удалось прочитать %s для контрольных сумм", config->output_iso);
+            return -1;
+        }
+        write_iso_sums(config, sha256, sha512);
+    }
+
+    int result = update_checksum_list(config->output_iso, "SHA256SUMS", sha256);
+    if (update_checksum_list(config->output_iso, "SHA512SUMS", sha512) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+/**
+ * Создание ISO образа
  */
 int create_iso_image(BuildConfig *config) {
-    printf(COLOR_YELLOW "Создание ISO образа...\n" COLOR_RESET);
+    log_step("Создание ISO образа...");
 
-    // Проверка наличия xorriso
-    if (execute_command("which xorriso", 0) != 0) {
-        printf(COLOR_RED "Ошибка: xorriso не установлен\n" COLOR_RESET);
-        printf("Установите: apt install xorriso\n");
+    // Образ пишется одним проходом по дереву; -o дублирует поток на
+    // устройство или в стандартный вывод
+    IsoStats stats;
+    const char *target = config->iso_target[0] ? config->iso_target : NULL;
+    if (iso_write(config->isodir, config->output_iso, target, &iso_options, &stats) != 0) {
         return 1;
     }
 
-    // Команда создания ISO
-    char cmd[1024];
-    snprintf(cmd, sizeof(cmd),
-        "xorriso -as mkisofs \\\n"
-        "    -volid \"Luna Linux\" \\\n"
-        "    -full-iso9660-filenames \\\n"
-        "    -joliet \\\n"
-        "    -rational-rock \\\n"
-        "    -iso-level 3 \\\n"
-        "    -eltorito-boot boot/grub/bios.img \\\n"
-        "    -no-emul-boot \\\n"
-        "    -boot-load-size 4 \\\n"
-        "    -boot-info-table \\\n"
-        "    --efi-boot boot/grub/efi.img \\\n"
-        "    -efi-boot-part --efi-boot-image \\\n"
-        "    --protective-msdos-label \\\n"
-        "    -isohybrid-gpt-basdat \\\n"
-        "    -o \"%s\" \\\n"
-        "    \"%s\"",
-        config->output_iso, config->isodir);
+    log_info("ISO: %s, %.1f MB, файлов %llu, %.1f с (%.0f MB/с)%s%s", config->output_iso,
+             stats.bytes / (1024.0 * 1024.0), stats.files, stats.seconds,
+             stats.bytes / (1024.0 * 1024.0) / (stats.seconds > 0 ? stats.seconds : 1),
+             target ? ", также в " : "", target ? target : "");
 
-    return execute_command(cmd, config->verbose);
+    // Суммы посчитаны по ходу записи, образ повторно не читается
+    write_iso_sums(config, stats.sha256, stats.sha512);
+    update_checksum_list(config->output_iso, "SHA256SUMS", stats.sha256);
+    update_checksum_list(config->output_iso, "SHA512SUMS", stats.sha512);
+    log_info("SHA-256: %s", stats.sha256);
+    return 0;
 }
 
 /**
  * Очистка временных файлов
  */
 int cleanup_build(BuildConfig *config) {
-    printf(COLOR_YELLOW "Очистка временных файлов...\n" COLOR_RESET);
-
-    // Удаление временных скриптов
-    const char *scripts[] = {
-        "/tmp/setup-grub.sh",
-        "/tmp/setup-kde.sh",
-        "/tmp/setup-calamares.sh",
-        "/tmp/setup-software.sh",
-        NULL
-    };
+    log_step("Очистка временных файлов...");
 
-    for (int i = 0; scripts[i] != NULL; i++) {
-        unlink(scripts[i]);
+    // Остатки прерванной сборки загрузочных образов
+    const char *files[] = { "grub-embed.cfg", "bootx64.efi", NULL };
+    for (int i = 0; files[i] != NULL; i++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", config->workdir, files[i]);
+        unlink(path);
     }
 
     return 0;
 }
 
 /**
- * Выполнение системной команды
+ * Путь к результату шага
+ */
+static const char *step_output_path(BuildConfig *config, StepOutput output) {
+    switch (output) {
+        case OUTPUT_CHROOT:
+            return config->chroot;
+        case OUTPUT_IMAGEDIR:
+            return config->imagedir;
+        case OUTPUT_ISO:
+            return config->output_iso;
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * Куда шаг пишет результат и где лежит метка с ключом этого результата.
+ * При сборке со слоями каждый шаг chroot пишет в собственный слой.
+ */
+static void step_target(BuildConfig *config, int index, char *target, char *stamp, size_t size) {
+    static const char *names[OUTPUT_COUNT] = { NULL, "chroot", "image", "output" };
+    StepOutput output = build_steps[index].output;
+
+    if (output == OUTPUT_CHROOT && config->use_layers) {
+        layers_path(&g_layers, step_layer(index), "upper", target, size);
+        layers_path(&g_layers, step_layer(index), "key", stamp, size);
+        return;
+    }
+
+    // Метка образа своя у каждого каталога образа: при совмещённой упаковке
+    // (-F) это casper дерева ISO, и метка обычного каталога к нему не относится
+    const char *name = output == OUTPUT_IMAGEDIR && config->fused_packaging ? "casper"
+                                                                           : names[output];
+    snprintf(target, size, "%s", step_output_path(config, output));
+    snprintf(stamp, size, "%s/.stamp-%s", config->workdir, name);
+}
+
+/**
+ * Вычисление ключа шага: встроенные скрипты, поля конфигурации,
+ * влияющие на содержимое образа, и ключи шагов, от которых он зависит
+ */
+static void compute_step_key(int index, BuildConfig *config, BuildPlan *plan) {
+    const BuildStep *step = &build_steps[index];
+    StepKey step_key;
+    step_key_init(&step_key, step->title);
+
+    for (int i = 0; step->inputs[i] != NULL; i++) {
+        step_key_add(&step_key, "input", step->inputs[i]);
+    }
+
+    // Брендинг входит в ключи только шагов, которые пишут его в образ:
+    // идентификаторов системы в chroot и загрузчика LiveCD (дальше он
+    // переходит по зависимостям). Редакции с разными именами делят базовую
+    // систему и установленные пакеты
+    if (index == STEP_SOFTWARE || index == STEP_BOOT_CONFIG) {
+        step_key_add(&step_key, "distro_name", config->distro_name);
+        step_key_add(&step_key, "distro_short_name", config->distro_short_name);
+        step_key_add(&step_key, "version", config->version);
+        step_key_add(&step_key, "codename", config->codename);
+    }
+    step_key_add(&step_key, "ubuntu_version", config->ubuntu_version);
+    step_key_add(&step_key, "ubuntu_codename", config->ubuntu_codename);
+    step_key_add(&step_key, "arch", config->arch);
+    step_key_add(&step_key, "components", config->components);
+
+    if (index == STEP_ISO_FILES) {
+        SqfsOptions options;
+        step_key_add(&step_key, "squashfs", squashfs_profile(&g_squashfs)->options);
+        step_key_add(&step_key, "squashfs_writer",
+                     squashfs_native_options(&g_squashfs, &options) ? "native" : "mksquashfs");
+    }
+
+    if (index == STEP_DEDUP) {
+        step_key_add(&step_key, "dedup", g_squashfs.dedup ? "yes" : "no");
+    }
+
+    // Каталог образа: при -F это casper дерева ISO. Ключ расходится с шага
+    // образа и по зависимостям доходит до размещения в casper и записи ISO
+    if (index == STEP_ISO_FILES) {
+        step_key_add(&step_key, "fused_packaging", config->fused_packaging ? "yes" : "no");
+    }
+
+    if (index == STEP_PACKAGES) {
+        for (int i = 0; i < PACKAGE_LIST_COUNT; i++) {
+            const PackageList *list = &config->packages[i];
+            for (size_t j = 0; j < list->count; j++) {
+                step_key_add_data(&step_key, config_package_list_name(i),
+                                  list->items[j].data, list->items[j].len);
+            }
+        }
+    }
+
+    for (int i = 0; i < step->dep_count; i++) {
+        step_key_add(&step_key, "dependency", plan->keys[step->deps[i]]);
+    }
+
+    step_key_final(&step_key, plan->keys[index]);
+}
+
+/**
+ * Проверка, что результат шага уже есть в рабочем каталоге: метка цели
+ * совпадает с ключом этого шага или более позднего шага той же цели
  */
-int execute_command(const char *cmd, int show_output) {
-    if (show_output) {
-        printf(COLOR_CYAN "Выполнение: %s\n" COLOR_RESET, cmd);
+static bool step_in_workdir(BuildConfig *config, int index, char keys[][SHA256_HEX_SIZE]) {
+    if (build_steps[index].output == OUTPUT_NONE) {
+        return false;
     }
 
-    int status = system(cmd);
-    if (status != 0) {
-        if (!show_output) {
-            printf(COLOR_RED "Ошибка выполнения команды: %s\n" COLOR_RESET, cmd);
+    char target[512], stamp[512];
+    step_target(config, index, target, stamp, sizeof(target));
+
+    for (int i = index; i < STEP_COUNT; i++) {
+        if (build_steps[i].output == OUTPUT_NONE) {
+            continue;
         }
+
+        char other_target[512], other_stamp[512];
+        step_target(config, i, other_target, other_stamp, sizeof(other_target));
+
+        if ( strcmp(other_target, target) == 0 && step_stamp_matches(stamp, keys[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Нужен ли результат шага: он конечный либо его использует выполняемый шаг.
+ * При сборке со слоями выполняемому шагу chroot нужны все слои под ним.
+ * Шаги другой части матричной сборки не учитываются.
+ */
+static bool step_needed(BuildConfig *config, BuildPlan *plan, int index) {
+    const BuildStep *step = &build_steps[index];
+    bool sink = true;
+
+    for (int i = index + 1; i < STEP_COUNT; i++) {
+        const BuildStep *other = &build_steps[i];
+        if (plan->excluded[i]) {
+            continue;
+        }
+
+        bool uses = false;
+        for (int d = 0; d < other->dep_count; d++) {
+            uses = uses || other->deps[d] == index;
+        }
+
+        if (config->use_layers && step->output == OUTPUT_CHROOT &&
+            (other->output == OUTPUT_CHROOT || other->reads_chroot)) {
+            uses = true;
+        }
+
+        if (uses) {
+            sink = false;
+            if (plan->actions[i] == ACTION_RUN) {
+                return true;
+            }
+        }
+    }
+
+    return sink;
+}
+
+/**
+ * Построение плана: ключи в топологическом порядке, затем обратным
+ * проходом — действие каждого шага
+ */
+static void plan_build(BuildPlan *plan, BuildConfig *config) {
+    bool forced[STEP_COUNT] = { false };
+
+    step_cache_open(&plan->cache, config->cachedir, config->use_cache,
+                    config->cache_max_mb * 1024 * 1024);
+
+    for (int i = 0; i < STEP_COUNT; i++) {
+        const BuildStep *step = &build_steps[i];
+        compute_step_key(i, config, plan);
+
+        // Слои выше точки возобновления и всё, что от них зависит, собираются заново
+        forced[i] = config->resume_layer >= 0 && step->output == OUTPUT_CHROOT &&
+                    step_layer(i) > config->resume_layer;
+        for (int d = 0; d < step->dep_count; d++) {
+            forced[i] = forced[i] || forced[step->deps[d]];
+        }
+    }
+
+    // Запись на устройство или в стандартный вывод идёт только при создании образа
+    forced[STEP_ISO] = forced[STEP_ISO] || config->iso_target[0];
+
+    bool in_workdir[STEP_COUNT];
+    for (int i = 0; i < STEP_COUNT; i++) {
+        in_workdir[i] = !forced[i] && step_in_workdir(config, i, plan->keys);
+    }
+
+    for (int i = STEP_COUNT - 1; i >= 0; i--) {
+        if (plan->excluded[i] || !step_needed(config, plan, i) || in_workdir[i]) {
+            plan->actions[i] = ACTION_SKIP;
+        } else if (!forced[i] && build_steps[i].output != OUTPUT_NONE && plan->cache.enabled &&
+                   step_cache_lookup(&plan->cache, plan->keys[i])) {
+            plan->actions[i] = ACTION_RESTORE;
+        } else {
+            plan->actions[i] = ACTION_RUN;
+        }
+        plan->restores_left += plan->actions[i] == ACTION_RESTORE;
+    }
+
+    // Найденные артефакты удерживаются до их восстановления
+    if (plan->restores_left == 0) {
+        step_cache_release(&plan->cache);
+    }
+
+    printf(COLOR_CYAN "\nПлан сборки:\n" COLOR_RESET);
+    for (int i = 0; i < STEP_COUNT; i++) {
+        const char *status;
+        switch (plan->actions[i]) {
+            case ACTION_RESTORE:
+                status = COLOR_GREEN "из кэша" COLOR_RESET;
+                break;
+            case ACTION_RUN:
+                status = forced[i] ? COLOR_YELLOW "пересборка" COLOR_RESET
+                                   : COLOR_YELLOW "выполнение" COLOR_RESET;
+                break;
+            default:
+                status = plan->excluded[i] ? COLOR_BLUE "в другой части матрицы" COLOR_RESET
+                       : in_workdir[i] ? COLOR_BLUE "актуален" COLOR_RESET
+                                       : COLOR_BLUE "не нужен" COLOR_RESET;
+                break;
+        }
+        printf("  [%02d] %s: %s\n", i + 1, build_steps[i].title, status);
+    }
+    printf("\n");
+}
+
+/**
+ * Развёртывание результата шага из кэша
+ */
+static int restore_step(BuildPlan *plan, int index) {
+    char target[512], stamp[512];
+    step_target(&g_config, index, target, stamp, sizeof(target));
+
+    if (step_stamp_matches(stamp, plan->keys[index])) {
+        return 0;
+    }
+
+    log_step("[КЭШ] Восстановление %s", target);
+
+    step_stamp_clear(stamp);
+    if (step_cache_restore(&plan->cache, plan->keys[index], target, g_config.verbose) != 0) {
         return 1;
     }
 
+    // Суммы прежнего образа к восстановленному не относятся; без сумм в
+    // кэше их посчитает publish_iso_sums
+    if (index == STEP_ISO) {
+        char sums_path[600];
+        iso_sums_path(&g_config, sums_path, sizeof(sums_path));
+        if (step_cache_restore_sums(&plan->cache, plan->keys[index], sums_path) != 0) {
+            unlink(sums_path);
+        }
+    }
+
+    return step_stamp_write(stamp, plan->keys[index]) == 0 ? 0 : 1;
+}
+
+/**
+ * Выполнение узла графа в рабочем потоке планировщика
+ */
+static int run_node(void *ctx, int index) {
+    BuildPlan *plan = ctx;
+
+    trace_step_begin(index, build_steps[index].title, plan->actions[index] == ACTION_RESTORE);
+    if (plan->actions[index] == ACTION_RESTORE) {
+        int result = restore_step(plan, index);
+        if (atomic_fetch_sub(&plan->restores_left, 1) == 1) {
+            step_cache_release(&plan->cache);
+        }
+        trace_step_end(index, result);
+        return result;
+    }
+
+    // Вывод команд шага пишется в отдельный журнал workdir/logs/step-NN.log
+    char logdir[512], log_path[600];
+    snprintf(logdir, sizeof(logdir), "%s/logs", g_config.workdir);
+    snprintf(log_path, sizeof(log_path), "%s/step-%02d.log", logdir, index + 1);
+    if (make_dirs(logdir) == 0 && write_file(log_path, "") == 0) {
+        exec_set_log(log_path);
+    }
+
+    exec_io_reset();
+    unsigned long long ram_before = ramdisk_used(&g_ramdisk);
+
+    const char *key = build_steps[index].output != OUTPUT_NONE ? plan->keys[index] : "";
+    int result = run_step(&g_config, index, key, &plan->cache);
+
+    exec_io_get(&plan->io[index]);
+    unsigned long long ram_after = ramdisk_used(&g_ramdisk);
+    plan->ram_bytes[index] = ram_after > ram_before ? ram_after - ram_before : 0;
+
+    exec_set_log(NULL);
+    trace_step_end(index, result);
+    return result;
+}
+
+/**
+ * Выполнение шага: монтирование слоя, запуск, сохранение результата в кэш
+ */
+static int run_step(BuildConfig *config, int index, const char *key, StepCache *cache) {
+    const BuildStep *step = &build_steps[index];
+    int layered = config->use_layers && step->output == OUTPUT_CHROOT;
+
+    char target[512], stamp[512];
+    if (key[0]) {
+        step_target(config, index, target, stamp, sizeof(target));
+        step_stamp_clear(stamp);
+    }
+
+    // Слой шага собирается заново поверх актуальных нижних слоёв
+    if (layered) {
+        if (layers_discard(&g_layers, step_layer(index)) != 0 ||
+            layers_begin(&g_layers, step_layer(index)) != 0) {
+            return 1;
+        }
+    } else if (step->reads_chroot && config->use_layers) {
+        if (layers_mount_view(&g_layers) != 0) {
+            return 1;
+        }
+    } else if (index == STEP_BASE) {
+        // mmdebstrap требует пустой каталог chroot
+        CleanMode mode = CLEAN_BACKGROUND;
+        clean_parse_mode(config->clean_mode, &mode);
+        if (clean_dir(config->chroot, mode, config->jobs) != 0 || make_dirs(config->chroot) != 0) {
+            return 1;
+        }
+    }
+
+    int step_result = step->run(config);
+
+    if (layered && layers_unmount(&g_layers) != 0) {
+        step_result = 1;
+    }
+
+    if (step_result != 0) {
+        return step_result;
+    }
+
+    if (key[0]) {
+        if (cache->enabled && step_cache_store(cache, key, target, step->title,
+                                               config->verbose) == 0 && index == STEP_ISO) {
+            char sums_path[600];
+            iso_sums_path(config, sums_path, sizeof(sums_path));
+            step_cache_store_sums(cache, key, sums_path);
+        }
+        step_stamp_write(stamp, key);
+    }
+
     return 0;
 }
 
 /**
- * Вывод прогресса выполнения
+ * Проверка наличия внешних программ сборки
+ */
+int check_dependencies(BuildConfig *config) {
+    (void)config;
+    // mksquashfs нужен, только если профиль собирается не встроенной записью;
+    // служба и матричная сборка заранее проверяют лишь общие программы
+    SqfsOptions options;
+    bool need_mksquashfs = !squashfs_native_options(&g_squashfs, &options);
+    if (g_dependencies_checked && !need_mksquashfs) {
+        return 0;
+    }
+
+    log_step("Проверка зависимостей...");
+    return check_all_dependencies(need_mksquashfs) ? 0 : 1;
+}
+
+/**
+ * Завершение запущенных команд при прерывании сборки
+ */
+static void handle_signal(int sig) {
+    terminate_running_processes();
+    if (g_ramdisk.mounted) {
+        umount2(g_ramdisk.mountpoint, MNT_DETACH);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/**
+ * Уровень терминала во время сборки: SIGUSR1 — отладочный вывод,
+ * SIGUSR2 — уровень из конфигурации
+ */
+static void handle_log_signal(int sig) {
+    LogLevel level = LOG_INFO;
+    if (sig == SIGUSR1) {
+        level = LOG_DEBUG;
+    } else {
+        log_parse_level(g_config.log_level, &level);
+    }
+    log_set_level(LOG_SINK_TERMINAL, level);
+}
+
+/**
+ * Перенос chroot, образа и дерева ISO в tmpfs, насколько хватает памяти
  */
-void print_progress(int step, int total, const char *message) {
-    float percentage = (float)step / total * 100;
-    printf(COLOR_BLUE "[%d/%d] ", step, total);
-    printf(COLOR_CYAN "%.0f%% " COLOR_RESET, percentage);
-    printf("%s\n", message);
+static void setup_ram_build(BuildConfig *config) {
+    make_dirs(config->workdir);
+    if (ramdisk_plan(&g_ramdisk, config->workdir) != 0 || ramdisk_mount(&g_ramdisk) != 0) {
+        log_warning("Сборка в памяти невозможна, используется %s", config->workdir);
+        return;
+    }
+
+    if (g_ramdisk.in_ram[RAM_AREA_CHROOT]) {
+        ramdisk_path(&g_ramdisk, "chroot", config->chroot, sizeof(config->chroot));
+        ramdisk_path(&g_ramdisk, "layers", config->layersdir, sizeof(config->layersdir));
+    }
+    if (g_ramdisk.in_ram[RAM_AREA_IMAGE]) {
+        ramdisk_path(&g_ramdisk, "image", config->imagedir, sizeof(config->imagedir));
+    }
+    if (g_ramdisk.in_ram[RAM_AREA_ISO]) {
+        ramdisk_path(&g_ramdisk, "iso", config->isodir, sizeof(config->isodir));
+    }
+}
+
+/**
+ * Замер объёма для следующей сборки и освобождение памяти;
+ * на постоянном хранилище остаётся только ISO
+ */
+static void finish_ram_build(BuildConfig *config, int result) {
+    if (result == 0) {
+        const char *paths[RAM_AREA_COUNT] = {
+            [RAM_AREA_CHROOT] = config->use_layers ? config->layersdir : config->chroot,
+            [RAM_AREA_IMAGE] = config->imagedir,
+            [RAM_AREA_ISO] = config->isodir,
+        };
+        ramdisk_record_usage(&g_ramdisk, paths);
+    }
+
+    ramdisk_unmount(&g_ramdisk);
+}
+
+/**
+ * Отчёт о вводе-выводе по шагам: блочный ввод-вывод команд шага и
+ * объём, записанный в tmpfs вместо диска. При параллельных шагах
+ * прирост tmpfs одного шага включает запись соседних.
+ */
+static void print_io_report(const BuildPlan *plan) {
+    unsigned long long total_read = 0, total_write = 0, total_ram = 0;
+
+    printf("\n");
+    print_padded("Шаг", 48);
+    print_padded("Чтение, MB", 14);
+    print_padded("Запись, MB", 14);
+    printf("В памяти, MB\n");
+    for (int i = 0; i < STEP_COUNT; i++) {
+        if (plan->actions[i] == ACTION_SKIP) {
+            continue;
+        }
+        print_padded(build_steps[i].title, 48);
+        printf("%-14.1f%-14.1f%.1f\n",
+               plan->io[i].read_bytes / (1024.0 * 1024.0),
+               plan->io[i].write_bytes / (1024.0 * 1024.0),
+               plan->ram_bytes[i] / (1024.0 * 1024.0));
+        total_read += plan->io[i].read_bytes;
+        total_write += plan->io[i].write_bytes;
+        total_ram += plan->ram_bytes[i];
+    }
+
+    log_info("Ввод-вывод: с диска прочитано %.1f MB, записано %.1f MB; "
+             "в tmpfs записано %.1f MB, которые не попали на диск",
+             total_read / (1024.0 * 1024.0), total_write / (1024.0 * 1024.0),
+             total_ram / (1024.0 * 1024.0));
+}
+
+/**
+ * Файл рядом с ISO: Luna-Linux-<версия>-<арх><suffix>
+ */
+static void output_path(const BuildConfig *config, const char *suffix, char *path, size_t size) {
+    size_t len = strlen(config->output_iso);
+    if (len > 4 && strcmp(config->output_iso + len - 4, ".iso") == 0) {
+        len -= 4;
+    }
+    snprintf(path, size, "%.*s%s", (int)len, config->output_iso, suffix);
+}
+
+/**
+ * Трасса сборки рядом с ISO: Luna-Linux-<версия>-<арх>.trace.json.
+ * Пишется и после сбоя — по ней видно, где сборка остановилась
+ */
+static void write_trace(const BuildConfig *config) {
+    char path[300];
+    output_path(config, ".trace.json", path, sizeof(path));
+
+    if (trace_write_json(path) == 0) {
+        log_info("Трасса сборки: %s (chrome://tracing или ui.perfetto.dev)", path);
+    }
+}
+
+/**
+ * Разбор запроса службы без сборки: рабочий каталог для очереди
+ */
+static int prepare_request(int argc, char *argv[], char *workdir, size_t size) {
+    BuildConfig config;
+    int loaded = load_build_config(argc, argv, &config, NULL);
+    if (loaded == 0 && optind < argc) {
+        fprintf(stderr, "Служба выполняет только сборку, команда %s не принимается\n",
+                argv[optind]);
+        loaded = 1;
+    }
+    if (loaded == 0 && strcmp(config.iso_target, "-") == 0) {
+        fprintf(stderr, "Служба не выводит образ в стандартный вывод клиента\n");
+        loaded = 1;
+    }
+    snprintf(workdir, size, "%s", config.workdir);
+    config_free(&config);
+    return loaded;
+}
+
+/**
+ * Служба сборки. Сборки идут в дочерних процессах и наследуют то, что
+ * служба подготовила один раз: проверенные зависимости. Слои, кэш шагов
+ * и кэш пакетов живут на диске и переходят от сборки к сборке, а
+ * страничный кэш остаётся тёплым между ними
+ */
+static int daemon_main(int argc, char *argv[]) {
+    const char *socket_path = DAEMON_SOCKET;
+    int max_builds = 1;
+    int option;
+
+    while ((option = getopt(argc, argv, "S:b:h")) != -1) {
+        switch (option) {
+            case 'S':
+                socket_path = optarg;
+                break;
+            case 'b':
+                max_builds = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            default:
+                printf("Использование: daemon [-S сокет] [-b сборок одновременно]\n");
+                return option == 'h' ? 0 : 1;
+        }
+    }
+
+    if (getuid() != 0) {
+        fprintf(stderr, "Служба сборки должна запускаться с правами root\n");
+        return 1;
+    }
+
+    // mksquashfs проверяется при каждой сборке по её настройкам [Squashfs]
+    log_step("Проверка зависимостей...");
+    if (!check_all_dependencies(false)) {
+        return 1;
+    }
+    g_dependencies_checked = true;
+
+    return daemon_serve(socket_path, max_builds, prepare_request, build_main);
+}
+
+/**
+ * Клиент службы: submit — сборка с выводом её хода, status — очередь.
+ * Опции submit после -S и -P передаются сборке как есть
+ */
+static int client_main(int argc, char *argv[]) {
+    const char *socket_path = DAEMON_SOCKET;
+    int priority = 0;
+    int i = 1;
+
+    while (i + 1 < argc && (strcmp(argv[i], "-S") == 0 || strcmp(argv[i], "-P") == 0)) {
+        if (argv[i][1] == 'S') {
+            socket_path = argv[i + 1];
+        } else {
+            priority = atoi(argv[i + 1]);
+        }
+        i += 2;
+    }
+
+    if (strcmp(argv[0], "status") == 0) {
+        return daemon_status(socket_path);
+    }
+    return daemon_submit(socket_path, priority, argc - i, argv + i);
+}
+
+/**
+ * Итоги журнала сборки: записано, отброшено при переполнении буфера
+ */
+static void report_log(const char *path) {
+    LogStats stats;
+    log_get_stats(&stats);
+
+    unsigned long long written = 0, dropped = 0;
+    for (int i = 0; i < LOG_LEVEL_COUNT; i++) {
+        written += stats.written[i];
+        dropped += stats.dropped[i];
+    }
+    if (written == 0) {
+        return;
+    }
+
+    log_info("Журнал сборки: %s (%llu строк, из них вывода команд %llu)",
+             path, written, stats.written[LOG_OUTPUT]);
+    if (dropped > 0 || stats.waits > 0) {
+        log_warning("Буфер журнала переполнялся: отброшено %llu строк (отладка %llu, вывод "
+                    "команд %llu), ожиданий места %llu; наибольшая занятость %zu из %zu",
+                    dropped, stats.dropped[LOG_DEBUG], stats.dropped[LOG_OUTPUT],
+                    stats.waits, stats.peak, stats.capacity);
+    }
+}
+
+/**
+ * Сравнение профилей сжатия на выборке из текущего chroot
+ */
+static int benchmark_squashfs(BuildConfig *config, int sample_mb) {
+    if (config->use_layers) {
+        layers_init(&g_layers, config->layersdir, config->chroot);
+        if (layers_mount_view(&g_layers) != 0) {
+            return 1;
+        }
+    }
+
+    char probe[600];
+    snprintf(probe, sizeof(probe), "%s/usr", config->chroot);
+
+    int result = 1;
+    if (!dir_exists(probe)) {
+        log_error("chroot %s ещё не собран: сначала выполните сборку", config->chroot);
+    } else {
+        result = squashfs_benchmark(&g_squashfs, config->chroot, config->workdir,
+                                    sample_mb, config->verbose);
+    }
+
+    layers_unmount(&g_layers);
+    return result;
 }
 
 /**
@@ -0,0 +1,123 @@
+/**
+ * packages.c - Реализация планировщика установки пакетов
+ *
+ * Списки пакетов всех шагов (базовые, рабочий стол, установщик,
+ * дополнительное ПО) объединяются и ставятся одной командой apt-get.
+ * Раздельная установка по шагам трижды скачивала индексы, четырежды
+ * решала зависимости и запускала триггеры dpkg после каждого шага.
+ */
+
+#include "packages.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Заголовок скрипта установки
+static const char install_header[] =
+    "#!/bin/bash\n"
+    "set -e\n\n"
+    "export DEBIAN_FRONTEND=noninteractive\n\n"
+    "apt-get update\n";
+
+void package_set_init(PackageSet *set) {
+    set->names = NULL;
+    set->count = 0;
+    set->capacity = 0;
+}
+
+int package_set_add(PackageSet *set, const char *name, size_t len) {
+    for (int i = 0; i < set->count; i++) {
+        if (set->names[i].len == len && memcmp(set->names[i].name, name, len) == 0) {
+            return 0;
+        }
+    }
+
+    if (set->count >= PACKAGES_MAX) {
+        log_error("Слишком много пакетов (больше %d)", PACKAGES_MAX);
+        return -1;
+    }
+
+    if (set->count == set->capacity) {
+        int capacity = set->capacity ? set->capacity * 2 : 64;
+        PackageName *names = realloc(set->names, capacity * sizeof(*names));
+        if (!names) {
+            return -1;
+        }
+        set->names = names;
+        set->capacity = capacity;
+    }
+
+    set->names[set->count].name = name;
+    set->names[set->count].len = len;
+    set->count++;
+    return 0;
+}
+
+// Добавление списка через запятую или пробел (формат luna.conf)
+int package_set_add_list(PackageSet *set, const char *list) {
+    const char *p = list;
+
+    while (*p) {
+        p += strspn(p, ", \t\n");
+        size_t len = strcspn(p, ", \t\n");
+        if (len > 0 && package_set_add(set, p, len) != 0) {
+            return -1;
+        }
+        p += len;
+    }
+
+    return 0;
+}
+
+void package_set_free(PackageSet *set) {
+    free(set->names);
+    package_set_init(set);
+}
+
+// Заголовок, две команды apt-get и по строке продолжения на пакет в каждой
+size_t package_set_script_size(const PackageSet *set) {
+    size_t size = sizeof(install_header) + 1024;
+    for (int i = 0; i < set->count; i++) {
+        size += 2 * (set->names[i].len + 8);
+    }
+    return size;
+}
+
+// Добавление команды apt-get со всем набором пакетов
+static size_t append_command(const PackageSet *set, const char *command,
+                             char *script, size_t len, size_t size) {
+    if (len < size) {
+        len += snprintf(script + len, size - len, "%s", command);
+    }
+    for (int i = 0; i < set->count && len < size; i++) {
+        len += snprintf(script + len, size - len, " \\\n    %.*s",
+                        (int)set->names[i].len, set->names[i].name);
+    }
+    if (len < size) {
+        len += snprintf(script + len, size - len, "\n");
+    }
+    return len;
+}
+
+int package_set_install_script(const PackageSet *set, const char *download_lock,
+                               char *script, size_t size) {
+    size_t len = snprintf(script, size, "%s", install_header);
+
+    if (download_lock) {
+        // Каталог архивов общий для всех сборок, и его блокировку apt берёт
+        // на всю транзакцию: сборки устанавливают пакеты по очереди
+        char command[512];
+        snprintf(command, sizeof(command), "flock %s apt-get install -y", download_lock);
+        len = append_command(set, command, script, len, size);
+    } else {
+        len = append_command(set, "apt-get install -y", script, len, size);
+    }
+
+    if (len >= size) {
+        log_error("Список пакетов не помещается в скрипт установки");
+        return -1;
+    }
+
+    return 0;
+}
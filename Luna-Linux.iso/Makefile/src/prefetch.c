@@ -0,0 +1,660 @@
+/**
+ * prefetch.c - Реализация предварительной загрузки пакетов
+ *
+ * Список пакетов вычисляется apt на хосте по отдельному каталогу состояния:
+ * apt-get --print-uris даёт адреса и размеры всего замыкания зависимостей,
+ * apt-cache show — SHA-256 из индекса. Загрузка идёт в несколько соединений
+ * параллельно с построением базовой системы; файл попадает в кэш
+ * переименованием только после проверки размера и хэша, поэтому apt в
+ * chroot никогда не видит неполный или подменённый пакет.
+ */
+
+#include "prefetch.h"
+#include "exec.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define PREFETCH_MAX_REDIRECTS 3
+
+// Предельное время подключения к зеркалу и ожидания данных от него, с.
+// Зависшее зеркало не задерживает сборку: загрузка прекращается, и
+// оставшиеся пакеты скачивает apt при установке
+#define PREFETCH_CONNECT_TIMEOUT 15
+#define PREFETCH_IO_TIMEOUT 30
+
+// Результат загрузки: зеркало не ответило вовремя
+#define FETCH_TIMEOUT (-2)
+
+// Общие данные рабочих потоков загрузки
+typedef struct {
+    Prefetch *pf;
+    PrefetchItem *items;
+    int count;
+    int next;
+    bool stalled;           // зеркало не ответило вовремя, загрузка прекращена
+    pthread_mutex_t lock;
+} PrefetchQueue;
+
+// Копирование строки в поле фиксированного размера; false — не помещается
+static bool copy_field(char *field, size_t size, const char *value) {
+    int len = snprintf(field, size, "%s", value);
+    return len >= 0 && (size_t)len < size;
+}
+
+int prefetch_init(Prefetch *pf, const char *statedir, const char *mirror,
+                  const char *codename, const char *components, const char *arch,
+                  const char *destdir) {
+    memset(pf, 0, sizeof(*pf));
+    pf->connections = PREFETCH_CONNECTIONS;
+    if (!copy_field(pf->statedir, sizeof(pf->statedir), statedir) ||
+        !copy_field(pf->mirror, sizeof(pf->mirror), mirror) ||
+        !copy_field(pf->codename, sizeof(pf->codename), codename) ||
+        !copy_field(pf->components, sizeof(pf->components), components) ||
+        !copy_field(pf->arch, sizeof(pf->arch), arch) ||
+        !copy_field(pf->destdir, sizeof(pf->destdir), destdir)) {
+        log_error("Слишком длинный параметр предзагрузки (каталог, зеркало или компоненты)");
+        return -1;
+    }
+    return 0;
+}
+
+// Команда apt с параметрами, направляющими его в отдельный каталог
+// состояния; аргументы передаются без оболочки
+static void apt_command(const Prefetch *pf, const char *program, ExecArgs *args) {
+    exec_args_init(args);
+    exec_args_add(args, program);
+    exec_args_addf(args, "-oDir::State=%s", pf->statedir);
+    exec_args_addf(args, "-oDir::State::status=%s/status", pf->statedir);
+    exec_args_addf(args, "-oDir::Cache=%s/cache", pf->statedir);
+    exec_args_addf(args, "-oDir::Etc::sourcelist=%s/sources.list", pf->statedir);
+    exec_args_add(args, "-oDir::Etc::sourceparts=-");
+    exec_args_addf(args, "-oAPT::Architecture=%s", pf->arch);
+    exec_args_addf(args, "-oAPT::Architectures::=%s", pf->arch);
+    exec_args_add(args, "-oAcquire::Languages=none");
+    exec_args_addf(args, "-oAcquire::http::Timeout=%d", PREFETCH_IO_TIMEOUT);
+}
+
+// Запуск apt с чтением его вывода; stderr остаётся у сборки
+static FILE *open_apt(ExecArgs *args, pid_t *pid) {
+    int out = -1;
+    *pid = args->argv[0] ? spawn_process(args->argv, NULL, &out, NULL) : -1;
+    if (*pid < 0) {
+        return NULL;
+    }
+
+    FILE *fp = fdopen(out, "r");
+    if (!fp) {
+        close(out);
+        wait_process(*pid, NULL, NULL);
+    }
+    return fp;
+}
+
+static int close_apt(FILE *fp, pid_t pid) {
+    fclose(fp);
+    int status;
+    if (wait_process(pid, &status, NULL) != 0) {
+        return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Путь внутри каталога состояния apt
+static bool state_path(const Prefetch *pf, const char *name, char *path, size_t size) {
+    int len = snprintf(path, size, "%s/%s", pf->statedir, name);
+    return len >= 0 && (size_t)len < size;
+}
+
+// Каталог состояния apt и список источников
+static int prepare_state(const Prefetch *pf) {
+    char path[600];
+    if (!state_path(pf, "lists/partial", path, sizeof(path)) || make_dirs(path) != 0) {
+        return -1;
+    }
+    if (!state_path(pf, "cache", path, sizeof(path)) || make_dirs(path) != 0) {
+        return -1;
+    }
+
+    if (!state_path(pf, "status", path, sizeof(path)) || write_to_file(path, "") != 0) {
+        return -1;
+    }
+
+    char components[128];
+    snprintf(components, sizeof(components), "%s", pf->components);
+    for (char *p = components; *p; p++) {
+        if (*p == ',') {
+            *p = ' ';
+        }
+    }
+
+    // Подпись индексов проверяется здесь, если на хосте есть ключи Ubuntu;
+    // в любом случае apt в chroot сверяет пакеты со своим проверенным индексом
+    const char *keyring = "/usr/share/keyrings/ubuntu-archive-keyring.gpg";
+    char sources[768];
+    if (file_exists(keyring)) {
+        snprintf(sources, sizeof(sources), "deb [arch=%s signed-by=%s] %s %s %s\n",
+                 pf->arch, keyring, pf->mirror, pf->codename, components);
+    } else {
+        snprintf(sources, sizeof(sources), "deb [arch=%s trusted=yes] %s %s %s\n",
+                 pf->arch, pf->mirror, pf->codename, components);
+    }
+
+    if (!state_path(pf, "sources.list", path, sizeof(path))) {
+        return -1;
+    }
+    return write_to_file(path, sources);
+}
+
+// Разбор строки apt-get --print-uris: 'URL' имя размер хэш
+static bool parse_uri_line(const char *line, PrefetchItem *item) {
+    if (line[0] != '\'') {
+        return false;
+    }
+
+    const char *end = strchr(line + 1, '\'');
+    if (!end || (size_t)(end - line - 1) >= sizeof(item->url)) {
+        return false;
+    }
+
+    memset(item, 0, sizeof(*item));
+    memcpy(item->url, line + 1, end - line - 1);
+
+    return sscanf(end + 1, " %255s %lld", item->filename, &item->size) == 2;
+}
+
+// Адреса и размеры пакетов для установки набора
+static PrefetchItem *resolve_uris(Prefetch *pf, const PackageSet *set, int *count) {
+    ExecArgs args;
+    apt_command(pf, "apt-get", &args);
+    exec_args_add(&args, "install");
+    exec_args_add(&args, "--print-uris");
+    exec_args_add(&args, "-qq");
+    exec_args_add(&args, "-y");
+    for (int i = 0; i < set->count; i++) {
+        exec_args_addf(&args, "%.*s", (int)set->names[i].len, set->names[i].name);
+    }
+
+    pid_t pid;
+    FILE *fp = open_apt(&args, &pid);
+    exec_args_free(&args);
+    if (!fp) {
+        return NULL;
+    }
+
+    int capacity = 256;
+    PrefetchItem *items = malloc(capacity * sizeof(PrefetchItem));
+    *count = 0;
+
+    char line[1024];
+    while (items && fgets(line, sizeof(line), fp)) {
+        if (*count == capacity) {
+            capacity *= 2;
+            PrefetchItem *grown = realloc(items, capacity * sizeof(PrefetchItem));
+            if (!grown) {
+                free(items);
+                items = NULL;
+                break;
+            }
+            items = grown;
+        }
+
+        if (parse_uri_line(line, &items[*count])) {
+            (*count)++;
+        }
+    }
+
+    if (close_apt(fp, pid) != 0) {
+        log_warning("apt-get не смог разрешить набор пакетов для предзагрузки");
+        free(items);
+        return NULL;
+    }
+
+    return items;
+}
+
+// SHA-256 из индекса: поле Filename записи совпадает с концом адреса пакета
+static int resolve_hashes(Prefetch *pf, PrefetchItem *items, int count) {
+    ExecArgs args;
+    apt_command(pf, "apt-cache", &args);
+    exec_args_add(&args, "show");
+    exec_args_add(&args, "--no-all-versions");
+    for (int i = 0; i < count; i++) {
+        exec_args_addf(&args, "%.*s", (int)strcspn(items[i].filename, "_"), items[i].filename);
+    }
+
+    pid_t pid;
+    FILE *fp = open_apt(&args, &pid);
+    exec_args_free(&args);
+    if (!fp) {
+        return -1;
+    }
+
+    char line[1024], filename[sizeof(line) + 1] = "";
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (strncmp(line, "Filename: ", 10) == 0) {
+            snprintf(filename, sizeof(filename), "/%s", line + 10);
+        } else if (strncmp(line, "SHA256: ", 8) == 0 && filename[0] &&
+                   strlen(line + 8) == SHA256_HEX_SIZE - 1) {
+            size_t flen = strlen(filename);
+            for (int i = 0; i < count; i++) {
+                size_t ulen = strlen(items[i].url);
+                if (ulen >= flen && strcmp(items[i].url + ulen - flen, filename) == 0) {
+                    snprintf(items[i].sha256, sizeof(items[i].sha256), "%s", line + 8);
+                }
+            }
+            filename[0] = '\0';
+        }
+    }
+
+    return close_apt(fp, pid);
+}
+
+// Запись полученных данных с подсчётом хэша
+static int sink_write(int fd, Sha256Ctx *ctx, const char *data, size_t len, long long *total) {
+    sha256_update(ctx, data, len);
+    *total += len;
+
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+// Загрузка file:// — локальное зеркало для проверок без сети
+static int fetch_file(const char *path, int fd, Sha256Ctx *ctx, long long *total) {
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return -1;
+    }
+
+    char buffer[65536];
+    ssize_t bytes;
+    int result = 0;
+    while ((bytes = read(in, buffer, sizeof(buffer))) > 0) {
+        if (sink_write(fd, ctx, buffer, bytes, total) != 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    close(in);
+    return bytes < 0 ? -1 : result;
+}
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Неблокирующее подключение к адресу с общим сроком deadline
+static int connect_addr(const struct addrinfo *ai, double deadline) {
+    int sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                      ai->ai_protocol);
+    if (sock < 0) {
+        return -1;
+    }
+
+    if (connect(sock, ai->ai_addr, ai->ai_addrlen) != 0) {
+        if (errno != EINPROGRESS) {
+            close(sock);
+            return -1;
+        }
+
+        struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+        int ready;
+        do {
+            int wait_ms = (int)((deadline - monotonic_seconds()) * 1000);
+            ready = wait_ms > 0 ? poll(&pfd, 1, wait_ms) : 0;
+        } while (ready < 0 && errno == EINTR);
+
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (ready <= 0 || getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) != 0 ||
+            error != 0) {
+            close(sock);
+            errno = ready == 0 ? ETIMEDOUT : error ? error : errno;
+            return -1;
+        }
+    }
+
+    // Дальше сокет блокирующий, но чтение и запись ограничены по времени
+    struct timeval timeout = { .tv_sec = PREFETCH_IO_TIMEOUT };
+    int flags = fcntl(sock, F_GETFL);
+    if (flags < 0 || fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) != 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Подключение к host:port не дольше PREFETCH_CONNECT_TIMEOUT на все адреса;
+// errno ETIMEDOUT — срок истёк
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints = { 0 }, *res, *ai;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+
+    double deadline = monotonic_seconds() + PREFETCH_CONNECT_TIMEOUT;
+    int sock = -1;
+    for (ai = res; ai && sock < 0 && monotonic_seconds() < deadline; ai = ai->ai_next) {
+        sock = connect_addr(ai, deadline);
+    }
+    if (sock < 0 && monotonic_seconds() >= deadline) {
+        errno = ETIMEDOUT;
+    }
+
+    freeaddrinfo(res);
+    return sock;
+}
+
+// Ошибка сокета из-за истёкшего срока: SO_RCVTIMEO и SO_SNDTIMEO дают EAGAIN
+static bool timed_out(void) {
+    return errno == ETIMEDOUT || errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+// Загрузка http:// (HTTP/1.1, тело по Content-Length или до закрытия)
+static int fetch_http(const char *url, int fd, Sha256Ctx *ctx, long long *total) {
+    char current[512];
+    snprintf(current, sizeof(current), "%s", url);
+
+    for (int redirect = 0; redirect <= PREFETCH_MAX_REDIRECTS; redirect++) {
+        char host[256], port[8] = "80";
+        const char *rest = current + strlen("http://");
+        size_t host_len = strcspn(rest, ":/");
+        if (host_len == 0 || host_len >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, rest, host_len);
+        host[host_len] = '\0';
+        rest += host_len;
+
+        if (*rest == ':') {
+            size_t port_len = strcspn(rest + 1, "/");
+            if (port_len == 0 || port_len >= sizeof(port)) {
+                return -1;
+            }
+            memcpy(port, rest + 1, port_len);
+            port[port_len] = '\0';
+            rest += port_len + 1;
+        }
+        const char *path = *rest ? rest : "/";
+
+        int sock = connect_to(host, port);
+        if (sock < 0) {
+            return timed_out() ? FETCH_TIMEOUT : -1;
+        }
+
+        char request[1024];
+        int request_len = snprintf(request, sizeof(request),
+                                   "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                                   "User-Agent: luna-linux-build\r\nConnection: close\r\n\r\n",
+                                   path, host);
+        if (write(sock, request, request_len) != request_len) {
+            bool stalled = timed_out();
+            close(sock);
+            return stalled ? FETCH_TIMEOUT : -1;
+        }
+
+        // Заголовки ответа
+        char buffer[65536];
+        size_t used = 0;
+        char *body = NULL;
+        bool stalled = false;
+        while (!body && used < sizeof(buffer) - 1) {
+            ssize_t bytes = read(sock, buffer + used, sizeof(buffer) - 1 - used);
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes <= 0) {
+                stalled = bytes < 0 && timed_out();
+                break;
+            }
+            used += bytes;
+            buffer[used] = '\0';
+            body = strstr(buffer, "\r\n\r\n");
+        }
+        if (!body) {
+            close(sock);
+            return stalled ? FETCH_TIMEOUT : -1;
+        }
+        *body = '\0';
+        body += 4;
+
+        int status = 0;
+        sscanf(buffer, "HTTP/%*s %d", &status);
+
+        long long length = -1;
+        char location[512] = "";
+        bool chunked = false;
+        for (char *line = strstr(buffer, "\r\n"); line; line = strstr(line, "\r\n")) {
+            line += 2;
+            if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                length = atoll(line + 15);
+            } else if (strncasecmp(line, "Location:", 9) == 0) {
+                sscanf(line + 9, " %511[^\r\n]", location);
+            } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 &&
+                       strstr(line, "chunked")) {
+                chunked = true;
+            }
+        }
+
+        if (status >= 300 && status < 400 && strncmp(location, "http://", 7) == 0) {
+            close(sock);
+            snprintf(current, sizeof(current), "%s", location);
+            continue;
+        }
+        if (status != 200 || chunked) {
+            close(sock);
+            return -1;
+        }
+
+        // Тело ответа
+        int result = sink_write(fd, ctx, body, used - (body - buffer), total);
+        while (result == 0 && (length < 0 || *total < length)) {
+            ssize_t bytes = read(sock, buffer, sizeof(buffer));
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes <= 0) {
+                stalled = bytes < 0 && timed_out();
+                break;
+            }
+            result = sink_write(fd, ctx, buffer, bytes, total);
+        }
+
+        close(sock);
+        if (stalled) {
+            return FETCH_TIMEOUT;
+        }
+        return result == 0 && (length < 0 || *total == length) ? 0 : -1;
+    }
+
+    return -1;
+}
+
+// Загрузка одного пакета с проверкой; в кэш он попадает переименованием
+static int fetch_item(Prefetch *pf, const PrefetchItem *item, int slot) {
+    char tmp_path[600], final_path[600];
+    snprintf(final_path, sizeof(final_path), "%s/%s", pf->destdir, item->filename);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.part.%d.%d",
+             pf->destdir, item->filename, getpid(), slot);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    Sha256Ctx ctx;
+    sha256_init(&ctx);
+    long long total = 0;
+
+    int result;
+    if (strncmp(item->url, "file:", 5) == 0) {
+        const char *path = item->url + 5;
+        while (path[0] == '/' && path[1] == '/') {
+            path++;
+        }
+        result = fetch_file(path, fd, &ctx, &total);
+    } else if (strncmp(item->url, "http://", 7) == 0) {
+        result = fetch_http(item->url, fd, &ctx, &total);
+    } else {
+        result = -1;
+    }
+
+    if (close(fd) != 0) {
+        result = -1;
+    }
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_HEX_SIZE];
+    sha256_final(&ctx, digest);
+    hash_to_hex(digest, sizeof(digest), hex);
+
+    if (result == 0 && (total != item->size || strcmp(hex, item->sha256) != 0)) {
+        log_warning("Пакет %s не совпадает с индексом, отброшен", item->filename);
+        result = -1;
+    }
+
+    if (result != 0 || rename(tmp_path, final_path) != 0) {
+        unlink(tmp_path);
+        return result == FETCH_TIMEOUT ? FETCH_TIMEOUT : -1;
+    }
+
+    return 0;
+}
+
+static void *fetch_worker(void *arg) {
+    PrefetchQueue *queue = arg;
+    Prefetch *pf = queue->pf;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->stalled ? queue->count : queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (index >= queue->count) {
+            break;
+        }
+
+        PrefetchItem *item = &queue->items[index];
+        int result = fetch_item(pf, item, index);
+
+        pthread_mutex_lock(&queue->lock);
+        if (result == FETCH_TIMEOUT) {
+            // Остальные пакеты скачает apt: ждать каждый по таймауту незачем
+            if (!queue->stalled) {
+                log_warning("Зеркало не ответило за %d с, предзагрузка прекращена",
+                            PREFETCH_IO_TIMEOUT);
+            }
+            queue->stalled = true;
+            pf->failed++;
+        } else if (result == 0) {
+            pf->fetched++;
+            pf->bytes += item->size;
+            log_debug("Загружен %s", item->filename);
+        } else {
+            pf->failed++;
+            log_warning("Не удалось загрузить %s", item->url);
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return NULL;
+}
+
+int prefetch_run(Prefetch *pf, const PackageSet *set) {
+    if (prepare_state(pf) != 0) {
+        log_warning("Не удалось подготовить каталог %s для предзагрузки", pf->statedir);
+        return -1;
+    }
+
+    ExecArgs args;
+    apt_command(pf, "apt-get", &args);
+    exec_args_add(&args, "-q");
+    exec_args_add(&args, "update");
+    int updated = exec_command(args.argv, pf->verbose);
+    exec_args_free(&args);
+    if (updated != 0) {
+        log_warning("Не удалось получить индексы %s для предзагрузки", pf->mirror);
+        return -1;
+    }
+
+    int count = 0;
+    PrefetchItem *items = resolve_uris(pf, set, &count);
+    if (!items) {
+        return -1;
+    }
+    if (resolve_hashes(pf, items, count) != 0) {
+        log_warning("Не удалось получить хэши пакетов из индекса");
+        free(items);
+        return -1;
+    }
+
+    // В очередь попадают пакеты, которых ещё нет в кэше и хэш которых известен
+    int pending = 0;
+    for (int i = 0; i < count; i++) {
+        char path[600];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", pf->destdir, items[i].filename);
+
+        if (stat(path, &st) == 0 && st.st_size == items[i].size) {
+            pf->present++;
+        } else if (items[i].sha256[0]) {
+            items[pending++] = items[i];
+        }
+    }
+
+    PrefetchQueue queue = { .pf = pf, .items = items, .count = pending, .next = 0 };
+    pthread_mutex_init(&queue.lock, NULL);
+
+    int workers = pf->connections < PREFETCH_CONNECTIONS ? pf->connections : PREFETCH_CONNECTIONS;
+    if (workers > pending) {
+        workers = pending;
+    }
+    pthread_t threads[PREFETCH_CONNECTIONS];
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&threads[i], NULL, fetch_worker, &queue);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&queue.lock);
+    free(items);
+
+    log_info("Предзагрузка: скачано %d (%.1f MB), уже в кэше %d, ошибок %d",
+             pf->fetched, pf->bytes / (1024.0 * 1024.0), pf->present, pf->failed);
+    return 0;
+}
@@ -0,0 +1,198 @@
+/**
+ * ramdisk.c - Реализация сборки в оперативной памяти
+ *
+ * Перед сборкой оценивается объём каждой области рабочего каталога: по
+ * замеру прошлой сборки с запасом или, если замера нет, по умолчанию.
+ * Области по порядку приоритета размещаются в tmpfs, пока помещаются в
+ * доступную память за вычетом запаса для самих команд сборки; остальные
+ * остаются на диске. Готовый ISO пишется в постоянное хранилище, tmpfs
+ * размонтируется по окончании сборки.
+ */
+
+#define _GNU_SOURCE
+
+#include "ramdisk.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ftw.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#define MB (1024ULL * 1024ULL)
+#define GB (1024ULL * MB)
+
+// Оценки без замера прошлой сборки
+static const unsigned long long default_estimate[RAM_AREA_COUNT] = {
+    [RAM_AREA_CHROOT] = 20 * GB,
+    [RAM_AREA_IMAGE] = 6 * GB,
+    [RAM_AREA_ISO] = 6 * GB,
+};
+
+static const char *const area_names[RAM_AREA_COUNT] = {
+    [RAM_AREA_CHROOT] = "chroot",
+    [RAM_AREA_IMAGE] = "image",
+    [RAM_AREA_ISO] = "iso",
+};
+
+// Память, которая остаётся командам сборки: не меньше 4 ГБ и 1/8 ОЗУ
+#define RESERVE_MIN (4 * GB)
+#define RESERVE_DIVISOR 8
+
+// Чтение значения из /proc/meminfo в байтах
+static unsigned long long meminfo_value(const char *name) {
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (!fp) {
+        return 0;
+    }
+
+    char line[256];
+    unsigned long long value = 0;
+    size_t len = strlen(name);
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, name, len) == 0 && line[len] == ':') {
+            value = strtoull(line + len + 1, NULL, 10) * 1024;
+            break;
+        }
+    }
+
+    fclose(fp);
+    return value;
+}
+
+// Замер прошлой сборки с запасом 25%
+static void load_usage(RamDisk *disk) {
+    for (int i = 0; i < RAM_AREA_COUNT; i++) {
+        disk->estimate[i] = default_estimate[i];
+    }
+
+    FILE *fp = fopen(disk->usage_path, "r");
+    if (!fp) {
+        return;
+    }
+
+    char name[32];
+    unsigned long long bytes;
+    while (fscanf(fp, "%31s %llu", name, &bytes) == 2) {
+        for (int i = 0; i < RAM_AREA_COUNT; i++) {
+            if (strcmp(name, area_names[i]) == 0 && bytes > 0) {
+                disk->estimate[i] = bytes + bytes / 4;
+            }
+        }
+    }
+
+    fclose(fp);
+}
+
+int ramdisk_plan(RamDisk *disk, const char *workdir) {
+    memset(disk, 0, sizeof(*disk));
+    snprintf(disk->mountpoint, sizeof(disk->mountpoint), "/run/luna-linux-build-%d", getpid());
+    snprintf(disk->usage_path, sizeof(disk->usage_path), "%s/ram-usage", workdir);
+    load_usage(disk);
+
+    unsigned long long total = meminfo_value("MemTotal");
+    unsigned long long available = meminfo_value("MemAvailable");
+    unsigned long long reserve = total / RESERVE_DIVISOR;
+    reserve = reserve > RESERVE_MIN ? reserve : RESERVE_MIN;
+    disk->available = available > reserve ? available - reserve : 0;
+
+    unsigned long long planned = 0;
+    for (int i = 0; i < RAM_AREA_COUNT; i++) {
+        if (planned + disk->estimate[i] <= disk->available) {
+            disk->in_ram[i] = true;
+            planned += disk->estimate[i];
+        }
+    }
+
+    for (int i = 0; i < RAM_AREA_COUNT; i++) {
+        if (disk->in_ram[i]) {
+            log_info("Сборка в памяти: %s (оценка %.1f ГБ)",
+                     area_names[i], disk->estimate[i] / (double)GB);
+        } else {
+            log_warning("Не хватает памяти для %s (оценка %.1f ГБ, доступно %.1f ГБ): "
+                        "область остаётся на диске", area_names[i],
+                        disk->estimate[i] / (double)GB, (disk->available - planned) / (double)GB);
+        }
+    }
+
+    // Предел tmpfs — вся доступная память сверх запаса: оценка может
+    // оказаться заниженной, а неиспользованный объём tmpfs память не занимает
+    disk->size = disk->available;
+    return planned > 0 ? 0 : -1;
+}
+
+int ramdisk_mount(RamDisk *disk) {
+    if (make_dirs(disk->mountpoint) != 0) {
+        log_error("Не удалось создать каталог %s", disk->mountpoint);
+        return -1;
+    }
+
+    char options[64];
+    snprintf(options, sizeof(options), "size=%llum,mode=0755", disk->size / MB);
+    if (mount("tmpfs", disk->mountpoint, "tmpfs", MS_NOSUID | MS_NODEV, options) != 0) {
+        log_error("Ошибка монтирования tmpfs в %s: %s", disk->mountpoint, strerror(errno));
+        rmdir(disk->mountpoint);
+        return -1;
+    }
+
+    disk->mounted = true;
+    return 0;
+}
+
+int ramdisk_unmount(RamDisk *disk) {
+    if (!disk->mounted) {
+        return 0;
+    }
+
+    if (umount2(disk->mountpoint, 0) != 0 && umount2(disk->mountpoint, MNT_DETACH) != 0) {
+        log_error("Не удалось размонтировать %s: %s", disk->mountpoint, strerror(errno));
+        return -1;
+    }
+
+    rmdir(disk->mountpoint);
+    disk->mounted = false;
+    return 0;
+}
+
+void ramdisk_path(const RamDisk *disk, const char *name, char *path, size_t size) {
+    snprintf(path, size, "%s/%s", disk->mountpoint, name);
+}
+
+unsigned long long ramdisk_used(const RamDisk *disk) {
+    struct statvfs st;
+    if (!disk->mounted || statvfs(disk->mountpoint, &st) != 0) {
+        return 0;
+    }
+    return (unsigned long long)(st.f_blocks - st.f_bfree) * st.f_frsize;
+}
+
+// nftw не передаёт контекст, поэтому сумма накапливается в переменной
+// файла; замер выполняется один раз в конце сборки
+static unsigned long long tree_bytes;
+
+static int add_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)path;
+    (void)flag;
+    (void)ftw;
+    tree_bytes += (unsigned long long)st->st_blocks * 512;
+    return 0;
+}
+
+void ramdisk_record_usage(const RamDisk *disk, const char *const paths[RAM_AREA_COUNT]) {
+    FILE *fp = fopen(disk->usage_path, "w");
+    if (!fp) {
+        return;
+    }
+
+    for (int i = 0; i < RAM_AREA_COUNT; i++) {
+        tree_bytes = 0;
+        nftw(paths[i], add_entry, 64, FTW_PHYS | FTW_MOUNT);
+        fprintf(fp, "%s %llu\n", area_names[i], tree_bytes);
+    }
+
+    fclose(fp);
+}
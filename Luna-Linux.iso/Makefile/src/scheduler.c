@@ -0,0 +1,288 @@
+/**
+ * scheduler.c - Реализация планировщика шагов сборки
+ *
+ * Узлы добавляются в топологическом порядке: зависимости узла должны
+ * быть добавлены раньше него, поэтому циклы невозможны. Рабочие потоки
+ * берут любой узел, все зависимости которого выполнены; при первом сбое
+ * ещё не начатые узлы отменяются, а запущенные команды завершаются.
+ */
+
+#include "scheduler.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+// Цвета для вывода
+#define SCHED_COLOR_RUN    "\033[0;36m"
+#define SCHED_COLOR_DONE   "\033[0;32m"
+#define SCHED_COLOR_SKIP   "\033[0;34m"
+#define SCHED_COLOR_FAIL   "\033[0;31m"
+#define SCHED_COLOR_RESET  "\033[0m"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void format_duration(double seconds, char *buf, size_t size) {
+    int total = (int)seconds;
+    snprintf(buf, size, "%02d:%02d", total / 60, total % 60);
+}
+
+// Инициализация планировщика
+void sched_init(Scheduler *sched, int workers, SchedRunFn run, void *ctx) {
+    memset(sched, 0, sizeof(*sched));
+    sched->workers = workers > 0 ? workers : 1;
+    sched->run = run;
+    sched->ctx = ctx;
+    sched->failed = -1;
+    sched->live = isatty(STDOUT_FILENO);
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->cond, NULL);
+}
+
+// Добавление узла; skip — результат узла уже есть, запуск не нужен
+int sched_add(Scheduler *sched, const char *name, const int *deps, int dep_count, bool skip) {
+    if (sched->count >= SCHED_MAX_NODES || dep_count > SCHED_MAX_DEPS) {
+        log_error("Слишком большой граф шагов: %s", name);
+        return -1;
+    }
+
+    SchedNode *node = &sched->nodes[sched->count];
+    node->name = name;
+    node->dep_count = dep_count;
+    node->state = skip ? SCHED_SKIPPED : SCHED_PENDING;
+
+    for (int i = 0; i < dep_count; i++) {
+        if (deps[i] < 0 || deps[i] >= sched->count) {
+            log_error("Шаг «%s» зависит от ещё не объявленного шага %d", name, deps[i]);
+            return -1;
+        }
+        node->deps[i] = deps[i];
+    }
+
+    return sched->count++;
+}
+
+// Строка состояния с запущенными узлами (вызывается под блокировкой)
+static void render_status(Scheduler *sched) {
+    int done = 0;
+    for (int i = 0; i < sched->count; i++) {
+        if (sched->nodes[i].state == SCHED_DONE || sched->nodes[i].state == SCHED_SKIPPED) {
+            done++;
+        }
+    }
+
+    char elapsed[16];
+    format_duration(now_seconds() - sched->start_time, elapsed, sizeof(elapsed));
+    printf("\r\033[K" SCHED_COLOR_RUN "[%d/%d %s]" SCHED_COLOR_RESET, done, sched->count, elapsed);
+
+    double now = now_seconds();
+    for (int i = 0; i < sched->count; i++) {
+        if (sched->nodes[i].state == SCHED_RUNNING) {
+            format_duration(now - sched->nodes[i].start_time, elapsed, sizeof(elapsed));
+            printf(" ▶ %s %s", sched->nodes[i].name, elapsed);
+        }
+    }
+    fflush(stdout);
+}
+
+// Событие узла отдельной строкой над строкой состояния
+static void print_event(Scheduler *sched, int index, const char *color, const char *label) {
+    SchedNode *node = &sched->nodes[index];
+    char elapsed[16] = "";
+    if (node->end_time > 0) {
+        format_duration(node->end_time - node->start_time, elapsed, sizeof(elapsed));
+    }
+
+    printf("%s%s[%s]" SCHED_COLOR_RESET " %s %s\n",
+           sched->live ? "\r\033[K" : "", color, label, node->name, elapsed);
+    if (sched->live) {
+        render_status(sched);
+    }
+}
+
+// Поиск узла, все зависимости которого выполнены
+static int find_ready(Scheduler *sched) {
+    for (int i = 0; i < sched->count; i++) {
+        SchedNode *node = &sched->nodes[i];
+        if (node->state != SCHED_PENDING) {
+            continue;
+        }
+
+        bool ready = true;
+        for (int d = 0; d < node->dep_count && ready; d++) {
+            SchedState state = sched->nodes[node->deps[d]].state;
+            ready = state == SCHED_DONE || state == SCHED_SKIPPED;
+        }
+        if (ready) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Отмена всех ещё не начатых узлов (вызывается под блокировкой)
+static void cancel_pending(Scheduler *sched) {
+    for (int i = 0; i < sched->count; i++) {
+        if (sched->nodes[i].state == SCHED_PENDING) {
+            sched->nodes[i].state = SCHED_CANCELLED;
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    Scheduler *sched = arg;
+
+    pthread_mutex_lock(&sched->lock);
+    while (!sched->stop) {
+        int index = sched->failed < 0 ? find_ready(sched) : -1;
+        if (index < 0) {
+            if (sched->running == 0) {
+                sched->stop = true;
+                pthread_cond_broadcast(&sched->cond);
+                break;
+            }
+            pthread_cond_wait(&sched->cond, &sched->lock);
+            continue;
+        }
+
+        SchedNode *node = &sched->nodes[index];
+        node->state = SCHED_RUNNING;
+        node->start_time = now_seconds();
+        sched->running++;
+        print_event(sched, index, SCHED_COLOR_RUN, "ЗАПУСК");
+        pthread_mutex_unlock(&sched->lock);
+
+        int result = sched->run(sched->ctx, index);
+
+        pthread_mutex_lock(&sched->lock);
+        sched->running--;
+        node->end_time = now_seconds();
+
+        if (result == 0) {
+            node->state = SCHED_DONE;
+            print_event(sched, index, SCHED_COLOR_DONE, "ГОТОВО");
+        } else if (sched->failed >= 0) {
+            node->state = SCHED_CANCELLED;
+            print_event(sched, index, SCHED_COLOR_SKIP, "ОТМЕНА");
+        } else {
+            node->state = SCHED_FAILED;
+            sched->failed = index;
+            print_event(sched, index, SCHED_COLOR_FAIL, "ОШИБКА");
+
+            // Быстрый отказ: соседние узлы прерываются, новые не запускаются
+            cancel_pending(sched);
+            terminate_running_processes();
+        }
+        pthread_cond_broadcast(&sched->cond);
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    return NULL;
+}
+
+// Обновление строки состояния раз в секунду
+static void *ticker_main(void *arg) {
+    Scheduler *sched = arg;
+
+    pthread_mutex_lock(&sched->lock);
+    while (!sched->stop) {
+        render_status(sched);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&sched->cond, &sched->lock, &deadline);
+    }
+    printf("\r\033[K");
+    fflush(stdout);
+    pthread_mutex_unlock(&sched->lock);
+
+    return NULL;
+}
+
+// Выполнение графа
+int sched_run(Scheduler *sched) {
+    pthread_t threads[SCHED_MAX_NODES];
+    pthread_t ticker;
+    int workers = sched->workers < sched->count ? sched->workers : sched->count;
+
+    sched->start_time = now_seconds();
+    sched->stop = false;
+
+    for (int i = 0; i < sched->count; i++) {
+        if (sched->nodes[i].state == SCHED_SKIPPED) {
+            print_event(sched, i, SCHED_COLOR_SKIP, "ПРОПУСК");
+        }
+    }
+
+    if (sched->live) {
+        pthread_create(&ticker, NULL, ticker_main, sched);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&threads[i], NULL, worker_main, sched);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (sched->live) {
+        pthread_join(ticker, NULL);
+    }
+
+    // Узлы, до которых не дошла очередь, считаются отменёнными
+    cancel_pending(sched);
+    return sched->failed >= 0 ? -1 : 0;
+}
+
+// Итоговая таблица: длительность узлов и критический путь графа
+void sched_print_summary(Scheduler *sched) {
+    double path[SCHED_MAX_NODES];
+    double total = 0, critical = 0;
+
+    printf("\n");
+    print_padded("Шаг", 48);
+    print_padded("Состояние", 12);
+    printf("Время\n");
+    for (int i = 0; i < sched->count; i++) {
+        SchedNode *node = &sched->nodes[i];
+        static const char *states[] = {
+            "ожидание", "выполняется", "готово", "пропущен", "ошибка", "отменён"
+        };
+
+        double duration = 0;
+        if (node->state == SCHED_DONE || node->state == SCHED_FAILED ||
+            (node->state == SCHED_CANCELLED && node->end_time > 0)) {
+            duration = node->end_time - node->start_time;
+        }
+        total += duration;
+
+        // Самый длинный путь до узла: узлы добавлены в топологическом порядке
+        path[i] = duration;
+        for (int d = 0; d < node->dep_count; d++) {
+            if (path[node->deps[d]] + duration > path[i]) {
+                path[i] = path[node->deps[d]] + duration;
+            }
+        }
+        if (path[i] > critical) {
+            critical = path[i];
+        }
+
+        char elapsed[16];
+        format_duration(duration, elapsed, sizeof(elapsed));
+        print_padded(node->name, 48);
+        print_padded(states[node->state], 12);
+        printf("%s\n", elapsed);
+    }
+
+    char wall[16], sum[16], crit[16];
+    format_duration(now_seconds() - sched->start_time, wall, sizeof(wall));
+    format_duration(total, sum, sizeof(sum));
+    format_duration(critical, crit, sizeof(crit));
+    printf("Общее время: %s (сумма шагов %s, критический путь %s)\n", wall, sum, crit);
+}
@@ -0,0 +1,2158 @@
+/**
+ * sqfs.c - Реализация записи образов squashfs 4.0
+ *
+ * Дерево обходится несколькими потоками сразу. Данные файлов читаются
+ * одним потоком подачи и режутся на блоки; блоки и заполненные блоки
+ * фрагментов сжимаются пулом потоков, у каждого из которых своя очередь,
+ * а простаивающий поток забирает задания из чужих очередей. Число блоков
+ * в работе ограничено, поэтому расход памяти не зависит от размера
+ * дерева. Сжатые блоки дописываются в файл образа строго по порядку
+ * подачи, так что результат не зависит от числа потоков. Таблицы inode,
+ * каталогов, фрагментов, идентификаторов и xattr пишутся после данных,
+ * суперблок — последним.
+ *
+ * Предварительный проход сжимает данные файлов нижних слоёв chroot, пока
+ * последние шаги настройки ещё работают. Итоговый проход берёт готовые
+ * блоки для файлов, не изменившихся с тех пор (тот же inode, размер и
+ * время изменения), и читает заново только новые и изменённые файлы.
+ *
+ * При инкрементальной сборке рядом с образом хранится манифест: для
+ * каждого файла размер, времена, SHA-256 содержимого и положение сжатых
+ * блоков. Сжатые блоки файлов, не изменившихся с прошлой сборки, и блоки
+ * фрагментов с их хвостами копируются из прошлого образа как есть
+ * (copy_file_range), без чтения исходных файлов и без сжатия.
+ */
+
+#define _GNU_SOURCE
+
+#include "sqfs.h"
+#include "hash.h"
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <zlib.h>
+#include <lzma.h>
+
+#define SQFS_MAGIC 0x73717368
+#define SQFS_SUPERBLOCK_SIZE 96
+#define SQFS_META_SIZE 8192
+#define SQFS_META_UNCOMPRESSED 0x8000
+#define SQFS_BLOCK_UNCOMPRESSED (1U << 24)
+#define SQFS_NO_FRAGMENT 0xFFFFFFFFU
+#define SQFS_NO_XATTR 0xFFFFFFFFU
+#define SQFS_INVALID 0xFFFFFFFFFFFFFFFFULL
+#define SQFS_DIR_HEADER_MAX 256
+#define SQFS_PAD 4096
+#define SQFS_MANIFEST_MAGIC "luna-sqfs-manifest 1"
+
+// Флаги суперблока
+#define SQFS_FLAG_UNCOMPRESSED_INODES    0x0001
+#define SQFS_FLAG_UNCOMPRESSED_DATA      0x0002
+#define SQFS_FLAG_UNCOMPRESSED_FRAGMENTS 0x0008
+#define SQFS_FLAG_NO_XATTRS              0x0200
+#define SQFS_FLAG_COMPRESSOR_OPTIONS     0x0400
+#define SQFS_FLAG_UNCOMPRESSED_IDS       0x0800
+
+// Типы inode; расширенные = базовые + 7
+enum {
+    SQFS_DIR = 1,
+    SQFS_FILE,
+    SQFS_SYMLINK,
+    SQFS_BLKDEV,
+    SQFS_CHRDEV,
+    SQFS_FIFO,
+    SQFS_SOCKET,
+    SQFS_EXT = 7
+};
+
+// Блоки в работе на один поток сжатия
+#define SQFS_JOBS_PER_THREAD 4
+
+// Данные файла в образе
+typedef struct {
+    uint64_t start;
+    uint64_t size;
+    uint64_t sparse;
+    uint32_t block_count;
+    uint32_t *blocks;           // размеры блоков в формате squashfs
+    uint32_t fragment;
+    uint32_t fragment_offset;
+    uint32_t fragment_size;
+    // Признаки неизменности для повторного использования
+    ino_t ino;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    bool hashed;
+    bool used;
+} SqfsFile;
+
+// Файл прошлого образа по манифесту
+typedef struct SqfsBaseFile {
+    char *path;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    uint64_t start;
+    uint64_t sparse;
+    uint32_t fragment;
+    uint32_t fragment_offset;
+    uint32_t block_count;
+    uint32_t *blocks;
+    struct SqfsBaseFile *next;
+} SqfsBaseFile;
+
+typedef struct SqfsNode {
+    char *name;
+    struct SqfsNode *parent;
+    struct SqfsNode **children;
+    int child_count;
+    int child_cap;
+    struct stat st;
+    char *link;
+    SqfsFile *file;
+    struct SqfsNode *same_inode;    // первая жёсткая ссылка на тот же inode
+    struct SqfsBaseFile *base;      // тот же файл в прошлом образе
+    uint32_t links;                 // число ссылок внутри образа
+    uint32_t inode_number;
+    uint64_t inode_ref;
+    uint32_t xattr;
+    unsigned char *xattr_pairs;     // xattr в формате таблицы squashfs
+    size_t xattr_size;
+    uint32_t xattr_count;
+} SqfsNode;
+
+// Поток метаданных: блоки по 8 КБ со сжатием, собираются в памяти
+typedef struct {
+    unsigned char block[SQFS_META_SIZE];
+    size_t used;
+    unsigned char *out;
+    size_t out_len;
+    size_t out_cap;
+    uint64_t *starts;               // смещения блоков в out
+    size_t start_count;
+    size_t start_cap;
+} SqfsMeta;
+
+// Задание сжатия: блок файла или блок фрагментов; задание копирования
+// переносит готовые сжатые данные из прошлого образа
+typedef struct {
+    uint64_t seq;
+    SqfsFile *file;
+    uint32_t block;
+    int64_t fragment;               // индекс блока фрагментов или -1
+    bool copy;
+    uint64_t copy_offset;
+    uint64_t copy_len;
+    uint32_t copy_size;             // размер блока фрагментов в формате squashfs
+    unsigned char *data;
+    size_t len;
+    unsigned char *out;
+    size_t out_len;
+    bool raw;
+    bool sparse;
+} SqfsJob;
+
+// Очередь потока сжатия: владелец берёт с головы, остальные — с хвоста
+typedef struct {
+    pthread_mutex_t lock;
+    SqfsJob **items;
+    int head;
+    int count;
+    int cap;
+} SqfsDeque;
+
+typedef struct {
+    uint64_t start;
+    uint32_t size;
+    uint32_t used;                  // несжатый объём хвостов в блоке
+} SqfsFragment;
+
+// Заранее сжатые файлы по относительному пути
+typedef struct SqfsPrefilled {
+    char *path;
+    SqfsFile *file;
+    struct SqfsPrefilled *next;
+} SqfsPrefilled;
+
+struct SqfsWriter {
+    SqfsOptions options;
+    char path[512];
+    int fd;
+    uint64_t offset;
+    bool failed;
+
+    // Пул сжатия; существует на время одного прохода
+    pthread_t threads[SQFS_MAX_THREADS];
+    SqfsDeque deques[SQFS_MAX_THREADS];
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    int queued;
+    bool stop;
+    SqfsJob **window;               // завершённые задания по seq % limit
+    int limit;
+    int inflight;
+    uint64_t next_seq;
+    uint64_t next_write;
+
+    // Текущий блок фрагментов
+    unsigned char *fragment_buffer;
+    size_t fragment_used;
+    uint32_t fragment_index;
+    SqfsFragment *fragments;
+    uint32_t fragment_count;
+    uint32_t fragment_cap;
+
+    SqfsPrefilled **prefilled;
+    size_t prefilled_buckets;
+
+    // Прошлый образ и его манифест
+    char manifest_path[512];
+    int base_fd;
+    SqfsBaseFile **base;
+    size_t base_buckets;
+    SqfsFragment *base_fragments;
+    uint32_t base_fragment_count;
+    int64_t *fragment_map;          // индекс в новом образе или -1
+    uint64_t *fragment_live;        // объём живых хвостов в проходе
+    unsigned char superblock[SQFS_SUPERBLOCK_SIZE];
+
+    SqfsFile **files;               // все записи данных для освобождения
+    size_t file_count;
+    size_t file_cap;
+
+    SqfsStats stats;
+};
+
+// Запись чисел в порядке little-endian
+static void put16(unsigned char *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = v >> (8 * i);
+    }
+}
+
+static void put64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = v >> (8 * i);
+    }
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+    void *result = realloc(ptr, size);
+    if (!result) {
+        log_error("Недостаточно памяти для записи squashfs");
+        abort();
+    }
+    return result;
+}
+
+// Разбор размера блока: 131072, 128K, 1M
+static uint32_t parse_size(const char *text) {
+    char *end;
+    unsigned long value = strtoul(text, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        value *= 1024;
+    } else if (*end == 'M' || *end == 'm') {
+        value *= 1024 * 1024;
+    }
+    return value;
+}
+
+int sqfs_options_parse(SqfsOptions *options, const char *profile_options, int threads) {
+    memset(options, 0, sizeof(*options));
+    options->compressor = SQFS_COMP_GZIP;
+    options->level = -1;
+    options->block_size = 128 * 1024;
+    options->threads = threads;
+
+    const char *source_date = getenv("SOURCE_DATE_EPOCH");
+    options->mtime = source_date ? (uint32_t)strtoul(source_date, NULL, 10) : (uint32_t)time(NULL);
+
+    char copy[512];
+    snprintf(copy, sizeof(copy), "%s", profile_options);
+    int uncompressed = 0;
+    char *save = NULL;
+
+    for (char *word = strtok_r(copy, " \t", &save); word; word = strtok_r(NULL, " \t", &save)) {
+        char *value = NULL;
+        if (strcmp(word, "-comp") == 0 || strcmp(word, "-b") == 0 ||
+            strcmp(word, "-Xcompression-level") == 0 || strcmp(word, "-Xpreset") == 0 ||
+            strcmp(word, "-Xbcj") == 0) {
+            value = strtok_r(NULL, " \t", &save);
+            if (!value) {
+                return -1;
+            }
+        }
+
+        if (strcmp(word, "-comp") == 0) {
+            if (strcmp(value, "gzip") == 0) {
+                options->compressor = SQFS_COMP_GZIP;
+            } else if (strcmp(value, "xz") == 0) {
+                options->compressor = SQFS_COMP_XZ;
+            } else {
+                return -1;
+            }
+        } else if (strcmp(word, "-b") == 0) {
+            options->block_size = parse_size(value);
+        } else if (strcmp(word, "-Xcompression-level") == 0 || strcmp(word, "-Xpreset") == 0) {
+            options->level = atoi(value);
+        } else if (strcmp(word, "-Xbcj") == 0) {
+            if (strcmp(value, "x86") != 0) {
+                return -1;
+            }
+            options->x86_filter = true;
+        } else if (strcmp(word, "-Xe") == 0) {
+            options->extreme = true;
+        } else if (strcmp(word, "-noI") == 0 || strcmp(word, "-noD") == 0 ||
+                   strcmp(word, "-noF") == 0) {
+            uncompressed++;
+        } else if (strcmp(word, "-noId") != 0 && strcmp(word, "-noX") != 0 &&
+                   strcmp(word, "-noappend") != 0 && strcmp(word, "-no-progress") != 0) {
+            return -1;
+        }
+    }
+
+    // Размер блока — степень двойки от 4 КБ до 1 МБ
+    uint32_t bs = options->block_size;
+    if (bs < 4096 || bs > 1024 * 1024 || (bs & (bs - 1)) != 0) {
+        return -1;
+    }
+
+    // Без сжатия — только если отключено всё сразу
+    if (uncompressed == 3) {
+        options->uncompressed = true;
+    } else if (uncompressed != 0) {
+        return -1;
+    }
+
+    if (options->level < 0) {
+        options->level = options->compressor == SQFS_COMP_XZ ? 6 : 9;
+    }
+    return 0;
+}
+
+static int block_log(uint32_t block_size) {
+    int log = 0;
+    while ((1U << log) < block_size) {
+        log++;
+    }
+    return log;
+}
+
+// Сжатие; 0 — результат не меньше исходного, хранить как есть
+static size_t compress_data(const SqfsOptions *options, const unsigned char *in, size_t len,
+                            unsigned char *out, size_t out_cap) {
+    if (options->uncompressed) {
+        return 0;
+    }
+
+    if (options->compressor == SQFS_COMP_GZIP) {
+        uLongf out_len = out_cap;
+        if (compress2(out, &out_len, in, len, options->level) != Z_OK) {
+            return 0;
+        }
+        return out_len < len ? out_len : 0;
+    }
+
+    // Словарь не больше блока: ядро выделяет буфер по размеру блока
+    lzma_options_lzma lzma;
+    lzma_lzma_preset(&lzma, options->level | (options->extreme ? LZMA_PRESET_EXTREME : 0));
+    lzma.dict_size = options->block_size;
+
+    lzma_filter filters[3];
+    int count = 0;
+    if (options->x86_filter) {
+        filters[count++] = (lzma_filter){ .id = LZMA_FILTER_X86, .options = NULL };
+    }
+    filters[count++] = (lzma_filter){ .id = LZMA_FILTER_LZMA2, .options = &lzma };
+    filters[count] = (lzma_filter){ .id = LZMA_VLI_UNKNOWN, .options = NULL };
+
+    size_t out_len = 0;
+    if (lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC32, NULL, in, len,
+                                  out, &out_len, out_cap) != LZMA_OK) {
+        return 0;
+    }
+    return out_len < len ? out_len : 0;
+}
+
+static size_t compress_bound(size_t len) {
+    return len + len / 16 + 1024;
+}
+
+// ---------------------------------------------------------------------
+// Метаданные
+
+static void meta_init(SqfsMeta *meta) {
+    memset(meta, 0, sizeof(*meta));
+}
+
+static void meta_free(SqfsMeta *meta) {
+    free(meta->out);
+    free(meta->starts);
+}
+
+static void meta_flush(SqfsMeta *meta, const SqfsOptions *options) {
+    if (meta->used == 0) {
+        return;
+    }
+
+    if (meta->out_len + 2 + SQFS_META_SIZE > meta->out_cap) {
+        meta->out_cap = (meta->out_cap + 2 + SQFS_META_SIZE) * 2;
+        meta->out = xrealloc(meta->out, meta->out_cap);
+    }
+    if (meta->start_count == meta->start_cap) {
+        meta->start_cap = meta->start_cap ? meta->start_cap * 2 : 64;
+        meta->starts = xrealloc(meta->starts, meta->start_cap * sizeof(uint64_t));
+    }
+    meta->starts[meta->start_count++] = meta->out_len;
+
+    unsigned char *dest = meta->out + meta->out_len;
+    unsigned char packed[SQFS_META_SIZE + 1024];
+    size_t packed_len = compress_data(options, meta->block, meta->used, packed, sizeof(packed));
+
+    if (packed_len > 0) {
+        put16(dest, packed_len);
+        memcpy(dest + 2, packed, packed_len);
+        meta->out_len += 2 + packed_len;
+    } else {
+        put16(dest, meta->used | SQFS_META_UNCOMPRESSED);
+        memcpy(dest + 2, meta->block, meta->used);
+        meta->out_len += 2 + meta->used;
+    }
+    meta->used = 0;
+}
+
+// Ссылка на текущую позицию: смещение блока << 16 | смещение в блоке
+static uint64_t meta_position(const SqfsMeta *meta) {
+    return ((uint64_t)meta->out_len << 16) | meta->used;
+}
+
+static void meta_write(SqfsMeta *meta, const SqfsOptions *options, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        size_t chunk = SQFS_META_SIZE - meta->used;
+        chunk = chunk < len ? chunk : len;
+        memcpy(meta->block + meta->used, p, chunk);
+        meta->used += chunk;
+        p += chunk;
+        len -= chunk;
+        if (meta->used == SQFS_META_SIZE) {
+            meta_flush(meta, options);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------
+// Пул сжатия
+
+static void deque_push(SqfsDeque *deque, SqfsJob *job) {
+    pthread_mutex_lock(&deque->lock);
+    deque->items[(deque->head + deque->count) % deque->cap] = job;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static SqfsJob *deque_pop(SqfsDeque *deque, bool steal) {
+    SqfsJob *job = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        if (steal) {
+            job = deque->items[(deque->head + deque->count - 1) % deque->cap];
+        } else {
+            job = deque->items[deque->head];
+            deque->head = (deque->head + 1) % deque->cap;
+        }
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
+
+typedef struct {
+    SqfsWriter *writer;
+    int index;
+    int step;               // шаг сборки, к которому относится время сжатия
+} SqfsWorker;
+
+// Задание из своей очереди, иначе из чужих
+static SqfsJob *take_job(SqfsWriter *w, int index) {
+    pthread_mutex_lock(&w->lock);
+    while (w->queued == 0 && !w->stop) {
+        pthread_cond_wait(&w->work_cond, &w->lock);
+    }
+    if (w->queued == 0) {
+        pthread_mutex_unlock(&w->lock);
+        return NULL;
+    }
+    w->queued--;
+    pthread_mutex_unlock(&w->lock);
+
+    // Счётчик уже зарезервировал одно задание, оно найдётся в одной из очередей
+    for (;;) {
+        SqfsJob *job = deque_pop(&w->deques[index], false);
+        for (int i = 1; !job && i < w->thread_count; i++) {
+            job = deque_pop(&w->deques[(index + i) % w->thread_count], true);
+        }
+        if (job) {
+            return job;
+        }
+    }
+}
+
+static bool all_zero(const unsigned char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *worker_main(void *arg) {
+    SqfsWorker *worker = arg;
+    SqfsWriter *w = worker->writer;
+    trace_thread_begin(worker->step);
+
+    SqfsJob *job;
+    while ((job = take_job(w, worker->index)) != NULL) {
+        // Нулевые блоки файлов не хранятся (разреженные блоки)
+        job->sparse = !job->copy && job->fragment < 0 && all_zero(job->data, job->len);
+        if (!job->sparse && !job->copy) {
+            size_t cap = compress_bound(job->len);
+            job->out = malloc(cap);
+            job->out_len = job->out ? compress_data(&w->options, job->data, job->len, job->out, cap) : 0;
+            job->raw = job->out_len == 0;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        w->window[job->seq % w->limit] = job;
+        pthread_cond_broadcast(&w->done_cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    trace_thread_end();
+    free(worker);
+    return NULL;
+}
+
+static int pool_start(SqfsWriter *w) {
+    int threads = w->options.threads > 0 ? w->options.threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    threads = threads < 1 ? 1 : threads > SQFS_MAX_THREADS ? SQFS_MAX_THREADS : threads;
+
+    w->thread_count = 0;
+    w->limit = threads * SQFS_JOBS_PER_THREAD;
+    w->window = calloc(w->limit, sizeof(SqfsJob *));
+    w->inflight = 0;
+    w->queued = 0;
+    w->stop = false;
+    w->next_seq = 0;
+    w->next_write = 0;
+    if (!w->window) {
+        return -1;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        SqfsDeque *deque = &w->deques[i];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->items = calloc(w->limit, sizeof(SqfsJob *));
+        deque->cap = w->limit;
+        deque->head = 0;
+        deque->count = 0;
+
+        SqfsWorker *worker = malloc(sizeof(*worker));
+        if (!deque->items || !worker) {
+            free(worker);
+            return -1;
+        }
+        worker->writer = w;
+        worker->index = i;
+        worker->step = trace_current_step();
+        if (pthread_create(&w->threads[i], NULL, worker_main, worker) != 0) {
+            free(worker);
+            return -1;
+        }
+        w->thread_count++;
+    }
+    return 0;
+}
+
+// Перенос сжатых данных из прошлого образа внутри ядра
+static void copy_from_base(SqfsWriter *w, uint64_t offset, uint64_t len) {
+    loff_t in = offset;
+    while (len > 0 && !w->failed) {
+        ssize_t copied = copy_file_range(w->base_fd, &in, w->fd, NULL, len, 0);
+        if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                           errno == EOPNOTSUPP)) {
+            // Другая файловая система: через буфер
+            unsigned char buffer[65536];
+            size_t chunk = len < sizeof(buffer) ? len : sizeof(buffer);
+            copied = pread(w->base_fd, buffer, chunk, in);
+            if (copied > 0 && write(w->fd, buffer, copied) != copied) {
+                copied = -1;
+            }
+            in += copied > 0 ? copied : 0;
+        }
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            log_error("Ошибка копирования данных прошлого образа в %s: %s", w->path,
+                      copied < 0 ? strerror(errno) : "образ короче манифеста");
+            w->failed = true;
+            return;
+        }
+        len -= copied;
+    }
+}
+
+// Запись готового задания в образ; вызывается только потоком подачи
+static void write_job(SqfsWriter *w, SqfsJob *job) {
+    if (job->copy) {
+        if (job->fragment >= 0) {
+            w->fragments[job->fragment].start = w->offset;
+            w->fragments[job->fragment].size = job->copy_size;
+        } else {
+            job->file->start = w->offset;
+        }
+        copy_from_base(w, job->copy_offset, job->copy_len);
+        w->offset += job->copy_len;
+        w->stats.copied_bytes += job->copy_len;
+        free(job);
+        return;
+    }
+
+    uint32_t size = 0;
+    const unsigned char *data = job->raw ? job->data : job->out;
+    size_t len = job->raw ? job->len : job->out_len;
+
+    if (job->file && job->block == 0) {
+        job->file->start = w->offset;
+    }
+
+    if (!job->sparse) {
+        size_t done = 0;
+        while (done < len && !w->failed) {
+            ssize_t written = write(w->fd, data + done, len - done);
+            if (written < 0 && errno != EINTR) {
+                log_error("Ошибка записи %s: %s", w->path, strerror(errno));
+                w->failed = true;
+            } else if (written > 0) {
+                done += written;
+            }
+        }
+        size = len | (job->raw ? SQFS_BLOCK_UNCOMPRESSED : 0);
+    }
+
+    if (job->fragment >= 0) {
+        w->fragments[job->fragment].start = w->offset;
+        w->fragments[job->fragment].size = size;
+    } else {
+        job->file->blocks[job->block] = size;
+        if (job->sparse) {
+            job->file->sparse += job->len;
+        }
+    }
+
+    w->offset += job->sparse ? 0 : len;
+    free(job->data);
+    free(job->out);
+    free(job);
+}
+
+// Запись заданий, завершённых по порядку; wait — дождаться хотя бы одного
+static void drain(SqfsWriter *w, bool wait) {
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        SqfsJob *job = w->window[w->next_write % w->limit];
+        if (job && job->seq == w->next_write) {
+            w->window[w->next_write % w->limit] = NULL;
+            pthread_mutex_unlock(&w->lock);
+            write_job(w, job);
+            pthread_mutex_lock(&w->lock);
+            w->next_write++;
+            w->inflight--;
+            wait = false;
+            continue;
+        }
+        if (!wait || w->inflight == 0) {
+            break;
+        }
+        pthread_cond_wait(&w->done_cond, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void submit(SqfsWriter *w, SqfsJob *job) {
+    while (w->inflight >= w->limit) {
+        drain(w, true);
+    }
+
+    job->seq = w->next_seq++;
+    w->inflight++;
+    deque_push(&w->deques[job->seq % w->thread_count], job);
+
+    pthread_mutex_lock(&w->lock);
+    w->queued++;
+    pthread_cond_signal(&w->work_cond);
+    pthread_mutex_unlock(&w->lock);
+
+    drain(w, false);
+}
+
+static void pool_stop(SqfsWriter *w) {
+    while (w->inflight > 0) {
+        drain(w, true);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_broadcast(&w->work_cond);
+    pthread_mutex_unlock(&w->lock);
+
+    for (int i = 0; i < w->thread_count; i++) {
+        pthread_join(w->threads[i], NULL);
+        pthread_mutex_destroy(&w->deques[i].lock);
+        free(w->deques[i].items);
+    }
+    w->thread_count = 0;
+    free(w->window);
+    w->window = NULL;
+}
+
+// ---------------------------------------------------------------------
+// Данные файлов
+
+static void submit_fragment_block(SqfsWriter *w) {
+    if (w->fragment_used == 0) {
+        return;
+    }
+
+    SqfsJob *job = calloc(1, sizeof(*job));
+    job->fragment = w->fragment_index;
+    job->data = w->fragment_buffer;
+    job->len = w->fragment_used;
+    w->fragments[w->fragment_index].used = w->fragment_used;
+    submit(w, job);
+
+    w->fragment_buffer = NULL;
+    w->fragment_used = 0;
+}
+
+static uint32_t new_fragment(SqfsWriter *w) {
+    if (w->fragment_count == w->fragment_cap) {
+        w->fragment_cap = w->fragment_cap ? w->fragment_cap * 2 : 256;
+        w->fragments = xrealloc(w->fragments, w->fragment_cap * sizeof(SqfsFragment));
+    }
+    memset(&w->fragments[w->fragment_count], 0, sizeof(SqfsFragment));
+    return w->fragment_count++;
+}
+
+// Хвост файла короче блока дописывается в общий блок фрагментов
+static void add_tail(SqfsWriter *w, SqfsFile *file, const unsigned char *data, size_t len) {
+    if (w->fragment_buffer && w->fragment_used + len > w->options.block_size) {
+        submit_fragment_block(w);
+    }
+    if (!w->fragment_buffer) {
+        w->fragment_buffer = xrealloc(NULL, w->options.block_size);
+        w->fragment_index = new_fragment(w);
+    }
+
+    file->fragment = w->fragment_index;
+    file->fragment_offset = w->fragment_used;
+    file->fragment_size = len;
+    memcpy(w->fragment_buffer + w->fragment_used, data, len);
+    w->fragment_used += len;
+}
+
+static SqfsFile *new_file(SqfsWriter *w, const struct stat *st) {
+    SqfsFile *file = calloc(1, sizeof(*file));
+    file->size = st->st_size;
+    file->fragment = SQFS_NO_FRAGMENT;
+    file->ino = st->st_ino;
+    file->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    file->ctime_ns = (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+
+    if (w->file_count == w->file_cap) {
+        w->file_cap = w->file_cap ? w->file_cap * 2 : 1024;
+        w->files = xrealloc(w->files, w->file_cap * sizeof(SqfsFile *));
+    }
+    w->files[w->file_count++] = file;
+    return file;
+}
+
+// Чтение файла блоками и постановка блоков в очередь сжатия
+static SqfsFile *add_file_data(SqfsWriter *w, const char *path, const struct stat *st) {
+    SqfsFile *file = new_file(w, st);
+    uint32_t bs = w->options.block_size;
+    file->block_count = file->size / bs;
+    file->blocks = calloc(file->block_count ? file->block_count : 1, sizeof(uint32_t));
+
+    Sha256Ctx hash;
+    sha256_init(&hash);
+    if (file->size == 0) {
+        sha256_final(&hash, file->hash);
+        file->hashed = true;
+        return file;
+    }
+
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Не удалось открыть %s: %s", path, strerror(errno));
+        w->failed = true;
+        return file;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint64_t left = file->size;
+    for (uint32_t index = 0; left > 0 && !w->failed; index++) {
+        size_t len = left < bs ? left : bs;
+        unsigned char *data = xrealloc(NULL, len);
+
+        size_t done = 0;
+        while (done < len) {
+            ssize_t got = read(fd, data + done, len - done);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                log_error("Файл %s изменился или не читается во время записи образа", path);
+                w->failed = true;
+                break;
+            }
+            done += got;
+        }
+        w->stats.bytes_in += done;
+        if (w->manifest_path[0]) {
+            sha256_update(&hash, data, done);
+        }
+
+        if (w->failed) {
+            free(data);
+        } else if (len == bs) {
+            SqfsJob *job = calloc(1, sizeof(*job));
+            job->file = file;
+            job->block = index;
+            job->fragment = -1;
+            job->data = data;
+            job->len = len;
+            submit(w, job);
+        } else {
+            // Если у файла нет полных блоков, его начало — текущая позиция
+            if (file->block_count == 0) {
+                file->start = w->offset;
+            }
+            add_tail(w, file, data, len);
+            free(data);
+        }
+        left -= len;
+    }
+
+    if (w->manifest_path[0]) {
+        sha256_final(&hash, file->hash);
+        file->hashed = !w->failed;
+    }
+    close(fd);
+    return file;
+}
+
+// ---------------------------------------------------------------------
+// Обход дерева
+
+typedef struct {
+    SqfsNode **items;
+    size_t count;
+    size_t cap;
+    int active;
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const char *root;
+    int step;
+} SqfsScan;
+
+static void node_path(const SqfsNode *node, const char *root, char *path, size_t size) {
+    const SqfsNode *chain[256];
+    int depth = 0;
+    for (const SqfsNode *n = node; n->parent && depth < 256; n = n->parent) {
+        chain[depth++] = n;
+    }
+
+    size_t len = snprintf(path, size, "%s", root);
+    for (int i = depth - 1; i >= 0 && len < size; i--) {
+        len += snprintf(path + len, size - len, "/%s", chain[i]->name);
+    }
+}
+
+// Относительный путь внутри образа, ключ заранее сжатых файлов
+static void node_relpath(const SqfsNode *node, char *path, size_t size) {
+    node_path(node, "", path, size);
+}
+
+// Xattr в формате squashfs: тип префикса, имя без префикса, значение
+static void read_xattrs(SqfsNode *node, const char *path) {
+    char names[4096];
+    ssize_t len = llistxattr(path, names, sizeof(names));
+    if (len <= 0) {
+        return;
+    }
+
+    static const char *const prefixes[] = { "user.", "trusted.", "security." };
+    for (char *name = names; name < names + len; name += strlen(name) + 1) {
+        int type = -1;
+        size_t prefix_len = 0;
+        for (int i = 0; i < 3; i++) {
+            prefix_len = strlen(prefixes[i]);
+            if (strncmp(name, prefixes[i], prefix_len) == 0) {
+                type = i;
+                break;
+            }
+        }
+        if (type < 0) {
+            continue;
+        }
+
+        unsigned char value[4096];
+        ssize_t value_len = lgetxattr(path, name, value, sizeof(value));
+        if (value_len < 0) {
+            continue;
+        }
+
+        size_t name_len = strlen(name) - prefix_len;
+        size_t entry = 4 + name_len + 4 + value_len;
+        node->xattr_pairs = xrealloc(node->xattr_pairs, node->xattr_size + entry);
+        unsigned char *p = node->xattr_pairs + node->xattr_size;
+        put16(p, type);
+        put16(p + 2, name_len);
+        memcpy(p + 4, name + prefix_len, name_len);
+        put32(p + 4 + name_len, value_len);
+        memcpy(p + 8 + name_len, value, value_len);
+        node->xattr_size += entry;
+        node->xattr_count++;
+    }
+}
+
+static void scan_push(SqfsScan *scan, SqfsNode *dir) {
+    pthread_mutex_lock(&scan->lock);
+    if (scan->count == scan->cap) {
+        scan->cap = scan->cap ? scan->cap * 2 : 1024;
+        scan->items = xrealloc(scan->items, scan->cap * sizeof(SqfsNode *));
+    }
+    scan->items[scan->count++] = dir;
+    pthread_cond_signal(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static void scan_dir(SqfsScan *scan, SqfsNode *dir) {
+    char path[4096];
+    node_path(dir, scan->root, path, sizeof(path));
+
+    DIR *d = opendir(path);
+    if (!d) {
+        log_error("Не удалось прочитать каталог %s: %s", path, strerror(errno));
+        scan->failed = true;
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        SqfsNode *node = calloc(1, sizeof(*node));
+        node->name = strdup(entry->d_name);
+        node->parent = dir;
+        node->xattr = SQFS_NO_XATTR;
+        if (fstatat(dirfd(d), entry->d_name, &node->st, AT_SYMLINK_NOFOLLOW) != 0) {
+            log_error("Не удалось получить сведения о %s/%s: %s", path, entry->d_name, strerror(errno));
+            scan->failed = true;
+            free(node->name);
+            free(node);
+            continue;
+        }
+
+        char child[4096];
+        int len = snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if (len < 0 || (size_t)len >= sizeof(child)) {
+            log_error("Слишком длинный путь: %s/%s", path, entry->d_name);
+            scan->failed = true;
+            free(node->name);
+            free(node);
+            continue;
+        }
+        if (S_ISLNK(node->st.st_mode)) {
+            node->link = calloc(1, node->st.st_size + 1);
+            if (readlink(child, node->link, node->st.st_size) < 0) {
+                scan->failed = true;
+            }
+        }
+        read_xattrs(node, child);
+
+        if (dir->child_count == dir->child_cap) {
+            dir->child_cap = dir->child_cap ? dir->child_cap * 2 : 8;
+            dir->children = xrealloc(dir->children, dir->child_cap * sizeof(SqfsNode *));
+        }
+        dir->children[dir->child_count++] = node;
+
+        if (S_ISDIR(node->st.st_mode)) {
+            scan_push(scan, node);
+        }
+    }
+
+    closedir(d);
+}
+
+static void *scan_main(void *arg) {
+    SqfsScan *scan = arg;
+    trace_thread_begin(scan->step);
+
+    pthread_mutex_lock(&scan->lock);
+    for (;;) {
+        while (scan->count == 0 && scan->active > 0) {
+            pthread_cond_wait(&scan->cond, &scan->lock);
+        }
+        if (scan->count == 0) {
+            break;
+        }
+        SqfsNode *dir = scan->items[--scan->count];
+        scan->active++;
+        pthread_mutex_unlock(&scan->lock);
+
+        scan_dir(scan, dir);
+
+        pthread_mutex_lock(&scan->lock);
+        scan->active--;
+        if (scan->active == 0 && scan->count == 0) {
+            pthread_cond_broadcast(&scan->cond);
+        }
+    }
+    pthread_mutex_unlock(&scan->lock);
+    trace_thread_end();
+    return NULL;
+}
+
+static int compare_nodes(const void *a, const void *b) {
+    const SqfsNode *x = *(const SqfsNode *const *)a;
+    const SqfsNode *y = *(const SqfsNode *const *)b;
+    return strcmp(x->name, y->name);
+}
+
+static void sort_tree(SqfsNode *dir) {
+    qsort(dir->children, dir->child_count, sizeof(SqfsNode *), compare_nodes);
+    for (int i = 0; i < dir->child_count; i++) {
+        if (S_ISDIR(dir->children[i]->st.st_mode)) {
+            sort_tree(dir->children[i]);
+        }
+    }
+}
+
+// Параллельный обход; порядок детей затем фиксируется сортировкой по имени
+static SqfsNode *scan_tree(const char *root, int threads) {
+    SqfsNode *top = calloc(1, sizeof(*top));
+    top->name = strdup("");
+    top->xattr = SQFS_NO_XATTR;
+    if (lstat(root, &top->st) != 0 || !S_ISDIR(top->st.st_mode)) {
+        log_error("Каталог %s недоступен", root);
+        free(top->name);
+        free(top);
+        return NULL;
+    }
+    read_xattrs(top, root);
+
+    SqfsScan scan = { .root = root, .step = trace_current_step() };
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.cond, NULL);
+    scan_push(&scan, top);
+
+    pthread_t walkers[SQFS_MAX_THREADS];
+    int started = 0;
+    threads = threads < 1 ? 1 : threads > SQFS_MAX_THREADS ? SQFS_MAX_THREADS : threads;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&walkers[i], NULL, scan_main, &scan) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        scan_main(&scan);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(walkers[i], NULL);
+    }
+
+    free(scan.items);
+    pthread_mutex_destroy(&scan.lock);
+    pthread_cond_destroy(&scan.cond);
+
+    sort_tree(top);
+    if (scan.failed) {
+        top->link = (char *)top;   // признак ошибки обхода проверяет вызывающий
+    }
+    return top;
+}
+
+static void free_tree(SqfsNode *node) {
+    for (int i = 0; i < node->child_count; i++) {
+        free_tree(node->children[i]);
+    }
+    free(node->children);
+    free(node->name);
+    if (node->link != (char *)node) {
+        free(node->link);
+    }
+    free(node->xattr_pairs);
+    free(node);
+}
+
+// ---------------------------------------------------------------------
+// Заранее сжатые файлы
+
+static size_t hash_path(const char *path) {
+    size_t hash = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void prefilled_add(SqfsWriter *w, const char *path, SqfsFile *file) {
+    if (!w->prefilled) {
+        w->prefilled_buckets = 65536;
+        w->prefilled = calloc(w->prefilled_buckets, sizeof(SqfsPrefilled *));
+    }
+    SqfsPrefilled *entry = malloc(sizeof(*entry));
+    entry->path = strdup(path);
+    entry->file = file;
+    size_t bucket = hash_path(path) % w->prefilled_buckets;
+    entry->next = w->prefilled[bucket];
+    w->prefilled[bucket] = entry;
+}
+
+static SqfsFile *prefilled_find(SqfsWriter *w, const char *path, const struct stat *st) {
+    if (!w->prefilled) {
+        return NULL;
+    }
+    for (SqfsPrefilled *e = w->prefilled[hash_path(path) % w->prefilled_buckets]; e; e = e->next) {
+        if (strcmp(e->path, path) != 0) {
+            continue;
+        }
+        SqfsFile *file = e->file;
+        int64_t mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+        int64_t ctime = (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+        if (!file->used && file->ino == st->st_ino && file->size == (uint64_t)st->st_size &&
+            file->mtime_ns == mtime && file->ctime_ns == ctime) {
+            return file;
+        }
+        return NULL;
+    }
+    return NULL;
+}
+
+static void prefilled_free(SqfsWriter *w) {
+    if (!w->prefilled) {
+        return;
+    }
+    for (size_t i = 0; i < w->prefilled_buckets; i++) {
+        SqfsPrefilled *e = w->prefilled[i];
+        while (e) {
+            SqfsPrefilled *next = e->next;
+            free(e->path);
+            free(e);
+            e = next;
+        }
+    }
+    free(w->prefilled);
+    w->prefilled = NULL;
+}
+
+// ---------------------------------------------------------------------
+// Списки узлов
+
+typedef struct {
+    SqfsNode **nodes;
+    size_t count;
+    size_t cap;
+} SqfsList;
+
+static void list_add(SqfsList *list, SqfsNode *node) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 1024;
+        list->nodes = xrealloc(list->nodes, list->cap * sizeof(SqfsNode *));
+    }
+    list->nodes[list->count++] = node;
+}
+
+// Обход в порядке имён; узлы в порядке после детей (post-order)
+static void collect_nodes(SqfsNode *node, SqfsList *list) {
+    for (int i = 0; i < node->child_count; i++) {
+        collect_nodes(node->children[i], list);
+    }
+    list_add(list, node);
+}
+
+// ---------------------------------------------------------------------
+// Прошлый образ
+
+// Параметры, при которых сжатые блоки прошлого образа годятся для нового
+static void options_fingerprint(const SqfsOptions *o, char *text, size_t size) {
+    snprintf(text, size, "comp=%d level=%d extreme=%d x86=%d raw=%d block=%u",
+             o->compressor, o->level, o->extreme, o->x86_filter, o->uncompressed, o->block_size);
+}
+
+static bool parse_hex(const char *hex, uint8_t *out, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) {
+            return false;
+        }
+        out[i] = byte;
+    }
+    return true;
+}
+
+// Строка файла: F, размер, mtime, ctime, SHA-256, начало, разреженный
+// объём, фрагмент, смещение в нём, число блоков, размеры блоков, путь
+static SqfsBaseFile *parse_base_file(char *line) {
+    SqfsBaseFile *base = calloc(1, sizeof(*base));
+    char *p = line + 2, *end;
+
+    base->size = strtoull(p, &end, 10);
+    base->mtime_ns = strtoll(end + 1, &end, 10);
+    base->ctime_ns = strtoll(end + 1, &end, 10);
+    if (*end != '\t' || !parse_hex(end + 1, base->hash, SHA256_DIGEST_SIZE)) {
+        free(base);
+        return NULL;
+    }
+    p = end + 1 + SHA256_DIGEST_SIZE * 2;
+    base->start = strtoull(p + 1, &end, 10);
+    base->sparse = strtoull(end + 1, &end, 10);
+    base->fragment = strtoul(end + 1, &end, 10);
+    base->fragment_offset = strtoul(end + 1, &end, 10);
+    base->block_count = strtoul(end + 1, &end, 10);
+    base->blocks = calloc(base->block_count ? base->block_count : 1, sizeof(uint32_t));
+
+    p = end + 1;
+    for (uint32_t i = 0; i < base->block_count; i++) {
+        base->blocks[i] = strtoul(p, &end, 10);
+        p = end + 1;
+    }
+    if (base->block_count == 0) {
+        p += 2;     // "-\t"
+    }
+
+    base->path = strdup(p);
+    return base;
+}
+
+static void base_free(SqfsWriter *w) {
+    if (w->base) {
+        for (size_t i = 0; i < w->base_buckets; i++) {
+            SqfsBaseFile *e = w->base[i];
+            while (e) {
+                SqfsBaseFile *next = e->next;
+                free(e->path);
+                free(e->blocks);
+                free(e);
+                e = next;
+            }
+        }
+    }
+    free(w->base);
+    free(w->base_fragments);
+    free(w->fragment_map);
+    free(w->fragment_live);
+    w->base = NULL;
+    w->base_fragments = NULL;
+    w->fragment_map = NULL;
+    w->fragment_live = NULL;
+    w->base_fragment_count = 0;
+    if (w->base_fd >= 0) {
+        close(w->base_fd);
+        w->base_fd = -1;
+    }
+}
+
+// Манифест годится, только если образ тот же (суперблок совпадает)
+// и блоки сжаты с теми же параметрами
+static int load_base(SqfsWriter *w, const char *image_path) {
+    FILE *fp = fopen(w->manifest_path, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    w->base_fd = open(image_path, O_RDONLY | O_CLOEXEC);
+    unsigned char superblock[SQFS_SUPERBLOCK_SIZE];
+    char expected[512], fingerprint[256], superblock_hex[SQFS_SUPERBLOCK_SIZE * 2 + 1];
+    options_fingerprint(&w->options, fingerprint, sizeof(fingerprint));
+    if (w->base_fd < 0 || pread(w->base_fd, superblock, sizeof(superblock), 0) != sizeof(superblock)) {
+        fclose(fp);
+        return -1;
+    }
+    hash_to_hex(superblock, sizeof(superblock), superblock_hex);
+
+    char *line = NULL;
+    size_t cap = 0;
+    int header = 0;
+    const char *headers[] = { SQFS_MANIFEST_MAGIC, fingerprint, superblock_hex };
+    uint32_t fragment_cap = 0;
+    w->base_buckets = 65536;
+    w->base = calloc(w->base_buckets, sizeof(SqfsBaseFile *));
+
+    while (getline(&line, &cap, fp) > 0) {
+        line[strcspn(line, "\n")] = '\0';
+        if (header < 3) {
+            snprintf(expected, sizeof(expected), "%s%s", header == 1 ? "options " :
+                     header == 2 ? "superblock " : "", headers[header]);
+            if (strcmp(line, expected) != 0) {
+                break;
+            }
+            header++;
+        } else if (line[0] == 'G') {
+            if (w->base_fragment_count == fragment_cap) {
+                fragment_cap = fragment_cap ? fragment_cap * 2 : 1024;
+                w->base_fragments = xrealloc(w->base_fragments, fragment_cap * sizeof(SqfsFragment));
+            }
+            SqfsFragment *fragment = &w->base_fragments[w->base_fragment_count++];
+            char *end;
+            fragment->start = strtoull(line + 2, &end, 10);
+            fragment->size = strtoul(end + 1, &end, 10);
+            fragment->used = strtoul(end + 1, &end, 10);
+        } else if (line[0] == 'F') {
+            SqfsBaseFile *base = parse_base_file(line);
+            if (base) {
+                size_t bucket = hash_path(base->path) % w->base_buckets;
+                base->next = w->base[bucket];
+                w->base[bucket] = base;
+            }
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    if (header < 3) {
+        base_free(w);
+        return -1;
+    }
+
+    size_t count = w->base_fragment_count ? w->base_fragment_count : 1;
+    w->fragment_map = malloc(count * sizeof(int64_t));
+    w->fragment_live = calloc(count, sizeof(uint64_t));
+    for (uint32_t i = 0; i < w->base_fragment_count; i++) {
+        w->fragment_map[i] = -1;
+    }
+    return 0;
+}
+
+// Тот же файл в прошлом образе: размер и времена совпадают, а если
+// времена другие (слой пересобран) — совпадает SHA-256 содержимого
+static SqfsBaseFile *base_find(SqfsWriter *w, const char *relpath, const char *path,
+                               const struct stat *st) {
+    if (!w->base) {
+        return NULL;
+    }
+
+    SqfsBaseFile *base = w->base[hash_path(relpath) % w->base_buckets];
+    while (base && strcmp(base->path, relpath) != 0) {
+        base = base->next;
+    }
+    if (!base || base->size != (uint64_t)st->st_size) {
+        return NULL;
+    }
+
+    int64_t mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    int64_t ctime = (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+    if (base->mtime_ns == mtime && base->ctime_ns == ctime) {
+        return base;
+    }
+
+    char hex[SHA256_HEX_SIZE], expected[SHA256_HEX_SIZE];
+    hash_to_hex(base->hash, SHA256_DIGEST_SIZE, expected);
+    w->stats.hashed_bytes += st->st_size;
+    if (sha256_file(path, hex) != 0 || strcmp(hex, expected) != 0) {
+        return NULL;
+    }
+    return base;
+}
+
+// Блок фрагментов прошлого образа копируется один раз на весь образ
+static uint32_t map_fragment(SqfsWriter *w, uint32_t old) {
+    if (w->fragment_map[old] < 0) {
+        uint32_t index = new_fragment(w);
+        w->fragments[index].used = w->base_fragments[old].used;
+
+        SqfsJob *job = calloc(1, sizeof(*job));
+        job->fragment = index;
+        job->copy = true;
+        job->copy_offset = w->base_fragments[old].start;
+        job->copy_size = w->base_fragments[old].size;
+        job->copy_len = job->copy_size & ~SQFS_BLOCK_UNCOMPRESSED;
+        submit(w, job);
+
+        w->fragment_map[old] = index;
+    }
+    return w->fragment_map[old];
+}
+
+// Файл из прошлого образа: сжатые блоки копируются; хвост берётся из
+// прошлого блока фрагментов, если тот в основном состоит из живых
+// хвостов, иначе читается заново и попадает в новый блок фрагментов
+static SqfsFile *add_base_file(SqfsWriter *w, SqfsBaseFile *base, const char *path,
+                               const struct stat *st) {
+    SqfsFile *file = new_file(w, st);
+    uint32_t bs = w->options.block_size;
+    file->block_count = base->block_count;
+    file->blocks = calloc(base->block_count ? base->block_count : 1, sizeof(uint32_t));
+    memcpy(file->blocks, base->blocks, base->block_count * sizeof(uint32_t));
+    file->sparse = base->sparse;
+    memcpy(file->hash, base->hash, SHA256_DIGEST_SIZE);
+    file->hashed = true;
+    w->stats.copied_files++;
+
+    if (base->block_count > 0) {
+        SqfsJob *job = calloc(1, sizeof(*job));
+        job->file = file;
+        job->fragment = -1;
+        job->copy = true;
+        job->copy_offset = base->start;
+        for (uint32_t i = 0; i < base->block_count; i++) {
+            job->copy_len += base->blocks[i] & ~SQFS_BLOCK_UNCOMPRESSED;
+        }
+        submit(w, job);
+    }
+
+    if (base->fragment == SQFS_NO_FRAGMENT) {
+        return file;
+    }
+
+    size_t tail = file->size - (uint64_t)base->block_count * bs;
+    uint32_t old = base->fragment;
+    if (old < w->base_fragment_count &&
+        (w->fragment_map[old] >= 0 || w->fragment_live[old] * 2 >= w->base_fragments[old].used)) {
+        file->fragment = map_fragment(w, old);
+        file->fragment_offset = base->fragment_offset;
+        file->fragment_size = tail;
+        return file;
+    }
+
+    unsigned char *data = xrealloc(NULL, tail);
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 || pread(fd, data, tail, (off_t)base->block_count * bs) != (ssize_t)tail) {
+        log_error("Файл %s изменился или не читается во время записи образа", path);
+        w->failed = true;
+    } else {
+        if (file->block_count == 0) {
+            file->start = w->offset;
+        }
+        add_tail(w, file, data, tail);
+        w->stats.bytes_in += tail;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(data);
+    return file;
+}
+
+static void save_manifest(SqfsWriter *w, SqfsNode *top) {
+    char tmp[600];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", w->manifest_path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        log_warning("Не удалось записать манифест %s", w->manifest_path);
+        return;
+    }
+
+    char fingerprint[256], superblock_hex[SQFS_SUPERBLOCK_SIZE * 2 + 1];
+    options_fingerprint(&w->options, fingerprint, sizeof(fingerprint));
+    hash_to_hex(w->superblock, sizeof(w->superblock), superblock_hex);
+    fprintf(fp, "%s\noptions %s\nsuperblock %s\n", SQFS_MANIFEST_MAGIC, fingerprint, superblock_hex);
+
+    for (uint32_t i = 0; i < w->fragment_count; i++) {
+        fprintf(fp, "G\t%llu\t%u\t%u\n", (unsigned long long)w->fragments[i].start,
+                w->fragments[i].size, w->fragments[i].used);
+    }
+
+    SqfsList list = { 0 };
+    collect_nodes(top, &list);
+    char relpath[4096], hex[SHA256_HEX_SIZE];
+    for (size_t i = 0; i < list.count; i++) {
+        SqfsNode *node = list.nodes[i];
+        SqfsFile *file = node->file;
+        if (!file || node->same_inode || !file->hashed) {
+            continue;
+        }
+        node_relpath(node, relpath, sizeof(relpath));
+        if (strchr(relpath, '\n')) {
+            continue;
+        }
+
+        hash_to_hex(file->hash, SHA256_DIGEST_SIZE, hex);
+        fprintf(fp, "F\t%llu\t%lld\t%lld\t%s\t%llu\t%llu\t%u\t%u\t%u\t",
+                (unsigned long long)file->size, (long long)file->mtime_ns,
+                (long long)file->ctime_ns, hex, (unsigned long long)file->start,
+                (unsigned long long)file->sparse, file->fragment, file->fragment_offset,
+                file->block_count);
+        for (uint32_t b = 0; b < file->block_count; b++) {
+            fprintf(fp, "%s%u", b ? "," : "", file->blocks[b]);
+        }
+        fprintf(fp, "%s\t%s\n", file->block_count ? "" : "-", relpath);
+    }
+    free(list.nodes);
+
+    if (fclose(fp) != 0 || rename(tmp, w->manifest_path) != 0) {
+        log_warning("Не удалось записать манифест %s", w->manifest_path);
+        unlink(tmp);
+    }
+}
+
+// ---------------------------------------------------------------------
+// Проход по данным
+
+static int data_pass(SqfsWriter *w, SqfsNode *top, const char *root, bool prefill) {
+    SqfsList list = { 0 };
+    collect_nodes(top, &list);
+
+    // Жёсткие ссылки: данные и inode общие для всех имён
+    size_t buckets = list.count * 2 + 1;
+    SqfsNode **seen = calloc(buckets, sizeof(SqfsNode *));
+    for (size_t i = 0; i < list.count; i++) {
+        SqfsNode *node = list.nodes[i];
+        node->links = 1;
+        if (S_ISDIR(node->st.st_mode) || node->st.st_nlink < 2) {
+            continue;
+        }
+        size_t slot = (node->st.st_ino * 31 + node->st.st_dev) % buckets;
+        while (seen[slot] && (seen[slot]->st.st_ino != node->st.st_ino ||
+                              seen[slot]->st.st_dev != node->st.st_dev)) {
+            slot = (slot + 1) % buckets;
+        }
+        if (seen[slot]) {
+            node->same_inode = seen[slot];
+            seen[slot]->links++;
+        } else {
+            seen[slot] = node;
+        }
+    }
+    free(seen);
+
+    if (pool_start(w) != 0) {
+        log_error("Не удалось запустить потоки сжатия squashfs");
+        pool_stop(w);
+        free(list.nodes);
+        return -1;
+    }
+
+    // Источник данных каждого файла: предварительный проход, прошлый
+    // образ или новое сжатие; заодно считаются живые хвосты в прошлых
+    // блоках фрагментов
+    char path[4096], relpath[4096];
+    for (uint32_t i = 0; i < w->base_fragment_count; i++) {
+        w->fragment_live[i] = 0;
+    }
+    for (size_t i = 0; i < list.count; i++) {
+        SqfsNode *node = list.nodes[i];
+        if (!S_ISREG(node->st.st_mode) || node->same_inode) {
+            continue;
+        }
+
+        node_relpath(node, relpath, sizeof(relpath));
+        if (!prefill) {
+            node->file = prefilled_find(w, relpath, &node->st);
+            if (node->file) {
+                node->file->used = true;
+                continue;
+            }
+        }
+
+        node_path(node, root, path, sizeof(path));
+        node->base = base_find(w, relpath, path, &node->st);
+        SqfsBaseFile *base = node->base;
+        if (base && base->fragment < w->base_fragment_count) {
+            w->fragment_live[base->fragment] +=
+                base->size - (uint64_t)base->block_count * w->options.block_size;
+        }
+    }
+
+    for (size_t i = 0; i < list.count && !w->failed; i++) {
+        SqfsNode *node = list.nodes[i];
+        if (!S_ISREG(node->st.st_mode) || node->same_inode) {
+            continue;
+        }
+        if (node->file) {
+            w->stats.reused_files++;
+            w->stats.files++;
+            continue;
+        }
+
+        node_relpath(node, relpath, sizeof(relpath));
+        node_path(node, root, path, sizeof(path));
+        if (node->base) {
+            node->file = add_base_file(w, node->base, path, &node->st);
+        } else {
+            node->file = add_file_data(w, path, &node->st);
+        }
+        if (prefill) {
+            prefilled_add(w, relpath, node->file);
+        } else {
+            node->file->used = true;
+            w->stats.files++;
+        }
+    }
+
+    // Последний блок фрагментов пишется только в итоговом проходе
+    if (!prefill) {
+        submit_fragment_block(w);
+    }
+
+    pool_stop(w);
+    free(list.nodes);
+    return w->failed ? -1 : 0;
+}
+
+// ---------------------------------------------------------------------
+// Таблицы
+
+typedef struct {
+    uint32_t ids[65536];
+    uint32_t count;
+} SqfsIds;
+
+static uint16_t id_index(SqfsIds *ids, uint32_t id) {
+    for (uint32_t i = 0; i < ids->count; i++) {
+        if (ids->ids[i] == id) {
+            return i;
+        }
+    }
+    if (ids->count == 65536) {
+        return 0;
+    }
+    ids->ids[ids->count] = id;
+    return ids->count++;
+}
+
+typedef struct {
+    SqfsMeta pairs;
+    SqfsMeta ids;
+    uint32_t count;
+    SqfsNode **sets;            // первый узел с каждым набором для сравнения
+    size_t set_cap;
+} SqfsXattrs;
+
+static uint32_t xattr_index(SqfsXattrs *x, const SqfsOptions *options, SqfsNode *node) {
+    if (node->xattr_count == 0) {
+        return SQFS_NO_XATTR;
+    }
+
+    for (uint32_t i = 0; i < x->count; i++) {
+        SqfsNode *other = x->sets[i];
+        if (other->xattr_size == node->xattr_size &&
+            memcmp(other->xattr_pairs, node->xattr_pairs, node->xattr_size) == 0) {
+            return i;
+        }
+    }
+
+    if (x->count == x->set_cap) {
+        x->set_cap = x->set_cap ? x->set_cap * 2 : 64;
+        x->sets = xrealloc(x->sets, x->set_cap * sizeof(SqfsNode *));
+    }
+    x->sets[x->count] = node;
+
+    unsigned char entry[16];
+    put64(entry, meta_position(&x->pairs));
+    put32(entry + 8, node->xattr_count);
+    put32(entry + 12, node->xattr_size);
+    meta_write(&x->ids, options, entry, sizeof(entry));
+    meta_write(&x->pairs, options, node->xattr_pairs, node->xattr_size);
+
+    return x->count++;
+}
+
+// Номера inode: после детей, корень получает последний номер
+static uint32_t number_inodes(SqfsList *list) {
+    uint32_t next = 1;
+    for (size_t i = 0; i < list->count; i++) {
+        SqfsNode *node = list->nodes[i];
+        if (!node->same_inode) {
+            node->inode_number = next++;
+        }
+    }
+    for (size_t i = 0; i < list->count; i++) {
+        SqfsNode *node = list->nodes[i];
+        if (node->same_inode) {
+            node->inode_number = node->same_inode->inode_number;
+        }
+    }
+    return next - 1;
+}
+
+static int basic_type(const SqfsNode *node) {
+    mode_t mode = node->st.st_mode;
+    return S_ISDIR(mode) ? SQFS_DIR : S_ISREG(mode) ? SQFS_FILE : S_ISLNK(mode) ? SQFS_SYMLINK :
+           S_ISBLK(mode) ? SQFS_BLKDEV : S_ISCHR(mode) ? SQFS_CHRDEV : S_ISFIFO(mode) ? SQFS_FIFO :
+           SQFS_SOCKET;
+}
+
+// Список каталога: заголовки на группы записей с inode в одном блоке
+static size_t write_listing(SqfsMeta *dirs, const SqfsOptions *options, const SqfsNode *dir) {
+    size_t total = 0;
+    int i = 0;
+    while (i < dir->child_count) {
+        const SqfsNode *first = dir->children[i];
+        uint64_t block = first->inode_ref >> 16;
+        int count = 1;
+        while (i + count < dir->child_count && count < SQFS_DIR_HEADER_MAX) {
+            const SqfsNode *next = dir->children[i + count];
+            int64_t delta = (int64_t)next->inode_number - first->inode_number;
+            if ((next->inode_ref >> 16) != block || delta > 32767 || delta < -32768) {
+                break;
+            }
+            count++;
+        }
+
+        unsigned char header[12];
+        put32(header, count - 1);
+        put32(header + 4, block);
+        put32(header + 8, first->inode_number);
+        meta_write(dirs, options, header, sizeof(header));
+        total += sizeof(header);
+
+        for (int j = 0; j < count; j++) {
+            const SqfsNode *child = dir->children[i + j];
+            size_t name_len = strlen(child->name);
+            unsigned char entry[8];
+            put16(entry, child->inode_ref & 0xFFFF);
+            put16(entry + 2, (uint16_t)(int16_t)((int64_t)child->inode_number - first->inode_number));
+            put16(entry + 4, basic_type(child));
+            put16(entry + 6, name_len - 1);
+            meta_write(dirs, options, entry, sizeof(entry));
+            meta_write(dirs, options, child->name, name_len);
+            total += sizeof(entry) + name_len;
+        }
+        i += count;
+    }
+    return total;
+}
+
+static void write_inode(SqfsWriter *w, SqfsMeta *inodes, SqfsMeta *dirs, SqfsIds *ids,
+                        SqfsXattrs *xattrs, SqfsNode *node, uint32_t inode_count) {
+    const SqfsOptions *options = &w->options;
+    unsigned char buf[64];
+    uint32_t xattr = xattr_index(xattrs, options, node);
+    int type = basic_type(node);
+    bool ext = xattr != SQFS_NO_XATTR;
+
+    size_t listing = 0;
+    uint64_t listing_pos = 0;
+    int subdirs = 0;
+    if (type == SQFS_DIR) {
+        listing_pos = meta_position(dirs);
+        listing = write_listing(dirs, options, node);
+        for (int i = 0; i < node->child_count; i++) {
+            subdirs += S_ISDIR(node->children[i]->st.st_mode);
+        }
+        ext = ext || listing + 3 > 0xFFFF;
+    }
+
+    SqfsFile *file = node->file;
+    if (type == SQFS_FILE) {
+        ext = ext || node->links > 1 || file->start > 0xFFFFFFFFULL || file->size > 0xFFFFFFFFULL;
+    }
+
+    node->inode_ref = meta_position(inodes);
+    put16(buf, type + (ext ? SQFS_EXT : 0));
+    put16(buf + 2, node->st.st_mode & 07777);
+    put16(buf + 4, id_index(ids, node->st.st_uid));
+    put16(buf + 6, id_index(ids, node->st.st_gid));
+    put32(buf + 8, (uint32_t)node->st.st_mtime);
+    put32(buf + 12, node->inode_number);
+    size_t len = 16;
+
+    uint32_t parent = node->parent ? node->parent->inode_number : inode_count + 1;
+    uint32_t rdev = (major(node->st.st_rdev) << 8) | (minor(node->st.st_rdev) & 0xFF) |
+                    ((minor(node->st.st_rdev) & ~0xFFU) << 12);
+
+    switch (type) {
+        case SQFS_DIR:
+            if (ext) {
+                put32(buf + 16, 2 + subdirs);
+                put32(buf + 20, listing + 3);
+                put32(buf + 24, listing_pos >> 16);
+                put32(buf + 28, parent);
+                put16(buf + 32, 0);
+                put16(buf + 34, listing_pos & 0xFFFF);
+                put32(buf + 36, xattr);
+                len = 40;
+            } else {
+                put32(buf + 16, listing_pos >> 16);
+                put32(buf + 20, 2 + subdirs);
+                put16(buf + 24, listing + 3);
+                put16(buf + 26, listing_pos & 0xFFFF);
+                put32(buf + 28, parent);
+                len = 32;
+            }
+            meta_write(inodes, options, buf, len);
+            break;
+
+        case SQFS_FILE:
+            if (ext) {
+                put64(buf + 16, file->start);
+                put64(buf + 24, file->size);
+                put64(buf + 32, file->sparse);
+                put32(buf + 40, node->links);
+                put32(buf + 44, file->fragment);
+                put32(buf + 48, file->fragment_offset);
+                put32(buf + 52, xattr);
+                len = 56;
+            } else {
+                put32(buf + 16, file->start);
+                put32(buf + 20, file->fragment);
+                put32(buf + 24, file->fragment_offset);
+                put32(buf + 28, file->size);
+                len = 32;
+            }
+            meta_write(inodes, options, buf, len);
+            for (uint32_t i = 0; i < file->block_count; i++) {
+                unsigned char size[4];
+                put32(size, file->blocks[i]);
+                meta_write(inodes, options, size, sizeof(size));
+            }
+            break;
+
+        case SQFS_SYMLINK: {
+            size_t target = strlen(node->link);
+            put32(buf + 16, node->links);
+            put32(buf + 20, target);
+            meta_write(inodes, options, buf, 24);
+            meta_write(inodes, options, node->link, target);
+            if (ext) {
+                put32(buf, xattr);
+                meta_write(inodes, options, buf, 4);
+            }
+            break;
+        }
+
+        case SQFS_BLKDEV:
+        case SQFS_CHRDEV:
+            put32(buf + 16, node->links);
+            put32(buf + 20, rdev);
+            put32(buf + 24, xattr);
+            meta_write(inodes, options, buf, ext ? 28 : 24);
+            break;
+
+        default:
+            put32(buf + 16, node->links);
+            put32(buf + 20, xattr);
+            meta_write(inodes, options, buf, ext ? 24 : 20);
+            break;
+    }
+}
+
+static int write_all(SqfsWriter *w, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        ssize_t written = write(w->fd, p, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            log_error("Ошибка записи %s: %s", w->path, strerror(errno));
+            w->failed = true;
+            return -1;
+        }
+        p += written;
+        len -= written;
+        w->offset += written;
+    }
+    return 0;
+}
+
+// Таблица в метаданных и её индекс из абсолютных смещений блоков
+static uint64_t write_indexed_table(SqfsWriter *w, SqfsMeta *meta) {
+    meta_flush(meta, &w->options);
+    uint64_t meta_start = w->offset;
+    write_all(w, meta->out, meta->out_len);
+
+    uint64_t index_start = w->offset;
+    for (size_t i = 0; i < meta->start_count; i++) {
+        unsigned char pointer[8];
+        put64(pointer, meta_start + meta->starts[i]);
+        write_all(w, pointer, sizeof(pointer));
+    }
+    return index_start;
+}
+
+static int write_tables(SqfsWriter *w, SqfsNode *top) {
+    const SqfsOptions *options = &w->options;
+    SqfsList list = { 0 };
+    collect_nodes(top, &list);
+    uint32_t inode_count = number_inodes(&list);
+
+    SqfsMeta inodes, dirs, fragments, id_meta;
+    SqfsIds *ids = calloc(1, sizeof(SqfsIds));
+    SqfsXattrs xattrs = { 0 };
+    meta_init(&inodes);
+    meta_init(&dirs);
+    meta_init(&fragments);
+    meta_init(&id_meta);
+    meta_init(&xattrs.pairs);
+    meta_init(&xattrs.ids);
+
+    // Первое имя жёсткой ссылки в этом порядке идёт раньше остальных, так
+    // что его inode уже записан, когда до остальных имён доходит их каталог
+    for (size_t i = 0; i < list.count; i++) {
+        SqfsNode *node = list.nodes[i];
+        if (node->same_inode) {
+            node->inode_ref = node->same_inode->inode_ref;
+            continue;
+        }
+        write_inode(w, &inodes, &dirs, ids, &xattrs, node, inode_count);
+    }
+    meta_flush(&inodes, options);
+    meta_flush(&dirs, options);
+
+    unsigned char superblock[SQFS_SUPERBLOCK_SIZE];
+    uint64_t inode_table = w->offset;
+    write_all(w, inodes.out, inodes.out_len);
+    uint64_t directory_table = w->offset;
+    write_all(w, dirs.out, dirs.out_len);
+
+    for (uint32_t i = 0; i < w->fragment_count; i++) {
+        unsigned char entry[16];
+        put64(entry, w->fragments[i].start);
+        put32(entry + 8, w->fragments[i].size);
+        put32(entry + 12, 0);
+        meta_write(&fragments, options, entry, sizeof(entry));
+    }
+    uint64_t fragment_table = write_indexed_table(w, &fragments);
+
+    for (uint32_t i = 0; i < ids->count; i++) {
+        unsigned char id[4];
+        put32(id, ids->ids[i]);
+        meta_write(&id_meta, options, id, sizeof(id));
+    }
+    uint64_t id_table = write_indexed_table(w, &id_meta);
+
+    uint64_t xattr_table = SQFS_INVALID;
+    if (xattrs.count > 0) {
+        meta_flush(&xattrs.pairs, options);
+        meta_flush(&xattrs.ids, options);
+        uint64_t pairs_start = w->offset;
+        write_all(w, xattrs.pairs.out, xattrs.pairs.out_len);
+        uint64_t ids_start = w->offset;
+        write_all(w, xattrs.ids.out, xattrs.ids.out_len);
+
+        xattr_table = w->offset;
+        unsigned char header[16];
+        put64(header, pairs_start);
+        put32(header + 8, xattrs.count);
+        put32(header + 12, 0);
+        write_all(w, header, sizeof(header));
+        for (size_t i = 0; i < xattrs.ids.start_count; i++) {
+            unsigned char pointer[8];
+            put64(pointer, ids_start + xattrs.ids.starts[i]);
+            write_all(w, pointer, sizeof(pointer));
+        }
+    }
+
+    uint64_t bytes_used = w->offset;
+    unsigned char pad[SQFS_PAD] = { 0 };
+    if (bytes_used % SQFS_PAD) {
+        write_all(w, pad, SQFS_PAD - bytes_used % SQFS_PAD);
+    }
+
+    uint16_t flags = xattrs.count ? 0 : SQFS_FLAG_NO_XATTRS;
+    if (options->uncompressed) {
+        flags |= SQFS_FLAG_UNCOMPRESSED_INODES | SQFS_FLAG_UNCOMPRESSED_DATA |
+                 SQFS_FLAG_UNCOMPRESSED_FRAGMENTS | SQFS_FLAG_UNCOMPRESSED_IDS;
+    }
+    if (options->compressor == SQFS_COMP_XZ && options->x86_filter) {
+        flags |= SQFS_FLAG_COMPRESSOR_OPTIONS;
+    }
+
+    memset(superblock, 0, sizeof(superblock));
+    put32(superblock, SQFS_MAGIC);
+    put32(superblock + 4, inode_count);
+    put32(superblock + 8, options->mtime);
+    put32(superblock + 12, options->block_size);
+    put32(superblock + 16, w->fragment_count);
+    put16(superblock + 20, options->compressor);
+    put16(superblock + 22, block_log(options->block_size));
+    put16(superblock + 24, flags);
+    put16(superblock + 26, ids->count);
+    put16(superblock + 28, 4);
+    put16(superblock + 30, 0);
+    put64(superblock + 32, top->inode_ref);
+    put64(superblock + 40, bytes_used);
+    put64(superblock + 48, id_table);
+    put64(superblock + 56, xattr_table);
+    put64(superblock + 64, inode_table);
+    put64(superblock + 72, directory_table);
+    put64(superblock + 80, fragment_table);
+    put64(superblock + 88, SQFS_INVALID);
+
+    memcpy(w->superblock, superblock, sizeof(superblock));
+    if (pwrite(w->fd, superblock, sizeof(superblock), 0) != sizeof(superblock)) {
+        log_error("Ошибка записи суперблока %s: %s", w->path, strerror(errno));
+        w->failed = true;
+    }
+
+    w->stats.inodes = inode_count;
+    w->stats.fragments = w->fragment_count;
+    w->stats.bytes_out = bytes_used;
+
+    meta_free(&inodes);
+    meta_free(&dirs);
+    meta_free(&fragments);
+    meta_free(&id_meta);
+    meta_free(&xattrs.pairs);
+    meta_free(&xattrs.ids);
+    free(xattrs.sets);
+    free(ids);
+    free(list.nodes);
+    return w->failed ? -1 : 0;
+}
+
+// ---------------------------------------------------------------------
+// Интерфейс
+
+SqfsWriter *sqfs_writer_open(const SqfsOptions *options, const char *path) {
+    SqfsWriter *w = calloc(1, sizeof(*w));
+    if (!w) {
+        return NULL;
+    }
+    w->options = *options;
+    w->base_fd = -1;
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work_cond, NULL);
+    pthread_cond_init(&w->done_cond, NULL);
+
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) {
+        log_error("Не удалось создать %s: %s", path, strerror(errno));
+        sqfs_writer_close(w);
+        return NULL;
+    }
+
+    // Место под суперблок; он пишется последним
+    unsigned char header[SQFS_SUPERBLOCK_SIZE] = { 0 };
+    write_all(w, header, sizeof(header));
+
+    // Параметры xz нужны ядру, только если задан фильтр BCJ
+    if (options->compressor == SQFS_COMP_XZ && options->x86_filter) {
+        unsigned char block[10];
+        put16(block, 8 | SQFS_META_UNCOMPRESSED);
+        put32(block + 2, options->block_size);
+        put32(block + 6, 1);    // x86
+        write_all(w, block, sizeof(block));
+    }
+
+    if (w->failed) {
+        sqfs_writer_close(w);
+        return NULL;
+    }
+    return w;
+}
+
+int sqfs_writer_set_base(SqfsWriter *w, const char *manifest_path, const char *image_path) {
+    snprintf(w->manifest_path, sizeof(w->manifest_path), "%s", manifest_path);
+    return load_base(w, image_path);
+}
+
+static int threads_for(const SqfsWriter *w) {
+    return w->options.threads > 0 ? w->options.threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+int sqfs_writer_prefill(SqfsWriter *w, const char *root) {
+    SqfsNode *top = scan_tree(root, threads_for(w));
+    if (!top) {
+        return -1;
+    }
+    bool scan_failed = top->link == (char *)top;
+
+    int result = scan_failed ? -1 : data_pass(w, top, root, true);
+    free_tree(top);
+    return result;
+}
+
+int sqfs_writer_finish(SqfsWriter *w, const char *root) {
+    SqfsNode *top = scan_tree(root, threads_for(w));
+    if (!top) {
+        return -1;
+    }
+    if (top->link == (char *)top) {
+        free_tree(top);
+        return -1;
+    }
+
+    int result = data_pass(w, top, root, false);
+    if (result == 0) {
+        result = write_tables(w, top);
+    }
+    if (result == 0 && w->manifest_path[0]) {
+        save_manifest(w, top);
+    }
+
+    // Заранее сжатые данные удалённых и изменённых файлов остались в образе
+    for (size_t i = 0; i < w->file_count; i++) {
+        SqfsFile *file = w->files[i];
+        if (file->used) {
+            continue;
+        }
+        for (uint32_t b = 0; b < file->block_count; b++) {
+            w->stats.wasted_bytes += file->blocks[b] & ~SQFS_BLOCK_UNCOMPRESSED;
+        }
+        w->stats.wasted_bytes += file->fragment_size;
+    }
+
+    free_tree(top);
+    if (result == 0 && fsync(w->fd) != 0) {
+        log_error("Ошибка записи %s: %s", w->path, strerror(errno));
+        result = -1;
+    }
+    return result;
+}
+
+void sqfs_writer_stats(const SqfsWriter *w, SqfsStats *stats) {
+    *stats = w->stats;
+}
+
+void sqfs_writer_close(SqfsWriter *w) {
+    if (!w) {
+        return;
+    }
+    if (w->fd >= 0) {
+        close(w->fd);
+    }
+    for (size_t i = 0; i < w->file_count; i++) {
+        free(w->files[i]->blocks);
+        free(w->files[i]);
+    }
+    free(w->files);
+    free(w->fragments);
+    free(w->fragment_buffer);
+    prefilled_free(w);
+    base_free(w);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->work_cond);
+    pthread_cond_destroy(&w->done_cond);
+    free(w);
+}
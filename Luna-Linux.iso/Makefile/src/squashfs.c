@@ -0,0 +1,336 @@
+/**
+ * squashfs.c - Реализация профилей сжатия squashfs
+ *
+ * Профиль — имя и параметры mksquashfs. Встроенные профили покрывают
+ * выпуск (xz), ночные сборки (zstd), отладку (lz4) и сборку без сжатия;
+ * luna.conf может выбрать профиль, задать число потоков и определить
+ * свои профили. Сравнение профилей сжимает и распаковывает выборку
+ * файлов реального chroot mksquashfs и встроенной записью, чтобы выбор
+ * профиля и способа записи опирался на данные.
+ */
+
+#define _GNU_SOURCE
+
+#include "squashfs.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+static const SquashProfile builtin_profiles[] = {
+    { "release-xz",     "-comp xz -b 1M -Xbcj x86" },
+    { "fast-zstd",      "-comp zstd -Xcompression-level 3 -b 1M" },
+    { "lz4-dev",        "-comp lz4 -b 256K" },
+    { "no-compression", "-noI -noId -noD -noF -noX -b 1M" },
+};
+
+void squashfs_settings_init(SquashSettings *settings) {
+    int count = sizeof(builtin_profiles) / sizeof(builtin_profiles[0]);
+    memcpy(settings->profiles, builtin_profiles, sizeof(builtin_profiles));
+    settings->count = count;
+    settings->selected = 0;
+    settings->threads = 0;
+    settings->native = true;
+    settings->incremental = true;
+    settings->dedup = true;
+    squashfs_select(settings, SQUASHFS_DEFAULT_PROFILE);
+}
+
+static int find_profile(const SquashSettings *settings, const char *name) {
+    for (int i = 0; i < settings->count; i++) {
+        if (strcmp(settings->profiles[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int squashfs_select(SquashSettings *settings, const char *name) {
+    int index = find_profile(settings, name);
+    if (index < 0) {
+        log_error("Неизвестный профиль сжатия squashfs: %s", name);
+        return -1;
+    }
+    settings->selected = index;
+    return 0;
+}
+
+const SquashProfile *squashfs_profile(const SquashSettings *settings) {
+    return &settings->profiles[settings->selected];
+}
+
+int squashfs_settings_apply(SquashSettings *settings, const ConfigFile *file) {
+    char selected[32] = "";
+
+    for (size_t i = 0; i < file->count; i++) {
+        const ConfigEntry *entry = &file->entries[i];
+        if (!config_str_equals(entry->section, "Squashfs")) {
+            continue;
+        }
+
+        ConfigStr key = entry->key;
+        ConfigStr value = entry->value;
+        if (config_str_equals(key, "Profile")) {
+            snprintf(selected, sizeof(selected), "%.*s", (int)value.len, value.data);
+        } else if (config_str_equals(key, "Threads")) {
+            char number[16];
+            snprintf(number, sizeof(number), "%.*s", (int)value.len, value.data);
+            settings->threads = atoi(number);
+        } else if (config_str_equals(key, "Writer")) {
+            settings->native = !config_str_equals(value, "mksquashfs");
+        } else if (config_str_equals(key, "Incremental")) {
+            settings->incremental = config_str_bool(value);
+        } else if (config_str_equals(key, "Dedup")) {
+            settings->dedup = config_str_bool(value);
+        } else if (key.len > 8 && memcmp(key.data, "Profile.", 8) == 0) {
+            // Свой профиль или замена параметров встроенного
+            char name[32];
+            snprintf(name, sizeof(name), "%.*s", (int)key.len - 8, key.data + 8);
+            int index = find_profile(settings, name);
+            if (index < 0 && settings->count < SQUASHFS_PROFILES_MAX) {
+                index = settings->count++;
+                snprintf(settings->profiles[index].name, sizeof(settings->profiles[index].name),
+                         "%s", name);
+            }
+            if (index >= 0) {
+                snprintf(settings->profiles[index].options,
+                         sizeof(settings->profiles[index].options), "%.*s",
+                         (int)value.len, value.data);
+            }
+        }
+    }
+
+    return selected[0] ? squashfs_select(settings, selected) : 0;
+}
+
+int squashfs_settings_load(SquashSettings *settings, const char *conf_path) {
+    ConfigFile file;
+    if (config_file_parse(&file, conf_path) != 0) {
+        return -1;
+    }
+
+    int result = squashfs_settings_apply(settings, &file);
+    config_file_free(&file);
+    return result;
+}
+
+bool squashfs_native_options(const SquashSettings *settings, SqfsOptions *options) {
+    return settings->native &&
+           sqfs_options_parse(options, squashfs_profile(settings)->options, settings->threads) == 0;
+}
+
+void squashfs_args(const SquashSettings *settings, const SquashProfile *profile,
+                   const char *source, const char *target, ExecArgs *args) {
+    int threads = settings->threads > 0 ? settings->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    exec_args_init(args);
+    exec_args_add(args, "mksquashfs");
+    exec_args_add(args, source);
+    exec_args_add(args, target);
+    exec_args_split(args, profile->options);
+    exec_args_add(args, "-noappend");
+    exec_args_add(args, "-no-progress");
+    exec_args_add(args, "-processors");
+    exec_args_addf(args, "%d", threads);
+}
+
+// Выборка: берётся равномерно каждый k-й файл дерева (k = объём дерева /
+// объём выборки), чтобы доля бинарных файлов, текста и уже сжатых данных
+// была как во всём дереве. nftw не передаёт контекст, поэтому состояние
+// обхода хранится в переменных файла.
+static struct {
+    unsigned long long total;
+    double fraction;
+    double credit;
+    unsigned long long taken;
+    unsigned long long limit;
+    const char *sample_dir;
+    int files;
+} sample;
+
+static int count_file(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)path;
+    (void)ftw;
+    if (flag == FTW_F && S_ISREG(st->st_mode)) {
+        sample.total += st->st_size;
+    }
+    return 0;
+}
+
+static int take_file(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)ftw;
+    if (flag != FTW_F || !S_ISREG(st->st_mode) || st->st_size == 0) {
+        return 0;
+    }
+
+    sample.credit += sample.fraction;
+    if (sample.credit < 1.0) {
+        return 0;
+    }
+    sample.credit -= 1.0;
+
+    char target[512];
+    snprintf(target, sizeof(target), "%s/%06d", sample.sample_dir, sample.files);
+    if (copy_file(path, target) == 0) {
+        sample.files++;
+        sample.taken += st->st_size;
+    }
+
+    // Выборка набрана
+    return sample.taken >= sample.limit ? 1 : 0;
+}
+
+static int build_sample(const char *root, const char *sample_dir, unsigned long long limit) {
+    memset(&sample, 0, sizeof(sample));
+    sample.sample_dir = sample_dir;
+    sample.limit = limit;
+
+    nftw(root, count_file, 64, FTW_PHYS | FTW_MOUNT);
+    if (sample.total == 0) {
+        log_error("В %s нет файлов для выборки", root);
+        return -1;
+    }
+
+    sample.fraction = sample.total > limit ? (double)limit / sample.total : 1.0;
+    sample.credit = 1.0 - sample.fraction;
+
+    nftw(root, take_file, 64, FTW_PHYS | FTW_MOUNT);
+    return sample.files > 0 ? 0 : -1;
+}
+
+static unsigned long long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (unsigned long long)st.st_size : 0;
+}
+
+static void remove_tree(const char *path, bool verbose) {
+    char *const argv[] = { "rm", "-rf", (char *)path, NULL };
+    exec_command(argv, verbose);
+}
+
+// Запись выборки встроенным писателем с замером времени, как у exec_run
+static int native_pack(const SqfsOptions *options, const char *source,
+                       const char *image, double *duration) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    SqfsWriter *writer = sqfs_writer_open(options, image);
+    if (!writer) {
+        return -1;
+    }
+    int result = sqfs_writer_finish(writer, source);
+    sqfs_writer_close(writer);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *duration = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return result;
+}
+
+// Распаковка образа unsquashfs и строка таблицы; образ и распакованное
+// дерево удаляются. 0 — образ записан и распакован
+static int report_image(const char *name, const char *writer, const char *detail,
+                        int packed, double pack_duration, const char *image,
+                        const char *unpacked, const ExecOptions *options) {
+    char *const unsquash[] = { "unsquashfs", "-no-progress", "-f", "-d",
+                               (char *)unpacked, (char *)image, NULL };
+    ExecResult unpack;
+    int unpacked_ok = packed == 0 ? exec_run(unsquash, options, &unpack) : -1;
+    unsigned long long size = file_size(image);
+    double sample_mib = sample.taken / (1024.0 * 1024.0);
+
+    print_padded(name, 18);
+    print_padded(writer, 12);
+    int result = 0;
+    if (packed != 0 || unpacked_ok != 0) {
+        printf("ошибка (%s)\n", detail);
+        result = 1;
+    } else {
+        char cell[32];
+        snprintf(cell, sizeof(cell), "%.1f", sample_mib / (pack_duration > 0 ? pack_duration : 1e-3));
+        print_padded(cell, 15);
+        snprintf(cell, sizeof(cell), "%.1f", sample_mib / (unpack.duration > 0 ? unpack.duration : 1e-3));
+        print_padded(cell, 19);
+        snprintf(cell, sizeof(cell), "%.1f", size / (1024.0 * 1024.0));
+        print_padded(cell, 13);
+        printf("%.2f\n", size ? (double)sample.taken / size : 0.0);
+    }
+
+    unlink(image);
+    remove_tree(unpacked, options->verbose);
+    return result;
+}
+
+int squashfs_benchmark(const SquashSettings *settings, const char *root,
+                       const char *workdir, int sample_mb, bool verbose) {
+    if (!check_dependency("unsquashfs")) {
+        log_error("Для сравнения профилей нужен unsquashfs (squashfs-tools)");
+        return 1;
+    }
+    // Без mksquashfs сравнивается только встроенная запись
+    bool have_mksquashfs = check_dependency("mksquashfs");
+    if (!have_mksquashfs) {
+        log_warning("mksquashfs не найден, сравнивается только встроенная запись");
+    }
+
+    char bench_dir[512], sample_dir[600];
+    snprintf(bench_dir, sizeof(bench_dir), "%s/squashfs-bench", workdir);
+    snprintf(sample_dir, sizeof(sample_dir), "%s/sample", bench_dir);
+    remove_tree(bench_dir, verbose);
+    if (make_dirs(sample_dir) != 0) {
+        log_error("Не удалось создать каталог %s", sample_dir);
+        return 1;
+    }
+
+    unsigned long long limit = (unsigned long long)sample_mb * 1024 * 1024;
+    if (build_sample(root, sample_dir, limit) != 0) {
+        remove_tree(bench_dir, verbose);
+        return 1;
+    }
+
+    double sample_mib = sample.taken / (1024.0 * 1024.0);
+    log_info("Выборка: %d файлов, %.1f MB из %.1f MB в %s",
+             sample.files, sample_mib, sample.total / (1024.0 * 1024.0), root);
+
+    printf("\n");
+    print_padded("Профиль", 18);
+    print_padded("Запись", 12);
+    print_padded("Сжатие, MB/s", 15);
+    print_padded("Распаковка, MB/s", 19);
+    print_padded("Размер, MB", 13);
+    printf("Степень\n");
+
+    int result = 0;
+    ExecOptions options = { .log_path = NULL, .timeout = -1, .verbose = verbose };
+    for (int i = 0; i < settings->count; i++) {
+        const SquashProfile *profile = &settings->profiles[i];
+        char image[600], unpacked[600];
+        snprintf(image, sizeof(image), "%s/%s.sqfs", bench_dir, profile->name);
+        snprintf(unpacked, sizeof(unpacked), "%s/%s.out", bench_dir, profile->name);
+
+        if (have_mksquashfs) {
+            ExecArgs args;
+            ExecResult pack;
+            squashfs_args(settings, profile, sample_dir, image, &args);
+            int packed = exec_run(args.argv, &options, &pack);
+            exec_args_free(&args);
+            result |= report_image(profile->name, "mksquashfs", profile->options,
+                                   packed, pack.duration, image, unpacked, &options);
+        }
+
+        // Встроенная запись — для профилей, которые она поддерживает (gzip, xz, без сжатия)
+        SqfsOptions native;
+        if (sqfs_options_parse(&native, profile->options, settings->threads) == 0) {
+            double duration = 0;
+            int packed = native_pack(&native, sample_dir, image, &duration);
+            result |= report_image(profile->name, "native", profile->options,
+                                   packed, duration, image, unpacked, &options);
+        }
+    }
+
+    remove_tree(bench_dir, verbose);
+    return result;
+}
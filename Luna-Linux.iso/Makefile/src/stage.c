@@ -0,0 +1,187 @@
+/**
+ * stage.c - Реализация размещения файлов
+ *
+ * Способы пробуются от дешёвого к дорогому: жёсткая ссылка или
+ * переименование (данные не трогаются), FICLONE (общие экстенты),
+ * copy_file_range (данные не проходят через пространство пользователя)
+ * и копирование крупным буфером. Неподдерживаемый способ распознаётся
+ * по коду ошибки до записи первого байта, поэтому переход к следующему
+ * безопасен.
+ */
+
+#define _GNU_SOURCE
+
+#include "stage.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#define STAGE_BUFFER_SIZE (4 * 1024 * 1024)
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+const char *stage_method_name(StageMethod method) {
+    switch (method) {
+        case STAGE_HARDLINK:
+            return "жёсткая ссылка";
+        case STAGE_RENAME:
+            return "переименование";
+        case STAGE_REFLINK:
+            return "reflink";
+        case STAGE_COPY_RANGE:
+            return "copy_file_range";
+        default:
+            return "копирование";
+    }
+}
+
+// Ошибки, означающие, что способ не поддерживается для этой пары файлов
+static bool unsupported(int error) {
+    return error == EXDEV || error == EINVAL || error == ENOSYS || error == EOPNOTSUPP ||
+           error == ENOTTY || error == EPERM || error == EBADF;
+}
+
+// Копирование внутри ядра; 1 — способ не поддерживается, ничего не записано
+static int copy_range(int in, int out, unsigned long long size) {
+    unsigned long long done = 0;
+    while (done < size) {
+        ssize_t copied = copy_file_range(in, NULL, out, NULL, size - done, 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied < 0 && done == 0 && unsupported(errno)) {
+            return 1;
+        }
+        if (copied <= 0) {
+            return -1;
+        }
+        done += copied;
+    }
+    return 0;
+}
+
+static int copy_buffer(int in, int out) {
+    char *buffer = malloc(STAGE_BUFFER_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int result = 0;
+    for (;;) {
+        ssize_t got = read(in, buffer, STAGE_BUFFER_SIZE);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            result = got < 0 ? -1 : 0;
+            break;
+        }
+
+        ssize_t done = 0;
+        while (done < got) {
+            ssize_t written = write(out, buffer + done, got - done);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                result = -1;
+                break;
+            }
+            done += written;
+        }
+        if (result != 0) {
+            break;
+        }
+    }
+
+    free(buffer);
+    return result;
+}
+
+static int copy_data(const char *src, const char *dst, const struct stat *st, StageResult *result) {
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        log_error("Не удалось открыть файл для чтения: %s", src);
+        return -1;
+    }
+
+    int out = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st->st_mode & 07777);
+    if (out < 0) {
+        close(in);
+        log_error("Не удалось открыть файл для записи: %s", dst);
+        return -1;
+    }
+
+    int status;
+    if (ioctl(out, FICLONE, in) == 0) {
+        result->method = STAGE_REFLINK;
+        status = 0;
+    } else if ((status = copy_range(in, out, st->st_size)) == 0) {
+        result->method = STAGE_COPY_RANGE;
+    } else if (status == 1) {
+        result->method = STAGE_BUFFER;
+        status = copy_buffer(in, out);
+    }
+
+    close(in);
+    if (close(out) != 0) {
+        status = -1;
+    }
+
+    if (status != 0) {
+        log_error("Ошибка записи в файл: %s", dst);
+        unlink(dst);
+        return -1;
+    }
+    return 0;
+}
+
+int stage_file(const char *src, const char *dst, int flags, StageResult *result) {
+    StageResult local;
+    result = result ? result : &local;
+    double start = now_seconds();
+
+    struct stat st;
+    if (stat(src, &st) != 0) {
+        log_error("Файл не найден: %s", src);
+        return -1;
+    }
+    result->bytes = st.st_size;
+
+    // Старый dst мог быть ссылкой на другой файл, писать в него нельзя
+    if (unlink(dst) != 0 && errno != ENOENT) {
+        log_error("Не удалось заменить %s: %s", dst, strerror(errno));
+        return -1;
+    }
+
+    if ((flags & STAGE_MOVE) && rename(src, dst) == 0) {
+        result->method = STAGE_RENAME;
+    } else if (!(flags & (STAGE_MOVE | STAGE_COPY)) && link(src, dst) == 0) {
+        result->method = STAGE_HARDLINK;
+    } else if (copy_data(src, dst, &st, result) != 0) {
+        return -1;
+    } else if (flags & STAGE_MOVE) {
+        unlink(src);
+    }
+
+    result->seconds = now_seconds() - start;
+    return 0;
+}
+
+void stage_report(const char *dst, const StageResult *result) {
+    log_info("%s: %s, %.1f MB за %.3f с", dst, stage_method_name(result->method),
+             result->bytes / (1024.0 * 1024.0), result->seconds);
+}
@@ -0,0 +1,94 @@
+/**
+ * efi_fat.c - Образ FAT из файлов для проверки boot_fat_image
+ *
+ * efi_fat <образ> <метка> <путь в образе>=<файл>...
+ *
+ * Файлы читаются целиком и передаются писателю FAT тем же вызовом, что
+ * и при сборке boot/grub/efi.img. Образ проверяет tests/efi_fat.sh.
+ */
+
+#define _GNU_SOURCE
+
+#include "boot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EFI_FAT_MAX_FILES 32
+
+static void *read_whole(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return NULL;
+    }
+
+    size_t capacity = 4096;
+    size_t len = 0;
+    char *data = malloc(capacity);
+    while (data) {
+        len += fread(data + len, 1, capacity - len, file);
+        if (len < capacity) {
+            break;
+        }
+        capacity *= 2;
+        char *grown = realloc(data, capacity);
+        if (!grown) {
+            free(data);
+        }
+        data = grown;
+    }
+
+    if (!data || ferror(file)) {
+        fprintf(stderr, "Не удалось прочитать %s\n", path);
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = len;
+    return data;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4 || argc - 3 > EFI_FAT_MAX_FILES) {
+        fprintf(stderr, "Использование: %s <образ> <метка> <путь в образе>=<файл>...\n", argv[0]);
+        return 2;
+    }
+
+    BootFile files[EFI_FAT_MAX_FILES];
+    int count = argc - 3;
+    for (int i = 0; i < count; i++) {
+        char *spec = argv[i + 3];
+        char *separator = strchr(spec, '=');
+        if (!separator) {
+            fprintf(stderr, "Ожидается <путь в образе>=<файл>: %s\n", spec);
+            return 2;
+        }
+        *separator = '\0';
+        files[i].path = spec;
+        files[i].data = read_whole(separator + 1, &files[i].size);
+        if (!files[i].data) {
+            return 1;
+        }
+    }
+
+    uint8_t *image;
+    size_t size;
+    if (boot_fat_image(files, count, argv[2], &image, &size) != 0) {
+        fprintf(stderr, "boot_fat_image не собрал образ\n");
+        return 1;
+    }
+
+    FILE *output = fopen(argv[1], "wb");
+    if (!output || fwrite(image, 1, size, output) != size || fclose(output) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    printf("%s: %zu байт, файлов %d\n", argv[1], size, count);
+    free(image);
+    for (int i = 0; i < count; i++) {
+        free((void *)files[i].data);
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+#!/bin/bash
+#
+# efi_fat.sh - Проверка раздела EFI, собранного писателем FAT в памяти
+#
+# Собирает tests/efi_fat.c вместе с исходниками сборщика и пишет образ
+# теми же вызовами, что и boot/grub/efi.img: ядро EFI на сотни кластеров,
+# конфигурацию, пустой файл и файл во вложенных каталогах. Образ
+# проверяют сторонние инструменты: fsck.vfat -n — структуру FAT и
+# цепочки кластеров, mdir — дерево каталогов, mtype — содержимое файлов
+# байт в байт. Драйвер и образ собираются всегда; без dosfstools или
+# mtools проверка образа пропускается с кодом 77.
+#
+# Запуск: tests/efi_fat.sh (компилятор — $CC, по умолчанию cc)
+
+set -euo pipefail
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Драйвер собирается со всеми модулями, кроме точек входа luna и luna-bench
+sources=()
+for file in "$src"/*.c; do
+    case "$(basename "$file")" in
+        main.c|bench.c) ;;
+        *) sources+=("$file") ;;
+    esac
+done
+# Каталог заголовков — include с суффиксом в имени, как в дереве исходников
+include=("$src"/include*/)
+if [ ! -f "${include[0]}/boot.h" ]; then
+    echo "Нет boot.h в $src/include*" >&2
+    exit 1
+fi
+"${CC:-cc}" -std=gnu11 -O2 -Wall -Wextra -I"${include[0]}" -o "$work/efi_fat" \
+    "$src/tests/efi_fat.c" "${sources[@]}" -lpthread -lz -llzma -lm
+
+# Файлы образа: ядро EFI, встроенная конфигурация, пустой файл и файл
+# размером на байт больше кластера во вложенных каталогах
+head -c 1500000 /dev/urandom > "$work/bootx64.efi"
+printf 'search --file --set=root /.disk/info\nconfigfile /boot/grub/grub.cfg\n' \
+    > "$work/grub.cfg"
+: > "$work/empty"
+head -c 2049 /dev/urandom > "$work/edge.bin"
+
+files=(
+    "EFI/BOOT/BOOTX64.EFI=$work/bootx64.efi"
+    "EFI/BOOT/GRUB.CFG=$work/grub.cfg"
+    "EFI/BOOT/EMPTY=$work/empty"
+    "BOOT/GRUB/X86_64/EDGE.BIN=$work/edge.bin"
+)
+"$work/efi_fat" "$work/efi.img" "LUNA EFI" "${files[@]}"
+
+for tool in fsck.vfat mdir mtype; do
+    if ! command -v "$tool" > /dev/null; then
+        echo "Пропуск: нет $tool (нужны dosfstools и mtools)"
+        exit 77
+    fi
+done
+
+echo "== fsck.vfat"
+fsck.vfat -n "$work/efi.img"
+
+# Образ не на диске — проверка геометрии mtools не нужна
+export MTOOLS_SKIP_CHECK=1
+
+echo "== mdir"
+mdir -i "$work/efi.img" -/ ::/
+
+echo "== mtype"
+failed=0
+for spec in "${files[@]}"; do
+    path=${spec%%=*}
+    mtype -i "$work/efi.img" "::/$path" > "$work/extracted"
+    if cmp -s "$work/extracted" "${spec#*=}"; then
+        echo "OK       $path"
+    else
+        echo "ОТЛИЧИЕ  $path"
+        failed=1
+    fi
+done
+
+exit $failed
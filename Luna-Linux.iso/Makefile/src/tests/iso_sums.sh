@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# iso_sums.sh - Списки SHA256SUMS и SHA512SUMS после сборок, которые не
+# записывают образ заново
+#
+# Полная сборка, затем две пересборки:
+#   1. с другим числом параллельных шагов — оно не входит в ключи шагов,
+#      образ «актуален» и не пишется;
+#   2. после сборки другой версии под тем же именем ISO — исходный образ
+#      разворачивается из кэша шагов, а списки перед этим переписаны
+#      суммами другой версии.
+# После каждой сборки образ сверяется со списками: sha256sum -c и
+# sha512sum -c.
+#
+# Нужны права root и всё, что нужно самой сборке (mmdebstrap, зеркало).
+# Запуск: sudo tests/iso_sums.sh <luna> [luna.conf] [опции сборки...]
+
+set -euo pipefail
+
+if [ $# -lt 1 ]; then
+    echo "Использование: $0 <luna> [luna.conf] [опции сборки...]" >&2
+    exit 2
+fi
+
+luna=$(realpath "$1")
+shift
+src=$(cd "$(dirname "$0")/.." && pwd)
+# Каталог конфигурации — config с суффиксом в имени, как в дереве исходников
+shipped=("$src"/config*/luna.conf)
+conf=${shipped[0]}
+if [ $# -gt 0 ] && [ -f "$1" ]; then
+    conf=$1
+    shift
+fi
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Своя конфигурация теста: рабочий каталог и образ во временном каталоге,
+# вторая версия отличается только полем Version
+iso="$work/out/Luna-Linux.iso"
+mkdir -p "$work/out"
+sed -e "s|^WorkDir *=.*|WorkDir = $work/build|" \
+    -e "s|^OutputISO *=.*|OutputISO = $iso|" \
+    "$conf" > "$work/first.conf"
+awk '/^\[/ { section = $0 }
+     section == "[Distribution]" && /^Version *=/ { print "Version = 0.0-sums-test"; next }
+     { print }' "$work/first.conf" > "$work/second.conf"
+
+build() {
+    echo "== luna $*"
+    "$luna" "$@" > "$work/build.log" 2>&1 || {
+        tail -n 50 "$work/build.log"
+        return 1
+    }
+    grep -F -e "актуален" -e "из кэша" "$work/build.log" | grep -F "ISO" || true
+}
+
+verify() {
+    (cd "$(dirname "$iso")" && sha256sum -c SHA256SUMS && sha512sum -c SHA512SUMS)
+}
+
+build -f "$work/first.conf" -C "$work/cache" "$@"
+verify
+
+build -f "$work/first.conf" -C "$work/cache" -j 1 "$@"
+verify
+
+build -f "$work/second.conf" -C "$work/cache" "$@"
+verify
+
+build -f "$work/first.conf" -C "$work/cache" "$@"
+verify
+
+echo "OK: списки сумм соответствуют образу после каждой сборки"
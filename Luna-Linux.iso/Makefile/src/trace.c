@@ -0,0 +1,443 @@
+/**
+ * trace.c - Реализация трассировки сборки
+ *
+ * Каждый шаг и каждая запущенная команда записываются как интервал со
+ * временем по часам, временем ЦП, пиковой памятью и счётчиками
+ * /proc/<pid>/io. Ресурсы команды берутся у завершившегося, но ещё не
+ * удалённого из таблицы процесса, поэтому включают и её потомков
+ * (dpkg под apt, сжатие под mksquashfs). Ресурсы шага складываются из
+ * ресурсов его команд, потока планировщика и вспомогательных потоков.
+ */
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define TRACE_TOP_COMMANDS 5
+
+typedef struct {
+    char name[96];
+    char command[512];
+    int step;
+    double start;
+    double end;
+    int status;
+    TraceUsage usage;
+} TraceCommand;
+
+typedef struct {
+    const char *name;
+    bool used;
+    bool cached;
+    double start;
+    double end;
+    int status;
+    int commands;
+    TraceUsage usage;
+} TraceStep;
+
+static struct {
+    bool enabled;
+    double origin;
+    pthread_mutex_t lock;
+    TraceStep steps[TRACE_MAX_STEPS];
+    TraceCommand *commands;
+    size_t count;
+    size_t capacity;
+} g_trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Шаг потока и его ресурсы на момент начала интервала
+static __thread int thread_step = -1;
+static __thread bool thread_helper;
+static __thread struct rusage thread_usage;
+static __thread TraceIo thread_io;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double timeval_seconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void format_duration(double seconds, char *buf, size_t size) {
+    int total = (int)seconds;
+    snprintf(buf, size, "%02d:%02d", total / 60, total % 60);
+}
+
+static void add_usage(TraceUsage *total, const TraceUsage *usage) {
+    total->user_time += usage->user_time;
+    total->sys_time += usage->sys_time;
+    if (usage->max_rss_kb > total->max_rss_kb) {
+        total->max_rss_kb = usage->max_rss_kb;
+    }
+    total->io.rchar += usage->io.rchar;
+    total->io.wchar += usage->io.wchar;
+    total->io.read_bytes += usage->io.read_bytes;
+    total->io.write_bytes += usage->io.write_bytes;
+}
+
+void trace_init(void) {
+    // Процесс редакции матричной сборки начинает свою трассу
+    pthread_mutex_lock(&g_trace.lock);
+    memset(g_trace.steps, 0, sizeof(g_trace.steps));
+    g_trace.count = 0;
+    g_trace.origin = now_seconds();
+    g_trace.enabled = true;
+    pthread_mutex_unlock(&g_trace.lock);
+}
+
+bool trace_enabled(void) {
+    return g_trace.enabled;
+}
+
+int trace_current_step(void) {
+    return thread_step;
+}
+
+int trace_read_io(pid_t pid, TraceIo *io) {
+    char path[64];
+    if (pid > 0) {
+        snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    } else {
+        snprintf(path, sizeof(path), "/proc/thread-self/io");
+    }
+
+    memset(io, 0, sizeof(*io));
+    FILE *fp = fopen(path, "re");
+    if (!fp) {
+        return -1;
+    }
+
+    char line[128];
+    int found = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long long value;
+        if (sscanf(line, "rchar: %llu", &value) == 1) {
+            io->rchar = value;
+            found++;
+        } else if (sscanf(line, "wchar: %llu", &value) == 1) {
+            io->wchar = value;
+            found++;
+        } else if (sscanf(line, "read_bytes: %llu", &value) == 1) {
+            io->read_bytes = value;
+            found++;
+        } else if (sscanf(line, "write_bytes: %llu", &value) == 1) {
+            io->write_bytes = value;
+            found++;
+        }
+    }
+    fclose(fp);
+    return found == 4 ? 0 : -1;
+}
+
+// Запоминание ресурсов потока в начале интервала
+static void thread_mark(int step) {
+    thread_step = step;
+    getrusage(RUSAGE_THREAD, &thread_usage);
+    trace_read_io(0, &thread_io);
+}
+
+// Ресурсы потока с начала интервала
+static void thread_delta(TraceUsage *usage) {
+    struct rusage now;
+    TraceIo io;
+    getrusage(RUSAGE_THREAD, &now);
+    trace_read_io(0, &io);
+
+    memset(usage, 0, sizeof(*usage));
+    usage->user_time = timeval_seconds(&now.ru_utime) - timeval_seconds(&thread_usage.ru_utime);
+    usage->sys_time = timeval_seconds(&now.ru_stime) - timeval_seconds(&thread_usage.ru_stime);
+    usage->io.rchar = io.rchar - thread_io.rchar;
+    usage->io.wchar = io.wchar - thread_io.wchar;
+    usage->io.read_bytes = io.read_bytes - thread_io.read_bytes;
+    usage->io.write_bytes = io.write_bytes - thread_io.write_bytes;
+}
+
+void trace_step_begin(int step, const char *name, bool cached) {
+    if (!g_trace.enabled || step < 0 || step >= TRACE_MAX_STEPS) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_trace.lock);
+    TraceStep *entry = &g_trace.steps[step];
+    memset(entry, 0, sizeof(*entry));
+    entry->name = name;
+    entry->used = true;
+    entry->cached = cached;
+    entry->start = now_seconds();
+    pthread_mutex_unlock(&g_trace.lock);
+
+    thread_mark(step);
+}
+
+void trace_step_end(int step, int status) {
+    if (!g_trace.enabled || step < 0 || step >= TRACE_MAX_STEPS) {
+        return;
+    }
+
+    TraceUsage usage;
+    thread_delta(&usage);
+    thread_step = -1;
+
+    pthread_mutex_lock(&g_trace.lock);
+    TraceStep *entry = &g_trace.steps[step];
+    entry->end = now_seconds();
+    entry->status = status;
+    add_usage(&entry->usage, &usage);
+    pthread_mutex_unlock(&g_trace.lock);
+}
+
+// Пул без потоков выполняет работу в вызывающем потоке: он уже учтён
+// интервалом шага, и повторная отметка его бы сбросила
+void trace_thread_begin(int step) {
+    if (g_trace.enabled && thread_step < 0) {
+        thread_helper = true;
+        thread_mark(step);
+    }
+}
+
+void trace_thread_end(void) {
+    if (!thread_helper) {
+        return;
+    }
+    thread_helper = false;
+    if (thread_step < 0 || thread_step >= TRACE_MAX_STEPS) {
+        return;
+    }
+
+    TraceUsage usage;
+    thread_delta(&usage);
+    int step = thread_step;
+    thread_step = -1;
+
+    // Пул может завершиться уже после конца интервала шага: ресурсы
+    // всё равно относятся к нему
+    pthread_mutex_lock(&g_trace.lock);
+    add_usage(&g_trace.steps[step].usage, &usage);
+    pthread_mutex_unlock(&g_trace.lock);
+}
+
+void trace_command(const char *name, const char *command_line, double start, double end,
+                   int status, const TraceUsage *usage) {
+    if (!g_trace.enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_trace.lock);
+    if (g_trace.count == g_trace.capacity) {
+        size_t capacity = g_trace.capacity ? g_trace.capacity * 2 : 256;
+        TraceCommand *grown = realloc(g_trace.commands, capacity * sizeof(*grown));
+        if (!grown) {
+            pthread_mutex_unlock(&g_trace.lock);
+            return;
+        }
+        g_trace.commands = grown;
+        g_trace.capacity = capacity;
+    }
+
+    TraceCommand *command = &g_trace.commands[g_trace.count++];
+    snprintf(command->name, sizeof(command->name), "%s", name);
+    snprintf(command->command, sizeof(command->command), "%s", command_line);
+    command->step = thread_step;
+    command->start = start;
+    command->end = end;
+    command->status = status;
+    command->usage = *usage;
+
+    if (thread_step >= 0 && thread_step < TRACE_MAX_STEPS) {
+        TraceStep *entry = &g_trace.steps[thread_step];
+        add_usage(&entry->usage, usage);
+        entry->commands++;
+    }
+    pthread_mutex_unlock(&g_trace.lock);
+}
+
+// Строка JSON с экранированием кавычек, обратной косой черты и
+// управляющих символов; UTF-8 пишется как есть
+static void json_string(FILE *fp, const char *text) {
+    fputc('"', fp);
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(fp, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(fp, "\\u%04x", *p);
+        } else {
+            fputc(*p, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static void json_usage(FILE *fp, const TraceUsage *usage, int status) {
+    fprintf(fp, "\"user_ms\":%.1f,\"sys_ms\":%.1f,\"max_rss_kb\":%ld,"
+                "\"rchar\":%llu,\"wchar\":%llu,\"read_bytes\":%llu,\"write_bytes\":%llu,"
+                "\"status\":%d",
+            usage->user_time * 1000, usage->sys_time * 1000, usage->max_rss_kb,
+            usage->io.rchar, usage->io.wchar, usage->io.read_bytes, usage->io.write_bytes,
+            status);
+}
+
+// Событие полного интервала ("ph":"X"); время в микросекундах от начала трассы
+static void json_span(FILE *fp, const char *name, const char *category, int tid,
+                      double start, double end) {
+    fprintf(fp, ",\n{\"name\":");
+    json_string(fp, name);
+    fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.0f,\"dur\":%.0f,"
+                "\"args\":{",
+            category, tid, (start - g_trace.origin) * 1e6, (end - start) * 1e6);
+}
+
+int trace_write_json(const char *path) {
+    if (!g_trace.enabled) {
+        return 0;
+    }
+
+    char tmp[600];
+    snprintf(tmp, sizeof(tmp), "%s.part", path);
+    FILE *fp = fopen(tmp, "we");
+    if (!fp) {
+        log_warning("Не удалось записать трассу %s", path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_trace.lock);
+
+    // Дорожка 0 — команды вне шагов, дорожка N — шаг N
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+                "\"args\":{\"name\":\"luna-linux\"}},\n"
+                "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+                "\"args\":{\"name\":\"Подготовка\"}}");
+    for (int i = 0; i < TRACE_MAX_STEPS; i++) {
+        TraceStep *step = &g_trace.steps[i];
+        if (!step->used) {
+            continue;
+        }
+
+        char title[160];
+        snprintf(title, sizeof(title), "%02d. %s", i + 1, step->name);
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":",
+                i + 1);
+        json_string(fp, title);
+        fprintf(fp, "}},\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                    "\"args\":{\"sort_index\":%d}}",
+                i + 1, i + 1);
+
+        // Незавершённый шаг (сбой соседнего) обрывается на моменте записи
+        double end = step->end > 0 ? step->end : now_seconds();
+        json_span(fp, step->name, step->cached ? "cache" : "step", i + 1, step->start, end);
+        json_usage(fp, &step->usage, step->status);
+        fprintf(fp, ",\"commands\":%d}}", step->commands);
+    }
+
+    for (size_t i = 0; i < g_trace.count; i++) {
+        TraceCommand *command = &g_trace.commands[i];
+        json_span(fp, command->name, "command", command->step + 1, command->start, command->end);
+        json_usage(fp, &command->usage, command->status);
+        fprintf(fp, ",\"command\":");
+        json_string(fp, command->command);
+        fprintf(fp, "}}");
+    }
+    fprintf(fp, "\n]}\n");
+
+    pthread_mutex_unlock(&g_trace.lock);
+
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        log_warning("Не удалось записать трассу %s", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_duration(const void *a, const void *b) {
+    const TraceCommand *x = *(const TraceCommand *const *)a;
+    const TraceCommand *y = *(const TraceCommand *const *)b;
+    double dx = x->end - x->start, dy = y->end - y->start;
+    return dx < dy ? 1 : dx > dy ? -1 : 0;
+}
+
+void trace_print_summary(void) {
+    if (!g_trace.enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_trace.lock);
+
+    // Чтение и запись — по rchar/wchar: сюда входят и сеть, и каналы,
+    // и tmpfs; объём на блочных устройствах есть в файле трассы
+    printf("\n");
+    print_padded("Шаг", 44);
+    print_padded("Время", 8);
+    print_padded("ЦП польз.", 11);
+    print_padded("ЦП сист.", 10);
+    print_padded("Пик RSS", 10);
+    print_padded("Чтение", 11);
+    print_padded("Запись", 11);
+    printf("Команд\n");
+
+    TraceUsage total = { 0 };
+    for (int i = 0; i < TRACE_MAX_STEPS; i++) {
+        TraceStep *step = &g_trace.steps[i];
+        if (!step->used) {
+            continue;
+        }
+
+        char title[160], elapsed[16], cell[32];
+        snprintf(title, sizeof(title), "%s%s", step->name, step->cached ? " (кэш)" : "");
+        format_duration((step->end > 0 ? step->end : now_seconds()) - step->start,
+                        elapsed, sizeof(elapsed));
+        print_padded(title, 44);
+        print_padded(elapsed, 8);
+        snprintf(cell, sizeof(cell), "%.1f с", step->usage.user_time);
+        print_padded(cell, 11);
+        snprintf(cell, sizeof(cell), "%.1f с", step->usage.sys_time);
+        print_padded(cell, 10);
+        snprintf(cell, sizeof(cell), "%ld MB", step->usage.max_rss_kb / 1024);
+        print_padded(cell, 10);
+        snprintf(cell, sizeof(cell), "%.1f MB", step->usage.io.rchar / (1024.0 * 1024.0));
+        print_padded(cell, 11);
+        snprintf(cell, sizeof(cell), "%.1f MB", step->usage.io.wchar / (1024.0 * 1024.0));
+        print_padded(cell, 11);
+        printf("%d\n", step->commands);
+        add_usage(&total, &step->usage);
+    }
+
+    log_info("Время ЦП: %.1f с пользователя, %.1f с ядра; прочитано %.1f MB, записано %.1f MB",
+             total.user_time, total.sys_time, total.io.rchar / (1024.0 * 1024.0),
+             total.io.wchar / (1024.0 * 1024.0));
+
+    TraceCommand **order = malloc((g_trace.count ? g_trace.count : 1) * sizeof(*order));
+    if (order && g_trace.count > 0) {
+        for (size_t i = 0; i < g_trace.count; i++) {
+            order[i] = &g_trace.commands[i];
+        }
+        qsort(order, g_trace.count, sizeof(*order), compare_duration);
+
+        printf("Самые долгие команды:\n");
+        for (size_t i = 0; i < g_trace.count && i < TRACE_TOP_COMMANDS; i++) {
+            char elapsed[16];
+            format_duration(order[i]->end - order[i]->start, elapsed, sizeof(elapsed));
+            printf("  %s  %-32s ЦП %.1f с", elapsed, order[i]->name,
+                   order[i]->usage.user_time + order[i]->usage.sys_time);
+            if (order[i]->step >= 0) {
+                printf("  [шаг %d]", order[i]->step + 1);
+            }
+            printf("\n");
+        }
+    }
+    free(order);
+
+    pthread_mutex_unlock(&g_trace.lock);
+}
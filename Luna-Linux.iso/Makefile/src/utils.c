@@ -2,7 +2,12 @@
  * utils.c - Реализация утилит
  */
 
+#define _GNU_SOURCE
+
 #include "utils.h"
+#include "exec.h"
+#include "chroot.h"
+#include "stage.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,41 +15,59 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <fcntl.h>
-#include <stdarg.h>
 #include <errno.h>
-
-// Цвета для логов
-#define LOG_COLOR_INFO    "\033[0;32m"
-#define LOG_COLOR_WARNING "\033[1;33m"
-#define LOG_COLOR_ERROR   "\033[0;31m"
-#define LOG_COLOR_DEBUG   "\033[0;36m"
-#define LOG_COLOR_RESET   "\033[0m"
-
-// Выполнение команды
-int execute_cmd(const char *cmd, bool verbose) {
-    if (verbose) {
-        printf(LOG_COLOR_DEBUG "[CMD] %s\n" LOG_COLOR_RESET, cmd);
+#include <signal.h>
+#include <spawn.h>
+
+extern char **environ;
+
+// Группы запущенных команд; доступ без блокировок, чтобы прерывать
+// их можно было и из обработчика сигнала
+#define MAX_RUNNING_COMMANDS 64
+static pid_t running_groups[MAX_RUNNING_COMMANDS];
+
+static void track_process(pid_t pid) {
+    for (int i = 0; i < MAX_RUNNING_COMMANDS; i++) {
+        pid_t expected = 0;
+        if (__atomic_compare_exchange_n(&running_groups[i], &expected, pid, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return;
+        }
     }
+}
 
-    int status = system(cmd);
-    if (status == -1) {
-        log_error("Ошибка выполнения команды: %s", cmd);
-        return -1;
+static void untrack_process(pid_t pid) {
+    for (int i = 0; i < MAX_RUNNING_COMMANDS; i++) {
+        pid_t expected = pid;
+        if (__atomic_compare_exchange_n(&running_groups[i], &expected, 0, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return;
+        }
     }
+}
 
-    if (WIFEXITED(status)) {
-        return WEXITSTATUS(status);
+// Завершение всех запущенных команд вместе с их дочерними процессами
+void terminate_running_processes(void) {
+    for (int i = 0; i < MAX_RUNNING_COMMANDS; i++) {
+        pid_t pid = __atomic_load_n(&running_groups[i], __ATOMIC_SEQ_CST);
+        if (pid > 0) {
+            kill(-pid, SIGTERM);
+        }
     }
+}
 
-    return -1;
+// Выполнение команды оболочки (для конвейеров и перенаправлений)
+int execute_cmd(const char *cmd, bool verbose) {
+    char *const argv[] = { "/bin/sh", "-c", (char *)cmd, NULL };
+    return exec_command(argv, verbose);
 }
 
-// Выполнение команды в chroot
+// Выполнение команды оболочки в chroot с /proc, /sys и /dev
 int execute_cmd_chroot(const char *chroot, const char *cmd, bool verbose) {
-    char full_cmd[1024];
-    snprintf(full_cmd, sizeof(full_cmd), "chroot %s /bin/bash -c \"%s\"", chroot, cmd);
-    return execute_cmd(full_cmd, verbose);
+    char *const argv[] = { "/bin/bash", "-c", (char *)cmd, NULL };
+    return chroot_run(chroot, argv, verbose);
 }
 
 // Проверка существования файла
@@ -59,37 +82,32 @@ bool dir_exists(const char *path) {
     return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
 }
 
-// Копирование файла
-int copy_file(const char *src, const char *dst) {
-    FILE *src_fp = fopen(src, "rb");
-    if (!src_fp) {
-        log_error("Не удалось открыть файл для чтения: %s", src);
-        return -1;
+// Рекурсивное создание каталога (аналог mkdir -p)
+int make_dirs(const char *path) {
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+                return -1;
+            }
+            *p = '/';
+        }
     }
 
-    FILE *dst_fp = fopen(dst, "wb");
-    if (!dst_fp) {
-        fclose(src_fp);
-        log_error("Не удалось открыть файл для записи: %s", dst);
+    if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
         return -1;
     }
-
-    char buffer[4096];
-    size_t bytes;
-    while ((bytes = fread(buffer, 1, sizeof(buffer), src_fp)) > 0) {
-        if (fwrite(buffer, 1, bytes, dst_fp) != bytes) {
-            fclose(src_fp);
-            fclose(dst_fp);
-            log_error("Ошибка записи в файл: %s", dst);
-            return -1;
-        }
-    }
-
-    fclose(src_fp);
-    fclose(dst_fp);
     return 0;
 }
 
+// Копирование файла
+int copy_file(const char *src, const char *dst) {
+    return stage_file(src, dst, STAGE_COPY, NULL);
+}
+
 // Запись в файл
 int write_to_file(const char *path, const char *content) {
     FILE *fp = fopen(path, "w");
@@ -132,105 +150,211 @@ char* read_file(const char *path) {
     return content;
 }
 
-// Создание процесса
-pid_t spawn_process(const char *cmd, int *stdin_fd, int *stdout_fd, int *stderr_fd) {
-    int stdin_pipe[2], stdout_pipe[2], stderr_pipe[2];
+// Дочерняя часть spawn_process_setup: между fork и exec допустимы только
+// системные вызовы, поэтому ошибки выводятся через write(2)
+static void child_exec(char *const argv[], int (*setup)(void *), void *arg,
+                       const int pipes[3][2], const bool used[3]) {
+    setpgid(0, 0);
+
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+
+    if (used[0]) {
+        dup2(pipes[0][0], STDIN_FILENO);
+    } else {
+        int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+        }
+    }
+    if (used[1]) {
+        dup2(pipes[1][1], STDOUT_FILENO);
+    }
+    if (used[2]) {
+        dup2(pipes[2][1], STDERR_FILENO);
+    }
 
-    if (pipe(stdin_pipe) < 0 || pipe(stdout_pipe) < 0 || pipe(stderr_pipe) < 0) {
-        return -1;
+    if (setup(arg) != 0) {
+        _exit(126);
     }
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        return -1;
+    execvp(argv[0], argv);
+
+    static const char message[] = "exec: команда не найдена\n";
+    write(STDERR_FILENO, message, sizeof(message) - 1);
+    _exit(127);
+}
+
+// Создание процесса в собственной группе процессов. Дескрипторы,
+// переданные как NULL: stdin — /dev/null, stdout и stderr наследуются.
+// Каналы создаются с O_CLOEXEC, чтобы команды, запущенные параллельно
+// из других потоков, не удерживали их открытыми. Без setup процесс
+// создаётся через posix_spawn; с setup — через fork, и setup выполняется
+// в дочернем процессе перед exec (пространства имён, монтирование, chroot).
+pid_t spawn_process_setup(char *const argv[], int (*setup)(void *), void *arg,
+                          int *stdin_fd, int *stdout_fd, int *stderr_fd) {
+    int pipes[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+    int *fds[3] = { stdin_fd, stdout_fd, stderr_fd };
+    bool used[3] = { stdin_fd != NULL, stdout_fd != NULL, stderr_fd != NULL };
+
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] && pipe2(pipes[i], O_CLOEXEC) < 0) {
+            for (int j = 0; j < i; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
+            return -1;
+        }
     }
 
-    if (pid == 0) { // Дочерний процесс
-        dup2(stdin_pipe[0], STDIN_FILENO);
-        dup2(stdout_pipe[1], STDOUT_FILENO);
-        dup2(stderr_pipe[1], STDERR_FILENO);
+    pid_t pid = -1;
+    int error = 0;
 
-        close(stdin_pipe[0]);
-        close(stdin_pipe[1]);
-        close(stdout_pipe[0]);
-        close(stdout_pipe[1]);
-        close(stderr_pipe[0]);
-        close(stderr_pipe[1]);
+    if (setup) {
+        pid = fork();
+        if (pid == 0) {
+            child_exec(argv, setup, arg, (const int (*)[2])pipes, used);
+        }
+        if (pid < 0) {
+            error = errno;
+        } else {
+            // Группа задаётся и здесь, чтобы сигнал не опередил setpgid потомка
+            setpgid(pid, pid);
+        }
+    } else {
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attr);
+
+        if (stdin_fd) {
+            posix_spawn_file_actions_adddup2(&actions, pipes[0][0], STDIN_FILENO);
+        } else {
+            posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        }
+        if (stdout_fd) {
+            posix_spawn_file_actions_adddup2(&actions, pipes[1][1], STDOUT_FILENO);
+        }
+        if (stderr_fd) {
+            posix_spawn_file_actions_adddup2(&actions, pipes[2][1], STDERR_FILENO);
+        }
+
+        // Своя группа, чтобы при сбое или прерывании завершать команду целиком
+        sigset_t empty;
+        sigemptyset(&empty);
+        posix_spawnattr_setsigmask(&attr, &empty);
+        posix_spawnattr_setpgroup(&attr, 0);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
 
-        execl("/bin/sh", "sh", "-c", cmd, NULL);
-        exit(127);
+        error = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
     }
 
-    // Родительский процесс
-    close(stdin_pipe[0]);
-    close(stdout_pipe[1]);
-    close(stderr_pipe[1]);
+    // Родительский процесс оставляет себе противоположные концы каналов
+    for (int i = 0; i < 3; i++) {
+        if (!fds[i]) {
+            continue;
+        }
+        int keep = i == 0 ? 1 : 0;
+        close(pipes[i][1 - keep]);
+        if (error == 0) {
+            *fds[i] = pipes[i][keep];
+        } else {
+            close(pipes[i][keep]);
+        }
+    }
 
-    if (stdin_fd) *stdin_fd = stdin_pipe[1];
-    if (stdout_fd) *stdout_fd = stdout_pipe[0];
-    if (stderr_fd) *stderr_fd = stderr_pipe[0];
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
 
+    track_process(pid);
     return pid;
 }
 
-// Ожидание завершения процесса
-int wait_process(pid_t pid) {
-    int status;
-    waitpid(pid, &status, 0);
-    return WEXITSTATUS(status);
+pid_t spawn_process(char *const argv[], int *stdin_fd, int *stdout_fd, int *stderr_fd) {
+    return spawn_process_setup(argv, NULL, NULL, stdin_fd, stdout_fd, stderr_fd);
 }
 
-// Логирование
-void log_info(const char *format, ...) {
-    va_list args;
-    printf(LOG_COLOR_INFO "[INFO] ");
-    va_start(args, format);
-    vprintf(format, args);
-    va_end(args);
-    printf(LOG_COLOR_RESET "\n");
-}
+// Ожидание завершения процесса; status — сырой статус waitpid,
+// usage — ресурсы процесса вместе с дождавшимися его потомками
+int wait_process(pid_t pid, int *status, struct rusage *usage) {
+    int raw;
+    while (wait4(pid, &raw, 0, usage) < 0) {
+        if (errno != EINTR) {
+            untrack_process(pid);
+            return -1;
+        }
+    }
+    untrack_process(pid);
 
-void log_warning(const char *format, ...) {
-    va_list args;
-    printf(LOG_COLOR_WARNING "[WARNING] ");
-    va_start(args, format);
-    vprintf(format, args);
-    va_end(args);
-    printf(LOG_COLOR_RESET "\n");
+    if (status) {
+        *status = raw;
+    }
+    return 0;
 }
 
-void log_error(const char *format, ...) {
-    va_list args;
-    printf(LOG_COLOR_ERROR "[ERROR] ");
-    va_start(args, format);
-    vprintf(format, args);
-    va_end(args);
-    printf(LOG_COLOR_RESET "\n");
+// Проверка завершения без ожидания: 1 — завершён, 0 — ещё работает
+int try_wait_process(pid_t pid, int *status, struct rusage *usage) {
+    int raw;
+    pid_t done = wait4(pid, &raw, WNOHANG, usage);
+    if (done == 0 || (done < 0 && errno == EINTR)) {
+        return 0;
+    }
+    untrack_process(pid);
+    if (done < 0) {
+        return -1;
+    }
+
+    if (status) {
+        *status = raw;
+    }
+    return 1;
 }
 
-void log_debug(const char *format, ...) {
-    va_list args;
-    printf(LOG_COLOR_DEBUG "[DEBUG] ");
-    va_start(args, format);
-    vprintf(format, args);
-    va_end(args);
-    printf(LOG_COLOR_RESET "\n");
+// Вывод строки с дополнением до width символов (UTF-8)
+void print_padded(const char *text, int width) {
+    int chars = 0;
+    for (const char *p = text; *p; p++) {
+        if ((*p & 0xc0) != 0x80) {
+            chars++;
+        }
+    }
+    printf("%s%*s", text, chars < width ? width - chars : 1, "");
 }
 
-// Проверка зависимостей
+// Проверка зависимостей: поиск исполняемого файла в PATH
 bool check_dependency(const char *cmd) {
-    char check_cmd[256];
-    snprintf(check_cmd, sizeof(check_cmd), "which %s > /dev/null 2>&1", cmd);
-    return system(check_cmd) == 0;
+    const char *path = getenv("PATH");
+    if (!path) {
+        path = "/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin";
+    }
+
+    while (*path) {
+        size_t len = strcspn(path, ":");
+        char candidate[1024];
+        snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)len, path, cmd);
+        if (len > 0 && access(candidate, X_OK) == 0) {
+            return true;
+        }
+        path += len;
+        if (*path == ':') {
+            path++;
+        }
+    }
+
+    return false;
 }
 
-bool check_all_dependencies() {
+bool check_all_dependencies(bool need_mksquashfs) {
+    // Команды в chroot выполняются через chroot(2), а не программу chroot
     const char *deps[] = {
         "mmdebstrap",
-        "mksquashfs",
-        "xorriso",
-        "grub-mkrescue",
-        "chroot",
+        "grub-mkimage",
         NULL
     };
 
@@ -242,5 +366,11 @@ bool check_all_dependencies() {
         }
     }
 
+    // Встроенная запись образа обходится без mksquashfs
+    if (need_mksquashfs && !check_dependency("mksquashfs")) {
+        log_error("Зависимость не найдена: mksquashfs");
+        all_ok = false;
+    }
+
     return all_ok;
 }